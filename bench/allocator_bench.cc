@@ -0,0 +1,77 @@
+#include <memory>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+
+#include "./common.h"
+#include "block/allocator.h"
+
+namespace chfs {
+
+// The number of blocks allocated (or deallocated) between two pauses
+const usize KAllocBatch = 256;
+
+// An allocator whose first `fill` percent of the blocks are allocated, so an
+// allocation scans the bitmap blocks of them first
+static auto filled_allocator(int64_t fill) -> std::unique_ptr<BlockAllocator> {
+  auto bm = std::make_shared<BlockManager>(KBenchBlockNum, KBenchBlockSize);
+  auto allocator = std::make_unique<BlockAllocator>(bm);
+  const usize target = allocator->free_block_cnt() * fill / 100;
+  for (usize i = 0; i < target; i++) {
+    allocator->allocate().unwrap();
+  }
+  return allocator;
+}
+
+static void BM_AllocatorAllocate(benchmark::State &state) {
+  auto allocator = filled_allocator(state.range(0));
+  std::vector<block_id_t> batch;
+  batch.reserve(KAllocBatch);
+  for (auto _ : state) {
+    batch.push_back(allocator->allocate().unwrap());
+    if (batch.size() == KAllocBatch) {
+      // keep the fill level
+      state.PauseTiming();
+      for (auto bid : batch) {
+        allocator->deallocate(bid).unwrap();
+      }
+      batch.clear();
+      state.ResumeTiming();
+    }
+  }
+}
+BENCHMARK(BM_AllocatorAllocate)->Arg(0)->Arg(50)->Arg(90)->Arg(99);
+
+static void BM_AllocatorDeallocate(benchmark::State &state) {
+  auto allocator = filled_allocator(state.range(0));
+  std::vector<block_id_t> batch;
+  batch.reserve(KAllocBatch);
+  for (auto _ : state) {
+    if (batch.empty()) {
+      state.PauseTiming();
+      for (usize i = 0; i < KAllocBatch; i++) {
+        batch.push_back(allocator->allocate().unwrap());
+      }
+      state.ResumeTiming();
+    }
+    allocator->deallocate(batch.back()).unwrap();
+    batch.pop_back();
+  }
+}
+BENCHMARK(BM_AllocatorDeallocate)->Arg(0)->Arg(50)->Arg(90)->Arg(99);
+
+static void BM_AllocatorAllocateN(benchmark::State &state) {
+  auto allocator = filled_allocator(50);
+  std::vector<block_id_t> blocks;
+  for (auto _ : state) {
+    blocks.clear();
+    allocator->allocate_n(state.range(0), blocks).unwrap();
+    state.PauseTiming();
+    allocator->deallocate_batch(blocks).unwrap();
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_AllocatorAllocateN)->Arg(16)->Arg(256);
+
+} // namespace chfs
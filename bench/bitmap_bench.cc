@@ -0,0 +1,65 @@
+#include <vector>
+
+#include "benchmark/benchmark.h"
+
+#include "./common.h"
+#include "common/bitmap.h"
+
+namespace chfs {
+
+// A bitmap of a block, the first `fill` percent of whose bits are set
+static auto filled_bitmap(std::vector<u8> &data, int64_t fill) -> Bitmap {
+  auto bitmap = Bitmap(data.data(), data.size());
+  bitmap.zeroed();
+  const usize set_bits = data.size() * KBitsPerByte * fill / 100;
+  for (usize i = 0; i < set_bits; i++) {
+    bitmap.set(i);
+  }
+  return bitmap;
+}
+
+static void BM_BitmapSetClear(benchmark::State &state) {
+  std::vector<u8> data(KBenchBlockSize);
+  auto bitmap = filled_bitmap(data, 0);
+  const usize bits = KBenchBlockSize * KBitsPerByte;
+  usize idx = 0;
+  for (auto _ : state) {
+    bitmap.set(idx);
+    benchmark::DoNotOptimize(bitmap.check(idx));
+    bitmap.clear(idx);
+    idx = (idx + 7) % bits;
+  }
+}
+BENCHMARK(BM_BitmapSetClear);
+
+static void BM_BitmapCountZeros(benchmark::State &state) {
+  std::vector<u8> data(KBenchBlockSize);
+  auto bitmap = filled_bitmap(data, state.range(0));
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(bitmap.count_zeros());
+  }
+  state.SetBytesProcessed(state.iterations() * KBenchBlockSize);
+}
+BENCHMARK(BM_BitmapCountZeros)->Arg(0)->Arg(50)->Arg(100);
+
+// The scan is as long as the set prefix of the bitmap
+static void BM_BitmapFindFirstFree(benchmark::State &state) {
+  std::vector<u8> data(KBenchBlockSize);
+  auto bitmap = filled_bitmap(data, state.range(0));
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(bitmap.find_first_free());
+  }
+}
+BENCHMARK(BM_BitmapFindFirstFree)->Arg(0)->Arg(25)->Arg(50)->Arg(90)->Arg(100);
+
+static void BM_BitmapFindFirstFreeWBound(benchmark::State &state) {
+  std::vector<u8> data(KBenchBlockSize);
+  auto bitmap = filled_bitmap(data, state.range(0));
+  const usize bound = KBenchBlockSize * KBitsPerByte - 3;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(bitmap.find_first_free_w_bound(bound));
+  }
+}
+BENCHMARK(BM_BitmapFindFirstFreeWBound)->Arg(0)->Arg(50)->Arg(100);
+
+} // namespace chfs
@@ -0,0 +1,74 @@
+#include <cstdio>
+#include <memory>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+
+#include "./common.h"
+#include "block/manager.h"
+
+namespace chfs {
+
+// The argument 0 is a memory-backed manager, and 1 is a file-backed one
+static auto bench_manager(int64_t file_backed) -> std::unique_ptr<BlockManager> {
+  if (file_backed == 0) {
+    return std::make_unique<BlockManager>(KBenchBlockNum, KBenchBlockSize);
+  }
+  std::remove(KBenchBlockFile);
+  return std::make_unique<BlockManager>(KBenchBlockFile, KBenchBlockNum,
+                                        KBenchBlockSize);
+}
+
+static auto bench_label(int64_t file_backed) -> const char * {
+  return file_backed == 0 ? "memory" : "file";
+}
+
+static void BM_BlockRead(benchmark::State &state) {
+  auto bm = bench_manager(state.range(0));
+  std::vector<u8> buffer(KBenchBlockSize);
+  auto rng = bench_rng();
+  std::uniform_int_distribution<block_id_t> dist(0, KBenchBlockNum - 1);
+  for (auto _ : state) {
+    bm->read_block(dist(rng), buffer.data()).unwrap();
+    benchmark::DoNotOptimize(buffer.data());
+  }
+  state.SetBytesProcessed(state.iterations() * KBenchBlockSize);
+  state.SetLabel(bench_label(state.range(0)));
+  bm.reset();
+  std::remove(KBenchBlockFile);
+}
+BENCHMARK(BM_BlockRead)->Arg(0)->Arg(1);
+
+static void BM_BlockWrite(benchmark::State &state) {
+  auto bm = bench_manager(state.range(0));
+  std::vector<u8> buffer(KBenchBlockSize, 0xab);
+  auto rng = bench_rng();
+  std::uniform_int_distribution<block_id_t> dist(0, KBenchBlockNum - 1);
+  for (auto _ : state) {
+    bm->write_block(dist(rng), buffer.data()).unwrap();
+  }
+  state.SetBytesProcessed(state.iterations() * KBenchBlockSize);
+  state.SetLabel(bench_label(state.range(0)));
+  bm.reset();
+  std::remove(KBenchBlockFile);
+}
+BENCHMARK(BM_BlockWrite)->Arg(0)->Arg(1);
+
+static void BM_BlockWritePartial(benchmark::State &state) {
+  auto bm = bench_manager(state.range(0));
+  std::vector<u8> buffer(KBenchBlockSize / 8, 0xab);
+  auto rng = bench_rng();
+  std::uniform_int_distribution<block_id_t> dist(0, KBenchBlockNum - 1);
+  for (auto _ : state) {
+    bm->write_partial_block(dist(rng), buffer.data(), KBenchBlockSize / 2,
+                            buffer.size())
+        .unwrap();
+  }
+  state.SetBytesProcessed(state.iterations() * buffer.size());
+  state.SetLabel(bench_label(state.range(0)));
+  bm.reset();
+  std::remove(KBenchBlockFile);
+}
+BENCHMARK(BM_BlockWritePartial)->Arg(0)->Arg(1);
+
+} // namespace chfs
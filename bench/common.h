@@ -0,0 +1,31 @@
+//===----------------------------------------------------------------------===//
+//
+//                         Chfs
+//
+// common.h
+//
+// Common configurations of the benchmarks
+//
+// Identification: bench/common.h
+//
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <random>
+
+#include "common/config.h"
+
+namespace chfs {
+
+const usize KBenchBlockSize = 4096;
+const usize KBenchBlockNum = 32 * 1024;
+const usize KBenchInodeNum = 1024;
+
+// the file of the file-backed block managers, in the working directory
+const char *const KBenchBlockFile = "chfs_bench.img";
+
+inline auto bench_rng() -> std::mt19937 { return std::mt19937(0xdeadbeaf); }
+
+} // namespace chfs
@@ -0,0 +1,40 @@
+#include <list>
+#include <string>
+
+#include "benchmark/benchmark.h"
+
+#include "./common.h"
+#include "filesystem/directory_op.h"
+
+namespace chfs {
+
+// A directory of `entries` files
+static auto bench_directory(int64_t entries) -> std::string {
+  std::string dir;
+  for (int64_t i = 0; i < entries; i++) {
+    dir = append_to_directory(dir, "file-" + std::to_string(i), i + 2);
+  }
+  return dir;
+}
+
+static void BM_ParseDirectory(benchmark::State &state) {
+  auto dir = bench_directory(state.range(0));
+  std::list<DirectoryEntry> list;
+  for (auto _ : state) {
+    list.clear();
+    parse_directory(dir, list);
+    benchmark::DoNotOptimize(list);
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_ParseDirectory)->RangeMultiplier(8)->Range(8, 4096);
+
+static void BM_AppendToDirectory(benchmark::State &state) {
+  auto dir = bench_directory(state.range(0));
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(append_to_directory(dir, "new-file", 1));
+  }
+}
+BENCHMARK(BM_AppendToDirectory)->RangeMultiplier(8)->Range(8, 4096);
+
+} // namespace chfs
@@ -0,0 +1,49 @@
+#include <memory>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+
+#include "./common.h"
+#include "filesystem/operations.h"
+
+namespace chfs {
+
+// A filesystem with a file of `size` bytes
+static auto bench_fs(u64 size) -> std::pair<std::unique_ptr<FileOperation>,
+                                            inode_id_t> {
+  auto bm = std::make_shared<BlockManager>(KBenchBlockNum, KBenchBlockSize);
+  auto fs = std::make_unique<FileOperation>(bm, KBenchInodeNum);
+  auto id = fs->alloc_inode(InodeType::FILE).unwrap();
+  if (size != 0) {
+    fs->write_file(id, std::vector<u8>(size, 0x5a)).unwrap();
+  }
+  return {std::move(fs), id};
+}
+
+// The arguments are the size of the I/O and its offset in the file
+static void BM_WriteFileWOff(benchmark::State &state) {
+  const u64 sz = state.range(0);
+  const u64 offset = state.range(1);
+  auto [fs, id] = bench_fs(offset + sz);
+  std::vector<char> data(sz, 'x');
+  for (auto _ : state) {
+    fs->write_file_w_off(id, data.data(), sz, offset).unwrap();
+  }
+  state.SetBytesProcessed(state.iterations() * sz);
+}
+BENCHMARK(BM_WriteFileWOff)
+    ->ArgsProduct({{64, 4096, 64 * 1024}, {0, 4000, 1024 * 1024}});
+
+static void BM_ReadFileWOff(benchmark::State &state) {
+  const u64 sz = state.range(0);
+  const u64 offset = state.range(1);
+  auto [fs, id] = bench_fs(offset + sz);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(fs->read_file_w_off(id, sz, offset).unwrap());
+  }
+  state.SetBytesProcessed(state.iterations() * sz);
+}
+BENCHMARK(BM_ReadFileWOff)
+    ->ArgsProduct({{64, 4096, 64 * 1024}, {0, 4000, 1024 * 1024}});
+
+} // namespace chfs
@@ -0,0 +1,103 @@
+/**
+ * chfs-dedup: deduplicate the file blocks of an unmounted chfs image.
+ *
+ * The deduplication is enabled on the image if it is not yet, so that the
+ * following writes are deduplicated once it is mounted.
+ */
+
+#include <chrono>
+#include <iostream>
+#include <string>
+
+#include "filesystem/operations.h"
+#include "metadata/superblock.h"
+
+#include "argparse/argparse.hpp"
+
+namespace chfs {
+
+/**
+ * The command line options of the tool
+ */
+struct DedupOptions {
+  std::string image;
+  // The size of the fingerprint index if the deduplication is not enabled
+  usize index_blocks;
+};
+
+auto parse_options(int argc, char **argv) -> DedupOptions {
+  argparse::ArgumentParser program(argv[0]);
+  program.add_argument("image").help("the chfs image to deduplicate");
+  program.add_argument("-n", "--index-blocks")
+      .help("the blocks of the fingerprint index, if the deduplication is "
+            "not enabled on the image")
+      .default_value(static_cast<usize>(1024))
+      .scan<'u', usize>();
+
+  try {
+    program.parse_args(argc, argv);
+  } catch (const std::runtime_error &err) {
+    std::cerr << err.what() << std::endl << program;
+    std::exit(1);
+  }
+
+  DedupOptions options;
+  options.image = program.get<std::string>("image");
+  options.index_blocks = program.get<usize>("--index-blocks");
+  return options;
+}
+
+auto run_dedup(const DedupOptions &options) -> int {
+  auto block_size = SuperBlock::peek_block_size(options.image);
+  if (!block_size) {
+    std::cerr << "The image " << options.image << " is not formatted by chfs. "
+              << std::endl;
+    return 1;
+  }
+
+  auto bm = std::shared_ptr<BlockManager>(
+      new BlockManager(options.image, 0, block_size.value()));
+  auto fs_res = FileOperation::create_from_raw(bm);
+  if (fs_res.is_err()) {
+    std::cerr << "Cannot mount the image " << options.image << ". "
+              << std::endl;
+    return 1;
+  }
+  auto fs = fs_res.unwrap();
+
+  if (!fs->is_dedup_enabled()) {
+    auto res = fs->enable_dedup(options.index_blocks);
+    if (res.is_err()) {
+      std::cerr << "Cannot enable the deduplication on the image. "
+                << std::endl;
+      return 1;
+    }
+    std::cout << "deduplication enabled with " << options.index_blocks
+              << " index blocks" << std::endl;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  auto freed_res = fs->deduplicate();
+  if (freed_res.is_err()) {
+    std::cerr << "Failed to deduplicate the image. " << std::endl;
+    return 1;
+  }
+  auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - start);
+
+  if (fs->unmount().is_err()) {
+    std::cerr << "Failed to unmount the image. " << std::endl;
+    return 1;
+  }
+  std::cout << freed_res.unwrap() << " blocks freed, "
+            << fs->get_free_blocks_num().unwrap() << " blocks free, in "
+            << elapsed.count() << " ms" << std::endl;
+  return 0;
+}
+
+} // namespace chfs
+
+int main(int argc, char **argv) {
+  auto options = chfs::parse_options(argc, argv);
+  return chfs::run_dedup(options);
+}
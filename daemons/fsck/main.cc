@@ -0,0 +1,181 @@
+/**
+ * chfs-fsck: check (and repair) the consistency of an unmounted chfs image.
+ *
+ * Exit codes follow e2fsck:
+ * 0 the filesystem is consistent
+ * 1 the inconsistencies are repaired
+ * 4 the inconsistencies are left unrepaired
+ * 8 operational error
+ */
+
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+
+#include "filesystem/fsck.h"
+
+#include "argparse/argparse.hpp"
+
+namespace chfs {
+
+const int KFsckOk = 0;
+const int KFsckRepaired = 1;
+const int KFsckUnrepaired = 4;
+const int KFsckError = 8;
+
+/**
+ * The command line options of the checker
+ */
+struct FsckOptions {
+  std::string image;
+  usize threads;
+  bool repair;
+  bool verbose;
+};
+
+auto parse_options(int argc, char **argv) -> FsckOptions {
+  argparse::ArgumentParser program(argv[0]);
+  program.add_argument("image").help("the chfs image to check");
+  program.add_argument("-t", "--threads")
+      .help("the number of threads to check the image")
+      .default_value(
+          static_cast<usize>(std::max(1u, std::thread::hardware_concurrency())))
+      .scan<'u', usize>();
+  program.add_argument("-r", "--repair")
+      .help("repair the inconsistencies in place")
+      .default_value(false)
+      .implicit_value(true);
+  program.add_argument("-v", "--verbose")
+      .help("list every inconsistency")
+      .default_value(false)
+      .implicit_value(true);
+
+  try {
+    program.parse_args(argc, argv);
+  } catch (const std::runtime_error &err) {
+    std::cerr << err.what() << std::endl << program;
+    std::exit(KFsckError);
+  }
+
+  FsckOptions options;
+  options.image = program.get<std::string>("image");
+  options.threads = program.get<usize>("--threads");
+  options.repair = program.get<bool>("--repair");
+  options.verbose = program.get<bool>("--verbose");
+  return options;
+}
+
+template <typename T>
+auto print_list(const char *what, const std::vector<T> &list, bool verbose)
+    -> void {
+  if (list.empty()) {
+    return;
+  }
+  std::cout << list.size() << " " << what;
+  if (verbose) {
+    std::cout << ":";
+    for (auto &item : list) {
+      std::cout << " " << item;
+    }
+  }
+  std::cout << std::endl;
+}
+
+auto print_report(const FsckReport &report, bool verbose) -> void {
+  std::cout << report.inodes << " inodes, " << report.used_blocks
+            << " blocks in use" << std::endl;
+  print_list("bad inodes", report.bad_inodes, verbose);
+  print_list("orphan inodes", report.orphan_inodes, verbose);
+  print_list("leaked blocks", report.leaked_blocks, verbose);
+  print_list("blocks in use but free in the bitmap", report.unmarked_blocks,
+             verbose);
+  print_list("blocks not matching their checksums", report.corrupted_blocks,
+             verbose);
+
+  if (!report.dangling_entries.empty()) {
+    std::cout << report.dangling_entries.size() << " dangling entries"
+              << std::endl;
+    for (auto &entry : report.dangling_entries) {
+      if (verbose) {
+        std::cout << "  " << entry.dir << "/" << entry.name << " -> "
+                  << entry.id << std::endl;
+      }
+    }
+  }
+  if (!report.shared_blocks.empty()) {
+    std::cout << report.shared_blocks.size() << " doubly allocated blocks"
+              << std::endl;
+    for (auto &shared : report.shared_blocks) {
+      if (verbose) {
+        std::cout << "  block " << shared.block_id << " claimed by inode "
+                  << shared.inode << std::endl;
+      }
+    }
+  }
+  if (report.bad_free_counter) {
+    std::cout << "the free block counter in the super block is wrong"
+              << std::endl;
+  }
+}
+
+auto run_fsck(const FsckOptions &options) -> int {
+  auto block_size = SuperBlock::peek_block_size(options.image);
+  if (!block_size) {
+    std::cerr << "The image " << options.image << " is not formatted by chfs. "
+              << std::endl;
+    return KFsckError;
+  }
+
+  auto bm = std::shared_ptr<BlockManager>(
+      new BlockManager(options.image, 0, block_size.value()));
+  auto fsck_res = Fsck::open(bm);
+  if (fsck_res.is_err()) {
+    std::cerr << "Cannot open the image " << options.image << ". " << std::endl;
+    return KFsckError;
+  }
+  auto fsck = fsck_res.unwrap();
+
+  auto start = std::chrono::steady_clock::now();
+  auto report_res = fsck->check(options.threads);
+  if (report_res.is_err()) {
+    std::cerr << "The root directory is corrupted. " << std::endl;
+    return KFsckError;
+  }
+  auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - start);
+
+  auto report = report_res.unwrap();
+  print_report(report, options.verbose);
+  std::cout << "checked in " << elapsed.count() << " ms with "
+            << options.threads << " threads" << std::endl;
+  if (report.is_clean()) {
+    std::cout << options.image << ": clean" << std::endl;
+    return KFsckOk;
+  }
+  if (!options.repair) {
+    return KFsckUnrepaired;
+  }
+
+  auto repair_res = fsck->repair(report);
+  if (repair_res.is_err()) {
+    std::cerr << "Failed to repair the image. " << std::endl;
+    return KFsckError;
+  }
+
+  // the repair may not fix everything at once, e.g., the orphans' entries
+  report = Fsck::open(bm).unwrap()->check(options.threads).unwrap();
+  if (!report.is_clean()) {
+    print_report(report, options.verbose);
+    return KFsckUnrepaired;
+  }
+  std::cout << options.image << ": repaired" << std::endl;
+  return KFsckRepaired;
+}
+
+} // namespace chfs
+
+int main(int argc, char **argv) {
+  auto options = chfs::parse_options(argc, argv);
+  return chfs::run_fsck(options);
+}
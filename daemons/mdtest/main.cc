@@ -0,0 +1,346 @@
+/**
+ * chfs-mdtest: measure the metadata operations of chfs in the manner of
+ * mdtest, driving `FileOperation` in-process without FUSE.
+ *
+ * Each thread builds its own directory tree of `--depth` levels with
+ * `--branch` subdirectories per directory under the root, spreads its
+ * `--items` files over the leaves, and then times each phase:
+ * create, lookup (resolving the whole path from the root), stat, readdir of
+ * the leaves and unlink. A depth of 0 is a flat directory.
+ *
+ * The filesystem is not thread-safe, so the threads serialize their calls as
+ * the requests of the daemon are, and the rates of more threads show the
+ * contention on it.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../single_node_fs/consts.h"
+#include "filesystem/directory_op.h"
+#include "filesystem/operations.h"
+
+#include "argparse/argparse.hpp"
+
+namespace chfs {
+
+/**
+ * The command line options of the benchmark
+ */
+struct MdtestOptions {
+  // the image to format, it is memory-backed if empty
+  std::string image;
+  usize disk_size;
+  usize block_size;
+  usize inodes;
+  usize journal_blocks;
+  // the files per thread
+  usize items;
+  usize threads;
+  usize depth;
+  usize branch;
+};
+
+auto parse_options(int argc, char **argv) -> MdtestOptions {
+  argparse::ArgumentParser program(argv[0]);
+  program.add_argument("-i", "--image")
+      .help("the image to run on, which is overwritten. The blocks are kept "
+            "in memory if it is not given")
+      .default_value(std::string(""));
+  program.add_argument("--disk-size")
+      .help("the size of the filesystem in bytes")
+      .default_value(static_cast<usize>(256 * 1024 * 1024))
+      .scan<'u', usize>();
+  program.add_argument("--block-size")
+      .help("the size of a block in bytes")
+      .default_value(static_cast<usize>(4096))
+      .scan<'u', usize>();
+  program.add_argument("--inodes")
+      .help("the maximum number of inodes")
+      .default_value(static_cast<usize>(65536))
+      .scan<'u', usize>();
+  program.add_argument("--journal-blocks")
+      .help("the size of the metadata journal in blocks, 0 disables it")
+      .default_value(static_cast<usize>(0))
+      .scan<'u', usize>();
+  program.add_argument("-n", "--items")
+      .help("the number of files created by each thread")
+      .default_value(static_cast<usize>(1000))
+      .scan<'u', usize>();
+  program.add_argument("-t", "--threads")
+      .help("the number of threads")
+      .default_value(static_cast<usize>(1))
+      .scan<'u', usize>();
+  program.add_argument("-z", "--depth")
+      .help("the depth of the directory tree of each thread, 0 is flat")
+      .default_value(static_cast<usize>(0))
+      .scan<'u', usize>();
+  program.add_argument("-b", "--branch")
+      .help("the number of subdirectories of each directory in the tree")
+      .default_value(static_cast<usize>(1))
+      .scan<'u', usize>();
+
+  try {
+    program.parse_args(argc, argv);
+  } catch (const std::runtime_error &err) {
+    std::cerr << err.what() << std::endl << program;
+    std::exit(1);
+  }
+
+  MdtestOptions options;
+  options.image = program.get<std::string>("--image");
+  options.disk_size = program.get<usize>("--disk-size");
+  options.block_size = program.get<usize>("--block-size");
+  options.inodes = program.get<usize>("--inodes");
+  options.journal_blocks = program.get<usize>("--journal-blocks");
+  options.items = program.get<usize>("--items");
+  options.threads = program.get<usize>("--threads");
+  options.depth = program.get<usize>("--depth");
+  options.branch = program.get<usize>("--branch");
+  if (options.threads == 0 || options.branch == 0) {
+    std::cerr << "The threads and the branch must be positive. " << std::endl;
+    std::exit(1);
+  }
+  return options;
+}
+
+/**
+ * The directory tree of a thread, whose files are spread over its leaves
+ */
+struct ThreadTree {
+  inode_id_t root;
+  std::vector<inode_id_t> leaves;
+  // the names from the root of the thread to each leaf
+  std::vector<std::vector<std::string>> leaf_paths;
+  // the id of each file, the i-th file is in the leaf i % leaves
+  std::vector<inode_id_t> files;
+};
+
+struct PhaseResult {
+  const char *name;
+  u64 ops;
+  double seconds;
+};
+
+class Mdtest {
+  MdtestOptions options;
+  std::shared_ptr<FileOperation> fs;
+  std::mutex mutex;
+  std::vector<ThreadTree> trees;
+
+public:
+  Mdtest(const MdtestOptions &options, std::shared_ptr<FileOperation> fs)
+      : options(options), fs(fs), trees(options.threads) {}
+
+  auto run() -> std::vector<PhaseResult> {
+    std::vector<PhaseResult> results;
+    results.push_back(this->run_phase(
+        "tree create", [this](usize t) { return this->create_tree(t); }));
+    results.push_back(this->run_phase(
+        "file create", [this](usize t) { return this->create_files(t); }));
+    results.push_back(this->run_phase(
+        "file lookup", [this](usize t) { return this->lookup_files(t); }));
+    results.push_back(this->run_phase(
+        "file stat", [this](usize t) { return this->stat_files(t); }));
+    results.push_back(this->run_phase(
+        "dir read", [this](usize t) { return this->read_leaves(t); }));
+    results.push_back(this->run_phase(
+        "file unlink", [this](usize t) { return this->unlink_files(t); }));
+    return results;
+  }
+
+private:
+  /**
+   * Run an operation on every thread, each returns the number of the
+   * operations it did
+   */
+  template <typename F> auto run_phase(const char *name, F op) -> PhaseResult {
+    std::atomic<u64> ops{0};
+    std::vector<std::thread> threads;
+    auto start = std::chrono::steady_clock::now();
+    for (usize t = 0; t < this->options.threads; t++) {
+      threads.emplace_back([&ops, &op, t]() { ops += op(t); });
+    }
+    for (auto &thread : threads) {
+      thread.join();
+    }
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    return PhaseResult{name, ops.load(), elapsed.count()};
+  }
+
+  template <typename T> static auto must(ChfsResult<T> res, const char *what)
+      -> T {
+    if (res.is_err()) {
+      std::cerr << what << " failed with error "
+                << static_cast<int>(res.unwrap_error()) << ". " << std::endl;
+      std::exit(1);
+    }
+    return res.unwrap();
+  }
+
+  static auto file_name(usize i) -> std::string {
+    return "file." + std::to_string(i);
+  }
+
+  auto create_tree(usize t) -> u64 {
+    auto &tree = this->trees[t];
+    const auto root_name = "mdtest." + std::to_string(t);
+    {
+      std::lock_guard<std::mutex> lock(this->mutex);
+      tree.root = must(this->fs->mkdir(KRootInode, root_name.c_str()), "mkdir");
+    }
+    u64 ops = 1;
+
+    std::vector<inode_id_t> level = {tree.root};
+    std::vector<std::vector<std::string>> paths = {{}};
+    for (usize d = 0; d < this->options.depth; d++) {
+      std::vector<inode_id_t> next;
+      std::vector<std::vector<std::string>> next_paths;
+      for (usize i = 0; i < level.size(); i++) {
+        for (usize b = 0; b < this->options.branch; b++) {
+          const auto name = "dir." + std::to_string(b);
+          std::lock_guard<std::mutex> lock(this->mutex);
+          next.push_back(must(this->fs->mkdir(level[i], name.c_str()), "mkdir"));
+          next_paths.push_back(paths[i]);
+          next_paths.back().push_back(name);
+          ops += 1;
+        }
+      }
+      level = std::move(next);
+      paths = std::move(next_paths);
+    }
+    tree.leaves = std::move(level);
+    tree.leaf_paths = std::move(paths);
+    return ops;
+  }
+
+  auto create_files(usize t) -> u64 {
+    auto &tree = this->trees[t];
+    tree.files.resize(this->options.items);
+    for (usize i = 0; i < this->options.items; i++) {
+      const auto name = file_name(i);
+      const auto parent = tree.leaves[i % tree.leaves.size()];
+      std::lock_guard<std::mutex> lock(this->mutex);
+      tree.files[i] = must(this->fs->mkfile(parent, name.c_str()), "mkfile");
+    }
+    return this->options.items;
+  }
+
+  auto lookup_files(usize t) -> u64 {
+    const auto &tree = this->trees[t];
+    for (usize i = 0; i < this->options.items; i++) {
+      const auto name = file_name(i);
+      const auto &path = tree.leaf_paths[i % tree.leaves.size()];
+      std::lock_guard<std::mutex> lock(this->mutex);
+      auto id = tree.root;
+      for (const auto &dir : path) {
+        id = must(this->fs->lookup(id, dir.c_str()), "lookup");
+      }
+      must(this->fs->lookup(id, name.c_str()), "lookup");
+    }
+    return this->options.items;
+  }
+
+  auto stat_files(usize t) -> u64 {
+    const auto &tree = this->trees[t];
+    for (auto id : tree.files) {
+      std::lock_guard<std::mutex> lock(this->mutex);
+      must(this->fs->getattr(id), "getattr");
+    }
+    return tree.files.size();
+  }
+
+  auto read_leaves(usize t) -> u64 {
+    const auto &tree = this->trees[t];
+    std::list<DirectoryEntry> list;
+    for (auto leaf : tree.leaves) {
+      list.clear();
+      std::lock_guard<std::mutex> lock(this->mutex);
+      must(read_directory(this->fs.get(), leaf, list), "readdir");
+    }
+    return tree.leaves.size();
+  }
+
+  auto unlink_files(usize t) -> u64 {
+    const auto &tree = this->trees[t];
+    for (usize i = 0; i < this->options.items; i++) {
+      const auto name = file_name(i);
+      const auto parent = tree.leaves[i % tree.leaves.size()];
+      std::lock_guard<std::mutex> lock(this->mutex);
+      must(this->fs->unlink(parent, name.c_str()), "unlink");
+    }
+    return this->options.items;
+  }
+};
+
+auto create_fs(const MdtestOptions &options)
+    -> std::shared_ptr<FileOperation> {
+  const auto block_cnt = options.disk_size / options.block_size;
+  std::shared_ptr<BlockManager> bm;
+  if (options.image.empty()) {
+    bm = std::make_shared<BlockManager>(block_cnt, options.block_size);
+  } else {
+    // start from an empty image of the given size
+    std::remove(options.image.c_str());
+    bm = std::make_shared<BlockManager>(options.image, block_cnt,
+                                        options.block_size);
+  }
+  auto fs = std::make_shared<FileOperation>(
+      bm, options.inodes, AllocatorType::Bitmap, options.journal_blocks);
+  auto res = fs->alloc_inode(InodeType::Directory);
+  if (res.is_err() || res.unwrap() != KRootInode) {
+    std::cerr << "Cannot allocate inode for root directory. " << std::endl;
+    std::exit(1);
+  }
+  return fs;
+}
+
+auto run_mdtest(const MdtestOptions &options) -> int {
+  // the directories of a tree: 1 + b + b^2 + ... + b^depth
+  u64 dirs = 0;
+  u64 width = 1;
+  for (usize d = 0; d <= options.depth; d++) {
+    dirs += width;
+    width *= options.branch;
+  }
+  const u64 inodes = options.threads * (dirs + options.items) + 1;
+  if (inodes > options.inodes) {
+    std::cerr << "The benchmark needs " << inodes << " inodes, but only "
+              << options.inodes << " are supported. " << std::endl;
+    return 1;
+  }
+
+  auto fs = create_fs(options);
+  auto mdtest = Mdtest(options, fs);
+  auto results = mdtest.run();
+
+  std::printf("%zu threads, %zu items per thread, depth %zu, branch %zu, "
+              "%llu directories per thread\n",
+              static_cast<size_t>(options.threads),
+              static_cast<size_t>(options.items),
+              static_cast<size_t>(options.depth),
+              static_cast<size_t>(options.branch),
+              static_cast<unsigned long long>(dirs));
+  std::printf("%-12s %10s %10s %14s\n", "phase", "ops", "seconds", "ops/s");
+  for (const auto &res : results) {
+    std::printf("%-12s %10llu %10.3f %14.1f\n", res.name,
+                static_cast<unsigned long long>(res.ops), res.seconds,
+                res.seconds > 0 ? res.ops / res.seconds : 0.0);
+  }
+  return 0;
+}
+
+} // namespace chfs
+
+int main(int argc, char **argv) {
+  auto options = chfs::parse_options(argc, argv);
+  return chfs::run_mdtest(options);
+}
@@ -0,0 +1,195 @@
+/**
+ * chfs-replay: re-execute a trace recorded by the daemon (`fs --trace`)
+ * against `FileOperation` in-process, without FUSE.
+ *
+ * The trace is replayed at full speed by default, or with the original
+ * timing, i.e., each operation is issued when it arrived at the daemon. It is
+ * replayed on a copy of the image the trace is captured on, which is
+ * modified, or on a new in-memory filesystem if the trace starts from an
+ * empty one.
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <thread>
+
+#include "../single_node_fs/consts.h"
+#include "common/stats.h"
+#include "filesystem/trace.h"
+#include "metadata/superblock.h"
+
+#include "argparse/argparse.hpp"
+
+namespace chfs {
+
+/**
+ * The command line options of the tool
+ */
+struct ReplayOptions {
+  std::string trace;
+  // The image to replay on. If it is empty, a new in-memory filesystem is.
+  std::string image;
+  // The geometry of the new filesystem, as the daemon formats one
+  usize block_size;
+  u64 disk_size;
+  usize inodes;
+  usize journal_blocks;
+  // The bytes buffered by the delayed allocation, 0 disables it
+  u64 dirty_limit;
+  // Whether to issue the operations with the original timing
+  bool timing;
+  // Whether to print the latency of the operations of the filesystem
+  bool stats;
+};
+
+auto parse_options(int argc, char **argv) -> ReplayOptions {
+  argparse::ArgumentParser program(argv[0]);
+  program.add_argument("trace").help("the trace recorded by the daemon");
+  program.add_argument("-i", "--image")
+      .help("the image to replay on, which is modified. A new in-memory "
+            "filesystem is used if it is not given")
+      .default_value(std::string(""));
+  program.add_argument("-b", "--block-size")
+      .help("the block size of the new filesystem")
+      .default_value(static_cast<usize>(1024))
+      .scan<'u', usize>();
+  program.add_argument("-s", "--disk-size")
+      .help("the size (in bytes) of the new filesystem")
+      .default_value(static_cast<u64>(16 * 1024 * 1024))
+      .scan<'u', u64>();
+  program.add_argument("--inodes")
+      .help("the maximum number of inodes of the new filesystem")
+      .default_value(static_cast<usize>(1024))
+      .scan<'u', usize>();
+  program.add_argument("-j", "--journal-blocks")
+      .help("the blocks of the metadata journal of the new filesystem, 0 "
+            "disables the journal")
+      .default_value(static_cast<usize>(1024))
+      .scan<'u', usize>();
+  program.add_argument("--dirty-limit")
+      .help("the bytes of the file content buffered by the delayed "
+            "allocation, 0 disables it")
+      .default_value(static_cast<u64>(4 * 1024 * 1024))
+      .scan<'u', u64>();
+  program.add_argument("-t", "--timing")
+      .help("issue the operations with the original timing instead of at "
+            "full speed")
+      .default_value(false)
+      .implicit_value(true);
+  program.add_argument("--stats")
+      .help("print the latency of the operations of the filesystem")
+      .default_value(false)
+      .implicit_value(true);
+
+  try {
+    program.parse_args(argc, argv);
+  } catch (const std::runtime_error &err) {
+    std::cerr << err.what() << std::endl << program;
+    std::exit(1);
+  }
+
+  ReplayOptions options;
+  options.trace = program.get<std::string>("trace");
+  options.image = program.get<std::string>("--image");
+  options.block_size = program.get<usize>("--block-size");
+  options.disk_size = program.get<u64>("--disk-size");
+  options.inodes = program.get<usize>("--inodes");
+  options.journal_blocks = program.get<usize>("--journal-blocks");
+  options.dirty_limit = program.get<u64>("--dirty-limit");
+  options.timing = program.get<bool>("--timing");
+  options.stats = program.get<bool>("--stats");
+  return options;
+}
+
+auto open_fs(const ReplayOptions &options) -> std::shared_ptr<FileOperation> {
+  if (!options.image.empty()) {
+    auto block_size = SuperBlock::peek_block_size(options.image);
+    if (!block_size) {
+      std::cerr << "The image " << options.image
+                << " is not formatted by chfs. " << std::endl;
+      std::exit(1);
+    }
+    auto bm = std::shared_ptr<BlockManager>(
+        new BlockManager(options.image, 0, block_size.value()));
+    auto res = FileOperation::create_from_raw(bm);
+    if (res.is_err()) {
+      std::cerr << "Cannot mount the image " << options.image << ". "
+                << std::endl;
+      std::exit(1);
+    }
+    return res.unwrap();
+  }
+
+  auto bm = std::shared_ptr<BlockManager>(new BlockManager(
+      options.disk_size / options.block_size, options.block_size));
+  auto fs = std::make_shared<FileOperation>(
+      bm, options.inodes, AllocatorType::Bitmap, options.journal_blocks);
+  auto res = fs->alloc_inode(InodeType::Directory);
+  if (res.is_err() || res.unwrap() != KRootInode) {
+    std::cerr << "Cannot allocate inode for root directory. " << std::endl;
+    std::exit(1);
+  }
+  return fs;
+}
+
+auto run_replay(const ReplayOptions &options) -> int {
+  auto reader_res = TraceReader::open(options.trace);
+  if (reader_res.is_err()) {
+    std::cerr << "The trace " << options.trace << " cannot be read. "
+              << std::endl;
+    return 1;
+  }
+  auto reader = reader_res.unwrap();
+
+  auto fs = open_fs(options);
+  if (options.dirty_limit != 0) {
+    fs->set_delayed_allocation(options.dirty_limit).unwrap();
+  }
+  set_stats_enabled(options.stats);
+
+  TraceReplayer replayer(fs.get());
+  TraceRecord record;
+  std::string name;
+  u64 ops = 0;
+  u64 mismatched = 0;
+  u64 traced_ns = 0;
+  auto start = std::chrono::steady_clock::now();
+  while (reader->next(record, name)) {
+    if (options.timing) {
+      std::this_thread::sleep_until(start +
+                                    std::chrono::nanoseconds(record.start));
+    }
+    if (!replayer.replay(record, name)) {
+      mismatched += 1;
+    }
+    ops += 1;
+    traced_ns += record.duration;
+  }
+  if (fs->unmount().is_err()) {
+    std::cerr << "Failed to unmount the filesystem cleanly. " << std::endl;
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  std::printf("%llu operations replayed in %.3f s, %.1f ops/s\n",
+              static_cast<unsigned long long>(ops), elapsed.count(),
+              elapsed.count() > 0 ? ops / elapsed.count() : 0.0);
+  std::printf("%.3f s spent in the traced operations\n", traced_ns / 1e9);
+  if (mismatched != 0) {
+    std::printf("%llu operations differ from the trace\n",
+                static_cast<unsigned long long>(mismatched));
+  }
+  if (options.stats) {
+    std::cout << dump_stats();
+  }
+  return 0;
+}
+
+} // namespace chfs
+
+int main(int argc, char **argv) {
+  auto options = chfs::parse_options(argc, argv);
+  return chfs::run_replay(options);
+}
@@ -27,4 +27,25 @@ const u64 kDiskSize = 1024 * 1024 * 16;
 
 const usize KMaxInodeNum = 1024;
 
+// The maximum bytes of file content buffered by the delayed allocation
+const u64 KDirtyBufferLimit = 1024 * 1024 * 4;
+
+// The number of blocks of the metadata journal of a newly formatted device
+const usize KJournalBlocks = 1024;
+
+// The maximum size of a write request, the kernel may lower it
+const usize KFuseMaxWrite = 1024 * 1024;
+
+// The seconds for the kernel to cache the attributes and the directory entries
+const double KAttrTimeout = 1.0;
+const double KEntryTimeout = 1.0;
+
+// The inode of the root directory, which is allocated first
+const u64 KRootInode = 1;
+
+// The virtual file in the root to read the statistics of the operations, and
+// its inode number, which is never allocated
+const char *const KStatsFileName = ".chfs_stats";
+const u64 KStatsInode = 0xFFFFFFFF;
+
 } // namespace chfs
\ No newline at end of file
@@ -0,0 +1,41 @@
+//===----------------------------------------------------------------------===//
+//
+//                         Chfs
+//
+// ioctl.h
+//
+// Identification: daemons/single_node_fs/ioctl.h
+//
+//
+//===----------------------------------------------------------------------===//
+#pragma once
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+/**
+ * The ioctls served by the daemon, issued on any file (or directory) of the
+ * mounted filesystem. They can be included by the user tools.
+ */
+
+// Take a snapshot, the id of the snapshot is returned in the argument
+#define CHFS_IOC_SNAPSHOT _IOR('c', 1, uint32_t)
+
+// Delete the snapshot whose id is given in the argument
+#define CHFS_IOC_DELETE_SNAPSHOT _IOW('c', 2, uint32_t)
+
+/**
+ * The argument of CHFS_IOC_CLONE_RANGE. The source is given by its inode
+ * number (`st_ino`), since the daemon can't resolve a file descriptor of the
+ * caller.
+ */
+struct chfs_clone_range {
+  uint64_t src_ino;
+  uint64_t src_offset;
+  uint64_t src_length;
+  uint64_t dest_offset;
+};
+
+// Clone a range of the source into the file the ioctl is issued on, sharing
+// the blocks. See `FileOperation::clone_range` for the alignment rules.
+#define CHFS_IOC_CLONE_RANGE _IOW('c', 3, struct chfs_clone_range)
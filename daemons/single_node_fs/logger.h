@@ -1,74 +1,377 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
 #include <cstdio>
 #include <cstdlib>
-#include <fstream>
+#include <cstring>
+#include <ctime>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <signal.h>
 #include <string>
+#include <thread>
+#include <type_traits>
+
+#include "common/config.h"
+
+// The least level of the logs, the statements below it are compiled out, see
+// `CHFS_LOG_DEBUG`
+#define CHFS_LOG_LEVEL_DEBUG 0
+#define CHFS_LOG_LEVEL_INFO 1
+#define CHFS_LOG_LEVEL_WARN 2
+#define CHFS_LOG_LEVEL_ERROR 3
+
+#ifndef CHFS_LOG_LEVEL
+#define CHFS_LOG_LEVEL CHFS_LOG_LEVEL_INFO
+#endif
 
 namespace chfs {
 
+enum class LogLevel : u8 { Debug = 0, Info, Warn, Error };
+
+// The maximum length of a formatted record, the longer ones are truncated
+const usize KLogRecordSize = 240;
+// The number of records buffered, a record is dropped if it is full
+const usize KLogRingSize = 4096;
+
+/**
+ * A log record, formatted as `event key=value ...` by the caller
+ */
+struct LogRecord {
+  // nanoseconds since the epoch
+  u64 time;
+  LogLevel level;
+  usize len;
+  char text[KLogRecordSize];
+
+  auto append(const char *str, usize len) -> void {
+    len = std::min<usize>(len, KLogRecordSize - this->len);
+    memcpy(this->text + this->len, str, len);
+    this->len += len;
+  }
+
+  auto append(const char *str) -> void { this->append(str, strlen(str)); }
+
+  /**
+   * Append a string value, which is quoted if it contains a space
+   */
+  auto append_value(const char *str, usize len) -> void {
+    if (len != 0 && memchr(str, ' ', len) == nullptr) {
+      this->append(str, len);
+      return;
+    }
+    this->append("\"", 1);
+    this->append(str, len);
+    this->append("\"", 1);
+  }
+
+  auto append_value(const char *str) -> void {
+    this->append_value(str, strlen(str));
+  }
+  auto append_value(const std::string &str) -> void {
+    this->append_value(str.data(), str.size());
+  }
+  auto append_value(bool value) -> void {
+    this->append(value ? "true" : "false");
+  }
+  auto append_value(double value) -> void {
+    char buf[32];
+    auto len = snprintf(buf, sizeof(buf), "%g", value);
+    this->append(buf, len);
+  }
+  template <typename T,
+            typename = std::enable_if_t<std::is_integral_v<T> ||
+                                        std::is_enum_v<T>>>
+  auto append_value(T value) -> void {
+    char buf[24];
+    std::to_chars_result res;
+    if constexpr (std::is_enum_v<T>) {
+      res = std::to_chars(buf, buf + sizeof(buf),
+                          static_cast<std::underlying_type_t<T>>(value));
+    } else {
+      res = std::to_chars(buf, buf + sizeof(buf), value);
+    }
+    this->append(buf, res.ptr - buf);
+  }
+
+  auto append_fields() -> void {}
+
+  template <typename V, typename... Rest>
+  auto append_fields(const char *key, const V &value, const Rest &...rest)
+      -> void {
+    this->append(" ", 1);
+    this->append(key);
+    this->append("=", 1);
+    this->append_value(value);
+    this->append_fields(rest...);
+  }
+};
+
 /**
- * Provide a logger abstraction
- * Such that the logs from the FUSE implementation can
+ * An asynchronous logger of structured records.
+ *
+ * The callers format the records in place and push them into a bounded
+ * lock-free ring (a multi-producer single-consumer variant of Vyukov's
+ * queue), which is drained to the log file by a background thread. So a
+ * request never waits for the file. If the ring is full, the record is
+ * dropped, and the number of the dropped records is logged later. The
+ * writer sleeps on a condition variable once the ring is drained, and a
+ * producer only takes the lock to wake it up.
+ *
+ * The records are logged by the macros, e.g.,
+ * `CHFS_LOG_DEBUG("read", "ino", ino, "size", size)`, which are compiled out
+ * below `CHFS_LOG_LEVEL`.
  */
 class Logger {
+  struct Slot {
+    // the position of the slot in the ring, see `push` and `pop`
+    std::atomic<u64> seq;
+    LogRecord record;
+  };
+
   FILE *logfile;
+  std::unique_ptr<Slot[]> slots;
+  // the next position to push, shared by the producers
+  std::atomic<u64> tail{0};
+  // the next position to pop, owned by the writer
+  u64 head = 0;
+  std::atomic<u64> dropped{0};
+  std::atomic<bool> stopped{false};
+  // whether the writer is (about to be) waiting for the records
+  std::atomic<bool> sleeping{false};
+  std::mutex mutex;
+  std::condition_variable wakeup;
+  std::thread writer;
 
 public:
-  Logger(const std::string &filename) {
+  explicit Logger(const std::string &filename)
+      : slots(new Slot[KLogRingSize]) {
+    static_assert((KLogRingSize & (KLogRingSize - 1)) == 0,
+                  "The ring size must be a power of two");
     this->logfile = fopen(filename.c_str(), "w");
     if (this->logfile == nullptr) {
       std::cerr << "Fatal error: failed to open the log file" << std::endl;
       std::abort();
     }
-    // set logfile to line buffering
-    setvbuf(logfile, NULL, _IOLBF, 0);
+    for (usize i = 0; i < KLogRingSize; i++) {
+      this->slots[i].seq.store(i, std::memory_order_relaxed);
+    }
+    // the writer never takes the signals, which are left to the other threads
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    this->writer = std::thread([this]() { this->write_loop(); });
+    pthread_sigmask(SIG_SETMASK, &old, nullptr);
+  }
+
+  ~Logger() { this->close(); }
+
+  Logger(const Logger &) = delete;
+  auto operator=(const Logger &) -> Logger & = delete;
+
+  /**
+   * Log a record of an event with the key/value pairs
+   */
+  template <typename... Fields>
+  auto log(LogLevel level, const char *event, const Fields &...fields)
+      -> void {
+    static_assert(sizeof...(Fields) % 2 == 0,
+                  "The fields must be key/value pairs");
+    LogRecord record;
+    record.time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      std::chrono::system_clock::now().time_since_epoch())
+                      .count();
+    record.level = level;
+    record.len = 0;
+    record.append(event);
+    record.append_fields(fields...);
+    if (!this->push(record)) {
+      this->dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+    this->wake_writer();
   }
 
-  Logger &operator<<(const char *msg) {
-    if (this->logfile != nullptr) {
-      std::fprintf(this->logfile, "%s\n", msg);
-      std::fflush(this->logfile); // Ensure the log is written immediately
+  /**
+   * Stop the writer after the buffered records are written, the later
+   * records are dropped. It is called before the process aborts.
+   */
+  auto close() -> void {
+    if (this->stopped.exchange(true)) {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(this->mutex);
+      this->wakeup.notify_one();
     }
-    return *this;
+    this->writer.join();
+    fclose(this->logfile);
   }
 
-  Logger &operator<<(const std::string &msg) {
-    if (this->logfile != nullptr) {
-      std::fprintf(this->logfile, "%s\n", msg.c_str());
-      std::fflush(this->logfile); // Ensure the log is written immediately
+private:
+  /**
+   * Wake the writer up if it is sleeping. It pairs with the fence in
+   * `wait_records`: either the writer sees the record before it sleeps, or
+   * this sees it sleeping.
+   */
+  auto wake_writer() -> void {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (this->sleeping.load(std::memory_order_relaxed)) {
+      // the writer holds the lock until it waits, so it cannot be missed
+      std::lock_guard<std::mutex> lock(this->mutex);
+      this->wakeup.notify_one();
     }
-    return *this;
   }
 
-  // Overload the << operator for log messages
-  template <typename T> Logger &operator<<(const T &msg) {
-    if (this->logfile != nullptr) {
-      std::fprintf(this->logfile, "%s\n", std::to_string(msg).c_str());
-      std::fflush(this->logfile); // Ensure the log is written immediately
+  /**
+   * Whether there is something for the writer to do, called by the writer
+   */
+  auto pending() -> bool {
+    const auto &slot = this->slots[this->head & (KLogRingSize - 1)];
+    return slot.seq.load(std::memory_order_acquire) == this->head + 1 ||
+           this->dropped.load(std::memory_order_relaxed) != 0 ||
+           this->stopped.load(std::memory_order_acquire);
+  }
+
+  auto wait_records() -> void {
+    std::unique_lock<std::mutex> lock(this->mutex);
+    this->sleeping.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    this->wakeup.wait(lock, [this]() { return this->pending(); });
+    this->sleeping.store(false, std::memory_order_relaxed);
+  }
+
+  auto push(const LogRecord &record) -> bool {
+    auto pos = this->tail.load(std::memory_order_relaxed);
+    while (true) {
+      auto &slot = this->slots[pos & (KLogRingSize - 1)];
+      const auto seq = slot.seq.load(std::memory_order_acquire);
+      const auto diff = static_cast<int64_t>(seq) - static_cast<int64_t>(pos);
+      if (diff == 0) {
+        // the slot is free for the position, claim it
+        if (this->tail.compare_exchange_weak(pos, pos + 1,
+                                             std::memory_order_relaxed)) {
+          slot.record = record;
+          slot.seq.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        // the slot is not popped yet, i.e., the ring is full
+        return false;
+      } else {
+        pos = this->tail.load(std::memory_order_relaxed);
+      }
     }
-    return *this;
   }
 
-  void log(const std::string &message) { (*this) << message << "\n"; }
+  auto pop(LogRecord &record) -> bool {
+    auto &slot = this->slots[this->head & (KLogRingSize - 1)];
+    if (slot.seq.load(std::memory_order_acquire) != this->head + 1) {
+      return false;
+    }
+    record = slot.record;
+    slot.seq.store(this->head + KLogRingSize, std::memory_order_release);
+    this->head += 1;
+    return true;
+  }
+
+  auto write_record(const LogRecord &record) -> void {
+    static const char *level_names[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+    const time_t secs = record.time / 1000000000;
+    struct tm tm;
+    localtime_r(&secs, &tm);
+    char time_buf[32];
+    strftime(time_buf, sizeof(time_buf), "%Y-%m-%dT%H:%M:%S", &tm);
+    fprintf(this->logfile, "%s.%06u %-5s %.*s\n", time_buf,
+            static_cast<unsigned>(record.time % 1000000000 / 1000),
+            level_names[static_cast<u8>(record.level)],
+            static_cast<int>(record.len), record.text);
+  }
+
+  auto write_loop() -> void {
+    LogRecord record;
+    bool written = false;
+    while (true) {
+      const bool stopping = this->stopped.load(std::memory_order_acquire);
+      while (this->pop(record)) {
+        this->write_record(record);
+        written = true;
+      }
+      if (auto dropped = this->dropped.exchange(0); dropped != 0) {
+        this->log_dropped(dropped);
+        written = true;
+      }
+      // the file is flushed once the ring is drained
+      if (written) {
+        fflush(this->logfile);
+        written = false;
+      }
+      if (stopping) {
+        return;
+      }
+      this->wait_records();
+    }
+  }
 
-  void close() {}
+  auto log_dropped(u64 dropped) -> void {
+    LogRecord record;
+    record.time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      std::chrono::system_clock::now().time_since_epoch())
+                      .count();
+    record.level = LogLevel::Warn;
+    record.len = 0;
+    record.append("log_dropped");
+    record.append_fields("records", dropped);
+    this->write_record(record);
+  }
 };
 
 extern Logger logger; // Declaration of the global logger instance
 
+#define CHFS_LOG(level, ...) ::chfs::logger.log(level, __VA_ARGS__)
+
+#if CHFS_LOG_LEVEL <= CHFS_LOG_LEVEL_DEBUG
+#define CHFS_LOG_DEBUG(...) CHFS_LOG(::chfs::LogLevel::Debug, __VA_ARGS__)
+#else
+#define CHFS_LOG_DEBUG(...)                                                    \
+  do {                                                                         \
+  } while (0)
+#endif
+
+#if CHFS_LOG_LEVEL <= CHFS_LOG_LEVEL_INFO
+#define CHFS_LOG_INFO(...) CHFS_LOG(::chfs::LogLevel::Info, __VA_ARGS__)
+#else
+#define CHFS_LOG_INFO(...)                                                     \
+  do {                                                                         \
+  } while (0)
+#endif
+
+#if CHFS_LOG_LEVEL <= CHFS_LOG_LEVEL_WARN
+#define CHFS_LOG_WARN(...) CHFS_LOG(::chfs::LogLevel::Warn, __VA_ARGS__)
+#else
+#define CHFS_LOG_WARN(...)                                                     \
+  do {                                                                         \
+  } while (0)
+#endif
+
+// the errors are always logged
+#define CHFS_LOG_ERROR(...) CHFS_LOG(::chfs::LogLevel::Error, __VA_ARGS__)
+
 #ifdef UNIMPLEMENTED
 #undef UNIMPLEMENTED
 #endif
 
 #define UNIMPLEMENTED()                                                        \
   do {                                                                         \
-    ::chfs::logger << "Unimplemented function of chfs: "                       \
-                   << __PRETTY_FUNCTION__ << " at " << __FILE__ << ":"         \
-                   << __LINE__ << "\n";                                        \
+    CHFS_LOG_ERROR("unimplemented", "function", __PRETTY_FUNCTION__, "file",   \
+                   __FILE__, "line", __LINE__);                                \
+    ::chfs::logger.close();                                                    \
     std::abort();                                                              \
   } while (0)
 
-} // namespace chfs
\ No newline at end of file
+} // namespace chfs
@@ -9,12 +9,22 @@
 #define FUSE_USE_VERSION 26
 #include <fuse/fuse_lowlevel.h>
 
+#include <filesystem>
 #include <iostream>
+#include <linux/fs.h>
+#include <optional>
+#include <signal.h>
 #include <string>
+#include <thread>
 #include <unistd.h>
 
 #include "./consts.h"
+#include "./ioctl.h"
+#include "common/stats.h"
 #include "filesystem/directory_op.h"
+#include "filesystem/readahead.h"
+#include "filesystem/trace.h"
+#include "metadata/superblock.h"
 
 #include "argparse/argparse.hpp"
 
@@ -25,6 +35,61 @@ namespace chfs {
 
 Logger logger("chfs.log"); // Definition of the global logger instance
 
+/**
+ * How long the kernel caches the attributes and the directory entries replied.
+ * The daemon is the only one changing the filesystem, and the kernel updates
+ * its caches on the changes requested through it. So only the changes made
+ * behind the kernel, e.g., by an ioctl, need to be invalidated explicitly.
+ */
+struct KernelCache {
+  double attr_timeout = KAttrTimeout;
+  double entry_timeout = KEntryTimeout;
+  // The channel to notify the kernel, it is set once mounted
+  struct fuse_chan *channel = nullptr;
+};
+
+KernelCache kernel_cache;
+
+// The trace of the operations if `--trace` is given, see `chfs-replay`
+std::shared_ptr<TraceWriter> tracer;
+
+/**
+ * Drop the cached attributes and pages of an inode
+ *
+ * Note that it must be called after the request is replied, since the kernel
+ * may wait for the request while holding the locks of the inode.
+ */
+auto invalidate_inode(fuse_ino_t ino) -> void {
+  if (kernel_cache.channel == nullptr) {
+    return;
+  }
+  // the inode may have never been cached, which is fine
+  fuse_lowlevel_notify_inval_inode(kernel_cache.channel, ino, 0, 0);
+}
+
+/**
+ * Map the error of a filesystem operation to the errno replied to the kernel.
+ * A corrupted block, as any other I/O error, fails the request with EIO.
+ */
+auto error_to_errno(ErrorType error) -> int {
+  switch (error) {
+  case ErrorType::INVALID_ARG:
+    return EINVAL;
+  case ErrorType::OUT_OF_RESOURCE:
+    return ENOSPC;
+  case ErrorType::NotExist:
+    return ENOENT;
+  case ErrorType::AlreadyExist:
+    return EEXIST;
+  case ErrorType::NotEmpty:
+    return ENOTEMPTY;
+  case ErrorType::ReadOnly:
+    return EROFS;
+  default:
+    return EIO;
+  }
+}
+
 auto getattr_helper(InodeType type, const FileAttr &attr) -> struct stat {
   struct stat st;
   st.st_nlink = 1;
@@ -48,90 +113,207 @@ auto getattr_helper(InodeType type, const FileAttr &attr) -> struct stat {
   return st;
 }
 
+/**
+ * The attributes of the virtual stats file, whose content is generated upon
+ * open, so its size is unknown
+ */
+auto stats_file_attr() -> struct stat {
+  struct stat st = {};
+  st.st_ino = KStatsInode;
+  st.st_mode = S_IFREG | 0444;
+  st.st_nlink = 1;
+  st.st_mtime = st.st_ctime = st.st_atime = time(nullptr);
+  return st;
+}
+
 static void
 chfs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+  StatTimer timer(Stat::FuseGetattr);
   FileOperation *fs = reinterpret_cast<FileOperation *>(fuse_req_userdata(req));
 
-  // logger << "getattr called with ino: " << ino << "\n";
+  CHFS_LOG_DEBUG("getattr", "ino", ino);
+
+  if (ino == KStatsInode) {
+    auto st = stats_file_attr();
+    fuse_reply_attr(req, &st, 0);
+    return;
+  }
+  TraceScope trace(tracer.get(), TraceOp::Getattr, ino);
 
   auto attr = fs->get_type_attr(ino);
   if (attr.is_err()) {
-    // entry not exist
-    fuse_reply_err(req, ENOENT);
+    fuse_reply_err(req, error_to_errno(attr.unwrap_error()));
   } else {
     auto type_attr = attr.unwrap();
     auto attr = std::get<1>(type_attr);
     auto st = getattr_helper(std::get<0>(type_attr), attr);
 
-    fuse_reply_attr(req, &st, 0);
+    fuse_reply_attr(req, &st, kernel_cache.attr_timeout);
   }
 }
 
-struct DirectoryBuf {
-  char *p;
-  size_t size;
-
-  DirectoryBuf() : p(nullptr), size(0) {}
-
-  auto add(fuse_req_t req, const char *name, fuse_ino_t ino) -> void {
-    // it will fail, anyway
-    auto sz = fuse_add_direntry(req, nullptr, 0, name, nullptr, size);
-    auto oldsize = size;
-    size += sz;
-    p = (char *)realloc(p, size);
-    memset(p + oldsize, 0, size - oldsize);
+/**
+ * The entries of an open directory. They are read once upon opendir, and
+ * readdir streams them from the offset the kernel resumes at, i.e., the index
+ * of the next entry. So a large directory is listed in one pass, and the
+ * listing is consistent even if the directory changes meanwhile.
+ */
+struct DirectoryCursor {
+  std::vector<DirectoryEntry> entries;
+};
 
-    struct stat stbuf = {};
-    stbuf.st_ino = ino;
+/**
+ * Fill the entries from the offset in a reply of at most `size` bytes, along
+ * with their attributes if `plus` is set (i.e., readdirplus)
+ */
+auto reply_entries(fuse_req_t req, const DirectoryCursor &cursor, size_t size,
+                   off_t off, bool plus) -> void {
+  FileOperation *fs = reinterpret_cast<FileOperation *>(fuse_req_userdata(req));
 
-    fuse_add_direntry(req, p + oldsize, size - oldsize, name, &stbuf, size);
+  std::vector<char> buf(size);
+  size_t filled = 0;
+  for (auto i = static_cast<usize>(off); i < cursor.entries.size(); i++) {
+    const auto &entry = cursor.entries[i];
+    size_t entry_sz;
+    if (plus) {
+      struct fuse_entry_param e = {};
+      auto attr_res = fs->get_type_attr(entry.id);
+      if (attr_res.is_ok()) {
+        auto type_attr = attr_res.unwrap();
+        e.ino = entry.id;
+        e.attr = getattr_helper(std::get<0>(type_attr), std::get<1>(type_attr));
+        e.attr.st_ino = entry.id;
+        e.attr_timeout = kernel_cache.attr_timeout;
+        e.entry_timeout = kernel_cache.entry_timeout;
+      } else {
+        // the file is removed after opendir, it is listed without attributes
+        e.attr.st_ino = entry.id;
+      }
+      entry_sz = fuse_add_direntry_plus(req, buf.data() + filled,
+                                        size - filled, entry.name.c_str(), &e,
+                                        i + 1);
+    } else {
+      struct stat stbuf = {};
+      stbuf.st_ino = entry.id;
+      entry_sz = fuse_add_direntry(req, buf.data() + filled, size - filled,
+                                   entry.name.c_str(), &stbuf, i + 1);
+    }
+    if (entry_sz > size - filled) {
+      // the entry is resumed by the next call
+      break;
+    }
+    filled += entry_sz;
   }
+  fuse_reply_buf(req, buf.data(), filled);
+}
 
-  auto reply_buf_limited(fuse_req_t req, off_t off, size_t maxsize) -> int {
-    if ((size_t)off < this->size)
-      return fuse_reply_buf(req, this->p + off,
-                            std::min(this->size - off, maxsize));
-    else
-      return fuse_reply_buf(req, nullptr, 0);
+auto do_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                struct fuse_file_info *fi, bool plus) -> void {
+  if (fi != nullptr && fi->fh != 0) {
+    reply_entries(req, *reinterpret_cast<DirectoryCursor *>(fi->fh), size,
+                  off, plus);
+    return;
   }
 
-  ~DirectoryBuf() { free(p); }
-};
-
-void chfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
-                  struct fuse_file_info *fi) {
+  // not opened by us, e.g., opendir is not hooked
   FileOperation *fs = reinterpret_cast<FileOperation *>(fuse_req_userdata(req));
-  // logger << "CHFS FUSE readdir\n";
-
-  if (fs->gettype(ino).unwrap() != InodeType::Directory) {
+  auto type_res = fs->gettype(ino);
+  if (type_res.is_err()) {
+    fuse_reply_err(req, error_to_errno(type_res.unwrap_error()));
+    return;
+  }
+  if (type_res.unwrap() != InodeType::Directory) {
     fuse_reply_err(req, ENOTDIR);
     return;
   }
-
   std::list<DirectoryEntry> list;
-  {
-    auto res = read_directory(fs, ino, list);
-    if (res.is_err()) {
-      fuse_reply_err(req, -1);
-      return;
-    }
+  if (read_directory(fs, ino, list).is_err()) {
+    fuse_reply_err(req, EIO);
+    return;
+  }
+  DirectoryCursor cursor{{list.begin(), list.end()}};
+  reply_entries(req, cursor, size, off, plus);
+}
+
+void chfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                  struct fuse_file_info *fi) {
+  StatTimer timer(Stat::FuseReaddir);
+  TraceScope trace(tracer.get(), TraceOp::Readdir, ino);
+  trace.set_range(off, size);
+  CHFS_LOG_DEBUG("readdir", "ino", ino, "size", size, "off", off);
+  do_readdir(req, ino, size, off, fi, false);
+}
+
+/** Read directory with attributes
+ *
+ * The attributes of the entries are replied along, so that `ls -l` needs no
+ * lookup of each entry.
+ *
+ * Introduced in version 2.9
+ */
+void chfs_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                      struct fuse_file_info *fi) {
+  StatTimer timer(Stat::FuseReaddir);
+  TraceScope trace(tracer.get(), TraceOp::Readdir, ino);
+  trace.set_range(off, size);
+  CHFS_LOG_DEBUG("readdirplus", "ino", ino, "size", size, "off", off);
+  do_readdir(req, ino, size, off, fi, true);
+}
+
+/**
+ * Reply the slices of the file content without copying them. libfuse splices
+ * the memory to /dev/fuse if `FUSE_CAP_SPLICE_WRITE` is negotiated.
+ */
+auto reply_slices(fuse_req_t req, const std::vector<FileSlice> &slices)
+    -> void {
+  if (slices.empty()) {
+    fuse_reply_buf(req, nullptr, 0);
+    return;
   }
 
-  DirectoryBuf buf;
-  for (auto &entry : list) {
-    buf.add(req, entry.name.c_str(), entry.id);
+  // fuse_bufvec ends with a one-element array, which is extended in place
+  std::vector<u8> storage(sizeof(fuse_bufvec) +
+                          (slices.size() - 1) * sizeof(fuse_buf));
+  auto bufv = reinterpret_cast<fuse_bufvec *>(storage.data());
+  bufv->count = slices.size();
+  bufv->idx = 0;
+  bufv->off = 0;
+  for (usize i = 0; i < slices.size(); i++) {
+    auto &buf = bufv->buf[i];
+    buf.size = slices[i].len;
+    buf.flags = static_cast<fuse_buf_flags>(0);
+    buf.mem = const_cast<u8 *>(slices[i].data);
+    buf.fd = -1;
+    buf.pos = 0;
   }
-  buf.reply_buf_limited(req, off, size);
+  // the pages are mapped from the image, so they are never moved
+  fuse_reply_data(req, bufv, static_cast<fuse_buf_copy_flags>(0));
 }
 
 void chfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
                struct fuse_file_info *fi) {
+  StatTimer timer(Stat::FuseRead);
+  timer.count(size);
+  CHFS_LOG_DEBUG("read", "ino", ino, "size", size, "off", off);
+
+  if (ino == KStatsInode) {
+    const auto &content = *reinterpret_cast<std::string *>(fi->fh);
+    if (static_cast<size_t>(off) >= content.size()) {
+      fuse_reply_buf(req, nullptr, 0);
+    } else {
+      fuse_reply_buf(req, content.data() + off,
+                     std::min(size, content.size() - off));
+    }
+    return;
+  }
+  TraceScope trace(tracer.get(), TraceOp::Read, ino);
+  trace.set_range(off, size);
 
   FileOperation *fs = reinterpret_cast<FileOperation *>(fuse_req_userdata(req));
 
   auto attr_res = fs->get_type_attr(ino);
   if (attr_res.is_err()) {
-    fuse_reply_err(req, -1);
+    fuse_reply_err(req, error_to_errno(attr_res.unwrap_error()));
     return;
   }
 
@@ -151,18 +333,31 @@ void chfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
     read_size = size;
   }
 
-  // {Your code here}
-  // UNIMPLEMENTED();
-
-  auto res = fs->read_file_w_off(ino, read_size, off);
-  if (res.is_err()) {
-    fuse_reply_err(req, -1);
-    return;
+  // the content is replied in place, i.e., spliced from the mapped blocks if
+  // the kernel supports it. A compressed file is decompressed to a buffer.
+  auto slices_res = fs->read_file_in_place(ino, read_size, off);
+  if (slices_res.is_ok()) {
+    reply_slices(req, slices_res.unwrap());
+  } else {
+    auto res = fs->read_file_w_off(ino, read_size, off);
+    if (res.is_err()) {
+      fuse_reply_err(req, error_to_errno(res.unwrap_error()));
+      return;
+    }
+    auto res_data = std::move(res).unwrap();
+    fuse_reply_buf(req, reinterpret_cast<const char *>(res_data.data()),
+                   res_data.size());
   }
 
-  auto res_data = res.unwrap();
-  fuse_reply_buf(req, reinterpret_cast<const char *>(res_data.data()),
-                 read_size);
+  // the blocks following a sequential read are fetched meanwhile
+  if (fi != nullptr && fi->fh != 0) {
+    auto window = reinterpret_cast<ReadaheadWindow *>(fi->fh);
+    auto [ahead_off, ahead_len] = window->on_read(off, read_size);
+    if (ahead_len != 0) {
+      // a hint, the read is replied anyway
+      static_cast<void>(fs->readahead(ino, ahead_off, ahead_len));
+    }
+  }
 }
 
 /** Read the target of a symbolic link
@@ -186,23 +381,26 @@ void chfs_readlink(fuse_req_t req, fuse_ino_t ino) { UNIMPLEMENTED(); }
 // shouldn't that comment be "if" there is no.... ?
 void chfs_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
                 mode_t mode, dev_t rdev) {
+  StatTimer timer(Stat::FuseMknod);
+  TraceScope trace(tracer.get(), TraceOp::Mknod, parent, name);
+  CHFS_LOG_DEBUG("mknod", "parent", parent, "name", name);
 
   FileOperation *fs = reinterpret_cast<FileOperation *>(fuse_req_userdata(req));
   struct fuse_entry_param e;
 
-  // In chfs, timeouts are always set to 0.0, and generations are always set to
-  // 0
-  e.attr_timeout = 0.0;
-  e.entry_timeout = 0.0;
+  // In chfs, generations are always set to 0
+  e.attr_timeout = kernel_cache.attr_timeout;
+  e.entry_timeout = kernel_cache.entry_timeout;
   e.generation = 0;
 
   auto res = fs->mkfile(parent, name);
 
   if (res.is_ok()) {
     e.ino = res.unwrap();
+    trace.set_result(e.ino);
     auto attr_res = fs->get_type_attr(e.ino);
     if (attr_res.is_err()) {
-      fuse_reply_err(req, -1);
+      fuse_reply_err(req, error_to_errno(attr_res.unwrap_error()));
       return;
     }
 
@@ -213,12 +411,7 @@ void chfs_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
     fuse_reply_entry(req, &e);
     return;
   } else {
-    auto err = res.unwrap_error();
-    if (err == ErrorType::AlreadyExist) {
-      fuse_reply_err(req, EEXIST);
-      return;
-    }
-    fuse_reply_err(req, ENOENT);
+    fuse_reply_err(req, error_to_errno(res.unwrap_error()));
     return;
   }
 }
@@ -226,12 +419,13 @@ void chfs_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
 /** Create a directory */
 void chfs_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
                 mode_t mode) {
+  StatTimer timer(Stat::FuseMkdir);
+  TraceScope trace(tracer.get(), TraceOp::Mkdir, parent, name);
   struct fuse_entry_param e;
 
-  // In chfs, timeouts are always set to 0.0, and generations are always set to
-  // 0
-  e.attr_timeout = 0.0;
-  e.entry_timeout = 0.0;
+  // In chfs, generations are always set to 0
+  e.attr_timeout = kernel_cache.attr_timeout;
+  e.entry_timeout = kernel_cache.entry_timeout;
   e.generation = 0;
 
   /**
@@ -244,21 +438,16 @@ void chfs_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
   // FIXME: a simple impl will ignore the mode
   auto res = fs->mkdir(parent, name);
   if (res.is_err()) {
-    switch (res.unwrap_error()) {
-    case ErrorType::AlreadyExist:
-      fuse_reply_err(req, EEXIST);
-      break;
-    default:
-      fuse_reply_err(req, ENOSYS);
-    }
+    fuse_reply_err(req, error_to_errno(res.unwrap_error()));
     return;
   }
 
   e.ino = res.unwrap();
+  trace.set_result(e.ino);
 
   auto attr_res = fs->get_type_attr(e.ino);
   if (attr_res.is_err()) {
-    fuse_reply_err(req, -1);
+    fuse_reply_err(req, error_to_errno(attr_res.unwrap_error()));
     return;
   }
 
@@ -271,19 +460,13 @@ void chfs_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
 
 /** Remove a file */
 void chfs_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  StatTimer timer(Stat::FuseUnlink);
+  TraceScope trace(tracer.get(), TraceOp::Unlink, parent, name);
+  CHFS_LOG_DEBUG("unlink", "parent", parent, "name", name);
   FileOperation *fs = reinterpret_cast<FileOperation *>(fuse_req_userdata(req));
   auto res = fs->unlink(parent, name);
   if (res.is_err()) {
-    switch (res.unwrap_error()) {
-    case ErrorType::NotExist:
-      fuse_reply_err(req, ENOENT);
-      break;
-    case ErrorType::NotEmpty:
-      fuse_reply_err(req, ENOTEMPTY);
-      break;
-    default:
-      fuse_reply_err(req, ENOSYS);
-    }
+    fuse_reply_err(req, error_to_errno(res.unwrap_error()));
     return;
   } else {
     fuse_reply_err(req, 0);
@@ -320,24 +503,27 @@ void chfs_symlink(fuse_req_t req, const char *link, fuse_ino_t parent,
 //
 void chfs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set,
                   struct fuse_file_info *fi) {
+  StatTimer timer(Stat::FuseSetattr);
+  TraceScope trace(tracer.get(), TraceOp::Setattr, ino);
+  trace.set_range(0, attr->st_size);
   FileOperation *fs = reinterpret_cast<FileOperation *>(fuse_req_userdata(req));
 
   // FIXME: currently we only deal with the resize case in the `setattr`
   auto res = fs->resize(ino, attr->st_size);
 
   if (res.is_err()) {
-    fuse_reply_err(req, ENOSYS);
+    fuse_reply_err(req, error_to_errno(res.unwrap_error()));
     return;
   } else {
     auto attr_res = fs->get_type_attr(ino);
     if (attr_res.is_err()) {
-      fuse_reply_err(req, -1); // fatal error
+      fuse_reply_err(req, error_to_errno(attr_res.unwrap_error()));
       return;
     }
     auto type_attr = attr_res.unwrap();
     auto attr = std::get<1>(type_attr);
     auto st = getattr_helper(std::get<0>(type_attr), attr);
-    fuse_reply_attr(req, &st, 0);
+    fuse_reply_attr(req, &st, kernel_cache.attr_timeout);
     return;
   }
 }
@@ -366,39 +552,101 @@ void chfs_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
  * Changed in version 2.2
  */
 void chfs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
-  // we adopt a simplified implementation
-  fuse_reply_open(req, fi);
+  StatTimer timer(Stat::FuseOpen);
+  if (ino == KStatsInode) {
+    if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+      fuse_reply_err(req, EACCES);
+      return;
+    }
+    // the statistics are taken upon open, and read regardless of the size
+    fi->direct_io = 1;
+    auto content = new std::string(dump_stats());
+    fi->fh = reinterpret_cast<uint64_t>(content);
+    if (fuse_reply_open(req, fi) != 0) {
+      delete content;
+    }
+    return;
+  }
+  TraceScope trace(tracer.get(), TraceOp::Open, ino);
+
+  // we adopt a simplified implementation, except that each open file tracks
+  // its reads for readahead
+  fi->fh = reinterpret_cast<uint64_t>(new ReadaheadWindow());
+  if (fuse_reply_open(req, fi) != 0) {
+    // the open is interrupted, so it is never released
+    delete reinterpret_cast<ReadaheadWindow *>(fi->fh);
+  }
 }
 
-/** Write data to an open file
- *
+/**
+ * Write data to a file and reply the bytes written
  */
-void chfs_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size,
-                off_t off, struct fuse_file_info *fi) {
-  // std::cerr << "[chfs write] file " << ino << " with size {" << size << "}"
-  //          << " and off: {" << off << "}.";
-
+auto write_and_reply(fuse_req_t req, fuse_ino_t ino, const char *buf,
+                     size_t size, off_t off) -> void {
   FileOperation *fs = reinterpret_cast<FileOperation *>(fuse_req_userdata(req));
   auto res = fs->write_file_w_off(ino, buf, size, off);
   if (res.is_err()) {
     auto error_code = res.unwrap_error();
-    switch (error_code) {
-    case ErrorType::OUT_OF_RESOURCE:
-      std::cerr << "OUT_OF_RESOURCE, free blocks left: "
-                << fs->get_free_blocks_num().unwrap() << std::endl;
-      break;
-    default:
-      UNIMPLEMENTED();
-      break;
+    if (error_code == ErrorType::OUT_OF_RESOURCE) {
+      CHFS_LOG_WARN("out_of_space", "ino", ino, "free_blocks",
+                    fs->get_free_blocks_num().unwrap());
     }
-
-    fuse_reply_err(req, ENOSYS);
+    fuse_reply_err(req, error_to_errno(error_code));
   } else {
     size_t bytes_written = static_cast<size_t>(res.unwrap());
     fuse_reply_write(req, static_cast<size_t>(bytes_written));
   }
 }
 
+/** Write data to an open file
+ *
+ */
+void chfs_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size,
+                off_t off, struct fuse_file_info *fi) {
+  StatTimer timer(Stat::FuseWrite);
+  timer.count(size);
+  TraceScope trace(tracer.get(), TraceOp::Write, ino);
+  trace.set_range(off, size);
+  CHFS_LOG_DEBUG("write", "ino", ino, "size", size, "off", off);
+  write_and_reply(req, ino, buf, size, off);
+}
+
+/** Write data to an open file, the data is given by a buffer vector
+ *
+ * It is preferred to write() by libfuse, and the data is never copied if it
+ * arrives in a single memory buffer, which is always the case since we don't
+ * ask for the spliced requests. Otherwise, it is gathered once.
+ *
+ * Introduced in version 2.9
+ */
+void chfs_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *in_buf,
+                    off_t off, struct fuse_file_info *fi) {
+  StatTimer timer(Stat::FuseWrite);
+  const auto size = fuse_buf_size(in_buf);
+  CHFS_LOG_DEBUG("write_buf", "ino", ino, "size", size, "off", off);
+  timer.count(size);
+  TraceScope trace(tracer.get(), TraceOp::Write, ino);
+  trace.set_range(off, size);
+  const auto &first = in_buf->buf[in_buf->idx];
+  if (in_buf->count - in_buf->idx == 1 && !(first.flags & FUSE_BUF_IS_FD)) {
+    write_and_reply(req, ino,
+                    reinterpret_cast<const char *>(first.mem) + in_buf->off,
+                    size, off);
+    return;
+  }
+
+  std::vector<char> data(size);
+  auto out_buf = FUSE_BUFVEC_INIT(size);
+  out_buf.buf[0].mem = data.data();
+  auto copied = fuse_buf_copy(&out_buf, in_buf,
+                              static_cast<fuse_buf_copy_flags>(0));
+  if (copied < 0) {
+    fuse_reply_err(req, static_cast<int>(-copied));
+    return;
+  }
+  write_and_reply(req, ino, data.data(), static_cast<size_t>(copied), off);
+}
+
 /** Get file system statistics
  *
  * The 'f_frsize', 'f_favail', 'f_fsid' and 'f_flag' fields are ignored
@@ -432,8 +680,13 @@ void chfs_statfs(fuse_req_t req, fuse_ino_t ino) { UNIMPLEMENTED(); }
  * Changed in version 2.2
  */
 // this is a no-op in BBFS.  It just logs the call and returns success
+// In chfs, we allocate the blocks of the buffered content here
 void chfs_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
-  UNIMPLEMENTED();
+  StatTimer timer(Stat::FuseFlush);
+  TraceScope trace(tracer.get(), TraceOp::Flush, ino);
+  FileOperation *fs = reinterpret_cast<FileOperation *>(fuse_req_userdata(req));
+  auto res = fs->flush(ino);
+  fuse_reply_err(req, res.is_err() ? error_to_errno(res.unwrap_error()) : 0);
 }
 
 /** Release an open file
@@ -451,7 +704,23 @@ void chfs_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
  * Changed in version 2.2
  */
 void chfs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
-  UNIMPLEMENTED();
+  StatTimer timer(Stat::FuseRelease);
+  if (ino == KStatsInode) {
+    delete reinterpret_cast<std::string *>(fi->fh);
+    fuse_reply_err(req, 0);
+    return;
+  }
+  TraceScope trace(tracer.get(), TraceOp::Release, ino);
+  FileOperation *fs = reinterpret_cast<FileOperation *>(fuse_req_userdata(req));
+  // the return value of release is ignored. The content is kept buffered if
+  // it cannot be written back, so that a later flush retries it.
+  auto res = fs->flush(ino);
+  if (res.is_err()) {
+    CHFS_LOG_WARN("release_flush_failed", "ino", ino, "error",
+                  res.unwrap_error());
+  }
+  delete reinterpret_cast<ReadaheadWindow *>(fi->fh);
+  fuse_reply_err(req, 0);
 }
 
 /** Synchronize file contents
@@ -463,7 +732,123 @@ void chfs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
  */
 void chfs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
                 struct fuse_file_info *fi) {
-  UNIMPLEMENTED();
+  StatTimer timer(Stat::FuseFsync);
+  TraceScope trace(tracer.get(), TraceOp::Fsync, ino);
+  FileOperation *fs = reinterpret_cast<FileOperation *>(fuse_req_userdata(req));
+  auto res = fs->fsync(ino);
+  fuse_reply_err(req, res.is_err() ? error_to_errno(res.unwrap_error()) : 0);
+}
+
+/** Ioctl
+ *
+ * The chfs specific ioctls in `ioctl.h`, e.g., taking a snapshot or cloning
+ * a range of a file.
+ *
+ * Introduced in version 2.8
+ */
+void chfs_ioctl(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg,
+                struct fuse_file_info *fi, unsigned flags, const void *in_buf,
+                size_t in_bufsz, size_t out_bufsz) {
+  StatTimer timer(Stat::FuseIoctl);
+  TraceScope trace(tracer.get(), TraceOp::Ioctl, ino);
+  trace.set_range(0, static_cast<unsigned>(cmd));
+  FileOperation *fs = reinterpret_cast<FileOperation *>(fuse_req_userdata(req));
+
+  // the inode flags, as `lsattr` and `chattr` do
+  if (static_cast<unsigned>(cmd) == FS_IOC_GETFLAGS) {
+    auto res = fs->get_compression(ino);
+    if (res.is_err()) {
+      fuse_reply_err(req, ENOENT);
+      return;
+    }
+    int inode_flags = res.unwrap() ? FS_COMPR_FL : 0;
+    fuse_reply_ioctl(req, 0, &inode_flags, sizeof(inode_flags));
+    return;
+  }
+  if (fs->is_read_only()) {
+    fuse_reply_err(req, EROFS);
+    return;
+  }
+
+  switch (static_cast<unsigned>(cmd)) {
+  case FS_IOC_SETFLAGS: {
+    if (in_bufsz < sizeof(int)) {
+      fuse_reply_err(req, EINVAL);
+      return;
+    }
+    const int inode_flags = *reinterpret_cast<const int *>(in_buf);
+    if (inode_flags & ~FS_COMPR_FL) {
+      fuse_reply_err(req, EOPNOTSUPP);
+      return;
+    }
+    auto res = fs->set_compression(ino, inode_flags & FS_COMPR_FL);
+    if (res.is_err()) {
+      fuse_reply_err(req, res.unwrap_error() == ErrorType::INVALID_ARG
+                              ? EOPNOTSUPP
+                              : EIO);
+      return;
+    }
+    fuse_reply_ioctl(req, 0, nullptr, 0);
+    return;
+  }
+  case CHFS_IOC_SNAPSHOT: {
+    auto res = fs->snapshot();
+    if (res.is_err()) {
+      fuse_reply_err(req, res.unwrap_error() == ErrorType::OUT_OF_RESOURCE
+                              ? ENOSPC
+                              : EOPNOTSUPP);
+      return;
+    }
+    u32 id = res.unwrap();
+    fuse_reply_ioctl(req, 0, &id, sizeof(id));
+    return;
+  }
+  case CHFS_IOC_DELETE_SNAPSHOT: {
+    if (in_bufsz != sizeof(u32)) {
+      fuse_reply_err(req, EINVAL);
+      return;
+    }
+    auto res = fs->delete_snapshot(*reinterpret_cast<const u32 *>(in_buf));
+    if (res.is_err()) {
+      fuse_reply_err(req,
+                     res.unwrap_error() == ErrorType::NotExist ? ENOENT : EIO);
+      return;
+    }
+    fuse_reply_ioctl(req, 0, nullptr, 0);
+    return;
+  }
+  case CHFS_IOC_CLONE_RANGE: {
+    if (in_bufsz != sizeof(chfs_clone_range)) {
+      fuse_reply_err(req, EINVAL);
+      return;
+    }
+    auto range = reinterpret_cast<const chfs_clone_range *>(in_buf);
+    auto res = fs->clone_range(range->src_ino, range->src_offset, ino,
+                               range->dest_offset, range->src_length);
+    if (res.is_err()) {
+      switch (res.unwrap_error()) {
+      case ErrorType::INVALID_ARG:
+        fuse_reply_err(req, EINVAL);
+        break;
+      case ErrorType::INVALID:
+        fuse_reply_err(req, EOPNOTSUPP);
+        break;
+      case ErrorType::OUT_OF_RESOURCE:
+        fuse_reply_err(req, ENOSPC);
+        break;
+      default:
+        fuse_reply_err(req, EIO);
+      }
+      return;
+    }
+    fuse_reply_ioctl(req, 0, nullptr, 0);
+    // the size and the content of the file are changed behind the kernel
+    invalidate_inode(ino);
+    return;
+  }
+  default:
+    fuse_reply_err(req, ENOTTY);
+  }
 }
 
 /** Open directory
@@ -474,7 +859,30 @@ void chfs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
  * Introduced in version 2.3
  */
 void chfs_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
-  UNIMPLEMENTED();
+  StatTimer timer(Stat::FuseOpendir);
+  TraceScope trace(tracer.get(), TraceOp::Opendir, ino);
+  FileOperation *fs = reinterpret_cast<FileOperation *>(fuse_req_userdata(req));
+  auto type_res = fs->gettype(ino);
+  if (type_res.is_err()) {
+    fuse_reply_err(req, error_to_errno(type_res.unwrap_error()));
+    return;
+  }
+  if (type_res.unwrap() != InodeType::Directory) {
+    fuse_reply_err(req, ENOTDIR);
+    return;
+  }
+
+  std::list<DirectoryEntry> list;
+  if (read_directory(fs, ino, list).is_err()) {
+    fuse_reply_err(req, EIO);
+    return;
+  }
+  auto cursor = new DirectoryCursor{{list.begin(), list.end()}};
+  fi->fh = reinterpret_cast<uint64_t>(cursor);
+  if (fuse_reply_open(req, fi) != 0) {
+    // the open is interrupted, so it is never released
+    delete cursor;
+  }
 }
 
 /** Release directory
@@ -483,7 +891,9 @@ void chfs_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
  */
 void chfs_releasedir(fuse_req_t req, fuse_ino_t ino,
                      struct fuse_file_info *fi) {
-  UNIMPLEMENTED();
+  TraceScope trace(tracer.get(), TraceOp::Releasedir, ino);
+  delete reinterpret_cast<DirectoryCursor *>(fi->fh);
+  fuse_reply_err(req, 0);
 }
 
 /** Synchronize directory contents
@@ -498,10 +908,70 @@ void chfs_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync,
   UNIMPLEMENTED();
 }
 
+/**
+ * Initialize filesystem
+ *
+ * Negotiate the capabilities of the connection with the kernel
+ *
+ * Introduced in version 2.6
+ */
+void chfs_init(void *userdata, struct fuse_conn_info *conn) {
+  // large writes, the kernel (and libfuse) may lower the limit
+  conn->want |= FUSE_CAP_BIG_WRITES;
+  conn->max_write = KFuseMaxWrite;
+  // the read replies are spliced from the mapped blocks
+  if (conn->capable & FUSE_CAP_SPLICE_WRITE) {
+    conn->want |= FUSE_CAP_SPLICE_WRITE;
+  }
+  // the attributes are listed along with the entries, the kernel decides
+  // whether they are worth it, e.g., for `ls -l`
+  if (conn->capable & FUSE_CAP_READDIRPLUS) {
+    conn->want |= FUSE_CAP_READDIRPLUS;
+  }
+  if (conn->capable & FUSE_CAP_READDIRPLUS_AUTO) {
+    conn->want |= FUSE_CAP_READDIRPLUS_AUTO;
+  }
+}
+
 static struct fuse_lowlevel_ops fuseserver_oper;
 
+/**
+ * Log the statistics of the operations upon each SIGUSR1, which must be
+ * blocked in every thread before it is called
+ */
+auto serve_stats_signal() -> void {
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  std::thread([set]() {
+    while (true) {
+      int sig;
+      if (sigwait(&set, &sig) != 0) {
+        return;
+      }
+      auto summary = collect_stats();
+      for (usize i = 0; i < KStatCount; i++) {
+        const auto &hist = summary[i].histogram;
+        if (hist.count() == 0) {
+          continue;
+        }
+        CHFS_LOG_INFO("stats", "op", stat_name(summary[i].stat), "calls",
+                      hist.count(), "p50", hist.percentile(50), "p99",
+                      hist.percentile(99), "p999", hist.percentile(99.9),
+                      "max", hist.max(), "bytes", summary[i].bytes,
+                      "blocks", summary[i].blocks);
+      }
+    }
+  }).detach();
+}
+
 void usage() {
-  std::cerr << "Usage: chfs [FUSE and mount options] mountPoint" << std::endl;
+  std::cerr << "Usage: chfs mountPoint [--image file] [--block-size n] "
+               "[--disk-size n] [--journal-blocks n] [--block-sharing] "
+               "[--dedup-index-blocks n] [--compress] [--checksum] "
+               "[--snapshot id] [--populate] [--attr-timeout s] "
+               "[--entry-timeout s] [--no-stats] [--trace file]"
+            << std::endl;
   abort();
 }
 
@@ -515,11 +985,213 @@ auto pre_process() -> void {
   }
 }
 
-auto bootstrap_fuse(int argc, char **argv) -> int {
+/**
+ * The command line options of the daemon
+ */
+struct DaemonOptions {
+  std::string mountpoint;
+  // The file-backed image. If it is empty, we use an in-memory device.
+  std::string image;
+  // The block size and the disk size of a newly formatted device
+  usize block_size;
+  u64 disk_size;
+  // Whether to pre-fault the whole image upon mount
+  bool populate;
+  // The size of the metadata journal of a newly formatted device
+  usize journal_blocks;
+  // Whether a newly formatted device can share blocks, i.e., take snapshots
+  bool block_sharing;
+  // The size of the fingerprint index of a newly formatted device, 0 if the
+  // blocks are not deduplicated
+  usize dedup_index_blocks;
+  // Whether to compress the files created
+  bool compress;
+  // Whether to checksum the blocks of a newly formatted device
+  bool checksum;
+  // The snapshot of the image to mount read-only, if any
+  std::optional<u32> snapshot;
+  // The seconds for the kernel to cache the attributes and the entries
+  double attr_timeout;
+  double entry_timeout;
+  // Whether to instrument the operations, see `KStatsFileName`
+  bool stats;
+  // The file to trace the operations to, if any
+  std::string trace;
+};
+
+auto parse_options(int argc, char **argv) -> DaemonOptions {
+  argparse::ArgumentParser program(argv[0]);
+  program.add_argument("mountpoint").help("the directory to mount chfs");
+  program.add_argument("-i", "--image")
+      .help("the file-backed image to mount, it is formatted if it is empty. "
+            "An in-memory device is used if it is not given")
+      .default_value(std::string(""));
+  program.add_argument("-b", "--block-size")
+      .help("the block size of a newly formatted device")
+      .default_value(KBlockSize)
+      .scan<'u', usize>();
+  program.add_argument("-s", "--disk-size")
+      .help("the size (in bytes) of a newly formatted device")
+      .default_value(kDiskSize)
+      .scan<'u', u64>();
+  program.add_argument("-j", "--journal-blocks")
+      .help("the blocks of the metadata journal of a newly formatted device, "
+            "a power of two. 0 disables the journal")
+      .default_value(KJournalBlocks)
+      .scan<'u', usize>();
+  program.add_argument("--block-sharing")
+      .help("allow a newly formatted device to share blocks, which is "
+            "required by the snapshots")
+      .default_value(false)
+      .implicit_value(true);
+  program.add_argument("--dedup-index-blocks")
+      .help("deduplicate the file blocks of a newly formatted device with a "
+            "fingerprint index of the blocks. 0 disables the deduplication")
+      .default_value(static_cast<usize>(0))
+      .scan<'u', usize>();
+  program.add_argument("--compress")
+      .help("compress the files created, the flag of a file can be changed "
+            "by `chattr +c/-c`")
+      .default_value(false)
+      .implicit_value(true);
+  program.add_argument("--checksum")
+      .help("checksum the blocks of a newly formatted device, a corrupted "
+            "block fails the request with EIO")
+      .default_value(false)
+      .implicit_value(true);
+  program.add_argument("--snapshot")
+      .help("mount the snapshot of the image with the id read-only")
+      .scan<'u', u32>();
+  program.add_argument("--populate")
+      .help("read the whole image into memory upon mount")
+      .default_value(false)
+      .implicit_value(true);
+  program.add_argument("--attr-timeout")
+      .help("the seconds for the kernel to cache the attributes of the "
+            "files. 0 disables the cache")
+      .default_value(KAttrTimeout)
+      .scan<'g', double>();
+  program.add_argument("--entry-timeout")
+      .help("the seconds for the kernel to cache the directory entries, "
+            "including the absent ones. 0 disables the cache")
+      .default_value(KEntryTimeout)
+      .scan<'g', double>();
+  program.add_argument("--no-stats")
+      .help("don't record the latency of the operations, which are read "
+            "from the `.chfs_stats` file in the root, or logged upon SIGUSR1")
+      .default_value(false)
+      .implicit_value(true);
+  program.add_argument("--trace")
+      .help("record the operations to the file, which are replayed by "
+            "`chfs-replay`")
+      .default_value(std::string(""));
+
+  try {
+    program.parse_args(argc, argv);
+  } catch (const std::runtime_error &err) {
+    std::cerr << err.what() << std::endl << program;
+    std::exit(1);
+  }
+
+  DaemonOptions options;
+  options.mountpoint = program.get<std::string>("mountpoint");
+  options.image = program.get<std::string>("--image");
+  options.block_size = program.get<usize>("--block-size");
+  options.disk_size = program.get<u64>("--disk-size");
+  options.populate = program.get<bool>("--populate");
+  options.journal_blocks = program.get<usize>("--journal-blocks");
+  options.block_sharing = program.get<bool>("--block-sharing");
+  options.dedup_index_blocks = program.get<usize>("--dedup-index-blocks");
+  options.compress = program.get<bool>("--compress");
+  options.checksum = program.get<bool>("--checksum");
+  options.snapshot = program.present<u32>("--snapshot");
+  options.attr_timeout = program.get<double>("--attr-timeout");
+  options.entry_timeout = program.get<double>("--entry-timeout");
+  options.stats = !program.get<bool>("--no-stats");
+  options.trace = program.get<std::string>("--trace");
+  if (options.snapshot && options.image.empty()) {
+    std::cerr << "A snapshot can only be mounted from an image. " << std::endl;
+    std::exit(1);
+  }
+  return options;
+}
+
+/**
+ * Mount the filesystem on the image, or format a new one if the image is
+ * empty (or in-memory).
+ */
+auto mount_or_format(const DaemonOptions &options)
+    -> std::shared_ptr<FileOperation> {
+  if (!options.image.empty() && std::filesystem::exists(options.image) &&
+      std::filesystem::file_size(options.image) > 0) {
+    auto block_size = SuperBlock::peek_block_size(options.image);
+    if (!block_size) {
+      std::cerr << "The image " << options.image
+                << " is not formatted by chfs. " << std::endl;
+      exit(1);
+    }
+
+    auto bm = std::shared_ptr<BlockManager>(
+        new BlockManager(options.image, 0, block_size.value(), options.populate));
+    if (!options.populate) {
+      // warm up the image asynchronously, we can serve requests meanwhile
+      static_cast<void>(bm->prefetch(0, bm->total_blocks()));
+    }
+
+    // the snapshot is safe to mount even if the image is in use
+    auto res = options.snapshot
+                   ? FileOperation::create_from_snapshot(
+                         bm, options.snapshot.value())
+                   : FileOperation::create_from_raw(bm);
+    if (res.is_err()) {
+      std::cerr << "Cannot mount the image " << options.image << ". "
+                << std::endl;
+      exit(1);
+    }
+    return res.unwrap();
+  }
+
+  const auto block_cnt = options.disk_size / options.block_size;
+  auto bm = options.image.empty()
+                ? std::shared_ptr<BlockManager>(
+                      new BlockManager(block_cnt, options.block_size))
+                : std::shared_ptr<BlockManager>(new BlockManager(
+                      options.image, block_cnt, options.block_size));
+  if (options.snapshot) {
+    std::cerr << "The image " << options.image << " has no snapshot. "
+              << std::endl;
+    exit(1);
+  }
+  auto fs = std::make_shared<FileOperation>(
+      bm, KMaxInodeNum, AllocatorType::Bitmap, options.journal_blocks,
+      options.block_sharing);
+  {
+    // pre-initialize
+    auto res = fs->alloc_inode(InodeType::Directory);
+    if (res.is_err()) {
+      std::cerr << "Cannot allocate inode for root directory. " << std::endl;
+      exit(1);
+    }
+    CHFS_ASSERT(res.unwrap() == KRootInode,
+                "The allocated inode number is incorrect ");
+  }
+  if (options.dedup_index_blocks != 0 &&
+      fs->enable_dedup(options.dedup_index_blocks).is_err()) {
+    std::cerr << "Cannot enable the deduplication. " << std::endl;
+    exit(1);
+  }
+  if (options.checksum && fs->enable_checksum().is_err()) {
+    std::cerr << "Cannot enable the checksums. " << std::endl;
+    exit(1);
+  }
+  return fs;
+}
+
+auto bootstrap_fuse(const char *prog, const DaemonOptions &options) -> int {
   const char *fuse_argv[20];
   int fuse_argc = 0;
-  fuse_argv[fuse_argc++] = argv[0];
-  auto mountpoint = argv[1];
+  fuse_argv[fuse_argc++] = prog;
+  char *mountpoint = nullptr;
 
   // prepare the fuse parameters
 #ifdef __APPLE__
@@ -529,8 +1201,12 @@ auto bootstrap_fuse(int argc, char **argv) -> int {
   fuse_argv[fuse_argc++] = "daemon_timeout=86400";
 #endif
 
-  fuse_argv[fuse_argc++] = mountpoint;
+  fuse_argv[fuse_argc++] = options.mountpoint.c_str();
   fuse_argv[fuse_argc++] = "-d";
+  if (options.snapshot) {
+    fuse_argv[fuse_argc++] = "-o";
+    fuse_argv[fuse_argc++] = "ro";
+  }
   fuse_args args = FUSE_ARGS_INIT(fuse_argc, (char **)fuse_argv);
   int foreground;
 
@@ -542,28 +1218,41 @@ auto bootstrap_fuse(int argc, char **argv) -> int {
     return 0;
   }
 
-  auto ch = fuse_mount(argv[1], &args);
+  auto ch = fuse_mount(options.mountpoint.c_str(), &args);
   if (ch == nullptr) {
     std::cerr << "Fuse mount fails. " << std::endl;
     exit(1);
   }
 
   // 2. prepare the filesystem handler
-  auto bm = std::shared_ptr<BlockManager>(
-      new BlockManager(kDiskSize / KBlockSize, KBlockSize));
-  auto fs = new FileOperation(bm, KMaxInodeNum);
-  {
-    // pre-initialize
-    auto res = fs->alloc_inode(InodeType::Directory);
+  auto fs = mount_or_format(options);
+  fs->set_delayed_allocation(KDirtyBufferLimit).unwrap();
+  fs->set_compress_new_files(options.compress);
+  kernel_cache.attr_timeout = options.attr_timeout;
+  kernel_cache.entry_timeout = options.entry_timeout;
+  kernel_cache.channel = ch;
+  set_stats_enabled(options.stats);
+  if (!options.trace.empty()) {
+    auto res = TraceWriter::create(options.trace);
     if (res.is_err()) {
-      std::cerr << "Cannot allocate inode for root directory. " << std::endl;
+      std::cerr << "Cannot create the trace " << options.trace << ". "
+                << std::endl;
       exit(1);
     }
-    CHFS_ASSERT(res.unwrap() == 1, "The allocated inode number is incorrect ");
+    tracer = res.unwrap();
   }
 
-  auto se =
-      fuse_lowlevel_new(&args, &fuseserver_oper, sizeof(fuseserver_oper), fs);
+  // zero the metadata blocks skipped by the lazy format in the background,
+  // a snapshot never writes the image
+  auto bm = fs->get_block_manager();
+  std::thread lazy_zeroer([bm, read_only = fs->is_read_only()]() {
+    if (!read_only) {
+      bm->zero_lazy_blocks();
+    }
+  });
+
+  auto se = fuse_lowlevel_new(&args, &fuseserver_oper, sizeof(fuseserver_oper),
+                              fs.get());
   if (se == 0) {
     std::cerr << "fuse_lowlevel_new failed\n";
     exit(1);
@@ -573,31 +1262,51 @@ auto bootstrap_fuse(int argc, char **argv) -> int {
   auto err = fuse_session_loop(se);
 
   fuse_session_destroy(se);
-  fuse_unmount(argv[1], ch);
-
-  delete fs;
+  kernel_cache.channel = nullptr;
+  // the buffered records are written
+  tracer.reset();
+  fuse_unmount(options.mountpoint.c_str(), ch);
+
+  bm->stop_lazy_zero();
+  lazy_zeroer.join();
+
+  // write back the buffered files before exit, so the next mount needs no
+  // recovery
+  if (fs->unmount().is_err()) {
+    std::cerr << "Failed to unmount the filesystem cleanly. " << std::endl;
+  }
   return err;
 }
 
 // We assume the lookup must be conducted on a directory inode
 void chfs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  StatTimer timer(Stat::FuseLookup);
+  CHFS_LOG_DEBUG("lookup", "parent", parent, "name", name);
   FileOperation *fs = reinterpret_cast<FileOperation *>(fuse_req_userdata(req));
   struct fuse_entry_param e;
 
-  // In chfs, timeouts are always set to 0.0, and generations are always set to
-  // 0
-  e.attr_timeout = 0.0;
-  e.entry_timeout = 0.0;
+  // In chfs, generations are always set to 0
+  e.attr_timeout = kernel_cache.attr_timeout;
+  e.entry_timeout = kernel_cache.entry_timeout;
   e.generation = 0;
 
+  // the virtual stats file in the root, which is never listed
+  if (parent == KRootInode && strcmp(name, KStatsFileName) == 0) {
+    e.ino = KStatsInode;
+    e.attr = stats_file_attr();
+    e.attr_timeout = 0;
+    fuse_reply_entry(req, &e);
+    return;
+  }
+  TraceScope trace(tracer.get(), TraceOp::Lookup, parent, name);
+
   // lookup
   std::list<DirectoryEntry> list;
 
   {
     auto res = read_directory(fs, parent, list);
     if (res.is_err()) {
-      // FIXME: the error type is incorrect
-      fuse_reply_err(req, -1);
+      fuse_reply_err(req, error_to_errno(res.unwrap_error()));
       return;
     }
   }
@@ -607,11 +1316,12 @@ void chfs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
     if (entry.name == name) {
       // found
       e.ino = entry.id;
+      trace.set_result(e.ino);
       // get attr
       {
         auto attr_res = fs->get_type_attr(e.ino);
         if (attr_res.is_err()) {
-          fuse_reply_err(req, -1);
+          fuse_reply_err(req, error_to_errno(attr_res.unwrap_error()));
           return;
         }
 
@@ -626,6 +1336,12 @@ void chfs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
     }
   }
 
+  // cache the absence as well, the kernel drops it upon the creation
+  if (kernel_cache.entry_timeout > 0) {
+    e.ino = 0;
+    fuse_reply_entry(req, &e);
+    return;
+  }
   fuse_reply_err(req, ENOENT);
 }
 
@@ -634,13 +1350,25 @@ void chfs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
 /**
  * Usage:
  *
- * ./bin/fs directory_to_mount xxx
+ * ./bin/fs directory_to_mount [--image chfs.img] [--block-size 1024]
+ *          [--disk-size 16777216] [--block-sharing] [--snapshot 0]
+ *          [--populate] [--attr-timeout 1.0] [--entry-timeout 1.0]
+ *          [--trace chfs.trace]
  */
 auto main(int argc, char **argv) -> int {
   using namespace chfs;
   pre_process();
 
+  // the signal is taken by a dedicated thread, so it is blocked before any
+  // other thread is spawned
+  sigset_t stats_signal;
+  sigemptyset(&stats_signal);
+  sigaddset(&stats_signal, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &stats_signal, nullptr);
+  serve_stats_signal();
+
   // Not all functions are needed for our tests
+  fuseserver_oper.init = chfs_init;
   fuseserver_oper.open = chfs_open;
   fuseserver_oper.getattr = chfs_getattr;
   fuseserver_oper.readdir = chfs_readdir;
@@ -654,20 +1382,24 @@ auto main(int argc, char **argv) -> int {
   fuseserver_oper.rename = chfs_rename;
   fuseserver_oper.link = chfs_link;
   fuseserver_oper.write = chfs_write;
+  fuseserver_oper.write_buf = chfs_write_buf;
   fuseserver_oper.setattr = chfs_setattr;
   fuseserver_oper.statfs = chfs_statfs;
-  // fuseserver_oper.flush = chfs_flush;
-  // fuseserver_oper.release = chfs_release;
-  // fuseserver_oper.fsync = chfs_fsync;
-  // fuseserver_oper.opendir = chfs_opendir;
-  // fuseserver_oper.releasedir = chfs_releasedir;
+  fuseserver_oper.flush = chfs_flush;
+  fuseserver_oper.release = chfs_release;
+  fuseserver_oper.fsync = chfs_fsync;
+  fuseserver_oper.ioctl = chfs_ioctl;
+  fuseserver_oper.readdirplus = chfs_readdirplus;
+  fuseserver_oper.opendir = chfs_opendir;
+  fuseserver_oper.releasedir = chfs_releasedir;
   // fuseserver_oper.fsyncdir = chfs_fsyncdir;
   fuseserver_oper.lookup = chfs_lookup;
 
   std::cout << "Start to hook fuse" << std::endl;
-  logger << "CHFS FUSE log started\n";
+  CHFS_LOG_INFO("log_started");
 
-  auto ret = bootstrap_fuse(argc, argv);
+  auto options = parse_options(argc, argv);
+  auto ret = bootstrap_fuse(argv[0], options);
   std::cout << "Fuse main return with [" << ret << "]. " << std::endl;
 
   if (ret != 0) {
@@ -1,14 +1,49 @@
+#include <algorithm>
+
 #include "block/allocator.h"
+#include "block/buddy_allocator.h"
 #include "common/bitmap.h"
+#include "common/buffer_pool.h"
+#include "common/stats.h"
 
 namespace chfs {
 
 BlockAllocator::BlockAllocator(std::shared_ptr<BlockManager> block_manager)
     : BlockAllocator(std::move(block_manager), 0, true) {}
 
+auto BlockAllocator::create(AllocatorType type,
+                            std::shared_ptr<BlockManager> block_manager,
+                            usize bitmap_block_id, bool will_initialize,
+                            std::optional<usize> free_blocks)
+    -> ChfsResult<std::shared_ptr<BlockAllocator>> {
+  if (type == AllocatorType::Buddy) {
+    auto res = BuddyAllocator::create(std::move(block_manager), bitmap_block_id,
+                                      will_initialize, free_blocks);
+    if (res.is_err()) {
+      return ChfsResult<std::shared_ptr<BlockAllocator>>(res.unwrap_error());
+    }
+    return ChfsResult<std::shared_ptr<BlockAllocator>>(
+        std::move(res).unwrap());
+  }
+
+  // the free blocks are counted here, where a read error can be returned
+  const bool recount = !will_initialize && !free_blocks;
+  auto allocator = std::shared_ptr<BlockAllocator>(new BlockAllocator(
+      std::move(block_manager), bitmap_block_id, will_initialize,
+      recount ? std::optional<usize>(0) : free_blocks));
+  if (recount) {
+    auto res = allocator->recount_free_blocks();
+    if (res.is_err()) {
+      return ChfsResult<std::shared_ptr<BlockAllocator>>(res.unwrap_error());
+    }
+  }
+  return ChfsResult<std::shared_ptr<BlockAllocator>>(allocator);
+}
+
 // Your implementation
 BlockAllocator::BlockAllocator(std::shared_ptr<BlockManager> block_manager,
-                               usize bitmap_block_id, bool will_initialize)
+                               usize bitmap_block_id, bool will_initialize,
+                               std::optional<usize> free_blocks)
     : bm(std::move(block_manager)), bitmap_block_id(bitmap_block_id) {
   // calculate the total blocks required
   const auto total_bits_per_block = this->bm->block_size() * KBitsPerByte;
@@ -32,16 +67,20 @@ BlockAllocator::BlockAllocator(std::shared_ptr<BlockManager> block_manager,
               "last block num should be less than total bits per block");
 
   if (!will_initialize) {
+    // scanning the bitmap takes time proportional to the device size
+    this->free_cnt = free_blocks ? free_blocks.value()
+                                 : this->count_free_blocks().unwrap();
     return;
   }
 
-  // zeroing
+  // zeroing, the bitmap blocks holding the reserved blocks are written below
+  this->bm->track_lazy(this->bitmap_block_id + this->bitmap_block_cnt);
   for (block_id_t i = 0; i < this->bitmap_block_cnt; i++) {
-    this->bm->zero_block(i + this->bitmap_block_id);
+    this->bm->zero_block_lazily(i + this->bitmap_block_id).unwrap();
   }
 
   block_id_t cur_block_id = this->bitmap_block_id;
-  std::vector<u8> buffer(bm->block_size());
+  auto buffer = BlockBuffer::acquire(bm->block_size());
   auto bitmap = Bitmap(buffer.data(), bm->block_size());
   bitmap.zeroed();
 
@@ -54,7 +93,7 @@ BlockAllocator::BlockAllocator(std::shared_ptr<BlockManager> block_manager,
     auto block_idx = i % total_bits_per_block;
 
     if (block_id != cur_block_id) {
-      bm->write_block(cur_block_id, buffer.data());
+      bm->write_block(cur_block_id, buffer.data()).unwrap();
 
       cur_block_id = block_id;
       bitmap.zeroed();
@@ -63,16 +102,20 @@ BlockAllocator::BlockAllocator(std::shared_ptr<BlockManager> block_manager,
     bitmap.set(block_idx);
   }
 
-  bm->write_block(cur_block_id, buffer.data());
+  bm->write_block(cur_block_id, buffer.data()).unwrap();
+  this->free_cnt =
+      this->bm->total_blocks() - this->bitmap_block_cnt - this->bitmap_block_id;
 }
 
-// Fixme: currently we don't consider errors in this implementation
-auto BlockAllocator::free_block_cnt() const -> usize {
+auto BlockAllocator::count_free_blocks() const -> ChfsResult<usize> {
   usize total_free_blocks = 0;
-  std::vector<u8> buffer(bm->block_size());
+  auto buffer = BlockBuffer::acquire(bm->block_size());
 
   for (block_id_t i = 0; i < this->bitmap_block_cnt; i++) {
-    bm->read_block(i + this->bitmap_block_id, buffer.data()).unwrap();
+    auto res = bm->read_block(i + this->bitmap_block_id, buffer.data());
+    if (res.is_err()) {
+      return ChfsResult<usize>(res.unwrap_error());
+    }
 
     usize n_free_blocks = 0;
     if (i == this->bitmap_block_cnt - 1) {
@@ -87,63 +130,311 @@ auto BlockAllocator::free_block_cnt() const -> usize {
     //           << std::endl;
     total_free_blocks += n_free_blocks;
   }
-  return total_free_blocks;
+  return ChfsResult<usize>(total_free_blocks);
+}
+
+auto BlockAllocator::recount_free_blocks() -> ChfsNullResult {
+  auto res = this->count_free_blocks();
+  if (res.is_err()) {
+    return ChfsNullResult(res.unwrap_error());
+  }
+  this->free_cnt = res.unwrap();
+  return KNullOk;
 }
 
 // Your implementation
 auto BlockAllocator::allocate() -> ChfsResult<block_id_t> {
-  std::vector<u8> buffer(bm->block_size());
+  StatTimer timer(Stat::AllocatorAllocate);
+  auto buffer = BlockBuffer::acquire(bm->block_size());
 
   for (uint i = 0; i < this->bitmap_block_cnt; i++) {
-    bm->read_block(i + this->bitmap_block_id, buffer.data());
+    auto read_res = bm->read_block(i + this->bitmap_block_id, buffer.data());
+    if (read_res.is_err()) {
+      return ChfsResult<block_id_t>(read_res.unwrap_error());
+    }
 
     // The index of the allocated bit inside current bitmap block.
     std::optional<block_id_t> res = std::nullopt;
+    auto bitmap = Bitmap(buffer.data(), bm->block_size());
 
     if (i == this->bitmap_block_cnt - 1) {
       // If current block is the last block of the bitmap.
-
-      // TODO: Find the first free bit of current bitmap block
-      // and store it in `res`.
-      UNIMPLEMENTED();
+      res = bitmap.find_first_free_w_bound(this->last_block_num);
     } else {
-
-      // TODO: Find the first free bit of current bitmap block
-      // and store it in `res`.
-      UNIMPLEMENTED();
+      res = bitmap.find_first_free();
     }
 
     // If we find one free bit inside current bitmap block.
     if (res) {
-      // The block id of the allocated block.
-      block_id_t retval = static_cast<block_id_t>(0);
-
-      // TODO:
-      // 1. Set the free bit we found to 1 in the bitmap.
-      // 2. Flush the changed bitmap block back to the block manager.
-      // 3. Calculate the value of `retval`.
-      UNIMPLEMENTED();
+      record_stat(Stat::AllocatorScan, i + 1);
+      bitmap.set(res.value());
+      auto write_res =
+          bm->write_block(i + this->bitmap_block_id, buffer.data());
+      if (write_res.is_err()) {
+        return ChfsResult<block_id_t>(write_res.unwrap_error());
+      }
+      this->free_cnt -= 1;
 
+      // The block id of the allocated block.
+      block_id_t retval = static_cast<block_id_t>(i) * bm->block_size() *
+                              KBitsPerByte +
+                          res.value();
       return ChfsResult<block_id_t>(retval);
     }
   }
+  record_stat(Stat::AllocatorScan, this->bitmap_block_cnt);
   return ChfsResult<block_id_t>(ErrorType::OUT_OF_RESOURCE);
 }
 
 // Your implementation
 auto BlockAllocator::deallocate(block_id_t block_id) -> ChfsNullResult {
+  StatTimer timer(Stat::AllocatorDeallocate);
   if (block_id >= this->bm->total_blocks()) {
     return ChfsNullResult(ErrorType::INVALID_ARG);
   }
 
-  // TODO: Implement this function.
-  // 1. According to `block_id`, zero the bit in the bitmap.
-  // 2. Flush the changed bitmap block back to the block manager.
-  // 3. Return ChfsNullResult(ErrorType::INVALID_ARG) 
-  //    if you find `block_id` is invalid (e.g. already freed).
-  UNIMPLEMENTED();
+  const auto total_bits_per_block = this->bm->block_size() * KBitsPerByte;
+  const auto bitmap_block = this->bitmap_block_id + block_id / total_bits_per_block;
+
+  auto buffer = BlockBuffer::acquire(bm->block_size());
+  auto read_res = bm->read_block(bitmap_block, buffer.data());
+  if (read_res.is_err()) {
+    return read_res;
+  }
+
+  auto bitmap = Bitmap(buffer.data(), bm->block_size());
+  if (!bitmap.check(block_id % total_bits_per_block)) {
+    // double free
+    return ChfsNullResult(ErrorType::INVALID_ARG);
+  }
+  bitmap.clear(block_id % total_bits_per_block);
+
+  auto write_res = bm->write_block(bitmap_block, buffer.data());
+  if (write_res.is_err()) {
+    return write_res;
+  }
+  this->free_cnt += 1;
+  return KNullOk;
+}
+
+auto BlockAllocator::allocate_n(usize count, std::vector<block_id_t> &out)
+    -> ChfsNullResult {
+  StatTimer timer(Stat::AllocatorAllocateN);
+  if (count == 0) {
+    return KNullOk;
+  }
+  if (count > this->free_cnt) {
+    return ChfsNullResult(ErrorType::OUT_OF_RESOURCE);
+  }
+
+  const auto total_bits_per_block = this->bm->block_size() * KBitsPerByte;
+  const auto out_start = out.size();
+  auto buffer = BlockBuffer::acquire(bm->block_size());
+  usize remaining = count;
+  timer.count(0, count);
+
+  block_id_t i = 0;
+  for (; i < this->bitmap_block_cnt && remaining > 0; i++) {
+    auto read_res = bm->read_block(i + this->bitmap_block_id, buffer.data());
+    if (read_res.is_err()) {
+      out.resize(out_start);
+      return read_res;
+    }
+
+    auto bitmap = Bitmap(buffer.data(), bm->block_size());
+    const auto bound = this->bits_in_bitmap_block(i);
+    const auto taken_before = remaining;
+
+    for (usize bit = 0; bit < bound && remaining > 0;) {
+      // skip the fully-allocated words quickly
+      if (bit % (KBytesPerWord * KBitsPerByte) == 0 &&
+          bit + KBytesPerWord * KBitsPerByte <= bound &&
+          reinterpret_cast<u64 *>(buffer.data())[bit / (KBytesPerWord *
+                                                        KBitsPerByte)] ==
+              ~u64(0)) {
+        bit += KBytesPerWord * KBitsPerByte;
+        continue;
+      }
+      if (!bitmap.check(bit)) {
+        bitmap.set(bit);
+        out.push_back(i * total_bits_per_block + bit);
+        remaining -= 1;
+      }
+      bit += 1;
+    }
+
+    if (remaining == taken_before) {
+      continue;
+    }
 
+    // flush the bitmap block once for all the bits taken from it
+    auto write_res = bm->write_block(i + this->bitmap_block_id, buffer.data());
+    if (write_res.is_err()) {
+      out.resize(out_start);
+      return write_res;
+    }
+    this->free_cnt -= taken_before - remaining;
+  }
+  record_stat(Stat::AllocatorScan, i);
+
+  if (remaining > 0) {
+    // not enough free blocks, give back what we have taken
+    std::vector<block_id_t> taken(out.begin() + out_start, out.end());
+    out.resize(out_start);
+    auto res = this->update_bitmap(taken, false);
+    if (res.is_err()) {
+      return res;
+    }
+    return ChfsNullResult(ErrorType::OUT_OF_RESOURCE);
+  }
   return KNullOk;
 }
 
+auto BlockAllocator::deallocate_batch(const std::vector<block_id_t> &block_ids)
+    -> ChfsNullResult {
+  return this->update_bitmap(block_ids, false);
+}
+
+auto BlockAllocator::allocate_extent(u32 order) -> ChfsResult<block_id_t> {
+  const block_id_t extent_sz = static_cast<block_id_t>(1) << order;
+  const auto total_bits_per_block = this->bm->block_size() * KBitsPerByte;
+  auto buffer = BlockBuffer::acquire(bm->block_size());
+
+  // A plain bitmap has no index of the free extents, so we scan it for an
+  // aligned free run. Sub-classes can do better.
+  block_id_t run_start = 0;
+  block_id_t run_len = 0;
+  for (block_id_t i = 0; i < this->bitmap_block_cnt; i++) {
+    auto read_res = bm->read_block(i + this->bitmap_block_id, buffer.data());
+    if (read_res.is_err()) {
+      return ChfsResult<block_id_t>(read_res.unwrap_error());
+    }
+
+    auto bitmap = Bitmap(buffer.data(), bm->block_size());
+    for (usize bit = 0; bit < this->bits_in_bitmap_block(i); bit++) {
+      const block_id_t block_id = i * total_bits_per_block + bit;
+      if (bitmap.check(bit)) {
+        run_len = 0;
+        continue;
+      }
+      if (run_len == 0 && block_id % extent_sz != 0) {
+        continue;
+      }
+      if (run_len == 0) {
+        run_start = block_id;
+      }
+      run_len += 1;
+      if (run_len == extent_sz) {
+        std::vector<block_id_t> extent(extent_sz);
+        for (block_id_t j = 0; j < extent_sz; j++) {
+          extent[j] = run_start + j;
+        }
+        auto res = this->update_bitmap(extent, true);
+        if (res.is_err()) {
+          return ChfsResult<block_id_t>(res.unwrap_error());
+        }
+        return ChfsResult<block_id_t>(run_start);
+      }
+    }
+  }
+  return ChfsResult<block_id_t>(ErrorType::OUT_OF_RESOURCE);
+}
+
+auto BlockAllocator::deallocate_extent(block_id_t start, u32 order)
+    -> ChfsNullResult {
+  const block_id_t extent_sz = static_cast<block_id_t>(1) << order;
+  if (start % extent_sz != 0) {
+    return ChfsNullResult(ErrorType::INVALID_ARG);
+  }
+
+  std::vector<block_id_t> extent(extent_sz);
+  for (block_id_t j = 0; j < extent_sz; j++) {
+    extent[j] = start + j;
+  }
+  return this->update_bitmap(extent, false);
+}
+
+auto BlockAllocator::update_bitmap(const std::vector<block_id_t> &block_ids,
+                                   bool allocated) -> ChfsNullResult {
+  const auto total_bits_per_block = this->bm->block_size() * KBitsPerByte;
+
+  std::vector<block_id_t> sorted(block_ids);
+  std::sort(sorted.begin(), sorted.end());
+
+  auto buffer = BlockBuffer::acquire(bm->block_size());
+  auto bitmap = Bitmap(buffer.data(), bm->block_size());
+
+  for (usize start = 0; start < sorted.size();) {
+    if (sorted[start] >= this->bm->total_blocks()) {
+      return ChfsNullResult(ErrorType::INVALID_ARG);
+    }
+
+    // [start, end) are tracked by the same bitmap block
+    const auto group = sorted[start] / total_bits_per_block;
+    usize end = start;
+    while (end < sorted.size() && sorted[end] / total_bits_per_block == group) {
+      end++;
+    }
+
+    auto read_res = bm->read_block(group + this->bitmap_block_id, buffer.data());
+    if (read_res.is_err()) {
+      return read_res;
+    }
+
+    for (usize j = start; j < end; j++) {
+      if (sorted[j] >= this->bm->total_blocks() ||
+          (j > start && sorted[j] == sorted[j - 1]) ||
+          bitmap.check(sorted[j] % total_bits_per_block) == allocated) {
+        // out of range, double allocation or double free
+        return ChfsNullResult(ErrorType::INVALID_ARG);
+      }
+    }
+    for (usize j = start; j < end; j++) {
+      if (allocated) {
+        bitmap.set(sorted[j] % total_bits_per_block);
+      } else {
+        bitmap.clear(sorted[j] % total_bits_per_block);
+      }
+    }
+
+    auto write_res =
+        bm->write_block(group + this->bitmap_block_id, buffer.data());
+    if (write_res.is_err()) {
+      return write_res;
+    }
+    if (allocated) {
+      this->free_cnt -= end - start;
+    } else {
+      this->free_cnt += end - start;
+    }
+    start = end;
+  }
+  return KNullOk;
+}
+
+auto BlockAllocator::allocate_contiguous(usize count)
+    -> ChfsResult<block_id_t> {
+  u32 order = 0;
+  while ((static_cast<usize>(1) << order) < count) {
+    order++;
+  }
+
+  auto res = this->allocate_extent(order);
+  if (res.is_err()) {
+    return res;
+  }
+
+  std::vector<block_id_t> tail;
+  for (auto i = count; i < (static_cast<usize>(1) << order); i++) {
+    tail.push_back(res.unwrap() + i);
+  }
+  if (!tail.empty()) {
+    auto dealloc_res = this->deallocate_batch(tail);
+    if (dealloc_res.is_err()) {
+      return ChfsResult<block_id_t>(dealloc_res.unwrap_error());
+    }
+  }
+  return res;
+}
+
 } // namespace chfs
@@ -0,0 +1,248 @@
+#include <algorithm>
+
+#include "block/buddy_allocator.h"
+
+namespace chfs {
+
+BuddyAllocator::BuddyAllocator(std::shared_ptr<BlockManager> block_manager,
+                               usize bitmap_block_id, bool will_initialize,
+                               std::optional<usize> free_blocks)
+    : BlockAllocator(std::move(block_manager), bitmap_block_id,
+                     will_initialize, free_blocks),
+      free_lists(KBuddyMaxOrder + 1) {}
+
+auto BuddyAllocator::create(std::shared_ptr<BlockManager> bm,
+                            usize bitmap_block_id, bool will_initialize,
+                            std::optional<usize> free_blocks)
+    -> ChfsResult<std::shared_ptr<BuddyAllocator>> {
+  // the free blocks are counted here, where a read error can be returned
+  const bool recount = !will_initialize && !free_blocks;
+  auto allocator = std::shared_ptr<BuddyAllocator>(new BuddyAllocator(
+      std::move(bm), bitmap_block_id, will_initialize,
+      recount ? std::optional<usize>(0) : free_blocks));
+  auto res = recount ? allocator->recount_free_blocks() : KNullOk;
+  if (res.is_ok()) {
+    res = allocator->build_free_lists();
+  }
+  if (res.is_err()) {
+    return ChfsResult<std::shared_ptr<BuddyAllocator>>(res.unwrap_error());
+  }
+  return ChfsResult<std::shared_ptr<BuddyAllocator>>(allocator);
+}
+
+auto BuddyAllocator::build_free_lists() -> ChfsNullResult {
+  const auto total_bits_per_block = this->bm->block_size() * KBitsPerByte;
+  std::vector<u8> buffer(bm->block_size());
+
+  for (auto &list : free_lists) {
+    list.clear();
+  }
+  this->nonempty_orders = 0;
+
+  // Split each free run of the bitmap into maximal aligned extents
+  auto add_run = [&](block_id_t start, block_id_t end) {
+    while (start < end) {
+      u32 order = 0;
+      while (order < KBuddyMaxOrder &&
+             start % (static_cast<block_id_t>(1) << (order + 1)) == 0 &&
+             start + (static_cast<block_id_t>(1) << (order + 1)) <= end) {
+        order++;
+      }
+      this->insert_free(start, order);
+      start += static_cast<block_id_t>(1) << order;
+    }
+  };
+
+  block_id_t run_start = 0;
+  bool in_run = false;
+  for (block_id_t i = 0; i < this->bitmap_block_cnt; i++) {
+    auto res = bm->read_block(i + this->bitmap_block_id, buffer.data());
+    if (res.is_err()) {
+      return res;
+    }
+
+    auto bitmap = Bitmap(buffer.data(), bm->block_size());
+    for (usize bit = 0; bit < this->bits_in_bitmap_block(i); bit++) {
+      const block_id_t block_id = i * total_bits_per_block + bit;
+      if (!bitmap.check(bit)) {
+        if (!in_run) {
+          run_start = block_id;
+          in_run = true;
+        }
+      } else if (in_run) {
+        add_run(run_start, block_id);
+        in_run = false;
+      }
+    }
+  }
+  if (in_run) {
+    add_run(run_start, this->bm->total_blocks());
+  }
+  return KNullOk;
+}
+
+auto BuddyAllocator::insert_free(block_id_t start, u32 order) -> void {
+  free_lists[order].insert(start);
+  this->nonempty_orders |= static_cast<u32>(1) << order;
+}
+
+auto BuddyAllocator::erase_free(std::set<block_id_t>::iterator iter, u32 order)
+    -> void {
+  free_lists[order].erase(iter);
+  if (free_lists[order].empty()) {
+    this->nonempty_orders &= ~(static_cast<u32>(1) << order);
+  }
+}
+
+auto BuddyAllocator::fitting_order(u32 order) const -> std::optional<u32> {
+  const u32 mask =
+      this->nonempty_orders & ((static_cast<u32>(2) << order) - 1);
+  if (mask == 0) {
+    return std::nullopt;
+  }
+  return 31 - __builtin_clz(mask);
+}
+
+auto BuddyAllocator::take_extent(u32 order) -> std::optional<block_id_t> {
+  // the smallest non-empty order no smaller than the requested one
+  const u32 mask = this->nonempty_orders >> order << order;
+  if (mask == 0) {
+    return std::nullopt;
+  }
+  u32 cur = __builtin_ctz(mask);
+
+  // prefer the lowest address to keep the allocation compact
+  auto start = *free_lists[cur].begin();
+  this->erase_free(free_lists[cur].begin(), cur);
+
+  // split it until we get the requested order, the upper halves are free
+  while (cur > order) {
+    cur--;
+    this->insert_free(start + (static_cast<block_id_t>(1) << cur), cur);
+  }
+  return start;
+}
+
+auto BuddyAllocator::put_extent(block_id_t start, u32 order) -> void {
+  while (order < KBuddyMaxOrder) {
+    auto buddy = start ^ (static_cast<block_id_t>(1) << order);
+    auto iter = free_lists[order].find(buddy);
+    if (iter == free_lists[order].end()) {
+      break;
+    }
+    this->erase_free(iter, order);
+    start = std::min(start, buddy);
+    order++;
+  }
+  this->insert_free(start, order);
+}
+
+auto BuddyAllocator::allocate_extent(u32 order) -> ChfsResult<block_id_t> {
+  if (order > KBuddyMaxOrder) {
+    return ChfsResult<block_id_t>(ErrorType::INVALID_ARG);
+  }
+
+  auto start = this->take_extent(order);
+  if (!start) {
+    return ChfsResult<block_id_t>(ErrorType::OUT_OF_RESOURCE);
+  }
+
+  std::vector<block_id_t> extent(static_cast<usize>(1) << order);
+  for (usize i = 0; i < extent.size(); i++) {
+    extent[i] = start.value() + i;
+  }
+  auto res = this->update_bitmap(extent, true);
+  if (res.is_err()) {
+    // the bitmap may be partially updated, re-sync the free lists with it.
+    // The error of the update is returned even if the re-sync fails.
+    static_cast<void>(this->build_free_lists());
+    return ChfsResult<block_id_t>(res.unwrap_error());
+  }
+  return ChfsResult<block_id_t>(start.value());
+}
+
+auto BuddyAllocator::deallocate_extent(block_id_t start, u32 order)
+    -> ChfsNullResult {
+  if (order > KBuddyMaxOrder ||
+      start % (static_cast<block_id_t>(1) << order) != 0) {
+    return ChfsNullResult(ErrorType::INVALID_ARG);
+  }
+
+  std::vector<block_id_t> extent(static_cast<usize>(1) << order);
+  for (usize i = 0; i < extent.size(); i++) {
+    extent[i] = start + i;
+  }
+  auto res = this->update_bitmap(extent, false);
+  if (res.is_err()) {
+    static_cast<void>(this->build_free_lists());
+    return res;
+  }
+
+  this->put_extent(start, order);
+  return KNullOk;
+}
+
+auto BuddyAllocator::allocate_n(usize count, std::vector<block_id_t> &out)
+    -> ChfsNullResult {
+  if (count > this->free_cnt) {
+    return ChfsNullResult(ErrorType::OUT_OF_RESOURCE);
+  }
+
+  // take the largest extents that fit the remaining count
+  std::vector<std::pair<block_id_t, u32>> extents;
+  usize remaining = count;
+  while (remaining > 0) {
+    u32 order = 0;
+    while (order < KBuddyMaxOrder &&
+           (static_cast<usize>(1) << (order + 1)) <= remaining) {
+      order++;
+    }
+
+    auto start = this->take_extent(order);
+    if (!start) {
+      // fragmented, fall back to the largest smaller extents
+      auto fitting = this->fitting_order(order);
+      CHFS_ASSERT(fitting.has_value(), "free count mismatches the free lists");
+      order = fitting.value();
+      start = this->take_extent(order);
+    }
+
+    extents.emplace_back(start.value(), order);
+    remaining -= static_cast<usize>(1) << order;
+  }
+
+  const auto out_start = out.size();
+  for (auto &[start, order] : extents) {
+    for (block_id_t i = 0; i < (static_cast<block_id_t>(1) << order); i++) {
+      out.push_back(start + i);
+    }
+  }
+
+  // the extents are taken largest first, not in the order of the addresses
+  std::sort(out.begin() + out_start, out.end());
+
+  std::vector<block_id_t> taken(out.begin() + out_start, out.end());
+  auto res = this->update_bitmap(taken, true);
+  if (res.is_err()) {
+    out.resize(out_start);
+    static_cast<void>(this->build_free_lists());
+    return res;
+  }
+  return KNullOk;
+}
+
+auto BuddyAllocator::deallocate_batch(const std::vector<block_id_t> &block_ids)
+    -> ChfsNullResult {
+  auto res = this->update_bitmap(block_ids, false);
+  if (res.is_err()) {
+    static_cast<void>(this->build_free_lists());
+    return res;
+  }
+
+  for (auto block_id : block_ids) {
+    this->put_extent(block_id, 0);
+  }
+  return KNullOk;
+}
+
+} // namespace chfs
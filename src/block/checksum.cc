@@ -0,0 +1,86 @@
+#include <array>
+#include <cstring>
+
+#include "block/checksum.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <nmmintrin.h>
+#define CHFS_CRC32C_HW 1
+#endif
+
+namespace chfs {
+
+// the reversed polynomial of CRC32C
+const u32 KCrc32cPoly = 0x82F63B78;
+
+using Crc32cTable = std::array<std::array<u32, 256>, 8>;
+
+/**
+ * table[k][b] is the CRC of the byte b followed by k zero bytes
+ */
+static auto make_table() -> Crc32cTable {
+  Crc32cTable table;
+  for (u32 b = 0; b < 256; b++) {
+    u32 crc = b;
+    for (int i = 0; i < 8; i++) {
+      crc = (crc >> 1) ^ (KCrc32cPoly & (0 - (crc & 1)));
+    }
+    table[0][b] = crc;
+  }
+  for (u32 b = 0; b < 256; b++) {
+    for (usize k = 1; k < 8; k++) {
+      const auto prev = table[k - 1][b];
+      table[k][b] = (prev >> 8) ^ table[0][prev & 0xFF];
+    }
+  }
+  return table;
+}
+
+auto crc32c_sw(const u8 *data, usize len, u32 crc) -> u32 {
+  static const Crc32cTable table = make_table();
+  crc = ~crc;
+
+  for (; len >= 8; len -= 8, data += 8) {
+    u64 word;
+    memcpy(&word, data, sizeof(word));
+    word ^= crc;
+    crc = table[7][word & 0xFF] ^ table[6][(word >> 8) & 0xFF] ^
+          table[5][(word >> 16) & 0xFF] ^ table[4][(word >> 24) & 0xFF] ^
+          table[3][(word >> 32) & 0xFF] ^ table[2][(word >> 40) & 0xFF] ^
+          table[1][(word >> 48) & 0xFF] ^ table[0][word >> 56];
+  }
+  for (; len > 0; len--, data++) {
+    crc = (crc >> 8) ^ table[0][(crc ^ *data) & 0xFF];
+  }
+  return ~crc;
+}
+
+#ifdef CHFS_CRC32C_HW
+__attribute__((target("sse4.2"))) static auto crc32c_hw(const u8 *data,
+                                                        usize len, u32 crc)
+    -> u32 {
+  u64 crc64 = ~crc;
+  for (; len >= 8; len -= 8, data += 8) {
+    u64 word;
+    memcpy(&word, data, sizeof(word));
+    crc64 = _mm_crc32_u64(crc64, word);
+  }
+  auto crc32 = static_cast<u32>(crc64);
+  for (; len > 0; len--, data++) {
+    crc32 = _mm_crc32_u8(crc32, *data);
+  }
+  return ~crc32;
+}
+#endif
+
+auto crc32c(const u8 *data, usize len, u32 crc) -> u32 {
+#ifdef CHFS_CRC32C_HW
+  static const bool hw = __builtin_cpu_supports("sse4.2");
+  if (hw) {
+    return crc32c_hw(data, len, crc);
+  }
+#endif
+  return crc32c_sw(data, len, crc);
+}
+
+} // namespace chfs
@@ -0,0 +1,160 @@
+#include <cstring>
+
+#include "block/fingerprint.h"
+
+namespace chfs {
+
+const u64 KPrime1 = 0x9E3779B185EBCA87ULL;
+const u64 KPrime2 = 0xC2B2AE3D27D4EB4FULL;
+const u64 KPrime3 = 0x165667B19E3779F9ULL;
+const u64 KPrime4 = 0x85EBCA77C2B2AE63ULL;
+const u64 KPrime5 = 0x27D4EB2F165667C5ULL;
+
+// the block of an empty entry, no data block is the super block
+const block_id_t KEmptyEntry = 0;
+
+static inline auto rotl(u64 x, int r) -> u64 {
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline auto read_u64(const u8 *p) -> u64 {
+  u64 v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline auto mix_round(u64 acc, u64 input) -> u64 {
+  acc += input * KPrime2;
+  return rotl(acc, 31) * KPrime1;
+}
+
+static inline auto merge_round(u64 acc, u64 val) -> u64 {
+  acc ^= mix_round(0, val);
+  return acc * KPrime1 + KPrime4;
+}
+
+auto FingerprintIndex::fingerprint(const u8 *data, usize len) -> u64 {
+  const u8 *p = data;
+  const u8 *end = data + len;
+  u64 h;
+
+  // four independent lanes, so that the rounds are pipelined
+  if (len >= 32) {
+    u64 v1 = KPrime1 + KPrime2;
+    u64 v2 = KPrime2;
+    u64 v3 = 0;
+    u64 v4 = -KPrime1;
+    for (; p + 32 <= end; p += 32) {
+      v1 = mix_round(v1, read_u64(p));
+      v2 = mix_round(v2, read_u64(p + 8));
+      v3 = mix_round(v3, read_u64(p + 16));
+      v4 = mix_round(v4, read_u64(p + 24));
+    }
+    h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+    h = merge_round(h, v1);
+    h = merge_round(h, v2);
+    h = merge_round(h, v3);
+    h = merge_round(h, v4);
+  } else {
+    h = KPrime5;
+  }
+  h += len;
+
+  for (; p + 8 <= end; p += 8) {
+    h ^= mix_round(0, read_u64(p));
+    h = rotl(h, 27) * KPrime1 + KPrime4;
+  }
+  for (; p < end; p++) {
+    h ^= (*p) * KPrime5;
+    h = rotl(h, 11) * KPrime1;
+  }
+
+  // avalanche
+  h ^= h >> 33;
+  h *= KPrime2;
+  h ^= h >> 29;
+  h *= KPrime3;
+  h ^= h >> 32;
+  return h;
+}
+
+auto FingerprintIndex::format() -> ChfsNullResult {
+  std::vector<u8> zeros(this->bm->block_size(), 0);
+  for (usize i = 0; i < this->block_cnt; i++) {
+    auto res = this->bm->write_block_unlogged(this->start + i, zeros.data());
+    if (res.is_err()) {
+      return res;
+    }
+  }
+  return KNullOk;
+}
+
+auto FingerprintIndex::lookup(u64 fingerprint,
+                              std::vector<block_id_t> &blocks)
+    -> ChfsNullResult {
+  std::vector<u8> buffer(this->bm->block_size());
+  auto res = this->bm->read_block(this->bucket(fingerprint), buffer.data());
+  if (res.is_err()) {
+    return res;
+  }
+
+  auto entries = reinterpret_cast<FingerprintEntry *>(buffer.data());
+  for (usize i = 0; i < buffer.size() / sizeof(FingerprintEntry); i++) {
+    if (entries[i].block_id != KEmptyEntry &&
+        entries[i].fingerprint == fingerprint) {
+      blocks.push_back(entries[i].block_id);
+    }
+  }
+  return KNullOk;
+}
+
+auto FingerprintIndex::insert(u64 fingerprint, block_id_t block_id)
+    -> ChfsNullResult {
+  std::vector<u8> buffer(this->bm->block_size());
+  const auto bucket = this->bucket(fingerprint);
+  auto res = this->bm->read_block(bucket, buffer.data());
+  if (res.is_err()) {
+    return res;
+  }
+
+  auto entries = reinterpret_cast<FingerprintEntry *>(buffer.data());
+  const auto entry_cnt = buffer.size() / sizeof(FingerprintEntry);
+  // evict an entry picked by the fingerprint if the bucket is full
+  usize slot = entry_cnt;
+  for (usize i = 0; i < entry_cnt; i++) {
+    if (entries[i].block_id == block_id &&
+        entries[i].fingerprint == fingerprint) {
+      return KNullOk;
+    }
+    if (entries[i].block_id == KEmptyEntry && slot == entry_cnt) {
+      slot = i;
+    }
+  }
+  if (slot == entry_cnt) {
+    slot = (fingerprint >> 32) % entry_cnt;
+  }
+  entries[slot] = FingerprintEntry{fingerprint, block_id};
+  return this->bm->write_block_unlogged(bucket, buffer.data());
+}
+
+auto FingerprintIndex::remove(u64 fingerprint, block_id_t block_id)
+    -> ChfsNullResult {
+  std::vector<u8> buffer(this->bm->block_size());
+  const auto bucket = this->bucket(fingerprint);
+  auto res = this->bm->read_block(bucket, buffer.data());
+  if (res.is_err()) {
+    return res;
+  }
+
+  auto entries = reinterpret_cast<FingerprintEntry *>(buffer.data());
+  for (usize i = 0; i < buffer.size() / sizeof(FingerprintEntry); i++) {
+    if (entries[i].block_id == block_id &&
+        entries[i].fingerprint == fingerprint) {
+      entries[i] = FingerprintEntry{0, KEmptyEntry};
+      return this->bm->write_block_unlogged(bucket, buffer.data());
+    }
+  }
+  return KNullOk;
+}
+
+} // namespace chfs
@@ -0,0 +1,473 @@
+#include <algorithm>
+#include <cstring>
+
+#include "block/journal.h"
+
+namespace chfs {
+
+const u64 KFnvOffsetBasis = 0xcbf29ce484222325;
+const u64 KFnvPrime = 0x100000001b3;
+
+/**
+ * FNV-1a hash, used as the checksum of a transaction to detect a torn commit
+ */
+auto journal_checksum(u64 hash, const u8 *data, usize len) -> u64 {
+  for (usize i = 0; i < len; i++) {
+    hash ^= data[i];
+    hash *= KFnvPrime;
+  }
+  return hash;
+}
+
+Journal::Journal(BlockManager *bm, block_id_t start, usize block_cnt)
+    : bm(bm), start(start), block_cnt(block_cnt), head(0), tail(0), seq(0),
+      tail_seq(0) {
+  this->group_limit = std::max(static_cast<usize>(1), this->log_blocks() / 4);
+}
+
+auto Journal::format(std::shared_ptr<BlockManager> bm, block_id_t start,
+                     usize block_cnt) -> ChfsResult<std::shared_ptr<Journal>> {
+  // the header, a descriptor, a block and a commit at least
+  if (block_cnt < 4 || start + block_cnt > bm->total_blocks()) {
+    return ChfsResult<std::shared_ptr<Journal>>(ErrorType::INVALID_ARG);
+  }
+
+  auto journal =
+      std::shared_ptr<Journal>(new Journal(bm.get(), start, block_cnt));
+  auto res = journal->write_header();
+  if (res.is_err()) {
+    return ChfsResult<std::shared_ptr<Journal>>(res.unwrap_error());
+  }
+
+  bm->set_journal(journal);
+  return ChfsResult<std::shared_ptr<Journal>>(journal);
+}
+
+auto Journal::open(std::shared_ptr<BlockManager> bm, block_id_t start,
+                   usize block_cnt) -> ChfsResult<std::shared_ptr<Journal>> {
+  if (block_cnt < 4 || start + block_cnt > bm->total_blocks()) {
+    return ChfsResult<std::shared_ptr<Journal>>(ErrorType::INVALID_ARG);
+  }
+
+  std::vector<u8> buffer(bm->block_size());
+  auto res = bm->read_block(start, buffer.data());
+  if (res.is_err()) {
+    return ChfsResult<std::shared_ptr<Journal>>(res.unwrap_error());
+  }
+
+  auto header = reinterpret_cast<JournalHeader *>(buffer.data());
+  if (header->magic != KJournalMagic) {
+    return ChfsResult<std::shared_ptr<Journal>>(ErrorType::INVALID);
+  }
+
+  auto journal =
+      std::shared_ptr<Journal>(new Journal(bm.get(), start, block_cnt));
+  journal->head = journal->tail = header->tail;
+  journal->seq = journal->tail_seq = header->tail_seq;
+  journal->free_blocks = header->free_blocks;
+
+  // replay the committed transactions since the last checkpoint
+  while (true) {
+    res = journal->replay_one();
+    if (res.is_err()) {
+      if (res.unwrap_error() == ErrorType::DONE) {
+        break;
+      }
+      return ChfsResult<std::shared_ptr<Journal>>(res.unwrap_error());
+    }
+  }
+
+  // the replayed transactions need not to be replayed again
+  res = journal->checkpoint();
+  if (res.is_err()) {
+    return ChfsResult<std::shared_ptr<Journal>>(res.unwrap_error());
+  }
+
+  bm->set_journal(journal);
+  return ChfsResult<std::shared_ptr<Journal>>(journal);
+}
+
+auto Journal::begin_op() -> void {
+  if (this->op_depth++ == 0 &&
+      (this->running.size() >= this->group_limit ||
+       (this->commit_wanted && this->commit_wanted()))) {
+    auto res = this->commit();
+    if (res.is_err()) {
+      this->pending_error = res.unwrap_error();
+    }
+  }
+}
+
+auto Journal::commit() -> ChfsNullResult {
+  if (this->pending_error != ErrorType::DONE) {
+    auto error = this->pending_error;
+    this->pending_error = ErrorType::DONE;
+    return ChfsNullResult(error);
+  }
+  if (this->before_commit) {
+    auto res = this->before_commit();
+    if (res.is_err()) {
+      return res;
+    }
+  }
+
+  // The file content is not journaled, it must be durable before the
+  // metadata referring to it is committed.
+  auto res = this->sync_blocks(this->unsynced, true);
+  if (res.is_err()) {
+    return res;
+  }
+  this->unsynced.clear();
+  if (this->running.empty()) {
+    return KNullOk;
+  }
+
+  const auto block_size = this->bm->block_size();
+  const auto logged_cnt = this->running.size();
+  const auto desc_cnt = this->descriptor_blocks(logged_cnt);
+  const auto need = desc_cnt + logged_cnt + 1;
+  if (need > this->log_blocks()) {
+    return this->write_through();
+  }
+
+  if (this->head - this->tail + need > this->log_blocks()) {
+    res = this->checkpoint();
+    if (res.is_err()) {
+      return res;
+    }
+  }
+
+  // 1. the descriptor blocks
+  std::vector<u8> desc_buf(desc_cnt * block_size, 0);
+  auto desc = reinterpret_cast<JournalDescriptor *>(desc_buf.data());
+  desc->magic = KJournalDescriptorMagic;
+  desc->block_cnt = logged_cnt;
+  desc->seq = this->seq;
+
+  auto ids =
+      reinterpret_cast<block_id_t *>(desc_buf.data() + sizeof(JournalDescriptor));
+  usize idx = 0;
+  for (auto &[block_id, _] : this->running) {
+    ids[idx++] = block_id;
+  }
+  auto checksum =
+      journal_checksum(KFnvOffsetBasis, reinterpret_cast<u8 *>(ids),
+                       logged_cnt * sizeof(block_id_t));
+
+  auto pos = this->head;
+  for (usize i = 0; i < desc_cnt; i++) {
+    res = this->bm->write_block(this->log_block_id(pos++),
+                                desc_buf.data() + i * block_size);
+    if (res.is_err()) {
+      return res;
+    }
+  }
+
+  // 2. the block images
+  for (auto &[_, image] : this->running) {
+    checksum = journal_checksum(checksum, image.data(), block_size);
+    res = this->bm->write_block(this->log_block_id(pos++), image.data());
+    if (res.is_err()) {
+      return res;
+    }
+  }
+
+  // 3. the commit block. A single sync suffices, since a torn transaction
+  // fails the checksum upon replay.
+  std::vector<u8> commit_buf(block_size, 0);
+  auto commit = reinterpret_cast<JournalCommit *>(commit_buf.data());
+  commit->magic = KJournalCommitMagic;
+  commit->block_cnt = logged_cnt;
+  commit->seq = this->seq;
+  commit->checksum = checksum;
+  const auto free_blocks = this->free_blocks_source
+                               ? this->free_blocks_source()
+                               : KJournalNoCounter;
+  commit->free_blocks = free_blocks;
+  res = this->bm->write_block(this->log_block_id(pos++), commit_buf.data());
+  if (res.is_err()) {
+    return res;
+  }
+
+  res = this->sync_log(this->head, pos);
+  if (res.is_err()) {
+    return res;
+  }
+  this->head = pos;
+  this->seq += 1;
+  this->free_blocks = free_blocks;
+
+  // 4. install the blocks, they are durable upon the next checkpoint
+  std::set<block_id_t> installed;
+  this->in_place = true;
+  for (auto &[block_id, image] : this->running) {
+    res = this->bm->write_block(block_id, image.data());
+    if (res.is_err()) {
+      break;
+    }
+    this->logged.insert(block_id);
+    installed.insert(block_id);
+  }
+  this->in_place = false;
+  if (res.is_err()) {
+    return res;
+  }
+
+  this->running.clear();
+  return this->sync_blocks(installed, false);
+}
+
+auto Journal::write_through() -> ChfsNullResult {
+  // the logged blocks must not be replayed over the newer images
+  auto res = this->checkpoint();
+  if (res.is_err()) {
+    return res;
+  }
+
+  std::set<block_id_t> installed;
+  this->in_place = true;
+  for (auto &[block_id, image] : this->running) {
+    res = this->bm->write_block(block_id, image.data());
+    if (res.is_err()) {
+      break;
+    }
+    installed.insert(block_id);
+  }
+  this->in_place = false;
+  if (res.is_err()) {
+    return res;
+  }
+
+  res = this->sync_blocks(installed, true);
+  if (res.is_err()) {
+    return res;
+  }
+  this->running.clear();
+
+  // the counter is recovered from the header until the next commit
+  this->free_blocks = this->free_blocks_source ? this->free_blocks_source()
+                                               : KJournalNoCounter;
+  res = this->write_header();
+  if (res.is_err()) {
+    return res;
+  }
+  return this->bm->sync(this->start, 1);
+}
+
+auto Journal::checkpoint() -> ChfsNullResult {
+  // the excluded blocks are updated in place, e.g., the lazy zeroing flags of
+  // the installed blocks, so they are synced after them
+  auto res = this->sync_blocks(this->logged, true);
+  if (res.is_err()) {
+    return res;
+  }
+  for (auto block_id : this->excluded) {
+    res = this->bm->sync(block_id, 1);
+    if (res.is_err()) {
+      return res;
+    }
+  }
+
+  this->tail = this->head;
+  this->tail_seq = this->seq;
+  res = this->write_header();
+  if (res.is_err()) {
+    return res;
+  }
+  res = this->bm->sync(this->start, 1);
+  if (res.is_err()) {
+    return res;
+  }
+
+  this->logged.clear();
+  return KNullOk;
+}
+
+auto Journal::stage(block_id_t block_id, const u8 *data, usize offset,
+                    usize len) -> bool {
+  if (this->in_place || this->in_region(block_id)) {
+    return false;
+  }
+  if (this->excluded.count(block_id) != 0) {
+    this->unsynced.insert(block_id);
+    return false;
+  }
+
+  const auto block_size = this->bm->block_size();
+  auto iter = this->running.find(block_id);
+  if (iter == this->running.end()) {
+    std::vector<u8> image(block_size);
+    if (offset != 0 || len != block_size) {
+      // a partial write starts from the current content. If it cannot be
+      // read, e.g., it is corrupted, the write lands in place, where the rest
+      // of the block is kept.
+      if (this->bm->read_block(block_id, image.data()).is_err()) {
+        this->unsynced.insert(block_id);
+        return false;
+      }
+    }
+    iter = this->running.emplace(block_id, std::move(image)).first;
+  }
+
+  if (data != nullptr) {
+    memcpy(iter->second.data() + offset, data, len);
+  } else {
+    memset(iter->second.data() + offset, 0, len);
+  }
+  return true;
+}
+
+auto Journal::read_staged(block_id_t block_id, u8 *data) -> bool {
+  auto iter = this->running.find(block_id);
+  if (iter == this->running.end()) {
+    return false;
+  }
+  memcpy(data, iter->second.data(), iter->second.size());
+  return true;
+}
+
+auto Journal::write_in_place(block_id_t block_id, const u8 *data)
+    -> ChfsNullResult {
+  this->in_place = true;
+  auto res = this->bm->write_block(block_id, data);
+  this->in_place = false;
+  if (res.is_ok()) {
+    this->unsynced.insert(block_id);
+  }
+  return res;
+}
+
+auto Journal::sync_blocks(const std::set<block_id_t> &blocks, bool wait)
+    -> ChfsNullResult {
+  for (auto iter = blocks.begin(); iter != blocks.end();) {
+    const auto first = *iter;
+    usize cnt = 0;
+    while (iter != blocks.end() && *iter == first + cnt) {
+      ++iter;
+      cnt++;
+    }
+    auto res = wait ? this->bm->sync(first, cnt)
+                    : this->bm->writeback(first, cnt);
+    if (res.is_err()) {
+      return res;
+    }
+  }
+  return KNullOk;
+}
+
+auto Journal::sync_log(u64 from, u64 to) -> ChfsNullResult {
+  // the range wraps around the end of the log at most once
+  const auto first = this->log_block_id(from);
+  const auto cnt = static_cast<usize>(to - from);
+  const auto end = this->start + 1 + this->log_blocks();
+  if (first + cnt <= end) {
+    return this->bm->sync(first, cnt);
+  }
+  auto res = this->bm->sync(first, end - first);
+  if (res.is_err()) {
+    return res;
+  }
+  return this->bm->sync(this->start + 1, first + cnt - end);
+}
+
+auto Journal::descriptor_blocks(usize logged_cnt) const -> usize {
+  const auto block_size = this->bm->block_size();
+  auto sz = sizeof(JournalDescriptor) + logged_cnt * sizeof(block_id_t);
+  return (sz + block_size - 1) / block_size;
+}
+
+auto Journal::write_header() -> ChfsNullResult {
+  std::vector<u8> buffer(this->bm->block_size(), 0);
+  auto header = reinterpret_cast<JournalHeader *>(buffer.data());
+  header->magic = KJournalMagic;
+  header->tail = this->tail;
+  header->tail_seq = this->tail_seq;
+  header->free_blocks = this->free_blocks;
+  return this->bm->write_block(this->start, buffer.data());
+}
+
+auto Journal::replay_one() -> ChfsNullResult {
+  const auto block_size = this->bm->block_size();
+  std::vector<u8> buffer(block_size);
+
+  // a torn transaction may fail the block checksums before its own
+  auto read_log = [this](u64 pos, u8 *data) -> ChfsNullResult {
+    auto res = this->bm->read_block(this->log_block_id(pos), data);
+    if (res.is_err() && res.unwrap_error() == ErrorType::Corrupted) {
+      return ChfsNullResult(ErrorType::DONE);
+    }
+    return res;
+  };
+
+  auto res = read_log(this->head, buffer.data());
+  if (res.is_err()) {
+    return res;
+  }
+
+  // a stale transaction of the previous round has a smaller sequence number
+  auto desc = reinterpret_cast<JournalDescriptor *>(buffer.data());
+  if (desc->magic != KJournalDescriptorMagic || desc->seq != this->seq) {
+    return ChfsNullResult(ErrorType::DONE);
+  }
+  const usize logged_cnt = desc->block_cnt;
+  const auto desc_cnt = this->descriptor_blocks(logged_cnt);
+  if (desc_cnt + logged_cnt + 1 > this->log_blocks()) {
+    return ChfsNullResult(ErrorType::DONE);
+  }
+
+  // 1. the block ids
+  std::vector<u8> desc_buf(desc_cnt * block_size);
+  auto pos = this->head;
+  for (usize i = 0; i < desc_cnt; i++) {
+    res = read_log(pos++, desc_buf.data() + i * block_size);
+    if (res.is_err()) {
+      return res;
+    }
+  }
+  auto ids =
+      reinterpret_cast<block_id_t *>(desc_buf.data() + sizeof(JournalDescriptor));
+  auto checksum =
+      journal_checksum(KFnvOffsetBasis, reinterpret_cast<u8 *>(ids),
+                       logged_cnt * sizeof(block_id_t));
+
+  // 2. the block images
+  std::vector<u8> images(logged_cnt * block_size);
+  for (usize i = 0; i < logged_cnt; i++) {
+    res = read_log(pos++, images.data() + i * block_size);
+    if (res.is_err()) {
+      return res;
+    }
+    checksum =
+        journal_checksum(checksum, images.data() + i * block_size, block_size);
+  }
+
+  // 3. a transaction without a valid commit block is not committed
+  res = read_log(pos++, buffer.data());
+  if (res.is_err()) {
+    return res;
+  }
+  auto commit = reinterpret_cast<JournalCommit *>(buffer.data());
+  if (commit->magic != KJournalCommitMagic || commit->seq != this->seq ||
+      commit->block_cnt != logged_cnt || commit->checksum != checksum) {
+    return ChfsNullResult(ErrorType::DONE);
+  }
+
+  for (usize i = 0; i < logged_cnt; i++) {
+    if (ids[i] >= this->bm->total_blocks() || this->in_region(ids[i])) {
+      return ChfsNullResult(ErrorType::INVALID);
+    }
+    res = this->bm->write_block(ids[i], images.data() + i * block_size);
+    if (res.is_err()) {
+      return res;
+    }
+    // made durable by the checkpoint after the replay
+    this->logged.insert(ids[i]);
+  }
+
+  this->head = pos;
+  this->seq += 1;
+  this->free_blocks = commit->free_blocks;
+  return KNullOk;
+}
+
+} // namespace chfs
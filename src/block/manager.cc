@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cstring>
 #include <fcntl.h>
 #include <filesystem>
@@ -5,7 +6,10 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include "block/checksum.h"
+#include "block/journal.h"
 #include "block/manager.h"
+#include "common/stats.h"
 
 namespace chfs {
 
@@ -53,57 +57,423 @@ BlockManager::BlockManager(usize block_cnt, usize block_size)
  * @input db_file: database file name
  */
 BlockManager::BlockManager(const std::string &file, usize block_cnt)
-    : file_name_(file), block_cnt(block_cnt), in_memory(false) {
+    : BlockManager(file, block_cnt, KDefaultBlockSize) {}
+
+BlockManager::BlockManager(const std::string &file, usize block_cnt,
+                           usize block_size, bool populate)
+    : block_sz(block_size), file_name_(file), block_cnt(block_cnt),
+      in_memory(false) {
   this->fd = open(file.c_str(), O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
-  CHFS_ASSERT(this->fd != -1, "Failed to open the block manager file");
+  CHFS_VERIFY(this->fd != -1, "Failed to open the block manager file");
 
   auto file_sz = get_file_sz(this->file_name_);
   if (file_sz == 0) {
     initialize_file(this->fd, this->total_storage_sz());
   } else {
+    CHFS_VERIFY(file_sz % this->block_sz == 0,
+                "The file size mismatches the block size");
     this->block_cnt = file_sz / this->block_sz;
-    CHFS_ASSERT(this->total_storage_sz() == KDefaultBlockCnt * this->block_sz,
-                "The file size mismatches");
   }
 
-  this->block_data =
-      static_cast<u8 *>(mmap(nullptr, this->total_storage_sz(),
-                             PROT_READ | PROT_WRITE, MAP_SHARED, this->fd, 0));
-  CHFS_ASSERT(this->block_data != MAP_FAILED, "Failed to mmap the data");
+  // MAP_POPULATE pre-faults the whole file, which makes the first accesses
+  // fast at the cost of reading the file upon start
+  auto flags = MAP_SHARED | (populate ? MAP_POPULATE : 0);
+  this->block_data = static_cast<u8 *>(mmap(nullptr, this->total_storage_sz(),
+                                            PROT_READ | PROT_WRITE, flags,
+                                            this->fd, 0));
+  CHFS_VERIFY(this->block_data != MAP_FAILED, "Failed to mmap the data");
 }
 
 auto BlockManager::write_block(block_id_t block_id, const u8 *data)
     -> ChfsNullResult {
-  
-  // TODO: Implement this function.
-  UNIMPLEMENTED();
+  StatTimer timer(Stat::BlockWrite);
+  timer.count(this->block_sz, 1);
+  if (block_id >= this->block_cnt) {
+    return ChfsNullResult(ErrorType::INVALID_ARG);
+  }
+  if (this->journal != nullptr &&
+      this->journal->stage(block_id, data, 0, this->block_sz)) {
+    return KNullOk;
+  }
+
+  if (this->is_lazy_tracked(block_id)) {
+    std::lock_guard<std::mutex> lock(this->lazy_mutex);
+    auto res = this->materialize_lazy_block(block_id, false);
+    if (res.is_err()) {
+      return ChfsNullResult(res.unwrap_error());
+    }
+    memcpy(this->block_data + block_id * this->block_sz, data, this->block_sz);
+    this->seal(block_id);
+    return KNullOk;
+  }
 
+  auto lock = this->lock_lazy(block_id);
+  memcpy(this->block_data + block_id * this->block_sz, data, this->block_sz);
+  this->seal(block_id);
   return KNullOk;
 }
 
+auto BlockManager::write_block_unlogged(block_id_t block_id, const u8 *data)
+    -> ChfsNullResult {
+  if (this->journal != nullptr && !this->journal->is_logged(block_id)) {
+    return this->journal->write_in_place(block_id, data);
+  }
+  return this->write_block(block_id, data);
+}
+
 auto BlockManager::write_partial_block(block_id_t block_id, const u8 *data,
                                        usize offset, usize len)
     -> ChfsNullResult {
-  
-  // TODO: Implement this function.
-  UNIMPLEMENTED();
+  StatTimer timer(Stat::BlockWritePartial);
+  timer.count(len, 1);
+  if (block_id >= this->block_cnt || offset + len > this->block_sz) {
+    return ChfsNullResult(ErrorType::INVALID_ARG);
+  }
+  if (this->journal != nullptr &&
+      this->journal->stage(block_id, data, offset, len)) {
+    return KNullOk;
+  }
 
+  if (this->is_lazy_tracked(block_id)) {
+    // the rest of a lazily zeroed block must be zeros after the write
+    std::lock_guard<std::mutex> lock(this->lazy_mutex);
+    auto res = this->materialize_lazy_block(block_id, true);
+    if (res.is_err()) {
+      return ChfsNullResult(res.unwrap_error());
+    }
+    memcpy(this->block_data + block_id * this->block_sz + offset, data, len);
+    this->seal(block_id);
+    return KNullOk;
+  }
+
+  auto lock = this->lock_lazy(block_id);
+  memcpy(this->block_data + block_id * this->block_sz + offset, data, len);
+  this->seal(block_id);
   return KNullOk;
 }
 
 auto BlockManager::read_block(block_id_t block_id, u8 *data) -> ChfsNullResult {
+  StatTimer timer(Stat::BlockRead);
+  timer.count(this->block_sz, 1);
+  if (block_id >= this->block_cnt) {
+    return ChfsNullResult(ErrorType::INVALID_ARG);
+  }
+  if (this->journal != nullptr && this->journal->read_staged(block_id, data)) {
+    return KNullOk;
+  }
 
-  // TODO: Implement this function.
-  UNIMPLEMENTED();
+  auto lock = this->lock_lazy(block_id);
+  if (this->is_lazy_tracked(block_id) &&
+      this->lazy_flags().check(block_id - this->lazy_start)) {
+    memset(data, 0, this->block_sz);
+    return KNullOk;
+  }
 
+  memcpy(data, this->block_data + block_id * this->block_sz, this->block_sz);
+  if (this->is_checksummed(block_id) &&
+      crc32c(data, this->block_sz) != *this->checksum_slot(block_id)) {
+    return ChfsNullResult(ErrorType::Corrupted);
+  }
   return KNullOk;
 }
 
+auto BlockManager::peek_block(block_id_t block_id) -> ChfsResult<const u8 *> {
+  StatTimer timer(Stat::BlockPeek);
+  timer.count(this->block_sz, 1);
+  if (block_id >= this->block_cnt) {
+    return ChfsResult<const u8 *>(ErrorType::INVALID_ARG);
+  }
+  if (this->journal != nullptr) {
+    if (auto staged = this->journal->peek_staged(block_id)) {
+      return ChfsResult<const u8 *>(staged);
+    }
+  }
+
+  auto lock = this->lock_lazy(block_id);
+  if (this->is_lazy_tracked(block_id) &&
+      this->lazy_flags().check(block_id - this->lazy_start)) {
+    return ChfsResult<const u8 *>(ErrorType::INVALID);
+  }
+
+  const u8 *data = this->block_data + block_id * this->block_sz;
+  if (this->is_checksummed(block_id) &&
+      crc32c(data, this->block_sz) != *this->checksum_slot(block_id)) {
+    return ChfsResult<const u8 *>(ErrorType::Corrupted);
+  }
+  return ChfsResult<const u8 *>(data);
+}
+
 auto BlockManager::zero_block(block_id_t block_id) -> ChfsNullResult {
-  
-  // TODO: Implement this function.
-  UNIMPLEMENTED();
+  StatTimer timer(Stat::BlockZero);
+  timer.count(this->block_sz, 1);
+  if (block_id >= this->block_cnt) {
+    return ChfsNullResult(ErrorType::INVALID_ARG);
+  }
+  if (this->journal != nullptr &&
+      this->journal->stage(block_id, nullptr, 0, this->block_sz)) {
+    return KNullOk;
+  }
+
+  if (this->is_lazy_tracked(block_id)) {
+    std::lock_guard<std::mutex> lock(this->lazy_mutex);
+    auto res = this->materialize_lazy_block(block_id, true);
+    if (res.is_err()) {
+      return ChfsNullResult(res.unwrap_error());
+    }
+    if (!res.unwrap()) {
+      memset(this->block_data + block_id * this->block_sz, 0, this->block_sz);
+      this->seal(block_id);
+    }
+    return KNullOk;
+  }
+
+  auto lock = this->lock_lazy(block_id);
+  memset(this->block_data + block_id * this->block_sz, 0, this->block_sz);
+  this->seal(block_id);
+  return KNullOk;
+}
+
+auto BlockManager::checksum_blocks_needed() const -> usize {
+  return (this->block_cnt * sizeof(u32) + this->block_sz - 1) / this->block_sz;
+}
+
+auto BlockManager::enable_checksum(block_id_t start, usize cnt, bool rebuild)
+    -> ChfsNullResult {
+  if (cnt < this->checksum_blocks_needed() || start == 0 ||
+      start + cnt > this->block_cnt) {
+    return ChfsNullResult(ErrorType::INVALID_ARG);
+  }
+
+  // the region is accessed in place, so it must not be zeroed lazily later
+  for (usize i = 0; i < cnt; i++) {
+    if (this->is_lazy_tracked(start + i)) {
+      std::lock_guard<std::mutex> lock(this->lazy_mutex);
+      auto res = this->materialize_lazy_block(start + i, false);
+      if (res.is_err()) {
+        return ChfsNullResult(res.unwrap_error());
+      }
+    }
+  }
+
+  std::vector<u8> zeros(this->block_sz, 0);
+  this->zero_checksum = crc32c(zeros.data(), zeros.size());
+  this->checksum_start = start;
+  this->checksum_cnt = cnt;
+  if (rebuild) {
+    for (block_id_t i = 0; i < this->block_cnt; i++) {
+      auto lock = this->lock_lazy(i);
+      this->seal(i);
+    }
+  }
+  return KNullOk;
+}
+
+auto BlockManager::update_checksum(block_id_t block_id) -> ChfsNullResult {
+  if (block_id >= this->block_cnt) {
+    return ChfsNullResult(ErrorType::INVALID_ARG);
+  }
+  auto lock = this->lock_lazy(block_id);
+  this->seal(block_id);
+  return KNullOk;
+}
+
+auto BlockManager::seal(block_id_t block_id) -> void {
+  if (!this->is_checksummed(block_id)) {
+    return;
+  }
+  // a lazily zeroed block is read as zeros
+  if (this->is_lazy_tracked(block_id) &&
+      this->lazy_flags().check(block_id - this->lazy_start)) {
+    *this->checksum_slot(block_id) = this->zero_checksum;
+    return;
+  }
+  *this->checksum_slot(block_id) =
+      crc32c(this->block_data + block_id * this->block_sz, this->block_sz);
+}
+
+auto BlockManager::lock_lazy(block_id_t block_id)
+    -> std::unique_lock<std::mutex> {
+  if (this->is_lazy_tracked(block_id) ||
+      (this->lazy_enabled && block_id == this->lazy_flag_block)) {
+    return std::unique_lock<std::mutex>(this->lazy_mutex);
+  }
+  return std::unique_lock<std::mutex>();
+}
+
+auto BlockManager::enable_lazy_zero(block_id_t flag_block, usize flag_offset,
+                                    usize tracked, bool format) -> usize {
+  CHFS_VERIFY(flag_block < this->block_cnt && flag_offset < this->block_sz,
+              "Invalid location of the lazy flags");
+
+  std::lock_guard<std::mutex> lock(this->lazy_mutex);
+  this->lazy_enabled = true;
+  this->lazy_flag_block = flag_block;
+  this->lazy_flag_offset = flag_offset;
+  this->lazy_start = flag_block + 1;
+  this->lazy_cnt = std::min<u64>(tracked, this->lazy_capacity());
+  this->lazy_stop = false;
 
+  auto flags = this->lazy_flags();
+  if (format) {
+    flags.zeroed();
+    this->lazy_uninit_cnt = 0;
+    this->seal(flag_block);
+  } else {
+    this->lazy_uninit_cnt = flags.count_ones();
+  }
+  return this->lazy_cnt;
+}
+
+auto BlockManager::track_lazy(block_id_t end) -> usize {
+  std::lock_guard<std::mutex> lock(this->lazy_mutex);
+  if (!this->lazy_enabled || end <= this->lazy_start) {
+    return this->lazy_cnt;
+  }
+  // the flags of the newly tracked blocks are clear, as the flags are zeroed
+  // upon format and only set for the tracked blocks
+  this->lazy_cnt = std::max<u64>(
+      this->lazy_cnt, std::min<u64>(end - this->lazy_start,
+                                    this->lazy_capacity()));
+  return this->lazy_cnt;
+}
+
+auto BlockManager::zero_block_lazily(block_id_t block_id) -> ChfsNullResult {
+  if (!this->is_lazy_tracked(block_id)) {
+    return this->zero_block(block_id);
+  }
+
+  std::lock_guard<std::mutex> lock(this->lazy_mutex);
+  auto flags = this->lazy_flags();
+  if (!flags.check(block_id - this->lazy_start)) {
+    flags.set(block_id - this->lazy_start);
+    this->lazy_uninit_cnt += 1;
+    this->seal(block_id);
+    this->seal(this->lazy_flag_block);
+  }
+  return KNullOk;
+}
+
+auto BlockManager::zero_lazy_blocks() -> usize {
+  usize zeroed = 0;
+  for (usize i = 0; i < this->lazy_cnt && !this->lazy_stop; i++) {
+    // release the lock per block, so the foreground is not blocked for long
+    std::lock_guard<std::mutex> lock(this->lazy_mutex);
+    if (this->lazy_uninit_cnt == 0) {
+      break;
+    }
+    auto res = this->materialize_lazy_block(this->lazy_start + i, true);
+    if (res.is_err()) {
+      // the block is left flagged, and zeroed again by a later pass
+      break;
+    }
+    if (res.unwrap()) {
+      zeroed += 1;
+    }
+  }
+  return zeroed;
+}
+
+auto BlockManager::materialize_lazy_block(block_id_t block_id, bool zero)
+    -> ChfsResult<bool> {
+  auto flags = this->lazy_flags();
+  if (!flags.check(block_id - this->lazy_start)) {
+    return ChfsResult<bool>(false);
+  }
+
+  if (zero) {
+    memset(this->block_data + block_id * this->block_sz, 0, this->block_sz);
+    this->seal(block_id);
+    // the flag block is synced on its own, e.g., by the journal checkpoint,
+    // so the zeros must be durable first
+    auto res = this->sync(block_id, 1);
+    if (res.is_err()) {
+      return ChfsResult<bool>(res.unwrap_error());
+    }
+  }
+  // the content must be in place before the flag is cleared
+  flags.clear(block_id - this->lazy_start);
+  this->lazy_uninit_cnt -= 1;
+  this->seal(this->lazy_flag_block);
+  return ChfsResult<bool>(true);
+}
+
+auto BlockManager::prefetch(block_id_t block_id, usize cnt) -> ChfsNullResult {
+  if (block_id >= this->block_cnt) {
+    return ChfsNullResult(ErrorType::INVALID_ARG);
+  }
+  if (this->in_memory) {
+    return KNullOk;
+  }
+
+  cnt = std::min(static_cast<u64>(cnt), this->block_cnt - block_id);
+  // madvise requires a page-aligned address
+  const u64 page_sz = sysconf(_SC_PAGESIZE);
+  u64 start = block_id * this->block_sz;
+  u64 end = start + static_cast<u64>(cnt) * this->block_sz;
+  start -= start % page_sz;
+
+  if (madvise(this->block_data + start, end - start, MADV_WILLNEED) != 0) {
+    return ChfsNullResult(ErrorType::INVALID);
+  }
+  return KNullOk;
+}
+
+auto BlockManager::sync(block_id_t block_id, usize cnt) -> ChfsNullResult {
+  StatTimer timer(Stat::BlockSync);
+  if (block_id >= this->block_cnt) {
+    return ChfsNullResult(ErrorType::INVALID_ARG);
+  }
+  if (this->in_memory) {
+    return KNullOk;
+  }
+
+  cnt = std::min(static_cast<u64>(cnt), this->block_cnt - block_id);
+  timer.count(static_cast<u64>(cnt) * this->block_sz, cnt);
+  return this->flush_range(block_id, cnt, true);
+}
+
+auto BlockManager::writeback(block_id_t block_id, usize cnt)
+    -> ChfsNullResult {
+  if (block_id >= this->block_cnt) {
+    return ChfsNullResult(ErrorType::INVALID_ARG);
+  }
+  if (this->in_memory) {
+    return KNullOk;
+  }
+
+  cnt = std::min(static_cast<u64>(cnt), this->block_cnt - block_id);
+  return this->flush_range(block_id, cnt, false);
+}
+
+auto BlockManager::flush_range(block_id_t block_id, usize cnt, bool wait)
+    -> ChfsNullResult {
+  // msync requires a page-aligned address
+  const u64 page_sz = sysconf(_SC_PAGESIZE);
+  auto flush = [this, page_sz, wait](u64 start, u64 end) -> bool {
+    start -= start % page_sz;
+    if (wait) {
+      return msync(this->block_data + start, end - start, MS_SYNC) == 0;
+    }
+    // MS_ASYNC starts no write on Linux
+    return sync_file_range(this->fd, start, end - start,
+                           SYNC_FILE_RANGE_WRITE) == 0;
+  };
+
+  if (!flush(block_id * this->block_sz,
+             (block_id + static_cast<u64>(cnt)) * this->block_sz)) {
+    return ChfsNullResult(ErrorType::INVALID);
+  }
+
+  // the checksums of the blocks are durable with them
+  if (this->checksum_cnt != 0) {
+    auto start =
+        reinterpret_cast<u8 *>(this->checksum_slot(block_id)) - this->block_data;
+    auto end = reinterpret_cast<u8 *>(this->checksum_slot(block_id + cnt)) -
+               this->block_data;
+    if (!flush(start, end)) {
+      return ChfsNullResult(ErrorType::INVALID);
+    }
+  }
   return KNullOk;
 }
 
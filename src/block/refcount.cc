@@ -0,0 +1,64 @@
+#include <vector>
+
+#include "block/refcount.h"
+
+namespace chfs {
+
+auto RefcountTable::format() -> ChfsNullResult {
+  for (usize i = 0; i < this->block_cnt; i++) {
+    auto res = this->bm->zero_block(this->start + i);
+    if (res.is_err()) {
+      return res;
+    }
+  }
+  return KNullOk;
+}
+
+auto RefcountTable::get(block_id_t block_id) -> ChfsResult<u32> {
+  if (block_id >= this->bm->total_blocks()) {
+    return ChfsResult<u32>(ErrorType::INVALID_ARG);
+  }
+
+  auto [counter_block, offset] = this->locate(block_id);
+  std::vector<u8> buffer(this->bm->block_size());
+  auto res = this->bm->read_block(counter_block, buffer.data());
+  if (res.is_err()) {
+    return ChfsResult<u32>(res.unwrap_error());
+  }
+  return ChfsResult<u32>(*reinterpret_cast<u32 *>(buffer.data() + offset));
+}
+
+auto RefcountTable::inc(block_id_t block_id) -> ChfsNullResult {
+  auto res = this->get(block_id);
+  if (res.is_err()) {
+    return ChfsNullResult(res.unwrap_error());
+  }
+
+  const u32 counter = res.unwrap() + 1;
+  auto [counter_block, offset] = this->locate(block_id);
+  return this->bm->write_partial_block(
+      counter_block, reinterpret_cast<const u8 *>(&counter), offset,
+      sizeof(u32));
+}
+
+auto RefcountTable::dec(block_id_t block_id) -> ChfsResult<bool> {
+  auto res = this->get(block_id);
+  if (res.is_err()) {
+    return ChfsResult<bool>(res.unwrap_error());
+  }
+  if (res.unwrap() == 0) {
+    return ChfsResult<bool>(false);
+  }
+
+  const u32 counter = res.unwrap() - 1;
+  auto [counter_block, offset] = this->locate(block_id);
+  auto write_res = this->bm->write_partial_block(
+      counter_block, reinterpret_cast<const u8 *>(&counter), offset,
+      sizeof(u32));
+  if (write_res.is_err()) {
+    return ChfsResult<bool>(write_res.unwrap_error());
+  }
+  return ChfsResult<bool>(true);
+}
+
+} // namespace chfs
@@ -0,0 +1,102 @@
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <vector>
+
+#include "common/buffer_pool.h"
+
+namespace chfs {
+
+namespace {
+
+/**
+ * The free buffers of a thread, by size. A filesystem has a single block
+ * size, so there are rarely more than a couple of lists.
+ */
+struct ThreadPool {
+  struct FreeList {
+    usize size;
+    std::vector<u8 *> buffers;
+  };
+  std::vector<FreeList> lists;
+
+  ~ThreadPool();
+
+  auto list_of(usize size) -> FreeList & {
+    for (auto &list : this->lists) {
+      if (list.size == size) {
+        return list;
+      }
+    }
+    this->lists.push_back({size, {}});
+    this->lists.back().buffers.reserve(KBufferPoolDepth);
+    return this->lists.back();
+  }
+};
+
+// The state of the pool of the thread, a buffer released after the pool is
+// destroyed, e.g., by a thread-local destructor, is freed directly
+enum class PoolState : u8 { Uninit, Alive, Destroyed };
+thread_local PoolState pool_state = PoolState::Uninit;
+
+ThreadPool::~ThreadPool() {
+  for (auto &list : this->lists) {
+    for (auto ptr : list.buffers) {
+      std::free(ptr);
+    }
+  }
+  pool_state = PoolState::Destroyed;
+}
+
+auto local_pool() -> ThreadPool & {
+  thread_local ThreadPool pool;
+  pool_state = PoolState::Alive;
+  return pool;
+}
+
+auto allocate_aligned(usize size) -> u8 * {
+  // the size of an aligned allocation must be a multiple of the alignment
+  const auto rounded = (size + KBufferAlign - 1) / KBufferAlign * KBufferAlign;
+  auto ptr =
+      std::aligned_alloc(KBufferAlign, rounded == 0 ? KBufferAlign : rounded);
+  if (ptr == nullptr) {
+    throw std::bad_alloc();
+  }
+  return static_cast<u8 *>(ptr);
+}
+
+} // namespace
+
+auto BlockBuffer::acquire(usize size) -> BlockBuffer {
+  if (pool_state != PoolState::Destroyed) {
+    auto &list = local_pool().list_of(size);
+    if (!list.buffers.empty()) {
+      auto ptr = list.buffers.back();
+      list.buffers.pop_back();
+      return BlockBuffer(ptr, size);
+    }
+  }
+  return BlockBuffer(allocate_aligned(size), size);
+}
+
+auto BlockBuffer::zeroed(usize size) -> BlockBuffer {
+  auto buffer = BlockBuffer::acquire(size);
+  memset(buffer.data(), 0, size);
+  return buffer;
+}
+
+BlockBuffer::~BlockBuffer() {
+  if (this->ptr == nullptr) {
+    return;
+  }
+  if (pool_state != PoolState::Destroyed) {
+    auto &list = local_pool().list_of(this->sz);
+    if (list.buffers.size() < KBufferPoolDepth) {
+      list.buffers.push_back(this->ptr);
+      return;
+    }
+  }
+  std::free(this->ptr);
+}
+
+} // namespace chfs
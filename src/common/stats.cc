@@ -0,0 +1,323 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <mutex>
+#include <vector>
+
+#include "common/stats.h"
+
+namespace chfs {
+
+std::atomic<bool> stats_enabled{false};
+
+static const char *const KStatNames[KStatCount] = {
+    "fuse.lookup",         "fuse.getattr",
+    "fuse.setattr",        "fuse.open",
+    "fuse.release",        "fuse.read",
+    "fuse.write",          "fuse.flush",
+    "fuse.fsync",          "fuse.mknod",
+    "fuse.mkdir",          "fuse.unlink",
+    "fuse.opendir",        "fuse.readdir",
+    "fuse.ioctl",          "fs.alloc_inode",
+    "fs.getattr",          "fs.read_file",
+    "fs.read_file_w_off",  "fs.write_file",
+    "fs.write_file_w_off", "fs.resize",
+    "fs.flush",            "fs.remove_file",
+    "fs.lookup",           "fs.mkfile",
+    "fs.mkdir",            "fs.unlink",
+    "inode.allocate",      "inode.get",
+    "inode.read",          "inode.free",
+    "allocator.allocate",  "allocator.allocate_n",
+    "allocator.deallocate", "allocator.scan",
+    "block.read",          "block.peek",
+    "block.write",         "block.write_partial",
+    "block.zero",          "block.sync",
+};
+
+auto stat_name(Stat stat) -> const char * {
+  return KStatNames[static_cast<usize>(stat)];
+}
+
+auto Histogram::bucket_of(u64 value) -> u32 {
+  if (value < KSubBuckets) {
+    return value;
+  }
+  const u32 msb = 63 - __builtin_clzll(value);
+  const u32 sub = (value >> (msb - KSubBucketBits)) & (KSubBuckets - 1);
+  return (msb - KSubBucketBits + 1) * KSubBuckets + sub;
+}
+
+auto Histogram::bucket_floor(u32 bucket) -> u64 {
+  if (bucket < KSubBuckets) {
+    return bucket;
+  }
+  const u32 msb = bucket / KSubBuckets + KSubBucketBits - 1;
+  const u64 sub = bucket % KSubBuckets;
+  return (u64(1) << msb) | (sub << (msb - KSubBucketBits));
+}
+
+auto Histogram::merge(const Histogram &other) -> void {
+  for (u32 i = 0; i < KBuckets; i++) {
+    const auto cnt = other.buckets[i].load(std::memory_order_relaxed);
+    if (cnt != 0) {
+      this->buckets[i].fetch_add(cnt, std::memory_order_relaxed);
+    }
+  }
+  this->sum.fetch_add(other.total(), std::memory_order_relaxed);
+  auto max = this->max_value.load(std::memory_order_relaxed);
+  while (other.max() > max &&
+         !this->max_value.compare_exchange_weak(max, other.max(),
+                                                std::memory_order_relaxed)) {
+  }
+}
+
+auto Histogram::count() const -> u64 {
+  u64 cnt = 0;
+  for (const auto &bucket : this->buckets) {
+    cnt += bucket.load(std::memory_order_relaxed);
+  }
+  return cnt;
+}
+
+auto Histogram::percentile(double p) const -> u64 {
+  const auto cnt = this->count();
+  if (cnt == 0) {
+    return 0;
+  }
+  const auto rank = std::max<u64>(
+      1, static_cast<u64>(std::ceil(std::clamp(p, 0.0, 100.0) / 100 * cnt)));
+  u64 seen = 0;
+  for (u32 i = 0; i < KBuckets; i++) {
+    seen += this->buckets[i].load(std::memory_order_relaxed);
+    if (seen >= rank) {
+      const auto floor = bucket_floor(i);
+      const auto width =
+          (i + 1 < KBuckets ? bucket_floor(i + 1) : floor * 2) - floor;
+      return floor + width / 2;
+    }
+  }
+  return bucket_floor(KBuckets - 1);
+}
+
+auto Histogram::reset() -> void {
+  for (auto &bucket : this->buckets) {
+    bucket.store(0, std::memory_order_relaxed);
+  }
+  this->sum.store(0, std::memory_order_relaxed);
+  this->max_value.store(0, std::memory_order_relaxed);
+}
+
+namespace {
+
+// Bumped by `reset_stats`, the counters of an older epoch are stale
+std::atomic<u64> stats_epoch{0};
+
+/**
+ * The statistics written by a thread
+ */
+struct ThreadStats {
+  Histogram histograms[KStatCount];
+  std::atomic<u64> bytes[KStatCount] = {};
+  std::atomic<u64> blocks[KStatCount] = {};
+  // the epoch of the counters, they are cleared by the owner once it is
+  // stale, so that no other thread writes them
+  std::atomic<u64> epoch{0};
+
+  auto clear() -> void {
+    for (usize i = 0; i < KStatCount; i++) {
+      this->histograms[i].reset();
+      this->bytes[i].store(0, std::memory_order_relaxed);
+      this->blocks[i].store(0, std::memory_order_relaxed);
+    }
+  }
+
+  /**
+   * Add the counters to a summary (or the retired statistics)
+   */
+  auto merge_into(StatSummary *summary) const -> void {
+    for (usize i = 0; i < KStatCount; i++) {
+      summary[i].histogram.merge(this->histograms[i]);
+      summary[i].bytes += this->bytes[i].load(std::memory_order_relaxed);
+      summary[i].blocks += this->blocks[i].load(std::memory_order_relaxed);
+    }
+  }
+};
+
+/**
+ * Every thread registers its statistics once. They are merged into the
+ * retired ones when the thread exits, so that they are never lost.
+ */
+struct StatsRegistry {
+  std::mutex mutex;
+  std::vector<std::unique_ptr<ThreadStats>> threads;
+  std::unique_ptr<StatSummary[]> retired =
+      std::make_unique<StatSummary[]>(KStatCount);
+
+  StatsRegistry() { this->clear_retired(); }
+
+  auto add() -> ThreadStats * {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->threads.emplace_back(new ThreadStats());
+    this->threads.back()->epoch.store(
+        stats_epoch.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    return this->threads.back().get();
+  }
+
+  auto retire(ThreadStats *stats) -> void {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if (stats->epoch.load(std::memory_order_acquire) ==
+        stats_epoch.load(std::memory_order_relaxed)) {
+      stats->merge_into(this->retired.get());
+    }
+    auto iter = std::find_if(
+        this->threads.begin(), this->threads.end(),
+        [stats](const auto &thread) { return thread.get() == stats; });
+    this->threads.erase(iter);
+  }
+
+  auto clear_retired() -> void {
+    for (usize i = 0; i < KStatCount; i++) {
+      this->retired[i].stat = static_cast<Stat>(i);
+      this->retired[i].histogram.reset();
+      this->retired[i].bytes = 0;
+      this->retired[i].blocks = 0;
+    }
+  }
+};
+
+auto registry() -> StatsRegistry & {
+  // never destroyed, a thread may record after the static destructors run
+  static auto registry = new StatsRegistry();
+  return *registry;
+}
+
+// Whether the statistics of the thread are retired, nothing is recorded then
+thread_local bool stats_retired = false;
+
+/**
+ * The statistics of the thread, retired when it exits
+ */
+struct LocalStats {
+  ThreadStats *stats = nullptr;
+
+  ~LocalStats() {
+    if (this->stats != nullptr) {
+      registry().retire(this->stats);
+    }
+    stats_retired = true;
+  }
+};
+
+auto local_stats() -> ThreadStats * {
+  if (stats_retired) {
+    return nullptr;
+  }
+  thread_local LocalStats local;
+  if (local.stats == nullptr) {
+    local.stats = registry().add();
+  }
+
+  // the counters are cleared here rather than by `reset_stats`, since only
+  // the owner writes them
+  const auto epoch = stats_epoch.load(std::memory_order_relaxed);
+  if (local.stats->epoch.load(std::memory_order_relaxed) != epoch) {
+    local.stats->clear();
+    local.stats->epoch.store(epoch, std::memory_order_release);
+  }
+  return local.stats;
+}
+
+} // namespace
+
+auto set_stats_enabled(bool enabled) -> void {
+  stats_enabled.store(enabled, std::memory_order_relaxed);
+}
+
+auto record_stat(Stat stat, u64 value) -> void {
+  if (!stats_enabled.load(std::memory_order_relaxed)) {
+    return;
+  }
+  if (auto stats = local_stats()) {
+    stats->histograms[static_cast<usize>(stat)].record(value);
+  }
+}
+
+auto count_stat(Stat stat, u64 bytes, u64 blocks) -> void {
+  if (!stats_enabled.load(std::memory_order_relaxed)) {
+    return;
+  }
+  auto stats = local_stats();
+  if (stats == nullptr) {
+    return;
+  }
+  const auto idx = static_cast<usize>(stat);
+  stats->bytes[idx].store(stats->bytes[idx].load(std::memory_order_relaxed) +
+                              bytes,
+                          std::memory_order_relaxed);
+  stats->blocks[idx].store(stats->blocks[idx].load(std::memory_order_relaxed) +
+                               blocks,
+                           std::memory_order_relaxed);
+}
+
+auto collect_stats() -> std::unique_ptr<StatSummary[]> {
+  auto summary = std::make_unique<StatSummary[]>(KStatCount);
+  for (usize i = 0; i < KStatCount; i++) {
+    summary[i].stat = static_cast<Stat>(i);
+    summary[i].bytes = 0;
+    summary[i].blocks = 0;
+  }
+
+  auto &reg = registry();
+  std::lock_guard<std::mutex> lock(reg.mutex);
+  for (usize i = 0; i < KStatCount; i++) {
+    summary[i].histogram.merge(reg.retired[i].histogram);
+    summary[i].bytes += reg.retired[i].bytes;
+    summary[i].blocks += reg.retired[i].blocks;
+  }
+  // the counters of a stale epoch are to be cleared by their owner
+  const auto epoch = stats_epoch.load(std::memory_order_relaxed);
+  for (const auto &thread : reg.threads) {
+    if (thread->epoch.load(std::memory_order_acquire) == epoch) {
+      thread->merge_into(summary.get());
+    }
+  }
+  return summary;
+}
+
+auto dump_stats() -> std::string {
+  auto summary = collect_stats();
+
+  std::string out;
+  char line[256];
+  snprintf(line, sizeof(line), "%-22s %10s %10s %10s %10s %10s %14s %10s\n",
+           "op", "calls", "p50", "p99", "p999", "max", "bytes", "blocks");
+  out += line;
+  for (usize i = 0; i < KStatCount; i++) {
+    const auto &hist = summary[i].histogram;
+    const auto calls = hist.count();
+    if (calls == 0) {
+      continue;
+    }
+    snprintf(line, sizeof(line),
+             "%-22s %10llu %10llu %10llu %10llu %10llu %14llu %10llu\n",
+             stat_name(static_cast<Stat>(i)),
+             static_cast<unsigned long long>(calls),
+             static_cast<unsigned long long>(hist.percentile(50)),
+             static_cast<unsigned long long>(hist.percentile(99)),
+             static_cast<unsigned long long>(hist.percentile(99.9)),
+             static_cast<unsigned long long>(hist.max()),
+             static_cast<unsigned long long>(summary[i].bytes),
+             static_cast<unsigned long long>(summary[i].blocks));
+    out += line;
+  }
+  return out;
+}
+
+auto reset_stats() -> void {
+  auto &reg = registry();
+  std::lock_guard<std::mutex> lock(reg.mutex);
+  reg.clear_retired();
+  stats_epoch.fetch_add(1, std::memory_order_relaxed);
+}
+
+} // namespace chfs
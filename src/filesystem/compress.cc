@@ -0,0 +1,222 @@
+#include <algorithm>
+#include <cstring>
+
+#include "filesystem/compress.h"
+
+namespace chfs {
+
+const usize KMinMatch = 4;
+const usize KHashBits = 12;
+const usize KMaxOffset = 65535;
+// the last bytes are always literals, so that a match never runs off the end
+const usize KLastLiterals = 5;
+
+static inline auto read_u32(const u8 *p) -> u32 {
+  u32 v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+/**
+ * Write a length exceeding the 4 bits of the token, 255 at a time
+ */
+static auto write_length(usize len, std::vector<u8> &dst) -> void {
+  for (; len >= 255; len -= 255) {
+    dst.push_back(255);
+  }
+  dst.push_back(static_cast<u8>(len));
+}
+
+static auto read_length(const u8 *&ip, const u8 *iend, usize &len) -> bool {
+  u8 byte;
+  do {
+    if (ip == iend) {
+      return false;
+    }
+    byte = *ip++;
+    len += byte;
+  } while (byte == 255);
+  return true;
+}
+
+/**
+ * Emit a sequence of literals followed by a match, the last sequence has no
+ * match (match_len == 0)
+ */
+static auto emit_sequence(const u8 *literals, usize lit_len, usize match_len,
+                          usize offset, std::vector<u8> &dst) -> void {
+  const usize lit_token = lit_len < 15 ? lit_len : 15;
+  usize match_token = 0;
+  if (match_len != 0) {
+    match_token = match_len - KMinMatch < 15 ? match_len - KMinMatch : 15;
+  }
+  dst.push_back(static_cast<u8>(lit_token << 4 | match_token));
+  if (lit_token == 15) {
+    write_length(lit_len - 15, dst);
+  }
+  dst.insert(dst.end(), literals, literals + lit_len);
+  if (match_len == 0) {
+    return;
+  }
+
+  dst.push_back(static_cast<u8>(offset));
+  dst.push_back(static_cast<u8>(offset >> 8));
+  if (match_token == 15) {
+    write_length(match_len - KMinMatch - 15, dst);
+  }
+}
+
+auto lz_compress(const u8 *src, usize len, std::vector<u8> &dst) -> void {
+  // the last position (plus one) of each hashed 4-byte sequence
+  std::vector<u32> table(1 << KHashBits, 0);
+  usize anchor = 0;
+  usize pos = 0;
+
+  while (pos + KMinMatch + KLastLiterals <= len) {
+    const auto seq = read_u32(src + pos);
+    const auto hash = (seq * 2654435761u) >> (32 - KHashBits);
+    const usize candidate = table[hash];
+    table[hash] = pos + 1;
+
+    if (candidate == 0 || pos - (candidate - 1) > KMaxOffset ||
+        read_u32(src + candidate - 1) != seq) {
+      pos++;
+      continue;
+    }
+
+    const usize match = candidate - 1;
+    usize match_len = KMinMatch;
+    while (pos + match_len + KLastLiterals < len &&
+           src[match + match_len] == src[pos + match_len]) {
+      match_len++;
+    }
+    emit_sequence(src + anchor, pos - anchor, match_len, pos - match, dst);
+    pos += match_len;
+    anchor = pos;
+  }
+  emit_sequence(src + anchor, len - anchor, 0, 0, dst);
+}
+
+auto lz_decompress(const u8 *src, usize len, u8 *dst, usize dst_len) -> bool {
+  const u8 *ip = src;
+  const u8 *iend = src + len;
+  u8 *op = dst;
+  u8 *oend = dst + dst_len;
+
+  while (ip < iend) {
+    const auto token = *ip++;
+
+    // 1. the literals
+    usize lit_len = token >> 4;
+    if (lit_len == 15 && !read_length(ip, iend, lit_len)) {
+      return false;
+    }
+    if (lit_len > static_cast<usize>(iend - ip) ||
+        lit_len > static_cast<usize>(oend - op)) {
+      return false;
+    }
+    memcpy(op, ip, lit_len);
+    ip += lit_len;
+    op += lit_len;
+    if (ip == iend) {
+      break;
+    }
+
+    // 2. the match, which may overlap with itself
+    if (iend - ip < 2) {
+      return false;
+    }
+    const usize offset = ip[0] | ip[1] << 8;
+    ip += 2;
+    usize match_len = token & 15;
+    if (match_len == 15 && !read_length(ip, iend, match_len)) {
+      return false;
+    }
+    match_len += KMinMatch;
+    if (offset == 0 || offset > static_cast<usize>(op - dst) ||
+        match_len > static_cast<usize>(oend - op)) {
+      return false;
+    }
+    for (const u8 *match = op - offset; match_len > 0; match_len--) {
+      *op++ = *match++;
+    }
+  }
+  return op == oend;
+}
+
+auto ClusterIndex::encode_cluster(const u8 *raw, usize raw_len,
+                                  std::vector<u8> &stored) -> void {
+  stored.clear();
+  lz_compress(raw, raw_len, stored);
+  if (stored.size() >= raw_len) {
+    stored.assign(raw, raw + raw_len);
+  }
+}
+
+auto ClusterIndex::decode_cluster(const u8 *stored, usize stored_len,
+                                  usize raw_len, std::vector<u8> &cluster)
+    -> bool {
+  cluster.resize(raw_len);
+  if (stored_len == raw_len) {
+    memcpy(cluster.data(), stored, raw_len);
+    return true;
+  }
+  return lz_decompress(stored, stored_len, cluster.data(), raw_len);
+}
+
+auto ClusterIndex::stored_blocks(const u8 *index, usize block_size) -> u64 {
+  auto header = reinterpret_cast<const u32 *>(index);
+  const auto cluster_cnt =
+      std::min<u64>(header[0], block_size / sizeof(u32) - 1);
+  u64 blocks = 1;
+  for (usize i = 0; i < cluster_cnt; i++) {
+    blocks += (header[1 + i] + block_size - 1) / block_size;
+  }
+  return blocks;
+}
+
+auto ClusterIndex::locate(const u8 *index, usize idx, usize block_size)
+    -> std::pair<u64, usize> {
+  auto header = reinterpret_cast<const u32 *>(index);
+  u64 first = 1;
+  for (usize i = 0; i < idx; i++) {
+    first += (header[1 + i] + block_size - 1) / block_size;
+  }
+  return {first, header[1 + idx]};
+}
+
+auto ClusterCache::get(inode_id_t id, usize idx) -> const std::vector<u8> * {
+  auto iter = this->index.find({id, idx});
+  if (iter == this->index.end()) {
+    return nullptr;
+  }
+  this->lru.splice(this->lru.begin(), this->lru, iter->second);
+  return &iter->second->second;
+}
+
+auto ClusterCache::put(inode_id_t id, usize idx, std::vector<u8> cluster)
+    -> const std::vector<u8> * {
+  auto iter = this->index.find({id, idx});
+  if (iter != this->index.end()) {
+    this->lru.erase(iter->second);
+    this->index.erase(iter);
+  }
+  if (this->lru.size() >= this->capacity && !this->lru.empty()) {
+    this->index.erase(this->lru.back().first);
+    this->lru.pop_back();
+  }
+
+  this->lru.emplace_front(Key{id, idx}, std::move(cluster));
+  this->index.emplace(Key{id, idx}, this->lru.begin());
+  return &this->lru.front().second;
+}
+
+auto ClusterCache::invalidate(inode_id_t id) -> void {
+  auto iter = this->index.lower_bound({id, 0});
+  while (iter != this->index.end() && iter->first.first == id) {
+    this->lru.erase(iter->second);
+    iter = this->index.erase(iter);
+  }
+}
+
+} // namespace chfs
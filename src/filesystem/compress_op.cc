@@ -0,0 +1,418 @@
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <map>
+
+#include "common/buffer_pool.h"
+#include "filesystem/operations.h"
+
+namespace chfs {
+
+auto FileOperation::set_compression(inode_id_t id, bool compressed)
+    -> ChfsNullResult {
+  if (this->read_only_) {
+    return ChfsNullResult(ErrorType::ReadOnly);
+  }
+  auto res = this->flush(id);
+  if (res.is_err()) {
+    return res;
+  }
+  JournalOp op(this->journal_.get());
+
+  const auto block_size = this->block_manager_->block_size();
+  std::vector<u8> inode(block_size);
+  auto inode_p = reinterpret_cast<Inode *>(inode.data());
+  auto inode_res = this->inode_manager_->read_inode(id, inode);
+  if (inode_res.is_err()) {
+    return ChfsNullResult(inode_res.unwrap_error());
+  }
+  if (inode_p->get_type() != InodeType::FILE) {
+    return ChfsNullResult(ErrorType::INVALID_ARG);
+  }
+  if (inode_p->is_compressed() == compressed) {
+    return KNullOk;
+  }
+
+  // 1. the blocks are released in the old layout
+  auto content_res = this->read_file_from_blocks(id);
+  if (content_res.is_err()) {
+    return ChfsNullResult(content_res.unwrap_error());
+  }
+  res = this->write_file_to_blocks(id, {});
+  if (res.is_err()) {
+    return res;
+  }
+
+  // 2. and the content is written in the new one. The inode block may be
+  // copied by the truncation if it was shared.
+  inode_res = this->inode_manager_->read_inode(id, inode);
+  if (inode_res.is_err()) {
+    return ChfsNullResult(inode_res.unwrap_error());
+  }
+  inode_p->set_compressed(compressed);
+  res = this->block_manager_->write_block(inode_res.unwrap(), inode.data());
+  if (res.is_err()) {
+    return res;
+  }
+  return this->write_file_to_blocks(id, content_res.value());
+}
+
+auto FileOperation::get_compression(inode_id_t id) -> ChfsResult<bool> {
+  std::vector<u8> inode(this->block_manager_->block_size());
+  auto inode_res = this->inode_manager_->read_inode(id, inode);
+  if (inode_res.is_err()) {
+    return ChfsResult<bool>(inode_res.unwrap_error());
+  }
+  return ChfsResult<bool>(
+      reinterpret_cast<Inode *>(inode.data())->is_compressed());
+}
+
+auto FileOperation::get_stored_size(const Inode *inode_p) -> ChfsResult<u64> {
+  if (!inode_p->is_compressed() || inode_p->get_size() == 0) {
+    return ChfsResult<u64>(inode_p->get_size());
+  }
+
+  // the index of the clusters is in the first block
+  const auto block_size = this->block_manager_->block_size();
+  std::vector<u8> buffer(block_size);
+  auto res = this->block_manager_->read_block(inode_p->blocks[0],
+                                              buffer.data());
+  if (res.is_err()) {
+    return ChfsResult<u64>(res.unwrap_error());
+  }
+  return ChfsResult<u64>(
+      ClusterIndex::stored_blocks(buffer.data(), block_size) * block_size);
+}
+
+auto FileOperation::write_compressed_to_blocks(inode_id_t id, u64 size,
+                                               const BlockSource &source,
+                                               const RangeSet *modified)
+    -> ChfsNullResult {
+  const auto block_size = this->block_manager_->block_size();
+  const u64 cluster_size = KClusterBlocks * block_size;
+
+  // 1. read the inode and the index of the clusters
+  auto inode = BlockBuffer::acquire(block_size);
+  auto inode_p = reinterpret_cast<Inode *>(inode.data());
+  auto inode_res = this->inode_manager_->read_inode(id, inode.data());
+  if (inode_res.is_err()) {
+    return ChfsNullResult(inode_res.unwrap_error());
+  }
+  auto inode_bid = inode_res.unwrap();
+  const usize new_cnt = (size + cluster_size - 1) / cluster_size;
+  if (size > inode_p->max_file_sz_supported() ||
+      new_cnt + 1 > block_size / sizeof(u32)) {
+    return ChfsNullResult(ErrorType::OUT_OF_RESOURCE);
+  }
+
+  const auto old_size = inode_p->get_size();
+  const usize old_cnt = (old_size + cluster_size - 1) / cluster_size;
+  auto stored_res = this->get_stored_size(inode_p);
+  if (stored_res.is_err()) {
+    return ChfsNullResult(stored_res.unwrap_error());
+  }
+  const usize direct_cnt = inode_p->get_direct_block_num();
+  const usize old_block_num = stored_res.unwrap() / block_size;
+  std::vector<u8> indirect_block;
+  if (old_block_num > direct_cnt) {
+    indirect_block.resize(block_size);
+    auto res = this->block_manager_->read_block(
+        inode_p->get_indirect_block_id(), indirect_block.data());
+    if (res.is_err()) {
+      return res;
+    }
+  }
+  auto indirect_p = reinterpret_cast<block_id_t *>(indirect_block.data());
+  std::vector<block_id_t> old_blocks;
+  for (usize idx = 0; idx < old_block_num; idx++) {
+    old_blocks.push_back(idx < direct_cnt
+                             ? static_cast<block_id_t>(inode_p->blocks[idx])
+                             : indirect_p[idx - direct_cnt]);
+  }
+
+  std::vector<u8> index(block_size, 0);
+  if (old_cnt > 0) {
+    auto res = this->block_manager_->read_block(old_blocks[0], index.data());
+    if (res.is_err()) {
+      return res;
+    }
+    if (reinterpret_cast<u32 *>(index.data())[0] != old_cnt) {
+      return ChfsNullResult(ErrorType::INVALID);
+    }
+  }
+  auto raw_len = [cluster_size](u64 file_size, usize idx) -> u64 {
+    return std::min<u64>(cluster_size, file_size - idx * cluster_size);
+  };
+
+  // 2. compress the modified clusters (or the ones whose length changes).
+  // The source may read the old clusters, so it is done before the blocks
+  // are touched.
+  std::map<usize, std::vector<u8>> encoded;
+  {
+    std::vector<u8> raw(cluster_size);
+    for (usize idx = 0; idx < new_cnt; idx++) {
+      const auto begin = idx * cluster_size;
+      if (modified != nullptr && idx < old_cnt &&
+          raw_len(old_size, idx) == raw_len(size, idx) &&
+          !modified->overlaps(begin, begin + cluster_size)) {
+        continue;
+      }
+      const auto len = raw_len(size, idx);
+      for (u64 pos = 0; pos < len; pos += block_size) {
+        auto res = source((begin + pos) / block_size, KInvalidBlockID,
+                          raw.data() + pos);
+        if (res.is_err()) {
+          return res;
+        }
+      }
+      ClusterIndex::encode_cluster(raw.data(), len, encoded[idx]);
+    }
+  }
+  this->cluster_cache_.invalidate(id);
+
+  // the blocks shared with a snapshot are copied before they are modified
+  if (this->refcount_ != nullptr) {
+    auto res = this->own_inode_blocks(id, inode.data(), inode_bid,
+                                      indirect_block, old_block_num);
+    if (res.is_err()) {
+      return res;
+    }
+  }
+
+  // 3. lay out the extents. An unchanged cluster keeps its blocks, even if
+  // they are moved in the file, and a rewritten one reuses its old blocks.
+  std::vector<block_id_t> new_blocks;
+  std::vector<usize> fresh;
+  std::vector<block_id_t> free_set;
+  if (new_cnt > 0) {
+    new_blocks.push_back(old_cnt > 0 ? old_blocks[0] : KInvalidBlockID);
+    if (old_cnt == 0) {
+      fresh.push_back(0);
+    }
+  } else if (old_cnt > 0) {
+    free_set.push_back(old_blocks[0]);
+  }
+  for (usize idx = 0; idx < std::max(old_cnt, new_cnt); idx++) {
+    usize old_first = 0;
+    usize old_num = 0;
+    if (idx < old_cnt) {
+      auto [first, stored_len] =
+          ClusterIndex::locate(index.data(), idx, block_size);
+      old_first = first;
+      old_num = (stored_len + block_size - 1) / block_size;
+    }
+    auto iter = encoded.find(idx);
+    usize new_num = 0;
+    if (idx < new_cnt) {
+      new_num = iter == encoded.end()
+                    ? old_num
+                    : (iter->second.size() + block_size - 1) / block_size;
+    }
+
+    for (usize i = 0; i < std::max(old_num, new_num); i++) {
+      if (i >= new_num) {
+        free_set.push_back(old_blocks[old_first + i]);
+      } else if (i < old_num) {
+        new_blocks.push_back(old_blocks[old_first + i]);
+      } else {
+        fresh.push_back(new_blocks.size());
+        new_blocks.push_back(KInvalidBlockID);
+      }
+    }
+  }
+  if (new_blocks.size() > inode_p->max_file_sz_supported() / block_size) {
+    return ChfsNullResult(ErrorType::OUT_OF_RESOURCE);
+  }
+
+  // the new blocks (including a new indirect block, if any) are taken from
+  // the allocator in a single batch
+  const usize new_block_num = new_blocks.size();
+  const bool need_indirect =
+      new_block_num > direct_cnt && old_block_num <= direct_cnt;
+  if (!fresh.empty() || need_indirect) {
+    std::vector<block_id_t> allocated;
+    auto res = this->block_allocator_->allocate_n(
+        fresh.size() + (need_indirect ? 1 : 0), allocated);
+    if (res.is_err()) {
+      return res;
+    }
+    if (need_indirect) {
+      inode_p->blocks[inode_p->get_nblocks() - 1] = allocated.back();
+      allocated.pop_back();
+      indirect_block.assign(block_size, 0);
+    }
+    for (usize i = 0; i < fresh.size(); i++) {
+      new_blocks[fresh[i]] = allocated[i];
+    }
+  }
+
+  // 4. write the index and the rewritten clusters
+  auto write = [&](usize block_idx, const u8 *data) -> ChfsNullResult {
+    const bool is_fresh =
+        std::find(fresh.begin(), fresh.end(), block_idx) != fresh.end();
+    auto res = this->write_file_block(inode_p, new_blocks[block_idx], is_fresh,
+                                      data);
+    if (res.is_err()) {
+      return ChfsNullResult(res.unwrap_error());
+    }
+    new_blocks[block_idx] = res.unwrap();
+    return KNullOk;
+  };
+
+  if (new_cnt > 0) {
+    auto buffer = BlockBuffer::acquire(block_size);
+    auto header = reinterpret_cast<u32 *>(index.data());
+    header[0] = new_cnt;
+    for (auto &[idx, stored] : encoded) {
+      header[1 + idx] = stored.size();
+    }
+    memset(index.data() + sizeof(u32) * (1 + new_cnt), 0,
+           block_size - sizeof(u32) * (1 + new_cnt));
+    auto res = write(0, index.data());
+    if (res.is_err()) {
+      return res;
+    }
+
+    for (auto &[idx, stored] : encoded) {
+      const auto first = ClusterIndex::locate(index.data(), idx, block_size)
+                             .first;
+      for (u64 pos = 0; pos < stored.size(); pos += block_size) {
+        const auto len = std::min<u64>(block_size, stored.size() - pos);
+        memcpy(buffer.data(), stored.data() + pos, len);
+        memset(buffer.data() + len, 0, block_size - len);
+        res = write(first + pos / block_size, buffer.data());
+        if (res.is_err()) {
+          return res;
+        }
+      }
+    }
+  }
+
+  // 5. update the block list, and release the blocks no longer used
+  if (old_block_num > direct_cnt && new_block_num <= direct_cnt) {
+    free_set.push_back(inode_p->get_indirect_block_id());
+    indirect_block.clear();
+    inode_p->invalid_indirect_block_id();
+  }
+  for (usize idx = 0; idx < std::max(old_block_num, new_block_num); idx++) {
+    const auto bid = idx < new_block_num ? new_blocks[idx] : KInvalidBlockID;
+    if (inode_p->is_direct_block(idx)) {
+      inode_p->set_block_direct(idx, bid);
+    } else if (!indirect_block.empty()) {
+      reinterpret_cast<block_id_t *>(
+          indirect_block.data())[idx - direct_cnt] = bid;
+    }
+  }
+  auto res = this->release_blocks(free_set);
+  if (res.is_err()) {
+    return res;
+  }
+
+  inode_p->inner_attr.size = size;
+  inode_p->inner_attr.set_all_time(time(0));
+  res = this->block_manager_->write_block(inode_bid, inode.data());
+  if (res.is_err()) {
+    return res;
+  }
+  if (!indirect_block.empty()) {
+    return inode_p->write_indirect_block(this->block_manager_, indirect_block);
+  }
+  return KNullOk;
+}
+
+auto FileOperation::read_compressed(inode_id_t id, u64 sz, u64 offset)
+    -> ChfsResult<std::vector<u8>> {
+  const auto block_size = this->block_manager_->block_size();
+  const u64 cluster_size = KClusterBlocks * block_size;
+  std::vector<u8> inode(block_size);
+  auto inode_p = reinterpret_cast<Inode *>(inode.data());
+  auto inode_res = this->inode_manager_->read_inode(id, inode);
+  if (inode_res.is_err()) {
+    return ChfsResult<std::vector<u8>>(inode_res.unwrap_error());
+  }
+
+  const auto size = inode_p->get_size();
+  if (offset >= size) {
+    return ChfsResult<std::vector<u8>>(std::vector<u8>());
+  }
+  sz = std::min(sz, size - offset);
+
+  // the index and the indirect block are loaded upon a cache miss
+  std::vector<u8> index;
+  std::vector<u8> indirect_block;
+  const usize direct_cnt = inode_p->get_direct_block_num();
+  auto read_stored = [&](u64 first, usize len,
+                         std::vector<u8> &stored) -> ChfsNullResult {
+    stored.clear();
+    std::vector<u8> buffer(block_size);
+    for (auto idx = first; (idx - first) * block_size < len; idx++) {
+      if (idx >= direct_cnt && indirect_block.empty()) {
+        indirect_block.resize(block_size);
+        auto res = this->block_manager_->read_block(
+            inode_p->get_indirect_block_id(), indirect_block.data());
+        if (res.is_err()) {
+          return res;
+        }
+      }
+      const block_id_t block_id =
+          idx < direct_cnt
+              ? static_cast<block_id_t>(inode_p->blocks[idx])
+              : reinterpret_cast<block_id_t *>(
+                    indirect_block.data())[idx - direct_cnt];
+      auto res = this->block_manager_->read_block(block_id, buffer.data());
+      if (res.is_err()) {
+        return res;
+      }
+      const auto sz =
+          std::min<u64>(block_size, len - (idx - first) * block_size);
+      stored.insert(stored.end(), buffer.begin(), buffer.begin() + sz);
+    }
+    return KNullOk;
+  };
+
+  std::vector<u8> content;
+  content.reserve(sz);
+  std::vector<u8> stored;
+  const usize cluster_cnt = (size + cluster_size - 1) / cluster_size;
+  for (usize idx = offset / cluster_size; idx * cluster_size < offset + sz;
+       idx++) {
+    auto cluster = this->cluster_cache_.get(id, idx);
+    if (cluster == nullptr) {
+      if (index.empty()) {
+        index.resize(block_size);
+        auto res = this->block_manager_->read_block(inode_p->blocks[0],
+                                                    index.data());
+        if (res.is_err()) {
+          return ChfsResult<std::vector<u8>>(res.unwrap_error());
+        }
+        if (reinterpret_cast<u32 *>(index.data())[0] != cluster_cnt) {
+          return ChfsResult<std::vector<u8>>(ErrorType::INVALID);
+        }
+      }
+
+      auto [first, stored_len] =
+          ClusterIndex::locate(index.data(), idx, block_size);
+      auto res = read_stored(first, stored_len, stored);
+      if (res.is_err()) {
+        return ChfsResult<std::vector<u8>>(res.unwrap_error());
+      }
+      std::vector<u8> decoded;
+      if (!ClusterIndex::decode_cluster(
+              stored.data(), stored_len,
+              std::min<u64>(cluster_size, size - idx * cluster_size),
+              decoded)) {
+        return ChfsResult<std::vector<u8>>(ErrorType::INVALID);
+      }
+      cluster = this->cluster_cache_.put(id, idx, std::move(decoded));
+    }
+
+    const u64 from = std::max<u64>(offset, idx * cluster_size);
+    const u64 to = std::min<u64>(offset + sz, (idx + 1) * cluster_size);
+    content.insert(content.end(),
+                   cluster->begin() + (from - idx * cluster_size),
+                   cluster->begin() + (to - idx * cluster_size));
+  }
+  return ChfsResult<std::vector<u8>>(std::move(content));
+}
+
+} // namespace chfs
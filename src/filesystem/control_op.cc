@@ -1,16 +1,73 @@
+#include "common/stats.h"
 #include "filesystem/operations.h"
 #include "metadata/superblock.h"
 
 namespace chfs {
 
+/**
+ * Enable lazy zeroing upon format, so that formatting a large device doesn't
+ * need to touch its inode table and bitmaps. The inode manager and the
+ * allocator register their blocks before zeroing them. The flags are stored
+ * in the super block at a fixed offset.
+ */
+static auto enable_lazy_zero(std::shared_ptr<BlockManager> bm)
+    -> std::shared_ptr<BlockManager> {
+  bm->enable_lazy_zero(0, KLazyFlagOffset, 0, true);
+  return bm;
+}
+
 FileOperation::FileOperation(std::shared_ptr<BlockManager> bm,
-                             u64 max_inode_supported)
-    : block_manager_(bm), inode_manager_(std::shared_ptr<InodeManager>(
-                              new InodeManager(bm, max_inode_supported))),
-      block_allocator_(std::shared_ptr<BlockAllocator>(
-          new BlockAllocator(bm, inode_manager_->get_reserved_blocks()))) {
+                             u64 max_inode_supported,
+                             AllocatorType allocator_type,
+                             usize journal_blocks, bool block_sharing)
+    // the block manager must track the lazy blocks before they are zeroed by
+    // the inode manager and the allocator
+    : block_manager_(enable_lazy_zero(bm)),
+      inode_manager_(std::shared_ptr<InodeManager>(
+          new InodeManager(bm, max_inode_supported))),
+      block_allocator_(BlockAllocator::create(
+                           allocator_type, bm,
+                           inode_manager_->get_reserved_blocks())
+                           .unwrap()) {
   // now initialize the superblock
-  SuperBlock(bm, inode_manager_->get_max_inode_supported()).flush(0).unwrap();
+  auto super_block =
+      SuperBlock(bm, inode_manager_->get_max_inode_supported(), allocator_type,
+                 bm->lazy_tracked_cnt());
+
+  block_id_t journal_start = 0;
+  if (journal_blocks != 0) {
+    CHFS_VERIFY((journal_blocks & (journal_blocks - 1)) == 0,
+                "The journal size should be a power of two");
+    // On a fresh filesystem, the first aligned extent follows the metadata
+    u32 order = 0;
+    while ((static_cast<usize>(1) << order) < journal_blocks) {
+      order++;
+    }
+    journal_start = block_allocator_->allocate_extent(order).unwrap();
+  }
+
+  // the counters are zeroed before the journal is attached, which can't
+  // hold the whole region in a transaction
+  if (block_sharing) {
+    const auto refcount_blocks = RefcountTable::blocks_needed(*bm);
+    auto refcount_start =
+        block_allocator_->allocate_contiguous(refcount_blocks).unwrap();
+    refcount_ = std::make_shared<RefcountTable>(bm, refcount_start,
+                                                refcount_blocks);
+    refcount_->format().unwrap();
+
+    snapshot_block_ = block_allocator_->allocate().unwrap();
+    bm->zero_block(snapshot_block_).unwrap();
+    super_block.set_block_sharing(refcount_start, refcount_blocks,
+                                  snapshot_block_);
+  }
+
+  if (journal_blocks != 0) {
+    journal_ = Journal::format(bm, journal_start, journal_blocks).unwrap();
+    this->setup_journal();
+    super_block.set_journal(journal_start, journal_blocks);
+  }
+  super_block.flush(0).unwrap();
 }
 
 auto FileOperation::create_from_raw(std::shared_ptr<BlockManager> bm)
@@ -21,6 +78,60 @@ auto FileOperation::create_from_raw(std::shared_ptr<BlockManager> bm)
     return ChfsResult<std::shared_ptr<FileOperation>>(
         superblock_res.unwrap_error());
   }
+  if (!superblock_res.unwrap()->is_valid()) {
+    // the device is not formatted by us
+    return ChfsResult<std::shared_ptr<FileOperation>>(ErrorType::INVALID);
+  }
+
+  // the untouched metadata blocks are still treated as zeros
+  const auto lazy_zero_blocks = superblock_res.unwrap()->get_lazy_zero_blocks();
+  if (lazy_zero_blocks != 0 &&
+      bm->enable_lazy_zero(0, KLazyFlagOffset, lazy_zero_blocks, false) !=
+          lazy_zero_blocks) {
+    return ChfsResult<std::shared_ptr<FileOperation>>(ErrorType::INVALID);
+  }
+
+  // The free block counter is recorded upon a clean unmount, so the block
+  // bitmap need not to be scanned
+  std::optional<usize> free_blocks = std::nullopt;
+  if (!superblock_res.unwrap()->is_dirty()) {
+    free_blocks = superblock_res.unwrap()->get_free_blocks();
+  }
+
+  // The checksums are enabled before the replay, so the replayed blocks get
+  // their checksums. The other blocks are synced with their checksums by
+  // the commits, and only a file block written in place but not committed
+  // before the crash may fail its checksum, like a torn write. Without a
+  // journal, nothing bounds the blocks written before the crash.
+  const bool has_journal = superblock_res.unwrap()->get_journal_blocks() != 0;
+  if (superblock_res.unwrap()->get_checksum_blocks() != 0) {
+    auto res = bm->enable_checksum(
+        superblock_res.unwrap()->get_checksum_start(),
+        superblock_res.unwrap()->get_checksum_blocks(),
+        superblock_res.unwrap()->is_dirty() && !has_journal);
+    if (res.is_err()) {
+      return ChfsResult<std::shared_ptr<FileOperation>>(res.unwrap_error());
+    }
+  }
+
+  // the committed metadata updates are replayed before reading the metadata
+  std::shared_ptr<Journal> journal = nullptr;
+  if (has_journal) {
+    auto journal_res =
+        Journal::open(bm, superblock_res.unwrap()->get_journal_start(),
+                      superblock_res.unwrap()->get_journal_blocks());
+    if (journal_res.is_err()) {
+      return ChfsResult<std::shared_ptr<FileOperation>>(
+          journal_res.unwrap_error());
+    }
+    journal = journal_res.unwrap();
+
+    // Not unmounted cleanly: the counter is recovered from the replayed
+    // transactions. Only if it is not recorded, the bitmap is scanned.
+    if (superblock_res.unwrap()->is_dirty()) {
+      free_blocks = journal->recorded_free_blocks();
+    }
+  }
 
   // 2. create the innode manager
   auto inode_manager_res = InodeManager::create_from_block_manager(
@@ -30,12 +141,162 @@ auto FileOperation::create_from_raw(std::shared_ptr<BlockManager> bm)
         inode_manager_res.unwrap_error());
   }
 
-  auto reserved_block_num = inode_manager_res.unwrap().get_reserved_blocks();
-  return ChfsResult<std::shared_ptr<FileOperation>>(
-      std::shared_ptr<FileOperation>(new FileOperation(
-          bm, InodeManager::to_shared_ptr(inode_manager_res.unwrap()),
-          std::shared_ptr<BlockAllocator>(
-              new BlockAllocator(bm, reserved_block_num, false)))));
+  auto reserved_block_num = inode_manager_res.value().get_reserved_blocks();
+  auto allocator_res =
+      BlockAllocator::create(superblock_res.unwrap()->get_allocator_type(), bm,
+                             reserved_block_num, false, free_blocks);
+  if (allocator_res.is_err()) {
+    return ChfsResult<std::shared_ptr<FileOperation>>(
+        allocator_res.unwrap_error());
+  }
+  auto fs = std::shared_ptr<FileOperation>(new FileOperation(
+      bm, InodeManager::to_shared_ptr(std::move(inode_manager_res).unwrap()),
+      std::move(allocator_res).unwrap(), journal));
+  if (superblock_res.unwrap()->get_refcount_blocks() != 0) {
+    fs->refcount_ = std::make_shared<RefcountTable>(
+        bm, superblock_res.unwrap()->get_refcount_start(),
+        superblock_res.unwrap()->get_refcount_blocks());
+    fs->snapshot_block_ = superblock_res.unwrap()->get_snapshot_block();
+  }
+  if (superblock_res.unwrap()->get_dedup_blocks() != 0) {
+    fs->dedup_ = std::make_shared<FingerprintIndex>(
+        bm, superblock_res.unwrap()->get_dedup_start(),
+        superblock_res.unwrap()->get_dedup_blocks());
+    // the index is not journaled, so it is stale after a crash
+    if (superblock_res.unwrap()->is_dirty()) {
+      auto res = fs->dedup_->format();
+      if (res.is_err()) {
+        return ChfsResult<std::shared_ptr<FileOperation>>(res.unwrap_error());
+      }
+    }
+  }
+
+  // 3. the filesystem is in use until it is unmounted
+  superblock_res.unwrap()->mark_dirty();
+  auto res = superblock_res.unwrap()->flush(0);
+  if (res.is_ok()) {
+    res = bm->sync(0, 1);
+  }
+  if (res.is_err()) {
+    return ChfsResult<std::shared_ptr<FileOperation>>(res.unwrap_error());
+  }
+  return ChfsResult<std::shared_ptr<FileOperation>>(fs);
+}
+
+auto FileOperation::unmount() -> ChfsNullResult {
+  // a snapshot is never modified
+  if (this->read_only_) {
+    return KNullOk;
+  }
+
+  auto res = this->sync();
+  if (res.is_err()) {
+    return res;
+  }
+
+  // the super block is written in place, after all the other blocks are
+  // durable
+  res = this->journal_ != nullptr
+            ? this->journal_->checkpoint()
+            : this->block_manager_->sync(0, this->block_manager_->total_blocks());
+  if (res.is_err()) {
+    return res;
+  }
+
+  auto super_block_res = SuperBlock::create_from_existing(block_manager_, 0);
+  if (super_block_res.is_err()) {
+    return ChfsNullResult(super_block_res.unwrap_error());
+  }
+  super_block_res.unwrap()->mark_clean(block_allocator_->free_block_cnt());
+  res = super_block_res.unwrap()->flush(0);
+  if (res.is_err()) {
+    return res;
+  }
+  return this->block_manager_->sync(0, 1);
+}
+
+auto FileOperation::enable_checksum() -> ChfsNullResult {
+  if (this->read_only_) {
+    return ChfsNullResult(ErrorType::ReadOnly);
+  }
+  if (this->is_checksum_enabled()) {
+    return ChfsNullResult(ErrorType::AlreadyExist);
+  }
+
+  auto res = this->sync();
+  if (res.is_err()) {
+    return res;
+  }
+  auto super_block_res = SuperBlock::create_from_existing(block_manager_, 0);
+  if (super_block_res.is_err()) {
+    return ChfsNullResult(super_block_res.unwrap_error());
+  }
+
+  const auto checksum_blocks = block_manager_->checksum_blocks_needed();
+  auto start_res = block_allocator_->allocate_contiguous(checksum_blocks);
+  if (start_res.is_err()) {
+    return ChfsNullResult(start_res.unwrap_error());
+  }
+  res = block_manager_->enable_checksum(start_res.unwrap(), checksum_blocks,
+                                        true);
+  if (res.is_err()) {
+    return res;
+  }
+
+  // the region is allocated and filled durably before the super block
+  // refers to it. The super block is written in place.
+  res = this->commit_journal();
+  if (res.is_ok()) {
+    res = block_manager_->sync(start_res.unwrap(), checksum_blocks);
+  }
+  if (res.is_err()) {
+    return res;
+  }
+  super_block_res.unwrap()->set_checksum(start_res.unwrap(), checksum_blocks);
+  res = super_block_res.unwrap()->flush(0);
+  if (res.is_ok()) {
+    res = block_manager_->sync(0, 1);
+  }
+  return res;
+}
+
+auto FileOperation::setup_journal() -> void {
+  if (this->journal_ == nullptr) {
+    return;
+  }
+
+  this->journal_->exclude(0);
+  // a weak pointer, since the journal outlives the filesystem handler
+  std::weak_ptr<BlockAllocator> allocator = this->block_allocator_;
+  this->journal_->set_free_blocks_source([allocator]() -> u64 {
+    auto ptr = allocator.lock();
+    return ptr != nullptr ? ptr->free_block_cnt() : KJournalNoCounter;
+  });
+
+  // the freed blocks are released into the transaction freeing them
+  std::weak_ptr<std::vector<block_id_t>> pending = this->pending_frees_;
+  this->journal_->set_before_commit([allocator, pending]() -> ChfsNullResult {
+    auto allocator_ptr = allocator.lock();
+    auto pending_ptr = pending.lock();
+    if (allocator_ptr == nullptr || pending_ptr == nullptr ||
+        pending_ptr->empty()) {
+      return KNullOk;
+    }
+    auto res = allocator_ptr->deallocate_batch(*pending_ptr);
+    if (res.is_err()) {
+      return res;
+    }
+    pending_ptr->clear();
+    return KNullOk;
+  });
+  // commit early once the free blocks run short of the pending ones
+  this->journal_->set_commit_wanted([allocator, pending]() -> bool {
+    auto allocator_ptr = allocator.lock();
+    auto pending_ptr = pending.lock();
+    return allocator_ptr != nullptr && pending_ptr != nullptr &&
+           !pending_ptr->empty() &&
+           allocator_ptr->free_block_cnt() <= pending_ptr->size();
+  });
 }
 
 auto FileOperation::get_free_inode_num() const -> ChfsResult<u64> {
@@ -43,21 +304,65 @@ auto FileOperation::get_free_inode_num() const -> ChfsResult<u64> {
 }
 
 auto FileOperation::get_free_blocks_num() const -> ChfsResult<u64> {
-  return ChfsResult<u64>(block_allocator_->free_block_cnt());
+  // the blocks reserved by the delayed allocation are not free, while the
+  // ones pending to be freed are
+  return ChfsResult<u64>(block_allocator_->free_block_cnt() +
+                         this->pending_frees_->size() -
+                         this->reserved_blocks_);
 }
 
 auto FileOperation::remove_file(inode_id_t id) -> ChfsNullResult {
-  auto error_code = ErrorType::DONE;
-  const auto block_size = this->block_manager_->block_size();
+  StatTimer timer(Stat::FsRemoveFile);
+  if (this->read_only_) {
+    return ChfsNullResult(ErrorType::ReadOnly);
+  }
 
+  const auto block_size = this->block_manager_->block_size();
   std::vector<u8> inode(block_size);
+  JournalOp op(this->journal_.get());
 
-  std::vector<block_id_t> free_set;
+  // the buffered content has no block yet, simply drop it
+  this->drop_dirty(id);
+  this->cluster_cache_.invalidate(id);
 
-  auto inode_p = reinterpret_cast<Inode *>(inode.data());
   auto inode_res = this->inode_manager_->read_inode(id, inode);
   if (inode_res.is_err()) {
-    error_code = inode_res.unwrap_error();
+    return ChfsNullResult(inode_res.unwrap_error());
+  }
+
+  // First we free the inode
+  auto res = this->inode_manager_->free_inode(id);
+  if (res.is_err()) {
+    return res;
+  }
+
+  // now free the blocks (unless they are shared with a snapshot)
+  return this->release_inode_block(inode_res.unwrap());
+}
+
+auto FileOperation::release_inode_block(block_id_t inode_block)
+    -> ChfsNullResult {
+  auto error_code = ErrorType::DONE;
+  const auto block_size = this->block_manager_->block_size();
+
+  std::vector<u8> inode(block_size);
+  std::vector<block_id_t> free_set;
+  auto inode_p = reinterpret_cast<Inode *>(inode.data());
+
+  // the content is still referenced by the other copies
+  if (this->refcount_ != nullptr) {
+    auto dec_res = this->refcount_->dec(inode_block);
+    if (dec_res.is_err()) {
+      return ChfsNullResult(dec_res.unwrap_error());
+    }
+    if (dec_res.unwrap()) {
+      return KNullOk;
+    }
+  }
+
+  auto read_res = this->block_manager_->read_block(inode_block, inode.data());
+  if (read_res.is_err()) {
+    error_code = read_res.unwrap_error();
     // I know goto is bad, but we have no choice
     goto err_ret;
   }
@@ -71,8 +376,8 @@ auto FileOperation::remove_file(inode_id_t id) -> ChfsNullResult {
 
   if (inode_p->blocks[inode_p->get_direct_block_num()] != KInvalidBlockID) {
     // we still need to release the indirect block
-    std::vector<u8> indirect_block;
-    auto read_res = this->block_manager_->read_block(
+    std::vector<u8> indirect_block(block_size);
+    read_res = this->block_manager_->read_block(
         inode_p->blocks[inode_p->get_direct_block_num()],
         indirect_block.data());
     if (read_res.is_err()) {
@@ -80,35 +385,34 @@ auto FileOperation::remove_file(inode_id_t id) -> ChfsNullResult {
       goto err_ret;
     }
 
+    // a shared indirect block keeps its entries referenced
+    const auto indirect_id = inode_p->blocks[inode_p->get_direct_block_num()];
+    auto shared = false;
+    if (this->refcount_ != nullptr) {
+      auto dec_res = this->refcount_->dec(indirect_id);
+      if (dec_res.is_err()) {
+        error_code = dec_res.unwrap_error();
+        goto err_ret;
+      }
+      shared = dec_res.unwrap();
+    }
+
     auto block_p = reinterpret_cast<block_id_t *>(indirect_block.data());
-    for (uint i = 0;
-         i < this->block_manager_->block_size() / sizeof(block_id_t); ++i) {
+    for (uint i = 0; !shared && i < block_size / sizeof(block_id_t); ++i) {
       if (block_p[i] == KInvalidBlockID) {
         break;
       } else {
         free_set.push_back(block_p[i]);
       }
     }
-  }
-
-  // First we free the inode
-  {
-    auto res = this->inode_manager_->free_inode(id);
-    if (res.is_err()) {
-      error_code = res.unwrap_error();
-      goto err_ret;
+    if (!shared) {
+      free_set.push_back(indirect_id);
     }
-    free_set.push_back(inode_res.unwrap());
   }
 
-  // now free the blocks
-  for (auto bid : free_set) {
-    auto res = this->block_allocator_->deallocate(bid);
-    if (res.is_err()) {
-      return res;
-    }
-  }
-  return KNullOk;
+  // each bitmap block is flushed only once
+  free_set.push_back(inode_block);
+  return this->release_blocks(free_set);
 err_ret:
   return ChfsNullResult(error_code);
 }
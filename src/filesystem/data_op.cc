@@ -1,31 +1,59 @@
+#include <algorithm>
+#include <cstring>
 #include <ctime>
 
+#include "common/buffer_pool.h"
+#include "common/stats.h"
 #include "filesystem/operations.h"
 
 namespace chfs {
 
 // {Your code here}
 auto FileOperation::alloc_inode(InodeType type) -> ChfsResult<inode_id_t> {
-  inode_id_t inode_id = static_cast<inode_id_t>(0);
-  auto inode_res = ChfsResult<inode_id_t>(inode_id);
+  StatTimer timer(Stat::FsAllocInode);
+  if (this->read_only_) {
+    return ChfsResult<inode_id_t>(ErrorType::ReadOnly);
+  }
+  JournalOp op(this->journal_.get());
 
-  // TODO:
   // 1. Allocate a block for the inode.
-  // 2. Allocate an inode.
-  // 3. Initialize the inode block
-  //    and write the block back to block manager.
-  UNIMPLEMENTED();
+  // The blocks reserved by the delayed allocation cannot be taken.
+  if (this->block_allocator_->free_block_cnt() <= this->reserved_blocks_) {
+    return ChfsResult<inode_id_t>(ErrorType::OUT_OF_RESOURCE);
+  }
+  auto block_res = this->block_allocator_->allocate();
+  if (block_res.is_err()) {
+    return ChfsResult<inode_id_t>(block_res.unwrap_error());
+  }
 
+  // 2. Allocate an inode, it will initialize the inode block
+  auto inode_res =
+      this->inode_manager_->allocate_inode(type, block_res.unwrap());
+  if (inode_res.is_err()) {
+    // the block is leaked if it cannot be freed, fsck reclaims it
+    static_cast<void>(this->block_allocator_->deallocate(block_res.unwrap()));
+  }
   return inode_res;
 }
 
 auto FileOperation::getattr(inode_id_t id) -> ChfsResult<FileAttr> {
+  auto iter = this->dirty_files_.find(id);
+  if (iter != this->dirty_files_.end()) {
+    return ChfsResult<FileAttr>(iter->second.attr);
+  }
   return this->inode_manager_->get_attr(id);
 }
 
 auto FileOperation::get_type_attr(inode_id_t id)
     -> ChfsResult<std::pair<InodeType, FileAttr>> {
-  return this->inode_manager_->get_type_attr(id);
+  StatTimer timer(Stat::FsGetattr);
+  auto res = this->inode_manager_->get_type_attr(id);
+  auto iter = this->dirty_files_.find(id);
+  if (res.is_ok() && iter != this->dirty_files_.end()) {
+    return ChfsResult<std::pair<InodeType, FileAttr>>(
+        std::make_pair(res.unwrap().first, iter->second.attr));
+  }
+  return res;
 }
 
 auto FileOperation::gettype(inode_id_t id) -> ChfsResult<InodeType> {
@@ -36,14 +64,38 @@ auto calculate_block_sz(u64 file_sz, u64 block_sz) -> u64 {
   return (file_sz % block_sz) ? (file_sz / block_sz + 1) : (file_sz / block_sz);
 }
 
+/**
+ * Calculate the number of blocks used by the file content, including the
+ * indirect block
+ */
+auto calculate_block_sz_w_indirect(u64 file_sz, u64 block_sz) -> u64 {
+  const u64 direct_block_num =
+      (block_sz - sizeof(Inode)) / sizeof(block_id_t) - 1;
+  auto data_blocks = calculate_block_sz(file_sz, block_sz);
+  return data_blocks > direct_block_num ? data_blocks + 1 : data_blocks;
+}
+
 auto FileOperation::write_file_w_off(inode_id_t id, const char *data, u64 sz,
                                      u64 offset) -> ChfsResult<u64> {
+  StatTimer timer(Stat::FsWriteFileWOff);
+  timer.count(sz);
+  // the small writes are absorbed by the buffered content
+  if (this->dirty_limit_ > 0 && !this->read_only_) {
+    JournalOp op(this->journal_.get());
+    auto res = this->buffer_write_at(id, reinterpret_cast<const u8 *>(data),
+                                     sz, offset);
+    if (res.is_err()) {
+      return ChfsResult<u64>(res.unwrap_error());
+    }
+    return ChfsResult<u64>(sz);
+  }
+
   auto read_res = this->read_file(id);
   if (read_res.is_err()) {
     return ChfsResult<u64>(read_res.unwrap_error());
   }
 
-  auto content = read_res.unwrap();
+  auto content = std::move(read_res).unwrap();
   if (offset + sz > content.size()) {
     content.resize(offset + sz);
   }
@@ -56,118 +108,515 @@ auto FileOperation::write_file_w_off(inode_id_t id, const char *data, u64 sz,
   return ChfsResult<u64>(sz);
 }
 
-// {Your code here}
 auto FileOperation::write_file(inode_id_t id, const std::vector<u8> &content)
     -> ChfsNullResult {
+  StatTimer timer(Stat::FsWriteFile);
+  timer.count(content.size());
+  if (this->read_only_) {
+    return ChfsNullResult(ErrorType::ReadOnly);
+  }
+  JournalOp op(this->journal_.get());
+  if (this->dirty_limit_ > 0) {
+    return this->buffer_write(id, content);
+  }
+  // the content replaces a buffered one, if any, as a whole
+  this->drop_dirty(id);
+  return this->write_file_to_blocks(id, content);
+}
+
+auto FileOperation::get_dirty(inode_id_t id)
+    -> ChfsResult<std::pair<DirtyFile *, bool>> {
+  using Ret = std::pair<DirtyFile *, bool>;
+  const auto block_size = this->block_manager_->block_size();
+
+  auto iter = this->dirty_files_.find(id);
+  if (iter != this->dirty_files_.end()) {
+    return ChfsResult<Ret>(Ret(&iter->second, false));
+  }
+
+  auto inode = BlockBuffer::acquire(block_size);
+  auto inode_p = reinterpret_cast<Inode *>(inode.data());
+  auto inode_res = this->inode_manager_->read_inode(id, inode.data());
+  if (inode_res.is_err()) {
+    return ChfsResult<Ret>(inode_res.unwrap_error());
+  }
+
+  auto stored_res = this->get_stored_size(inode_p);
+  if (stored_res.is_err()) {
+    return ChfsResult<Ret>(stored_res.unwrap_error());
+  }
+
+  DirtyFile dirty = {{},
+                     inode_p->get_size(),
+                     inode_p->get_size(),
+                     inode_p->get_attr(),
+                     static_cast<usize>(calculate_block_sz_w_indirect(
+                         stored_res.unwrap(), block_size)),
+                     0,
+                     inode_p->max_file_sz_supported(),
+                     inode_p->is_compressed(),
+                     id};
+  iter = this->dirty_files_.emplace(id, std::move(dirty)).first;
+  return ChfsResult<Ret>(Ret(&iter->second, true));
+}
+
+auto FileOperation::fill_dirty(DirtyFile &dirty,
+                               const std::vector<u8> &content) -> void {
+  const auto block_size = this->block_manager_->block_size();
+  this->dirty_bytes_ -= dirty.blocks.size() * block_size;
+  dirty.blocks.clear();
+
+  for (u64 begin = 0; begin < content.size(); begin += block_size) {
+    const auto len = std::min<u64>(block_size, content.size() - begin);
+    auto &block = dirty.blocks[begin / block_size];
+    block.data.assign(block_size, 0);
+    memcpy(block.data.data(), content.data() + begin, len);
+    // the tail of the last block is zeros
+    block.written.add(0, block_size);
+  }
+  this->dirty_bytes_ += dirty.blocks.size() * block_size;
+  dirty.stored_size = 0;
+  dirty.attr.size = content.size();
+}
+
+auto FileOperation::read_dirty_block(const DirtyFile &dirty, u64 block_idx,
+                                     block_id_t stored, u8 *data)
+    -> ChfsNullResult {
+  const auto block_size = this->block_manager_->block_size();
+  auto iter = dirty.blocks.find(block_idx);
+  if (iter != dirty.blocks.end() && iter->second.is_full(block_size)) {
+    memcpy(data, iter->second.data.data(), block_size);
+    return KNullOk;
+  }
+
+  // the stored content, which is valid below the stored size. The one of a
+  // compressed file is decompressed from its cluster.
+  const u64 begin = block_idx * block_size;
+  if (dirty.compressed && begin < dirty.stored_size) {
+    auto res = this->read_compressed(dirty.id, block_size, begin);
+    if (res.is_err()) {
+      return ChfsNullResult(res.unwrap_error());
+    }
+    const auto &content = res.unwrap();
+    memcpy(data, content.data(), content.size());
+    memset(data + content.size(), 0, block_size - content.size());
+    if (dirty.stored_size - begin < block_size) {
+      memset(data + (dirty.stored_size - begin), 0,
+             block_size - (dirty.stored_size - begin));
+    }
+  } else if (stored != KInvalidBlockID && begin < dirty.stored_size) {
+    auto res = this->block_manager_->read_block(stored, data);
+    if (res.is_err()) {
+      return res;
+    }
+    if (dirty.stored_size - begin < block_size) {
+      memset(data + (dirty.stored_size - begin), 0,
+             block_size - (dirty.stored_size - begin));
+    }
+  } else {
+    memset(data, 0, block_size);
+  }
+
+  if (iter != dirty.blocks.end()) {
+    for (auto [range_begin, range_end] : iter->second.written) {
+      memcpy(data + range_begin, iter->second.data.data() + range_begin,
+             range_end - range_begin);
+    }
+  }
+  return KNullOk;
+}
+
+auto FileOperation::reserve_dirty(DirtyFile &dirty, u64 size)
+    -> ChfsNullResult {
+  const auto block_size = this->block_manager_->block_size();
+
+  // only reserve the blocks, they will be allocated upon flush. The index
+  // of a compressed file takes a block.
+  auto needed = calculate_block_sz_w_indirect(
+      size + (dirty.compressed ? block_size : 0), block_size);
+  usize reserve = needed > dirty.ondisk_blocks ? needed - dirty.ondisk_blocks : 0;
+  auto total_reserved = this->reserved_blocks_ - dirty.reserved_blocks + reserve;
+
+  if (size > dirty.max_file_sz ||
+      total_reserved > this->block_allocator_->free_block_cnt()) {
+    return ChfsNullResult(ErrorType::OUT_OF_RESOURCE);
+  }
+  this->reserved_blocks_ = total_reserved;
+  dirty.reserved_blocks = reserve;
+  return KNullOk;
+}
+
+auto FileOperation::buffer_write(inode_id_t id,
+                                 const std::vector<u8> &content)
+    -> ChfsNullResult {
+  auto dirty_res = this->get_dirty(id);
+  if (dirty_res.is_err()) {
+    return ChfsNullResult(dirty_res.unwrap_error());
+  }
+  auto [dirty_p, newly_dirty] = dirty_res.unwrap();
+  auto &dirty = *dirty_p;
+
+  auto res = this->reserve_dirty(dirty, content.size());
+  if (res.is_err()) {
+    if (newly_dirty) {
+      this->dirty_files_.erase(id);
+    }
+    return res;
+  }
+
+  this->fill_dirty(dirty, content);
+  dirty.attr.set_all_time(time(0));
+
+  // memory pressure
+  if (this->dirty_bytes_ > this->dirty_limit_) {
+    return this->flush_all();
+  }
+  return KNullOk;
+}
+
+auto FileOperation::buffer_write_at(inode_id_t id, const u8 *data, u64 sz,
+                                    u64 offset) -> ChfsNullResult {
+  auto dirty_res = this->get_dirty(id);
+  if (dirty_res.is_err()) {
+    return ChfsNullResult(dirty_res.unwrap_error());
+  }
+  auto [dirty_p, newly_dirty] = dirty_res.unwrap();
+  auto &dirty = *dirty_p;
+
+  const auto block_size = this->block_manager_->block_size();
+  const auto new_size = std::max<u64>(dirty.attr.size, offset + sz);
+  auto res = this->reserve_dirty(dirty, new_size);
+  if (res.is_err()) {
+    if (newly_dirty) {
+      this->drop_dirty(id);
+    }
+    return res;
+  }
+
+  // the hole before the range is read as zeros, since it is beyond the
+  // stored size
+  for (u64 pos = offset; pos < offset + sz;) {
+    const auto in_block = pos % block_size;
+    const auto len = std::min<u64>(block_size - in_block, offset + sz - pos);
+    auto [iter, inserted] = dirty.blocks.try_emplace(pos / block_size);
+    if (inserted) {
+      iter->second.data.assign(block_size, 0);
+      this->dirty_bytes_ += block_size;
+    }
+    memcpy(iter->second.data.data() + in_block, data + (pos - offset), len);
+    iter->second.written.add(in_block, in_block + len);
+    pos += len;
+  }
+  dirty.attr.size = new_size;
+  dirty.attr.set_all_time(time(0));
+
+  // memory pressure
+  if (this->dirty_bytes_ > this->dirty_limit_) {
+    return this->flush_all();
+  }
+  return KNullOk;
+}
+
+auto FileOperation::drop_dirty(inode_id_t id) -> void {
+  auto iter = this->dirty_files_.find(id);
+  if (iter == this->dirty_files_.end()) {
+    return;
+  }
+  this->reserved_blocks_ -= iter->second.reserved_blocks;
+  this->dirty_bytes_ -=
+      iter->second.blocks.size() * this->block_manager_->block_size();
+  this->dirty_files_.erase(iter);
+}
+
+auto FileOperation::flush(inode_id_t id) -> ChfsNullResult {
+  StatTimer timer(Stat::FsFlush);
+  auto iter = this->dirty_files_.find(id);
+  if (iter == this->dirty_files_.end()) {
+    return KNullOk;
+  }
+  JournalOp op(this->journal_.get());
+  const auto block_size = this->block_manager_->block_size();
+  const auto &dirty = iter->second;
+
+  // only the buffered blocks are written, and the stored ones beyond the
+  // stored size, which are zeroed
+  RangeSet modified;
+  for (auto &[block_idx, _] : dirty.blocks) {
+    modified.add(block_idx * block_size, (block_idx + 1) * block_size);
+  }
+  if (dirty.stored_size < dirty.ondisk_size) {
+    modified.add(dirty.stored_size, dirty.ondisk_size);
+  }
+
+  // the size is known now, so the blocks are allocated in a batch. A
+  // partially written block is completed from the device.
+  auto res = this->write_file_to_blocks(
+      id, dirty.attr.size,
+      [this, &dirty](u64 block_idx, block_id_t stored, u8 *data) {
+        return this->read_dirty_block(dirty, block_idx, stored, data);
+      },
+      &modified);
+  if (res.is_err()) {
+    return res;
+  }
+  this->drop_dirty(id);
+  return KNullOk;
+}
+
+auto FileOperation::fsync(inode_id_t id) -> ChfsNullResult {
+  auto res = this->flush(id);
+  if (res.is_err()) {
+    return res;
+  }
+  return this->commit_journal();
+}
+
+auto FileOperation::sync() -> ChfsNullResult {
+  auto res = this->flush_all();
+  if (res.is_err()) {
+    return res;
+  }
+  return this->commit_journal();
+}
+
+auto FileOperation::flush_all() -> ChfsNullResult {
+  std::vector<inode_id_t> ids;
+  ids.reserve(this->dirty_files_.size());
+  for (auto &[id, _] : this->dirty_files_) {
+    ids.push_back(id);
+  }
+
+  for (auto id : ids) {
+    auto res = this->flush(id);
+    if (res.is_err()) {
+      return res;
+    }
+  }
+  return KNullOk;
+}
+
+auto FileOperation::set_delayed_allocation(u64 dirty_limit) -> ChfsNullResult {
+  this->dirty_limit_ = dirty_limit;
+  // a file truncated while buffered has no dirty bytes, but must be flushed
+  // as well once the buffer is gone
+  if (this->dirty_bytes_ > this->dirty_limit_ ||
+      (this->dirty_limit_ == 0 && !this->dirty_files_.empty())) {
+    return this->flush_all();
+  }
+  return KNullOk;
+}
+
+// {Your code here}
+auto FileOperation::write_file_to_blocks(inode_id_t id,
+                                         const std::vector<u8> &content,
+                                         const RangeSet *modified)
+    -> ChfsNullResult {
+  const auto block_size = this->block_manager_->block_size();
+  return this->write_file_to_blocks(
+      id, content.size(),
+      [&content, block_size](u64 block_idx, block_id_t, u8 *data) {
+        const u64 begin = block_idx * block_size;
+        const auto sz = std::min<u64>(block_size, content.size() - begin);
+        memcpy(data, content.data() + begin, sz);
+        if (sz < block_size) {
+          memset(data + sz, 0, block_size - sz);
+        }
+        return KNullOk;
+      },
+      modified);
+}
+
+auto FileOperation::write_file_to_blocks(inode_id_t id, u64 size,
+                                         const BlockSource &source,
+                                         const RangeSet *modified)
+    -> ChfsNullResult {
   auto error_code = ErrorType::DONE;
   const auto block_size = this->block_manager_->block_size();
   usize old_block_num = 0;
   usize new_block_num = 0;
   u64 original_file_sz = 0;
+  block_id_t inode_bid = KInvalidBlockID;
 
   // 1. read the inode
-  std::vector<u8> inode(block_size);
+  auto inode = BlockBuffer::acquire(block_size);
   std::vector<u8> indirect_block(0);
   indirect_block.reserve(block_size);
 
   auto inode_p = reinterpret_cast<Inode *>(inode.data());
   auto inlined_blocks_num = 0;
 
-  auto inode_res = this->inode_manager_->read_inode(id, inode);
+  auto inode_res = this->inode_manager_->read_inode(id, inode.data());
   if (inode_res.is_err()) {
     error_code = inode_res.unwrap_error();
     // I know goto is bad, but we have no choice
     goto err_ret;
   } else {
     inlined_blocks_num = inode_p->get_direct_block_num();
+    inode_bid = inode_res.unwrap();
   }
 
-  if (content.size() > inode_p->max_file_sz_supported()) {
-    std::cerr << "file size too large: " << content.size() << " vs. "
+  // the clusters of a compressed file are laid out on their own
+  if (inode_p->is_compressed() && inode_p->get_type() == InodeType::FILE) {
+    return this->write_compressed_to_blocks(id, size, source, modified);
+  }
+
+  if (size > inode_p->max_file_sz_supported()) {
+    std::cerr << "file size too large: " << size << " vs. "
               << inode_p->max_file_sz_supported() << std::endl;
     error_code = ErrorType::OUT_OF_RESOURCE;
     goto err_ret;
   }
 
   // 2. make sure whether we need to allocate more blocks
-  original_file_sz = inode_p->get_size();
+  {
+    auto stored_res = this->get_stored_size(inode_p);
+    if (stored_res.is_err()) {
+      error_code = stored_res.unwrap_error();
+      goto err_ret;
+    }
+    original_file_sz = stored_res.unwrap();
+  }
   old_block_num = calculate_block_sz(original_file_sz, block_size);
-  new_block_num = calculate_block_sz(content.size(), block_size);
+  new_block_num = calculate_block_sz(size, block_size);
+
+  if (old_block_num > inlined_blocks_num) {
+    // the file already has an indirect block, load it
+    indirect_block.resize(block_size);
+    auto read_res = this->block_manager_->read_block(
+        inode_p->get_indirect_block_id(), indirect_block.data());
+    if (read_res.is_err()) {
+      error_code = read_res.unwrap_error();
+      goto err_ret;
+    }
+  }
+
+  // the blocks shared with a snapshot are copied before they are modified
+  if (this->refcount_ != nullptr) {
+    auto own_res = this->own_inode_blocks(id, inode.data(), inode_bid,
+                                          indirect_block, old_block_num);
+    if (own_res.is_err()) {
+      error_code = own_res.unwrap_error();
+      goto err_ret;
+    }
+  }
 
   if (new_block_num > old_block_num) {
     // If we need to allocate more blocks.
-    for (usize idx = old_block_num; idx < new_block_num; ++idx) {
+    // All the blocks (including a new indirect block, if any) are taken from
+    // the allocator in a single batch to save the bitmap I/Os.
+    const bool need_indirect = new_block_num > inlined_blocks_num &&
+                               old_block_num <= inlined_blocks_num;
+    std::vector<block_id_t> new_blocks;
+    auto alloc_res = this->block_allocator_->allocate_n(
+        new_block_num - old_block_num + (need_indirect ? 1 : 0), new_blocks);
+    if (alloc_res.is_err()) {
+      error_code = alloc_res.unwrap_error();
+      goto err_ret;
+    }
 
-      // TODO: Implement the case of allocating more blocks.
-      // 1. Allocate a block.
-      // 2. Fill the allocated block id to the inode.
-      //    You should pay attention to the case of indirect block.
-      //    You may use function `get_or_insert_indirect_block`
-      //    in the case of indirect block.
-      UNIMPLEMENTED();
+    if (need_indirect) {
+      inode_p->blocks[inode_p->get_nblocks() - 1] = new_blocks.back();
+      new_blocks.pop_back();
+      indirect_block.resize(block_size);
+      memset(indirect_block.data(), 0, block_size);
+    }
 
+    for (usize idx = old_block_num; idx < new_block_num; ++idx) {
+      auto bid = new_blocks[idx - old_block_num];
+      if (inode_p->is_direct_block(idx)) {
+        inode_p->set_block_direct(idx, bid);
+      } else {
+        reinterpret_cast<block_id_t *>(
+            indirect_block.data())[idx - inlined_blocks_num] = bid;
+      }
     }
 
   } else {
     // We need to free the extra blocks.
+    std::vector<block_id_t> free_set;
     for (usize idx = new_block_num; idx < old_block_num; ++idx) {
       if (inode_p->is_direct_block(idx)) {
-
-        // TODO: Free the direct extra block.
-        UNIMPLEMENTED();
-
+        free_set.push_back(inode_p->blocks[idx]);
+        inode_p->set_block_direct(idx, KInvalidBlockID);
       } else {
-
-        // TODO: Free the indirect extra block.
-        UNIMPLEMENTED();
-
+        auto indirect_p = reinterpret_cast<block_id_t *>(indirect_block.data());
+        free_set.push_back(indirect_p[idx - inlined_blocks_num]);
+        indirect_p[idx - inlined_blocks_num] = KInvalidBlockID;
       }
     }
 
     // If there are no more indirect blocks.
     if (old_block_num > inlined_blocks_num &&
         new_block_num <= inlined_blocks_num && true) {
-
-      auto res =
-          this->block_allocator_->deallocate(inode_p->get_indirect_block_id());
-      if (res.is_err()) {
-        error_code = res.unwrap_error();
-        goto err_ret;
-      }
+      free_set.push_back(inode_p->get_indirect_block_id());
       indirect_block.clear();
       inode_p->invalid_indirect_block_id();
     }
+
+    // a block shared with a snapshot is not freed
+    auto res = this->release_blocks(free_set);
+    if (res.is_err()) {
+      error_code = res.unwrap_error();
+      goto err_ret;
+    }
   }
 
   // 3. write the contents
-  inode_p->inner_attr.size = content.size();
+  inode_p->inner_attr.size = size;
   inode_p->inner_attr.mtime = time(0);
 
   {
     auto block_idx = 0;
     u64 write_sz = 0;
+    auto buffer = BlockBuffer::acquire(block_size);
 
-    while (write_sz < content.size()) {
-      auto sz = ((content.size() - write_sz) > block_size)
-                    ? block_size
-                    : (content.size() - write_sz);
-      std::vector<u8> buffer(block_size);
-      memcpy(buffer.data(), content.data() + write_sz, sz);
+    while (write_sz < size) {
+      auto sz = ((size - write_sz) > block_size) ? block_size
+                                                 : (size - write_sz);
 
-      if (inode_p->is_direct_block(block_idx)) {
-
-        // TODO: Implement getting block id of current direct block.
-        UNIMPLEMENTED();
+      // an unchanged block is skipped
+      if (modified != nullptr &&
+          static_cast<usize>(block_idx) < old_block_num &&
+          !modified->overlaps(write_sz, write_sz + block_size)) {
+        write_sz += sz;
+        block_idx += 1;
+        continue;
+      }
 
+      block_id_t bid = KInvalidBlockID;
+      if (inode_p->is_direct_block(block_idx)) {
+        bid = inode_p->blocks[block_idx];
       } else {
+        bid = reinterpret_cast<block_id_t *>(
+            indirect_block.data())[block_idx - inlined_blocks_num];
+      }
 
-        // TODO: Implement getting block id of current indirect block.
-        UNIMPLEMENTED();
+      // the old block is passed along, so a partially modified one can be
+      // completed from it
+      auto fill_res = source(
+          block_idx,
+          static_cast<usize>(block_idx) < old_block_num ? bid : KInvalidBlockID,
+          buffer.data());
+      if (fill_res.is_err()) {
+        error_code = fill_res.unwrap_error();
+        goto err_ret;
+      }
 
+      auto write_res = this->write_file_block(
+          inode_p, bid, static_cast<usize>(block_idx) >= old_block_num,
+          buffer.data());
+      if (write_res.is_err()) {
+        error_code = write_res.unwrap_error();
+        goto err_ret;
       }
+      const block_id_t written = write_res.unwrap();
 
-      // TODO: Write to current block.
-      UNIMPLEMENTED();
+      if (written != bid && inode_p->is_direct_block(block_idx)) {
+        inode_p->set_block_direct(block_idx, written);
+      } else if (written != bid) {
+        reinterpret_cast<block_id_t *>(
+            indirect_block.data())[block_idx - inlined_blocks_num] = written;
+      }
 
       write_sz += sz;
       block_idx += 1;
@@ -178,8 +627,7 @@ auto FileOperation::write_file(inode_id_t id, const std::vector<u8> &content)
   {
     inode_p->inner_attr.set_all_time(time(0));
 
-    auto write_res =
-        this->block_manager_->write_block(inode_res.unwrap(), inode.data());
+    auto write_res = this->block_manager_->write_block(inode_bid, inode.data());
     if (write_res.is_err()) {
       error_code = write_res.unwrap_error();
       goto err_ret;
@@ -201,51 +649,127 @@ err_ret:
   return ChfsNullResult(error_code);
 }
 
-// {Your code here}
+auto FileOperation::write_file_block(const Inode *inode_p, block_id_t block_id,
+                                     bool fresh, const u8 *data)
+    -> ChfsResult<block_id_t> {
+  // the file content is not journaled, but the directory content is metadata
+  const bool journaled = inode_p->get_type() == InodeType::Directory;
+  if (this->dedup_ != nullptr && inode_p->get_type() == InodeType::FILE) {
+    // the content may be stored already
+    return this->dedup_write_block(block_id, fresh, data);
+  }
+  if (this->refcount_ != nullptr && !fresh) {
+    // the old block may be shared
+    return this->write_shared_block(block_id, data, journaled);
+  }
+  auto res = journaled
+                 ? this->block_manager_->write_block(block_id, data)
+                 : this->block_manager_->write_block_unlogged(block_id, data);
+  if (res.is_err()) {
+    return ChfsResult<block_id_t>(res.unwrap_error());
+  }
+  return ChfsResult<block_id_t>(block_id);
+}
+
 auto FileOperation::read_file(inode_id_t id) -> ChfsResult<std::vector<u8>> {
+  StatTimer timer(Stat::FsReadFile);
+  auto iter = this->dirty_files_.find(id);
+  if (iter == this->dirty_files_.end()) {
+    return this->read_file_from_blocks(id);
+  }
+
+  // the stored content, overlaid with the buffered blocks
+  const auto &dirty = iter->second;
+  const auto block_size = this->block_manager_->block_size();
+  std::vector<u8> content;
+  if (dirty.stored_size > 0) {
+    auto res = this->read_file_from_blocks(id);
+    if (res.is_err()) {
+      return res;
+    }
+    content = std::move(res).unwrap();
+  }
+  content.resize(std::min<u64>(content.size(), dirty.stored_size));
+  content.resize(dirty.attr.size);
+  for (auto &[block_idx, block] : dirty.blocks) {
+    const u64 base = block_idx * block_size;
+    for (auto [begin, end] : block.written) {
+      if (base + begin >= content.size()) {
+        break;
+      }
+      const auto len = std::min<u64>(end, content.size() - base) - begin;
+      memcpy(content.data() + base + begin, block.data.data() + begin, len);
+    }
+  }
+  return ChfsResult<std::vector<u8>>(std::move(content));
+}
+
+// {Your code here}
+auto FileOperation::read_file_from_blocks(inode_id_t id)
+    -> ChfsResult<std::vector<u8>> {
   auto error_code = ErrorType::DONE;
   std::vector<u8> content;
 
   const auto block_size = this->block_manager_->block_size();
 
   // 1. read the inode
-  std::vector<u8> inode(block_size);
+  auto inode = BlockBuffer::acquire(block_size);
   std::vector<u8> indirect_block(0);
   indirect_block.reserve(block_size);
+  auto buffer = BlockBuffer::acquire(block_size);
 
   auto inode_p = reinterpret_cast<Inode *>(inode.data());
   u64 file_sz = 0;
   u64 read_sz = 0;
 
-  auto inode_res = this->inode_manager_->read_inode(id, inode);
+  auto inode_res = this->inode_manager_->read_inode(id, inode.data());
   if (inode_res.is_err()) {
     error_code = inode_res.unwrap_error();
     // I know goto is bad, but we have no choice
     goto err_ret;
   }
 
+  // a compressed file is decompressed cluster by cluster
+  if (inode_p->is_compressed()) {
+    return this->read_compressed(id, inode_p->get_size(), 0);
+  }
   file_sz = inode_p->get_size();
   content.reserve(file_sz);
 
   // Now read the file
   while (read_sz < file_sz) {
-    auto sz = ((inode_p->get_size() - read_sz) > block_size)
-                  ? block_size
-                  : (inode_p->get_size() - read_sz);
-    std::vector<u8> buffer(block_size);
+    auto sz = ((file_sz - read_sz) > block_size) ? block_size
+                                                 : (file_sz - read_sz);
 
     // Get current block id.
+    block_id_t bid = KInvalidBlockID;
     if (inode_p->is_direct_block(read_sz / block_size)) {
-      // TODO: Implement the case of direct block.
-      UNIMPLEMENTED();
+      bid = inode_p->blocks[read_sz / block_size];
     } else {
-      // TODO: Implement the case of indirect block.
-      UNIMPLEMENTED();
+      if (indirect_block.size() == 0) {
+        indirect_block.resize(block_size);
+        auto read_res = this->block_manager_->read_block(
+            inode_p->get_indirect_block_id(), indirect_block.data());
+        if (read_res.is_err()) {
+          error_code = read_res.unwrap_error();
+          goto err_ret;
+        }
+      }
+      bid = reinterpret_cast<block_id_t *>(
+          indirect_block.data())[read_sz / block_size -
+                                 inode_p->get_direct_block_num()];
+    }
+
+    // Read from current block and store to `content`.
+    {
+      auto read_res = this->block_manager_->read_block(bid, buffer.data());
+      if (read_res.is_err()) {
+        error_code = read_res.unwrap_error();
+        goto err_ret;
+      }
+      content.insert(content.end(), buffer.begin(), buffer.begin() + sz);
     }
 
-    // TODO: Read from current block and store to `content`.
-    UNIMPLEMENTED();
-    
     read_sz += sz;
   }
 
@@ -257,17 +781,292 @@ err_ret:
 
 auto FileOperation::read_file_w_off(inode_id_t id, u64 sz, u64 offset)
     -> ChfsResult<std::vector<u8>> {
-  auto res = read_file(id);
+  StatTimer timer(Stat::FsReadFileWOff);
+  timer.count(sz);
+  // only the clusters covering the range are decompressed
+  if (this->dirty_files_.count(id) == 0) {
+    auto compressed_res = this->get_compression(id);
+    if (compressed_res.is_ok() && compressed_res.unwrap()) {
+      return this->read_compressed(id, sz, offset);
+    }
+  }
+
+  // only the blocks covering the range are read
+  const auto block_size = this->block_manager_->block_size();
+  auto inode = BlockBuffer::acquire(block_size);
+  auto inode_p = reinterpret_cast<Inode *>(inode.data());
+  auto inode_res = this->inode_manager_->read_inode(id, inode.data());
+  if (inode_res.is_err()) {
+    return ChfsResult<std::vector<u8>>(inode_res.unwrap_error());
+  }
+
+  auto iter = this->dirty_files_.find(id);
+  if (iter != this->dirty_files_.end()) {
+    const auto &dirty = iter->second;
+    if (offset >= dirty.attr.size) {
+      return ChfsResult<std::vector<u8>>(std::vector<u8>());
+    }
+    sz = std::min<u64>(sz, dirty.attr.size - offset);
+
+    // the stored blocks under the range, if any. Those of a compressed file
+    // are not the content.
+    const usize first = offset / block_size;
+    const usize last = (offset + sz + block_size - 1) / block_size;
+    const usize stored_end =
+        dirty.compressed
+            ? first
+            : std::min<usize>(
+                  last, calculate_block_sz(dirty.stored_size, block_size));
+    std::vector<block_id_t> blocks;
+    if (stored_end > first) {
+      auto res = this->get_file_blocks(inode_p, first, stored_end, blocks);
+      if (res.is_err()) {
+        return ChfsResult<std::vector<u8>>(res.unwrap_error());
+      }
+    }
+
+    std::vector<u8> content(sz);
+    auto buffer = BlockBuffer::acquire(block_size);
+    for (u64 pos = offset; pos < offset + sz;) {
+      const usize block_idx = pos / block_size;
+      const auto stored = block_idx < stored_end ? blocks[block_idx - first]
+                                                 : KInvalidBlockID;
+      auto res = this->read_dirty_block(dirty, block_idx, stored, buffer.data());
+      if (res.is_err()) {
+        return ChfsResult<std::vector<u8>>(res.unwrap_error());
+      }
+      const auto in_block = pos % block_size;
+      const auto len = std::min<u64>(block_size - in_block, offset + sz - pos);
+      memcpy(content.data() + (pos - offset), buffer.data() + in_block, len);
+      pos += len;
+    }
+    return ChfsResult<std::vector<u8>>(std::move(content));
+  }
+  const auto size = inode_p->get_size();
+  if (offset >= size) {
+    return ChfsResult<std::vector<u8>>(std::vector<u8>());
+  }
+  sz = std::min(sz, size - offset);
+
+  std::vector<block_id_t> blocks;
+  auto res = this->get_file_blocks(inode_p, offset / block_size,
+                                   (offset + sz + block_size - 1) / block_size,
+                                   blocks);
+  if (res.is_err()) {
+    return ChfsResult<std::vector<u8>>(res.unwrap_error());
+  }
+
+  std::vector<u8> content(sz);
+  auto buffer = BlockBuffer::acquire(block_size);
+  u64 pos = offset;
+  for (auto block_id : blocks) {
+    res = this->block_manager_->read_block(block_id, buffer.data());
+    if (res.is_err()) {
+      return ChfsResult<std::vector<u8>>(res.unwrap_error());
+    }
+    const auto in_block = pos % block_size;
+    const auto len = std::min<u64>(block_size - in_block, offset + sz - pos);
+    memcpy(content.data() + (pos - offset), buffer.data() + in_block, len);
+    pos += len;
+  }
+  return ChfsResult<std::vector<u8>>(std::move(content));
+}
+
+auto FileOperation::read_file_in_place(inode_id_t id, u64 sz, u64 offset)
+    -> ChfsResult<std::vector<FileSlice>> {
+  std::vector<FileSlice> slices;
+  const auto block_size = this->block_manager_->block_size();
+  auto inode = BlockBuffer::acquire(block_size);
+  auto inode_p = reinterpret_cast<Inode *>(inode.data());
+  auto inode_res = this->inode_manager_->read_inode(id, inode.data());
+  if (inode_res.is_err()) {
+    return ChfsResult<std::vector<FileSlice>>(inode_res.unwrap_error());
+  }
+
+  // the stored blocks of a compressed file are not the content
+  if (inode_p->is_compressed()) {
+    return ChfsResult<std::vector<FileSlice>>(ErrorType::INVALID);
+  }
+  auto iter = this->dirty_files_.find(id);
+  if (iter != this->dirty_files_.end()) {
+    return this->read_dirty_in_place(inode_p, iter->second, sz, offset);
+  }
+  const auto size = inode_p->get_size();
+  if (offset >= size) {
+    return ChfsResult<std::vector<FileSlice>>(std::move(slices));
+  }
+  sz = std::min(sz, size - offset);
+
+  std::vector<block_id_t> blocks;
+  auto res = this->get_file_blocks(inode_p, offset / block_size,
+                                   (offset + sz + block_size - 1) / block_size,
+                                   blocks);
+  if (res.is_err()) {
+    return ChfsResult<std::vector<FileSlice>>(res.unwrap_error());
+  }
+
+  u64 pos = offset;
+  for (auto block_id : blocks) {
+    auto data_res = this->block_manager_->peek_block(block_id);
+    if (data_res.is_err()) {
+      return ChfsResult<std::vector<FileSlice>>(data_res.unwrap_error());
+    }
+    const auto in_block = pos % block_size;
+    const auto len = std::min<u64>(block_size - in_block, offset + sz - pos);
+    const u8 *data = data_res.unwrap() + in_block;
+    if (!slices.empty() && slices.back().data + slices.back().len == data) {
+      slices.back().len += len;
+    } else {
+      slices.push_back({data, len});
+    }
+    pos += len;
+  }
+  return ChfsResult<std::vector<FileSlice>>(std::move(slices));
+}
+
+auto FileOperation::read_dirty_in_place(const Inode *inode_p, DirtyFile &dirty,
+                                        u64 sz, u64 offset)
+    -> ChfsResult<std::vector<FileSlice>> {
+  std::vector<FileSlice> slices;
+  if (offset >= dirty.attr.size) {
+    return ChfsResult<std::vector<FileSlice>>(std::move(slices));
+  }
+  sz = std::min<u64>(sz, dirty.attr.size - offset);
+
+  const auto block_size = this->block_manager_->block_size();
+  const usize first = offset / block_size;
+  const usize last = (offset + sz + block_size - 1) / block_size;
+  const usize stored_end =
+      std::min<usize>(last, calculate_block_sz(dirty.stored_size, block_size));
+  std::vector<block_id_t> blocks;
+  if (stored_end > first) {
+    auto res = this->get_file_blocks(inode_p, first, stored_end, blocks);
+    if (res.is_err()) {
+      return ChfsResult<std::vector<FileSlice>>(res.unwrap_error());
+    }
+  }
+
+  for (u64 pos = offset; pos < offset + sz;) {
+    const usize block_idx = pos / block_size;
+    const auto stored =
+        block_idx < stored_end ? blocks[block_idx - first] : KInvalidBlockID;
+    const u8 *data = nullptr;
+    auto block_iter = dirty.blocks.find(block_idx);
+    if (block_iter == dirty.blocks.end() &&
+        (block_idx + 1) * block_size <= dirty.stored_size) {
+      // an unchanged block is read from the device
+      auto data_res = this->block_manager_->peek_block(stored);
+      if (data_res.is_err()) {
+        return ChfsResult<std::vector<FileSlice>>(data_res.unwrap_error());
+      }
+      data = data_res.unwrap();
+    } else {
+      // a partial block is completed in the buffer, so it stays valid
+      if (block_iter == dirty.blocks.end() ||
+          !block_iter->second.is_full(block_size)) {
+        auto buffer = BlockBuffer::acquire(block_size);
+        auto res =
+            this->read_dirty_block(dirty, block_idx, stored, buffer.data());
+        if (res.is_err()) {
+          return ChfsResult<std::vector<FileSlice>>(res.unwrap_error());
+        }
+        if (block_iter == dirty.blocks.end()) {
+          block_iter = dirty.blocks.try_emplace(block_idx).first;
+          this->dirty_bytes_ += block_size;
+        }
+        block_iter->second.data.assign(buffer.begin(), buffer.end());
+        block_iter->second.written.add(0, block_size);
+      }
+      data = block_iter->second.data.data();
+    }
+
+    const auto in_block = pos % block_size;
+    const auto len = std::min<u64>(block_size - in_block, offset + sz - pos);
+    data += in_block;
+    if (!slices.empty() && slices.back().data + slices.back().len == data) {
+      slices.back().len += len;
+    } else {
+      slices.push_back({data, len});
+    }
+    pos += len;
+  }
+  return ChfsResult<std::vector<FileSlice>>(std::move(slices));
+}
+
+auto FileOperation::readahead(inode_id_t id, u64 offset, u64 len)
+    -> ChfsNullResult {
+  // the buffered content is in memory already, and the stored blocks of a
+  // compressed file are not in the file order
+  if (this->dirty_files_.count(id) != 0) {
+    return KNullOk;
+  }
+  const auto block_size = this->block_manager_->block_size();
+  auto inode = BlockBuffer::acquire(block_size);
+  auto inode_p = reinterpret_cast<Inode *>(inode.data());
+  auto inode_res = this->inode_manager_->read_inode(id, inode.data());
+  if (inode_res.is_err()) {
+    return ChfsNullResult(inode_res.unwrap_error());
+  }
+  const auto size = inode_p->get_size();
+  if (inode_p->is_compressed() || offset >= size) {
+    return KNullOk;
+  }
+
+  const auto end = std::min(offset + len, size);
+  std::vector<block_id_t> blocks;
+  auto res = this->get_file_blocks(inode_p, offset / block_size,
+                                   (end + block_size - 1) / block_size, blocks);
   if (res.is_err()) {
     return res;
   }
 
-  auto content = res.unwrap();
-  return ChfsResult<std::vector<u8>>(
-      std::vector<u8>(content.begin() + offset, content.begin() + offset + sz));
+  // the physically contiguous blocks are prefetched at once
+  for (usize i = 0; i < blocks.size();) {
+    usize run = 1;
+    while (i + run < blocks.size() && blocks[i + run] == blocks[i] + run) {
+      run++;
+    }
+    res = this->block_manager_->prefetch(blocks[i], run);
+    if (res.is_err()) {
+      return res;
+    }
+    i += run;
+  }
+  return KNullOk;
+}
+
+auto FileOperation::get_file_blocks(const Inode *inode_p, usize begin,
+                                    usize end, std::vector<block_id_t> &blocks)
+    -> ChfsNullResult {
+  const auto block_size = this->block_manager_->block_size();
+  if (begin > end ||
+      end > calculate_block_sz(inode_p->get_size(), block_size)) {
+    return ChfsNullResult(ErrorType::INVALID_ARG);
+  }
+  const usize direct_cnt = inode_p->get_direct_block_num();
+  blocks.clear();
+  for (auto idx = begin; idx < std::min(end, direct_cnt); idx++) {
+    blocks.push_back(inode_p->blocks[idx]);
+  }
+  if (end <= direct_cnt) {
+    return KNullOk;
+  }
+
+  std::vector<u8> indirect_block(block_size);
+  auto res = this->block_manager_->read_block(inode_p->blocks[direct_cnt],
+                                              indirect_block.data());
+  if (res.is_err()) {
+    return res;
+  }
+  auto indirect_p = reinterpret_cast<block_id_t *>(indirect_block.data());
+  for (auto idx = std::max(begin, direct_cnt); idx < end; idx++) {
+    blocks.push_back(indirect_p[idx - direct_cnt]);
+  }
+  return KNullOk;
 }
 
 auto FileOperation::resize(inode_id_t id, u64 sz) -> ChfsResult<FileAttr> {
+  StatTimer timer(Stat::FsResize);
   auto attr_res = this->getattr(id);
   if (attr_res.is_err()) {
     return ChfsResult<FileAttr>(attr_res.unwrap_error());
@@ -279,7 +1078,7 @@ auto FileOperation::resize(inode_id_t id, u64 sz) -> ChfsResult<FileAttr> {
     return ChfsResult<FileAttr>(file_content.unwrap_error());
   }
 
-  auto content = file_content.unwrap();
+  auto content = std::move(file_content).unwrap();
 
   if (content.size() != sz) {
     content.resize(sz);
@@ -0,0 +1,345 @@
+#include <cstring>
+
+#include "filesystem/operations.h"
+#include "metadata/superblock.h"
+
+namespace chfs {
+
+/**
+ * Zero a region in place. The region is not referenced until the super block
+ * records it, so it needs not to be journaled.
+ */
+static auto zero_region(std::shared_ptr<BlockManager> bm, block_id_t start,
+                        usize block_cnt) -> ChfsNullResult {
+  std::vector<u8> zeros(bm->block_size(), 0);
+  for (usize i = 0; i < block_cnt; i++) {
+    auto res = bm->write_block_unlogged(start + i, zeros.data());
+    if (res.is_err()) {
+      return res;
+    }
+  }
+  return KNullOk;
+}
+
+auto FileOperation::enable_dedup(usize index_blocks) -> ChfsNullResult {
+  if (this->read_only_) {
+    return ChfsNullResult(ErrorType::ReadOnly);
+  }
+  if (this->dedup_ != nullptr) {
+    return ChfsNullResult(ErrorType::AlreadyExist);
+  }
+  if (index_blocks == 0) {
+    return ChfsNullResult(ErrorType::INVALID_ARG);
+  }
+
+  auto res = this->sync();
+  if (res.is_err()) {
+    return res;
+  }
+  auto super_block_res =
+      SuperBlock::create_from_existing(this->block_manager_, 0);
+  if (super_block_res.is_err()) {
+    return ChfsNullResult(super_block_res.unwrap_error());
+  }
+  auto super_block = super_block_res.unwrap();
+
+  // 1. the duplicated blocks are shared, which requires the counters
+  std::shared_ptr<RefcountTable> refcount = this->refcount_;
+  block_id_t snapshot_block = this->snapshot_block_;
+  if (refcount == nullptr) {
+    const auto refcount_blocks =
+        RefcountTable::blocks_needed(*this->block_manager_);
+    auto start_res =
+        this->block_allocator_->allocate_contiguous(refcount_blocks);
+    if (start_res.is_err()) {
+      return ChfsNullResult(start_res.unwrap_error());
+    }
+    auto snapshot_res = this->block_allocator_->allocate();
+    if (snapshot_res.is_err()) {
+      return ChfsNullResult(snapshot_res.unwrap_error());
+    }
+    snapshot_block = snapshot_res.unwrap();
+
+    res = zero_region(this->block_manager_, start_res.unwrap(),
+                      refcount_blocks);
+    if (res.is_ok()) {
+      res = zero_region(this->block_manager_, snapshot_block, 1);
+    }
+    if (res.is_err()) {
+      return res;
+    }
+    refcount = std::make_shared<RefcountTable>(
+        this->block_manager_, start_res.unwrap(), refcount_blocks);
+    super_block->set_block_sharing(start_res.unwrap(), refcount_blocks,
+                                   snapshot_block);
+  }
+
+  // 2. the fingerprint index
+  auto start_res = this->block_allocator_->allocate_contiguous(index_blocks);
+  if (start_res.is_err()) {
+    return ChfsNullResult(start_res.unwrap_error());
+  }
+  auto index = std::make_shared<FingerprintIndex>(
+      this->block_manager_, start_res.unwrap(), index_blocks);
+  res = index->format();
+  if (res.is_err()) {
+    return res;
+  }
+  super_block->set_dedup_index(start_res.unwrap(), index_blocks);
+
+  // 3. the regions are allocated durably before the super block refers to
+  // them. The super block is written in place.
+  res = this->commit_journal();
+  if (res.is_ok()) {
+    res = super_block->flush(0);
+  }
+  if (res.is_ok()) {
+    res = this->block_manager_->sync(0, 1);
+  }
+  if (res.is_err()) {
+    return res;
+  }
+
+  this->refcount_ = refcount;
+  this->snapshot_block_ = snapshot_block;
+  this->dedup_ = index;
+  return KNullOk;
+}
+
+auto FileOperation::deduplicate() -> ChfsResult<u64> {
+  if (this->read_only_) {
+    return ChfsResult<u64>(ErrorType::ReadOnly);
+  }
+  if (this->dedup_ == nullptr) {
+    return ChfsResult<u64>(ErrorType::INVALID);
+  }
+
+  auto res = this->sync();
+  if (res.is_err()) {
+    return ChfsResult<u64>(res.unwrap_error());
+  }
+  const auto free_blocks = this->block_allocator_->free_block_cnt();
+
+  // each file in its own operation to bound the transaction
+  const auto max_inode = this->inode_manager_->get_max_inode_supported();
+  for (inode_id_t id = 1; id <= max_inode; id++) {
+    auto block_res = this->inode_manager_->get(id);
+    if (block_res.is_err()) {
+      return ChfsResult<u64>(block_res.unwrap_error());
+    }
+    if (block_res.unwrap() == KInvalidBlockID) {
+      continue;
+    }
+
+    JournalOp op(this->journal_.get());
+    res = this->dedup_file(id);
+    if (res.is_err()) {
+      return ChfsResult<u64>(res.unwrap_error());
+    }
+  }
+
+  res = this->commit_journal();
+  if (res.is_err()) {
+    return ChfsResult<u64>(res.unwrap_error());
+  }
+  return ChfsResult<u64>(this->block_allocator_->free_block_cnt() -
+                         free_blocks);
+}
+
+auto FileOperation::dedup_file(inode_id_t id) -> ChfsNullResult {
+  const auto block_size = this->block_manager_->block_size();
+  std::vector<u8> inode(block_size);
+  std::vector<u8> indirect_block;
+  auto inode_p = reinterpret_cast<Inode *>(inode.data());
+
+  auto inode_res = this->inode_manager_->read_inode(id, inode);
+  if (inode_res.is_err()) {
+    return ChfsNullResult(inode_res.unwrap_error());
+  }
+  if (inode_p->get_type() != InodeType::FILE) {
+    return KNullOk;
+  }
+  auto inode_bid = inode_res.unwrap();
+
+  auto stored_res = this->get_stored_size(inode_p);
+  if (stored_res.is_err()) {
+    return ChfsNullResult(stored_res.unwrap_error());
+  }
+  const usize direct_cnt = inode_p->get_direct_block_num();
+  const usize block_num = (stored_res.unwrap() + block_size - 1) / block_size;
+  if (block_num > direct_cnt) {
+    indirect_block.resize(block_size);
+    auto res = this->block_manager_->read_block(
+        inode_p->get_indirect_block_id(), indirect_block.data());
+    if (res.is_err()) {
+      return res;
+    }
+  }
+  auto indirect_p = reinterpret_cast<block_id_t *>(indirect_block.data());
+  auto get_block = [&](usize idx) {
+    return idx < direct_cnt ? static_cast<block_id_t>(inode_p->blocks[idx])
+                            : indirect_p[idx - direct_cnt];
+  };
+
+  // 1. find the blocks duplicating a stored one, the others are indexed
+  std::vector<std::pair<usize, block_id_t>> duplicates;
+  std::vector<u8> buffer(block_size);
+  for (usize idx = 0; idx < block_num; idx++) {
+    const auto block_id = get_block(idx);
+    auto res = this->block_manager_->read_block(block_id, buffer.data());
+    if (res.is_err()) {
+      return res;
+    }
+    const auto fingerprint =
+        FingerprintIndex::fingerprint(buffer.data(), block_size);
+    auto dup_res = this->find_duplicate(fingerprint, buffer.data(), block_id);
+    if (dup_res.is_err()) {
+      return ChfsNullResult(dup_res.unwrap_error());
+    }
+
+    if (dup_res.unwrap() != KInvalidBlockID) {
+      duplicates.emplace_back(idx, dup_res.unwrap());
+    } else {
+      res = this->dedup_->insert(fingerprint, block_id);
+      if (res.is_err()) {
+        return res;
+      }
+    }
+  }
+  if (duplicates.empty()) {
+    return KNullOk;
+  }
+
+  // 2. point to the stored blocks instead
+  auto res = this->own_inode_blocks(id, inode.data(), inode_bid,
+                                    indirect_block, block_num);
+  if (res.is_err()) {
+    return res;
+  }
+
+  std::vector<block_id_t> replaced;
+  for (auto [idx, dup] : duplicates) {
+    res = this->refcount_->inc(dup);
+    if (res.is_err()) {
+      return res;
+    }
+    replaced.push_back(get_block(idx));
+    if (idx < direct_cnt) {
+      inode_p->set_block_direct(idx, dup);
+    } else {
+      indirect_p[idx - direct_cnt] = dup;
+    }
+  }
+
+  res = this->block_manager_->write_block(inode_bid, inode.data());
+  if (res.is_ok() && !indirect_block.empty()) {
+    res = inode_p->write_indirect_block(this->block_manager_, indirect_block);
+  }
+  if (res.is_err()) {
+    return res;
+  }
+  return this->release_blocks(replaced);
+}
+
+auto FileOperation::dedup_write_block(block_id_t block_id, bool fresh,
+                                      const u8 *data)
+    -> ChfsResult<block_id_t> {
+  const auto block_size = this->block_manager_->block_size();
+
+  // an unchanged block is kept
+  u64 old_fingerprint = 0;
+  if (!fresh) {
+    std::vector<u8> old(block_size);
+    auto res = this->block_manager_->read_block(block_id, old.data());
+    if (res.is_err()) {
+      return ChfsResult<block_id_t>(res.unwrap_error());
+    }
+    if (memcmp(old.data(), data, block_size) == 0) {
+      return ChfsResult<block_id_t>(block_id);
+    }
+    old_fingerprint = FingerprintIndex::fingerprint(old.data(), block_size);
+  }
+
+  // 1. share the block with the same content
+  const auto fingerprint = FingerprintIndex::fingerprint(data, block_size);
+  auto dup_res = this->find_duplicate(fingerprint, data, block_id);
+  if (dup_res.is_err()) {
+    return dup_res;
+  }
+  if (dup_res.unwrap() != KInvalidBlockID) {
+    auto res = this->refcount_->inc(dup_res.unwrap());
+    if (res.is_ok()) {
+      res = this->release_blocks({block_id});
+    }
+    if (res.is_err()) {
+      return ChfsResult<block_id_t>(res.unwrap_error());
+    }
+    return dup_res;
+  }
+
+  // 2. otherwise, the content is stored. The indexed blocks are immutable,
+  // so the old content is unindexed before it is overwritten.
+  auto target = block_id;
+  bool shared = false;
+  if (!fresh) {
+    auto shared_res = this->refcount_->is_shared(block_id);
+    if (shared_res.is_err()) {
+      return ChfsResult<block_id_t>(shared_res.unwrap_error());
+    }
+    shared = shared_res.unwrap();
+  }
+  if (shared) {
+    auto alloc_res = this->block_allocator_->allocate();
+    if (alloc_res.is_err()) {
+      return alloc_res;
+    }
+    target = alloc_res.unwrap();
+    // the block is shared, so it is never the last reference
+    auto dec_res = this->refcount_->dec(block_id);
+    if (dec_res.is_err()) {
+      return ChfsResult<block_id_t>(dec_res.unwrap_error());
+    }
+  } else if (!fresh) {
+    auto res = this->dedup_->remove(old_fingerprint, block_id);
+    if (res.is_err()) {
+      return ChfsResult<block_id_t>(res.unwrap_error());
+    }
+  }
+
+  auto res = this->block_manager_->write_block_unlogged(target, data);
+  if (res.is_ok()) {
+    res = this->dedup_->insert(fingerprint, target);
+  }
+  if (res.is_err()) {
+    return ChfsResult<block_id_t>(res.unwrap_error());
+  }
+  return ChfsResult<block_id_t>(target);
+}
+
+auto FileOperation::find_duplicate(u64 fingerprint, const u8 *data,
+                                   block_id_t exclude)
+    -> ChfsResult<block_id_t> {
+  std::vector<block_id_t> candidates;
+  auto res = this->dedup_->lookup(fingerprint, candidates);
+  if (res.is_err()) {
+    return ChfsResult<block_id_t>(res.unwrap_error());
+  }
+
+  // the fingerprints may collide, so the contents are compared
+  std::vector<u8> buffer(this->block_manager_->block_size());
+  for (auto candidate : candidates) {
+    if (candidate == exclude) {
+      continue;
+    }
+    res = this->block_manager_->read_block(candidate, buffer.data());
+    if (res.is_err()) {
+      return ChfsResult<block_id_t>(res.unwrap_error());
+    }
+    if (memcmp(buffer.data(), data, buffer.size()) == 0) {
+      return ChfsResult<block_id_t>(candidate);
+    }
+  }
+  return ChfsResult<block_id_t>(KInvalidBlockID);
+}
+
+} // namespace chfs
@@ -1,6 +1,7 @@
 #include <algorithm>
 #include <sstream>
 
+#include "common/stats.h"
 #include "filesystem/directory_op.h"
 
 namespace chfs {
@@ -39,32 +40,40 @@ auto dir_list_to_string(const std::list<DirectoryEntry> &entries)
 // {Your code here}
 auto append_to_directory(std::string src, std::string filename, inode_id_t id)
     -> std::string {
-
-  // TODO: Implement this function.
-  //       Append the new directory entry to `src`.
-  UNIMPLEMENTED();
-  
+  if (!src.empty()) {
+    src += '/';
+  }
+  src += filename + ':' + inode_id_to_string(id);
   return src;
 }
 
 // {Your code here}
 void parse_directory(std::string &src, std::list<DirectoryEntry> &list) {
+  usize pos = 0;
+  while (pos < src.size()) {
+    auto end = src.find('/', pos);
+    if (end == std::string::npos) {
+      end = src.size();
+    }
 
-  // TODO: Implement this function.
-  UNIMPLEMENTED();
-
+    // the name may contain ':', so the last one separates the inode id
+    auto entry = src.substr(pos, end - pos);
+    auto sep = entry.rfind(':');
+    if (sep != std::string::npos) {
+      auto id = entry.substr(sep + 1);
+      list.push_back({entry.substr(0, sep), string_to_inode_id(id)});
+    }
+    pos = end + 1;
+  }
 }
 
 // {Your code here}
 auto rm_from_directory(std::string src, std::string filename) -> std::string {
-
-  auto res = std::string("");
-
-  // TODO: Implement this function.
-  //       Remove the directory entry from `src`.
-  UNIMPLEMENTED();
-
-  return res;
+  std::list<DirectoryEntry> list;
+  parse_directory(src, list);
+  list.remove_if(
+      [&filename](const DirectoryEntry &e) { return e.name == filename; });
+  return dir_list_to_string(list);
 }
 
 /**
@@ -72,48 +81,124 @@ auto rm_from_directory(std::string src, std::string filename) -> std::string {
  */
 auto read_directory(FileOperation *fs, inode_id_t id,
                     std::list<DirectoryEntry> &list) -> ChfsNullResult {
-  
-  // TODO: Implement this function.
-  UNIMPLEMENTED();
+  auto res = fs->read_file(id);
+  if (res.is_err()) {
+    return ChfsNullResult(res.unwrap_error());
+  }
 
+  const auto &content = res.value();
+  std::string src(content.begin(), content.end());
+  parse_directory(src, list);
   return KNullOk;
 }
 
 // {Your code here}
 auto FileOperation::lookup(inode_id_t id, const char *name)
     -> ChfsResult<inode_id_t> {
+  StatTimer timer(Stat::FsLookup);
   std::list<DirectoryEntry> list;
 
-  // TODO: Implement this function.
-  UNIMPLEMENTED();
-
+  auto res = read_directory(this, id, list);
+  if (res.is_err()) {
+    return ChfsResult<inode_id_t>(res.unwrap_error());
+  }
+  for (const auto &entry : list) {
+    if (entry.name == name) {
+      return ChfsResult<inode_id_t>(entry.id);
+    }
+  }
   return ChfsResult<inode_id_t>(ErrorType::NotExist);
 }
 
 // {Your code here}
 auto FileOperation::mk_helper(inode_id_t id, const char *name, InodeType type)
     -> ChfsResult<inode_id_t> {
+  StatTimer timer(type == InodeType::Directory ? Stat::FsMkdir
+                                                  : Stat::FsMkfile);
+  JournalOp op(this->journal_.get());
 
-  // TODO:
   // 1. Check if `name` already exists in the parent.
-  //    If already exist, return ErrorType::AlreadyExist.
+  auto content_res = this->read_file(id);
+  if (content_res.is_err()) {
+    return ChfsResult<inode_id_t>(content_res.unwrap_error());
+  }
+  auto content = std::move(content_res).unwrap();
+  std::string src(content.begin(), content.end());
+
+  std::list<DirectoryEntry> list;
+  parse_directory(src, list);
+  for (const auto &entry : list) {
+    if (entry.name == name) {
+      return ChfsResult<inode_id_t>(ErrorType::AlreadyExist);
+    }
+  }
+
   // 2. Create the new inode.
-  // 3. Append the new entry to the parent directory.
-  UNIMPLEMENTED();
+  auto inode_res = this->alloc_inode(type);
+  if (inode_res.is_err()) {
+    return inode_res;
+  }
+  if (this->compress_new_files_ && type == InodeType::FILE) {
+    auto res = this->set_compression(inode_res.unwrap(), true);
+    if (res.is_err()) {
+      // the inode is leaked if it cannot be removed, fsck reclaims it
+      static_cast<void>(this->remove_file(inode_res.unwrap()));
+      return ChfsResult<inode_id_t>(res.unwrap_error());
+    }
+  }
 
-  return ChfsResult<inode_id_t>(static_cast<inode_id_t>(0));
+  // 3. Append the new entry to the parent directory.
+  src = append_to_directory(src, name, inode_res.unwrap());
+  auto write_res =
+      this->write_file(id, std::vector<u8>(src.begin(), src.end()));
+  if (write_res.is_err()) {
+    static_cast<void>(this->remove_file(inode_res.unwrap()));
+    return ChfsResult<inode_id_t>(write_res.unwrap_error());
+  }
+  return inode_res;
 }
 
 // {Your code here}
 auto FileOperation::unlink(inode_id_t parent, const char *name)
     -> ChfsNullResult {
+  StatTimer timer(Stat::FsUnlink);
+  JournalOp op(this->journal_.get());
+
+  auto id_res = this->lookup(parent, name);
+  if (id_res.is_err()) {
+    return ChfsNullResult(id_res.unwrap_error());
+  }
+
+  auto type_res = this->gettype(id_res.unwrap());
+  if (type_res.is_err()) {
+    return ChfsNullResult(type_res.unwrap_error());
+  }
+  if (type_res.unwrap() == InodeType::Directory) {
+    std::list<DirectoryEntry> list;
+    auto res = read_directory(this, id_res.unwrap(), list);
+    if (res.is_err()) {
+      return res;
+    }
+    if (!list.empty()) {
+      return ChfsNullResult(ErrorType::NotEmpty);
+    }
+  }
+
+  // 1. Remove the file
+  auto res = this->remove_file(id_res.unwrap());
+  if (res.is_err()) {
+    return res;
+  }
 
-  // TODO: 
-  // 1. Remove the file, you can use the function `remove_file`
   // 2. Remove the entry from the directory.
-  UNIMPLEMENTED();
-  
-  return KNullOk;
+  auto content_res = this->read_file(parent);
+  if (content_res.is_err()) {
+    return ChfsNullResult(content_res.unwrap_error());
+  }
+  auto content = std::move(content_res).unwrap();
+  auto src = rm_from_directory(std::string(content.begin(), content.end()),
+                               name);
+  return this->write_file(parent, std::vector<u8>(src.begin(), src.end()));
 }
 
 } // namespace chfs
@@ -0,0 +1,774 @@
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <thread>
+#include <unordered_set>
+
+#include "block/checksum.h"
+#include "filesystem/directory_op.h"
+#include "filesystem/fsck.h"
+
+namespace chfs {
+
+// The state of an inode found by the check
+enum class FsckInodeState : u8 {
+  Free = 0,
+  File = 1,
+  Directory = 2,
+  Bad = 3,
+};
+
+/**
+ * Run `f(task)` for the tasks in [0, task_cnt) with a pool of threads.
+ * The tasks are handed out one at a time, so that the threads are kept busy
+ * even if some ranges are much more crowded than others.
+ */
+template <typename F>
+static auto parallel_for(usize task_cnt, usize threads, F f) -> void {
+  std::atomic<usize> next(0);
+  std::vector<std::thread> pool;
+  for (usize i = 0; i < std::min(threads, task_cnt); i++) {
+    pool.emplace_back([&next, &f, task_cnt]() {
+      for (auto task = next++; task < task_cnt; task = next++) {
+        f(task);
+      }
+    });
+  }
+  for (auto &thread : pool) {
+    thread.join();
+  }
+}
+
+Fsck::Fsck(std::shared_ptr<BlockManager> bm,
+           std::shared_ptr<SuperBlock> super_block, inode_id_t root)
+    : bm(bm), super_block(super_block), root(root) {
+  const auto block_size = bm->block_size();
+  const auto bits_per_block = block_size * KBitsPerByte;
+  const auto inode_per_block = block_size / sizeof(block_id_t);
+
+  // the same layout as `InodeManager` and `BlockAllocator`
+  this->max_inode = super_block->get_ninodes();
+  this->n_table_blocks =
+      (this->max_inode + inode_per_block - 1) / inode_per_block;
+  this->inode_bitmap_start = 1 + this->n_table_blocks;
+  this->block_bitmap_start =
+      this->inode_bitmap_start + this->max_inode / bits_per_block;
+  this->n_block_bitmap_blocks =
+      (bm->total_blocks() + bits_per_block - 1) / bits_per_block;
+  this->data_start = this->block_bitmap_start + this->n_block_bitmap_blocks;
+
+  if (super_block->get_refcount_blocks() != 0) {
+    this->refcount = std::make_unique<RefcountTable>(
+        bm, super_block->get_refcount_start(),
+        super_block->get_refcount_blocks());
+  }
+}
+
+auto Fsck::open(std::shared_ptr<BlockManager> bm, inode_id_t root)
+    -> ChfsResult<std::shared_ptr<Fsck>> {
+  auto super_block_res = SuperBlock::create_from_existing(bm, 0);
+  if (super_block_res.is_err()) {
+    return ChfsResult<std::shared_ptr<Fsck>>(super_block_res.unwrap_error());
+  }
+  auto super_block = super_block_res.unwrap();
+  if (!super_block->is_valid()) {
+    return ChfsResult<std::shared_ptr<Fsck>>(ErrorType::INVALID);
+  }
+
+  // the untouched metadata blocks are treated as zeros
+  if (super_block->get_lazy_zero_blocks() != 0 &&
+      bm->enable_lazy_zero(0, KLazyFlagOffset,
+                           super_block->get_lazy_zero_blocks(), false) !=
+          super_block->get_lazy_zero_blocks()) {
+    return ChfsResult<std::shared_ptr<Fsck>>(ErrorType::INVALID);
+  }
+
+  // The replay ends with a checkpoint, so the journal can be detached: the
+  // check reads the blocks in place, and the repair writes them in place.
+  if (super_block->get_journal_blocks() != 0) {
+    auto journal_res = Journal::open(bm, super_block->get_journal_start(),
+                                     super_block->get_journal_blocks());
+    if (journal_res.is_err()) {
+      return ChfsResult<std::shared_ptr<Fsck>>(journal_res.unwrap_error());
+    }
+    bm->set_journal(nullptr);
+  }
+
+  return ChfsResult<std::shared_ptr<Fsck>>(
+      std::shared_ptr<Fsck>(new Fsck(bm, super_block, root)));
+}
+
+auto Fsck::is_data_block(block_id_t block_id) const -> bool {
+  const auto journal_start = this->super_block->get_journal_start();
+  return block_id >= this->data_start && block_id < this->bm->total_blocks() &&
+         block_id - journal_start >= this->super_block->get_journal_blocks();
+}
+
+auto Fsck::table_entry(inode_id_t id) const -> std::pair<block_id_t, usize> {
+  const auto inode_per_block = this->bm->block_size() / sizeof(block_id_t);
+  const auto raw_id = id - 1;
+  return {1 + raw_id / inode_per_block,
+          raw_id % inode_per_block * sizeof(block_id_t)};
+}
+
+auto Fsck::check(usize threads) -> ChfsResult<FsckReport> {
+  const auto block_size = this->bm->block_size();
+  const auto inode_per_block = block_size / sizeof(block_id_t);
+  const auto total_blocks = this->bm->total_blocks();
+  FsckReport report;
+
+  // 1. the metadata and the journal are always in use, and so are the
+  // reference counters, the frozen tables of the snapshots and the
+  // fingerprint index
+  this->used = std::make_unique<ConcurrentBitmap>(total_blocks);
+  for (block_id_t i = 0; i < this->data_start; i++) {
+    this->used->test_and_set(i);
+  }
+  for (usize i = 0; i < this->super_block->get_journal_blocks(); i++) {
+    this->used->test_and_set(this->super_block->get_journal_start() + i);
+  }
+
+  std::vector<block_id_t> snapshot_tables;
+  if (this->refcount != nullptr) {
+    for (usize i = 0; i < this->refcount->region_blocks(); i++) {
+      this->used->test_and_set(this->refcount->region_start() + i);
+    }
+    this->used->test_and_set(this->super_block->get_snapshot_block());
+
+    std::vector<u8> list(block_size);
+    auto res = this->bm->read_block(this->super_block->get_snapshot_block(),
+                                    list.data());
+    if (res.is_err()) {
+      return ChfsResult<FsckReport>(res.unwrap_error());
+    }
+    auto entries = reinterpret_cast<SnapshotEntry *>(list.data());
+    for (usize i = 0; i < block_size / sizeof(SnapshotEntry); i++) {
+      if (entries[i].table_start == 0) {
+        continue;
+      }
+      snapshot_tables.push_back(entries[i].table_start);
+      // the frozen inode table and inode bitmap
+      for (block_id_t j = 0; j < this->block_bitmap_start - 1; j++) {
+        this->used->test_and_set(entries[i].table_start + j);
+      }
+    }
+  }
+  for (usize i = 0; i < this->super_block->get_dedup_blocks(); i++) {
+    this->used->test_and_set(this->super_block->get_dedup_start() + i);
+  }
+  for (usize i = 0; i < this->super_block->get_checksum_blocks(); i++) {
+    this->used->test_and_set(this->super_block->get_checksum_start() + i);
+  }
+
+  auto read_inode_bitmap = [&](block_id_t table_start,
+                               std::vector<u8> &inode_bitmap) {
+    inode_bitmap.resize(this->max_inode / KBitsPerByte);
+    for (usize i = 0; i < inode_bitmap.size() / block_size; i++) {
+      auto res = this->bm->read_block(table_start + this->n_table_blocks + i,
+                                      inode_bitmap.data() + i * block_size);
+      if (res.is_err()) {
+        return res;
+      }
+    }
+    return KNullOk;
+  };
+  std::vector<u8> inode_bitmap;
+  auto bitmap_res = read_inode_bitmap(1, inode_bitmap);
+  if (bitmap_res.is_err()) {
+    return ChfsResult<FsckReport>(bitmap_res.unwrap_error());
+  }
+  auto live_allocated = Bitmap(inode_bitmap.data(), inode_bitmap.size());
+
+  // 2. check the inodes and claim their blocks, a table block at a time
+  std::vector<FsckInodeState> states(this->max_inode, FsckInodeState::Free);
+  std::vector<std::vector<inode_id_t>> bad(this->n_table_blocks);
+  std::vector<std::vector<FsckSharedBlock>> shared(this->n_table_blocks);
+  std::vector<std::map<inode_id_t, std::list<DirectoryEntry>>> dirs(
+      this->n_table_blocks);
+  std::atomic<u64> inode_cnt(0);
+
+  // The inodes of a snapshot only claim their blocks, the live inodes are
+  // checked further
+  auto check_table_block = [&](block_id_t table_start, Bitmap &allocated,
+                               bool live, usize task) {
+    std::vector<u8> table(block_size);
+    std::vector<u8> inode(block_size);
+    std::vector<u8> indirect(block_size);
+    std::vector<std::pair<usize, block_id_t>> claims;
+    auto inode_p = reinterpret_cast<Inode *>(inode.data());
+    auto indirect_p = reinterpret_cast<block_id_t *>(indirect.data());
+
+    if (this->bm->read_block(table_start + task, table.data()).is_err()) {
+      return;
+    }
+    const auto begin = task * inode_per_block;
+    const auto end = std::min(begin + inode_per_block, this->max_inode);
+    for (auto raw_id = begin; raw_id < end; raw_id++) {
+      if (!allocated.check(raw_id)) {
+        continue;
+      }
+      inode_cnt += live;
+      const inode_id_t id = raw_id + 1;
+      const auto inode_block =
+          reinterpret_cast<block_id_t *>(table.data())[raw_id - begin];
+
+      // 2.1 collect the blocks claimed by the inode, they are claimed only
+      // if all of them are valid
+      claims.clear();
+      claims.emplace_back(KFsckInodeBlock, inode_block);
+      bool valid = this->is_data_block(inode_block) &&
+                   this->bm->read_block(inode_block, inode.data()).is_ok();
+      valid = valid &&
+              (inode_p->get_type() == InodeType::FILE ||
+               inode_p->get_type() == InodeType::Directory) &&
+              inode_p->get_nblocks() ==
+                  (block_size - sizeof(Inode)) / sizeof(block_id_t) &&
+              inode_p->get_size() <= inode_p->max_file_sz_supported();
+
+      // the clusters of a compressed file are indexed by its first block
+      u64 stored_size = valid ? inode_p->get_size() : 0;
+      if (valid && inode_p->is_compressed() && stored_size != 0) {
+        valid = this->is_data_block(inode_p->blocks[0]) &&
+                this->bm->read_block(inode_p->blocks[0], indirect.data())
+                    .is_ok();
+        stored_size =
+            valid ? ClusterIndex::stored_blocks(indirect.data(), block_size) *
+                        block_size
+                  : 0;
+        valid = valid && stored_size <= inode_p->max_file_sz_supported();
+      }
+      const auto nblocks = (stored_size + block_size - 1) / block_size;
+      const auto direct_cnt = valid ? inode_p->get_direct_block_num() : 0;
+      for (usize idx = 0; valid && idx < nblocks; idx++) {
+        if (idx == direct_cnt) {
+          const auto indirect_block = inode_p->blocks[direct_cnt];
+          claims.emplace_back(KFsckIndirectBlock, indirect_block);
+          valid = this->is_data_block(indirect_block) &&
+                  this->bm->read_block(indirect_block, indirect.data())
+                      .is_ok();
+          if (!valid) {
+            break;
+          }
+        }
+        const auto block_id = idx < direct_cnt
+                                  ? inode_p->blocks[idx]
+                                  : indirect_p[idx - direct_cnt];
+        claims.emplace_back(idx, block_id);
+        valid = this->is_data_block(block_id);
+      }
+
+      if (!valid && live) {
+        states[raw_id] = FsckInodeState::Bad;
+        bad[task].push_back(id);
+      }
+      if (!valid) {
+        continue;
+      }
+
+      // 2.2 claim the blocks. A block shared with the snapshots is claimed
+      // again legitimately, but the blocks it points to are claimed through
+      // it only once.
+      bool skip_indirect = false;
+      for (auto &[idx, block_id] : claims) {
+        const bool in_indirect = idx >= direct_cnt && idx < KFsckIndirectBlock;
+        if ((in_indirect && skip_indirect) ||
+            !this->used->test_and_set(block_id)) {
+          continue;
+        }
+        // an unreadable counter is taken as not shared, so the block is
+        // copied rather than left cross-linked
+        bool counted = false;
+        if (this->refcount != nullptr) {
+          auto shared_res = this->refcount->is_shared(block_id);
+          counted = shared_res.is_ok() && shared_res.unwrap();
+        }
+        if (!counted) {
+          if (live) {
+            shared[task].push_back({id, idx, block_id});
+          }
+          continue;
+        }
+        if (idx == KFsckInodeBlock) {
+          break;
+        }
+        skip_indirect = skip_indirect || idx == KFsckIndirectBlock;
+      }
+
+      if (!live) {
+        continue;
+      }
+      if (inode_p->get_type() == InodeType::FILE) {
+        states[raw_id] = FsckInodeState::File;
+        continue;
+      }
+
+      // 2.3 parse the directory, its entries are checked later
+      states[raw_id] = FsckInodeState::Directory;
+      std::string content;
+      std::vector<u8> buffer(block_size);
+      for (usize i = 1; i < claims.size(); i++) {
+        if (claims[i].first == KFsckIndirectBlock) {
+          continue;
+        }
+        this->bm->read_block(claims[i].second, buffer.data()).unwrap();
+        content.append(buffer.begin(), buffer.end());
+      }
+      content.resize(inode_p->get_size());
+      parse_directory(content, dirs[task][id]);
+    }
+  };
+
+  parallel_for(this->n_table_blocks, threads, [&](usize task) {
+    check_table_block(1, live_allocated, true, task);
+  });
+  for (auto table_start : snapshot_tables) {
+    std::vector<u8> snapshot_bitmap;
+    bitmap_res = read_inode_bitmap(table_start, snapshot_bitmap);
+    if (bitmap_res.is_err()) {
+      return ChfsResult<FsckReport>(bitmap_res.unwrap_error());
+    }
+    auto snapshot_allocated =
+        Bitmap(snapshot_bitmap.data(), snapshot_bitmap.size());
+    parallel_for(this->n_table_blocks, threads, [&](usize task) {
+      check_table_block(table_start, snapshot_allocated, false, task);
+    });
+  }
+  report.inodes = inode_cnt;
+
+  // 3. walk the directory tree from the root
+  if (this->root == KInvalidInodeID || this->root > this->max_inode ||
+      states[this->root - 1] != FsckInodeState::Directory) {
+    return ChfsResult<FsckReport>(ErrorType::INVALID);
+  }
+
+  std::map<inode_id_t, std::list<DirectoryEntry> *> entries;
+  for (auto &part : dirs) {
+    for (auto &[id, list] : part) {
+      entries.emplace(id, &list);
+    }
+  }
+
+  auto is_valid = [&states, this](inode_id_t id) {
+    return id != KInvalidInodeID && id <= this->max_inode &&
+           (states[id - 1] == FsckInodeState::File ||
+            states[id - 1] == FsckInodeState::Directory);
+  };
+  for (auto &[dir, list] : entries) {
+    for (auto &entry : *list) {
+      if (!is_valid(entry.id)) {
+        report.dangling_entries.push_back({dir, entry.name, entry.id});
+      }
+    }
+  }
+
+  std::vector<bool> reached(this->max_inode, false);
+  std::vector<inode_id_t> queue = {this->root};
+  reached[this->root - 1] = true;
+  while (!queue.empty()) {
+    auto dir = queue.back();
+    queue.pop_back();
+    for (auto &entry : *entries[dir]) {
+      if (is_valid(entry.id) && !reached[entry.id - 1]) {
+        reached[entry.id - 1] = true;
+        if (states[entry.id - 1] == FsckInodeState::Directory) {
+          queue.push_back(entry.id);
+        }
+      }
+    }
+  }
+
+  for (u64 raw_id = 0; raw_id < this->max_inode; raw_id++) {
+    if (is_valid(raw_id + 1) && !reached[raw_id]) {
+      report.orphan_inodes.push_back(raw_id + 1);
+    }
+  }
+  for (usize i = 0; i < this->n_table_blocks; i++) {
+    report.bad_inodes.insert(report.bad_inodes.end(), bad[i].begin(),
+                             bad[i].end());
+    report.shared_blocks.insert(report.shared_blocks.end(), shared[i].begin(),
+                                shared[i].end());
+  }
+
+  // 4. compare the block bitmap with the claimed blocks
+  const auto bits_per_block = block_size * KBitsPerByte;
+  std::vector<std::vector<block_id_t>> leaked(this->n_block_bitmap_blocks);
+  std::vector<std::vector<block_id_t>> unmarked(this->n_block_bitmap_blocks);
+  std::atomic<u64> used_cnt(0);
+  std::atomic<u64> free_cnt(0);
+
+  parallel_for(this->n_block_bitmap_blocks, threads, [&](usize task) {
+    std::vector<u8> buffer(block_size);
+    this->bm->read_block(this->block_bitmap_start + task, buffer.data())
+        .unwrap();
+    auto bitmap = Bitmap(buffer.data(), block_size);
+
+    const block_id_t begin = task * bits_per_block;
+    const block_id_t end =
+        std::min<usize>(begin + bits_per_block, total_blocks);
+    u64 used_in_task = 0;
+    u64 free_in_task = 0;
+    for (auto block_id = begin; block_id < end; block_id++) {
+      const bool marked = bitmap.check(block_id - begin);
+      const bool in_use = this->used->check(block_id);
+      used_in_task += in_use;
+      free_in_task += !marked;
+      if (marked && !in_use) {
+        leaked[task].push_back(block_id);
+      } else if (!marked && in_use) {
+        unmarked[task].push_back(block_id);
+      }
+    }
+    used_cnt += used_in_task;
+    free_cnt += free_in_task;
+  });
+
+  for (usize i = 0; i < this->n_block_bitmap_blocks; i++) {
+    report.leaked_blocks.insert(report.leaked_blocks.end(), leaked[i].begin(),
+                                leaked[i].end());
+    report.unmarked_blocks.insert(report.unmarked_blocks.end(),
+                                  unmarked[i].begin(), unmarked[i].end());
+  }
+  report.used_blocks = used_cnt;
+  report.bad_free_counter = !this->super_block->is_dirty() &&
+                            this->super_block->get_free_blocks() != free_cnt;
+
+  // 5. verify the blocks with their checksums, a checksum block at a time.
+  // The checksums are not journaled, so they are stale after a crash.
+  const auto checksum_start = this->super_block->get_checksum_start();
+  const auto checksum_blocks = this->super_block->get_checksum_blocks();
+  if (checksum_blocks != 0 && !this->super_block->is_dirty()) {
+    const auto per_block = block_size / sizeof(u32);
+    std::vector<std::vector<block_id_t>> corrupted(checksum_blocks);
+    parallel_for(checksum_blocks, threads, [&](usize task) {
+      std::vector<u8> checksums(block_size);
+      std::vector<u8> buffer(block_size);
+      if (this->bm->read_block(checksum_start + task, checksums.data())
+              .is_err()) {
+        return;
+      }
+      const block_id_t begin = task * per_block;
+      const block_id_t end = std::min<usize>(begin + per_block, total_blocks);
+      for (auto block_id = begin; block_id < end; block_id++) {
+        if (block_id - checksum_start < checksum_blocks) {
+          continue;
+        }
+        auto res = this->bm->read_block(block_id, buffer.data());
+        if (res.is_err() ||
+            crc32c(buffer.data(), block_size) !=
+                reinterpret_cast<u32 *>(checksums.data())[block_id - begin]) {
+          corrupted[task].push_back(block_id);
+        }
+      }
+    });
+    for (auto &part : corrupted) {
+      report.corrupted_blocks.insert(report.corrupted_blocks.end(),
+                                     part.begin(), part.end());
+    }
+  }
+
+  return ChfsResult<FsckReport>(report);
+}
+
+auto Fsck::allocate_block() -> ChfsResult<block_id_t> {
+  for (auto block_id = this->data_start; block_id < this->bm->total_blocks();
+       block_id++) {
+    if (this->is_data_block(block_id) && !this->used->test_and_set(block_id)) {
+      return ChfsResult<block_id_t>(block_id);
+    }
+  }
+  return ChfsResult<block_id_t>(ErrorType::OUT_OF_RESOURCE);
+}
+
+auto Fsck::copy_block(block_id_t block_id) -> ChfsResult<block_id_t> {
+  auto res = this->allocate_block();
+  if (res.is_err()) {
+    return res;
+  }
+
+  std::vector<u8> buffer(this->bm->block_size());
+  auto read_res = this->bm->read_block(block_id, buffer.data());
+  if (read_res.is_ok()) {
+    read_res = this->bm->write_block(res.unwrap(), buffer.data());
+  }
+  if (read_res.is_err()) {
+    return ChfsResult<block_id_t>(read_res.unwrap_error());
+  }
+  return res;
+}
+
+auto Fsck::repair(const FsckReport &report) -> ChfsNullResult {
+  CHFS_ASSERT(this->used != nullptr, "Check the filesystem before repairing");
+  const auto block_size = this->bm->block_size();
+  std::vector<u8> buffer(block_size);
+
+  // 1. free the bad inodes, their blocks are not claimed
+  for (auto id : report.bad_inodes) {
+    auto [table_block, offset] = this->table_entry(id);
+    const block_id_t invalid = KInvalidBlockID;
+    auto res = this->bm->write_partial_block(
+        table_block, reinterpret_cast<const u8 *>(&invalid), offset,
+        sizeof(block_id_t));
+    if (res.is_err()) {
+      return res;
+    }
+
+    const auto raw_id = id - 1;
+    const auto bitmap_block =
+        this->inode_bitmap_start + raw_id / (block_size * KBitsPerByte);
+    res = this->bm->read_block(bitmap_block, buffer.data());
+    if (res.is_err()) {
+      return res;
+    }
+    Bitmap(buffer.data(), block_size).clear(raw_id % (block_size * KBitsPerByte));
+    res = this->bm->write_block(bitmap_block, buffer.data());
+    if (res.is_err()) {
+      return res;
+    }
+  }
+
+  // 2. give a copy of the shared blocks to their later claims
+  auto res = this->repair_shared_blocks(report);
+  if (res.is_err()) {
+    return res;
+  }
+
+  // 3. rebuild the block bitmap from the claimed blocks
+  const auto bits_per_block = block_size * KBitsPerByte;
+  const auto total_blocks = this->bm->total_blocks();
+  u64 used_cnt = 0;
+  for (usize i = 0; i < this->n_block_bitmap_blocks; i++) {
+    res = this->bm->read_block(this->block_bitmap_start + i, buffer.data());
+    if (res.is_err()) {
+      return res;
+    }
+
+    std::vector<u8> rebuilt(block_size, 0);
+    auto bitmap = Bitmap(rebuilt.data(), block_size);
+    const block_id_t begin = i * bits_per_block;
+    const block_id_t end =
+        std::min<usize>(begin + bits_per_block, total_blocks);
+    for (auto block_id = begin; block_id < end; block_id++) {
+      if (this->used->check(block_id)) {
+        bitmap.set(block_id - begin);
+        used_cnt++;
+      }
+    }
+    if (rebuilt != buffer) {
+      res = this->bm->write_block(this->block_bitmap_start + i,
+                                  rebuilt.data());
+      if (res.is_err()) {
+        return res;
+      }
+    }
+  }
+
+  // 4. the fingerprint index may refer to the blocks freed or copied above
+  if (this->super_block->get_dedup_blocks() != 0) {
+    res = FingerprintIndex(this->bm, this->super_block->get_dedup_start(),
+                           this->super_block->get_dedup_blocks())
+              .format();
+    if (res.is_err()) {
+      return res;
+    }
+  }
+
+  // 5. the blocks are written in place above, and the corrupted ones are
+  // accepted as they are
+  if (this->super_block->get_checksum_blocks() != 0) {
+    res = this->bm->enable_checksum(this->super_block->get_checksum_start(),
+                                    this->super_block->get_checksum_blocks(),
+                                    true);
+    if (res.is_err()) {
+      return res;
+    }
+  }
+
+  // 6. the free block counter is exact now, so the filesystem is mounted
+  // without scanning the bitmap
+  this->super_block->mark_clean(total_blocks - used_cnt);
+  res = this->super_block->flush(0);
+  if (res.is_ok()) {
+    res = this->bm->sync(0, total_blocks);
+  }
+  if (res.is_err()) {
+    return res;
+  }
+
+  return this->repair_namespace(report);
+}
+
+auto Fsck::repair_shared_blocks(const FsckReport &report) -> ChfsNullResult {
+  const auto block_size = this->bm->block_size();
+  std::vector<u8> table(block_size);
+  std::vector<u8> inode(block_size);
+  std::vector<u8> indirect(block_size);
+  auto inode_p = reinterpret_cast<Inode *>(inode.data());
+  auto indirect_p = reinterpret_cast<block_id_t *>(indirect.data());
+
+  std::map<inode_id_t, std::vector<usize>> claims;
+  for (auto &shared : report.shared_blocks) {
+    claims[shared.inode].push_back(shared.idx);
+  }
+
+  for (auto &[id, indices] : claims) {
+    // the inode block goes first, then the indirect block, since the data
+    // block ids are updated in their copies
+    std::sort(indices.begin(), indices.end(), std::greater<usize>());
+
+    auto [table_block, offset] = this->table_entry(id);
+    auto res = this->bm->read_block(table_block, table.data());
+    if (res.is_err()) {
+      return res;
+    }
+    auto &inode_block =
+        *reinterpret_cast<block_id_t *>(table.data() + offset);
+
+    usize i = 0;
+    if (indices[i] == KFsckInodeBlock) {
+      auto copy_res = this->copy_block(inode_block);
+      if (copy_res.is_err()) {
+        return ChfsNullResult(copy_res.unwrap_error());
+      }
+      inode_block = copy_res.unwrap();
+      res = this->bm->write_block(table_block, table.data());
+      if (res.is_err()) {
+        return res;
+      }
+      i++;
+    }
+
+    res = this->bm->read_block(inode_block, inode.data());
+    if (res.is_err()) {
+      return res;
+    }
+    const auto direct_cnt = inode_p->get_direct_block_num();
+    auto &indirect_block = (*inode_p)[direct_cnt];
+    if (i < indices.size() && indices[i] == KFsckIndirectBlock) {
+      auto copy_res = this->copy_block(indirect_block);
+      if (copy_res.is_err()) {
+        return ChfsNullResult(copy_res.unwrap_error());
+      }
+      indirect_block = copy_res.unwrap();
+      i++;
+    }
+
+    bool indirect_dirty = false;
+    if (i < indices.size() && indices[i] >= direct_cnt) {
+      res = this->bm->read_block(indirect_block, indirect.data());
+      if (res.is_err()) {
+        return res;
+      }
+    }
+    for (; i < indices.size(); i++) {
+      const auto idx = indices[i];
+      auto &block_id = idx < direct_cnt ? (*inode_p)[idx]
+                                        : indirect_p[idx - direct_cnt];
+      auto copy_res = this->copy_block(block_id);
+      if (copy_res.is_err()) {
+        return ChfsNullResult(copy_res.unwrap_error());
+      }
+      block_id = copy_res.unwrap();
+      indirect_dirty = indirect_dirty || idx >= direct_cnt;
+    }
+
+    if (indirect_dirty) {
+      res = this->bm->write_block(indirect_block, indirect.data());
+      if (res.is_err()) {
+        return res;
+      }
+    }
+    res = this->bm->write_block(inode_block, inode.data());
+    if (res.is_err()) {
+      return res;
+    }
+  }
+  return KNullOk;
+}
+
+auto Fsck::repair_namespace(const FsckReport &report) -> ChfsNullResult {
+  if (report.dangling_entries.empty() && report.orphan_inodes.empty()) {
+    return KNullOk;
+  }
+
+  auto fs_res = FileOperation::create_from_raw(this->bm);
+  if (fs_res.is_err()) {
+    return ChfsNullResult(fs_res.unwrap_error());
+  }
+  auto fs = fs_res.unwrap();
+
+  // 1. remove the dangling entries
+  std::map<inode_id_t, std::vector<const FsckDanglingEntry *>> dangling;
+  for (auto &entry : report.dangling_entries) {
+    dangling[entry.dir].push_back(&entry);
+  }
+  for (auto &[dir, removed] : dangling) {
+    std::list<DirectoryEntry> list;
+    auto res = read_directory(fs.get(), dir, list);
+    if (res.is_err()) {
+      return res;
+    }
+    list.remove_if([&removed](const DirectoryEntry &entry) {
+      return std::any_of(removed.begin(), removed.end(),
+                         [&entry](const FsckDanglingEntry *e) {
+                           return e->name == entry.name && e->id == entry.id;
+                         });
+    });
+    auto content = dir_list_to_string(list);
+    res = fs->write_file(dir, std::vector<u8>(content.begin(), content.end()));
+    if (res.is_err()) {
+      return res;
+    }
+  }
+
+  // 2. reconnect the orphans not referred by other orphan directories, the
+  // rest are reachable from them
+  std::unordered_set<inode_id_t> referred;
+  for (auto id : report.orphan_inodes) {
+    if (fs->gettype(id).unwrap() != InodeType::Directory) {
+      continue;
+    }
+    std::list<DirectoryEntry> list;
+    auto res = read_directory(fs.get(), id, list);
+    if (res.is_err()) {
+      return res;
+    }
+    for (auto &entry : list) {
+      if (entry.id != id) {
+        referred.insert(entry.id);
+      }
+    }
+  }
+
+  if (!report.orphan_inodes.empty()) {
+    auto lost_found_res = fs->lookup(this->root, "lost+found");
+    if (lost_found_res.is_err()) {
+      lost_found_res = fs->mkdir(this->root, "lost+found");
+    }
+    if (lost_found_res.is_err()) {
+      return ChfsNullResult(lost_found_res.unwrap_error());
+    }
+    const auto lost_found = lost_found_res.unwrap();
+
+    auto content_res = fs->read_file(lost_found);
+    if (content_res.is_err()) {
+      return ChfsNullResult(content_res.unwrap_error());
+    }
+    auto raw_content = std::move(content_res).unwrap();
+    std::string content(raw_content.begin(), raw_content.end());
+    for (auto id : report.orphan_inodes) {
+      if (referred.count(id) == 0) {
+        content = append_to_directory(content, "#" + std::to_string(id), id);
+      }
+    }
+    auto res = fs->write_file(lost_found,
+                              std::vector<u8>(content.begin(), content.end()));
+    if (res.is_err()) {
+      return res;
+    }
+  }
+
+  return fs->unmount();
+}
+
+} // namespace chfs
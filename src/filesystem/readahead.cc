@@ -0,0 +1,32 @@
+#include <algorithm>
+
+#include "filesystem/readahead.h"
+
+namespace chfs {
+
+auto ReadaheadWindow::on_read(u64 offset, u64 len) -> std::pair<u64, u64> {
+  const auto end = offset + len;
+  if (offset != this->next_offset) {
+    this->next_offset = end;
+    this->window = 0;
+    this->ahead_end = 0;
+    return {end, 0};
+  }
+
+  this->next_offset = end;
+  if (this->window == 0) {
+    this->window = this->min_window;
+  } else if (this->ahead_end > end &&
+             this->ahead_end - end >= this->window / 2) {
+    // enough is still ahead of the stream
+    return {this->ahead_end, 0};
+  } else {
+    this->window = std::min(this->window * 2, this->max_window);
+  }
+
+  const auto from = std::max(this->ahead_end, end);
+  this->ahead_end = end + this->window;
+  return {from, this->ahead_end - from};
+}
+
+} // namespace chfs
@@ -0,0 +1,606 @@
+#include <algorithm>
+#include <ctime>
+#include <functional>
+
+#include "common/bitmap.h"
+#include "filesystem/operations.h"
+#include "metadata/superblock.h"
+
+namespace chfs {
+
+/**
+ * Visit the inode block of every allocated inode in an inode table
+ */
+static auto for_each_inode_block(std::shared_ptr<BlockManager> bm,
+                                 block_id_t table_start, usize table_blocks,
+                                 usize bitmap_blocks,
+                                 const std::function<ChfsNullResult(block_id_t)>
+                                     &visit) -> ChfsNullResult {
+  const auto block_size = bm->block_size();
+  const auto inode_per_block = block_size / sizeof(block_id_t);
+  const auto bits_per_block = block_size * KBitsPerByte;
+
+  std::vector<u8> bitmap_block(block_size);
+  std::vector<u8> table_block(block_size);
+  block_id_t loaded_table = KInvalidBlockID;
+  for (usize i = 0; i < bitmap_blocks; i++) {
+    auto res =
+        bm->read_block(table_start + table_blocks + i, bitmap_block.data());
+    if (res.is_err()) {
+      return res;
+    }
+
+    auto bitmap = Bitmap(bitmap_block.data(), block_size);
+    for (usize bit = 0; bit < bits_per_block; bit++) {
+      if (!bitmap.check(bit)) {
+        continue;
+      }
+      const auto raw_id = i * bits_per_block + bit;
+      const auto table = table_start + raw_id / inode_per_block;
+      if (table != loaded_table) {
+        res = bm->read_block(table, table_block.data());
+        if (res.is_err()) {
+          return res;
+        }
+        loaded_table = table;
+      }
+
+      res = visit(reinterpret_cast<block_id_t *>(
+          table_block.data())[raw_id % inode_per_block]);
+      if (res.is_err()) {
+        return res;
+      }
+    }
+  }
+  return KNullOk;
+}
+
+auto FileOperation::create_from_snapshot(std::shared_ptr<BlockManager> bm,
+                                         u32 id)
+    -> ChfsResult<std::shared_ptr<FileOperation>> {
+  auto superblock_res = SuperBlock::create_from_existing(bm, 0);
+  if (superblock_res.is_err()) {
+    return ChfsResult<std::shared_ptr<FileOperation>>(
+        superblock_res.unwrap_error());
+  }
+  auto super_block = superblock_res.unwrap();
+  if (!super_block->is_valid()) {
+    return ChfsResult<std::shared_ptr<FileOperation>>(ErrorType::INVALID);
+  }
+  if (super_block->get_snapshot_block() == 0) {
+    return ChfsResult<std::shared_ptr<FileOperation>>(ErrorType::NotExist);
+  }
+
+  // The snapshot is committed as a whole when it is taken, so nothing needs
+  // to be replayed from the journal. It is safe even if the filesystem is in
+  // use, since the snapshot is never modified.
+  if (super_block->get_lazy_zero_blocks() != 0) {
+    bm->enable_lazy_zero(0, KLazyFlagOffset,
+                         super_block->get_lazy_zero_blocks(), false);
+  }
+  // the checksums of a filesystem in use may be stale
+  if (super_block->get_checksum_blocks() != 0 && !super_block->is_dirty()) {
+    auto res = bm->enable_checksum(super_block->get_checksum_start(),
+                                   super_block->get_checksum_blocks(), false);
+    if (res.is_err()) {
+      return ChfsResult<std::shared_ptr<FileOperation>>(res.unwrap_error());
+    }
+  }
+
+  std::vector<u8> list(bm->block_size());
+  auto read_res =
+      bm->read_block(super_block->get_snapshot_block(), list.data());
+  if (read_res.is_err()) {
+    return ChfsResult<std::shared_ptr<FileOperation>>(read_res.unwrap_error());
+  }
+  auto entries = reinterpret_cast<SnapshotEntry *>(list.data());
+  if (id >= bm->block_size() / sizeof(SnapshotEntry) ||
+      entries[id].table_start == 0) {
+    return ChfsResult<std::shared_ptr<FileOperation>>(ErrorType::NotExist);
+  }
+
+  auto inode_manager_res = InodeManager::create_from_block_manager(
+      bm, super_block->get_ninodes(), entries[id].table_start);
+  if (inode_manager_res.is_err()) {
+    return ChfsResult<std::shared_ptr<FileOperation>>(
+        inode_manager_res.unwrap_error());
+  }
+
+  // the allocator only serves the statistics
+  auto reserved_block_num = inode_manager_res.value().get_reserved_blocks();
+  auto allocator_res = BlockAllocator::create(super_block->get_allocator_type(),
+                                              bm, reserved_block_num, false);
+  if (allocator_res.is_err()) {
+    return ChfsResult<std::shared_ptr<FileOperation>>(
+        allocator_res.unwrap_error());
+  }
+  auto fs = std::shared_ptr<FileOperation>(new FileOperation(
+      bm, InodeManager::to_shared_ptr(std::move(inode_manager_res).unwrap()),
+      std::move(allocator_res).unwrap()));
+  fs->read_only_ = true;
+  return ChfsResult<std::shared_ptr<FileOperation>>(fs);
+}
+
+auto FileOperation::read_snapshot_list(std::vector<u8> &buffer)
+    -> ChfsNullResult {
+  if (this->refcount_ == nullptr || this->snapshot_block_ == 0) {
+    return ChfsNullResult(ErrorType::INVALID);
+  }
+  buffer.resize(this->block_manager_->block_size());
+  return this->block_manager_->read_block(this->snapshot_block_,
+                                          buffer.data());
+}
+
+auto FileOperation::snapshot() -> ChfsResult<u32> {
+  if (this->read_only_) {
+    return ChfsResult<u32>(ErrorType::ReadOnly);
+  }
+
+  // 1. the snapshot starts from a committed state
+  auto res = this->sync();
+  if (res.is_err()) {
+    return ChfsResult<u32>(res.unwrap_error());
+  }
+
+  std::vector<u8> list;
+  res = this->read_snapshot_list(list);
+  if (res.is_err()) {
+    return ChfsResult<u32>(res.unwrap_error());
+  }
+  auto entries = reinterpret_cast<SnapshotEntry *>(list.data());
+  const auto max_snapshots = list.size() / sizeof(SnapshotEntry);
+  u32 id = 0;
+  while (id < max_snapshots && entries[id].table_start != 0) {
+    id++;
+  }
+  if (id == max_snapshots) {
+    return ChfsResult<u32>(ErrorType::OUT_OF_RESOURCE);
+  }
+
+  JournalOp op(this->journal_.get());
+
+  // 2. freeze the inode table and the inode bitmap. The copy is written in
+  // place, it becomes visible once the list entry is committed.
+  const auto table_blocks = this->inode_manager_->n_table_blocks;
+  const auto bitmap_blocks = this->inode_manager_->n_bitmap_blocks;
+  auto start_res =
+      this->block_allocator_->allocate_contiguous(table_blocks + bitmap_blocks);
+  if (start_res.is_err()) {
+    return ChfsResult<u32>(start_res.unwrap_error());
+  }
+  const auto table_start = start_res.unwrap();
+
+  std::vector<u8> buffer(this->block_manager_->block_size());
+  for (usize i = 0; i < table_blocks + bitmap_blocks; i++) {
+    res = this->block_manager_->read_block(
+        this->inode_manager_->table_start + i, buffer.data());
+    if (res.is_ok()) {
+      res = this->block_manager_->write_block_unlogged(table_start + i,
+                                                       buffer.data());
+    }
+    if (res.is_err()) {
+      return ChfsResult<u32>(res.unwrap_error());
+    }
+  }
+
+  // 3. the inode blocks are shared by the snapshot, which shares their
+  // content through them
+  res = for_each_inode_block(this->block_manager_, table_start, table_blocks,
+                             bitmap_blocks, [this](block_id_t inode_block) {
+                               return this->refcount_->inc(inode_block);
+                             });
+  if (res.is_err()) {
+    return ChfsResult<u32>(res.unwrap_error());
+  }
+
+  // 4. publish the snapshot
+  entries[id] = SnapshotEntry{table_start, static_cast<u64>(time(0))};
+  res = this->block_manager_->write_block(this->snapshot_block_, list.data());
+  if (res.is_ok()) {
+    res = this->commit_journal();
+  }
+  if (res.is_err()) {
+    return ChfsResult<u32>(res.unwrap_error());
+  }
+  return ChfsResult<u32>(id);
+}
+
+auto FileOperation::list_snapshots()
+    -> ChfsResult<std::vector<std::pair<u32, u64>>> {
+  std::vector<u8> list;
+  auto res = this->read_snapshot_list(list);
+  if (res.is_err()) {
+    return ChfsResult<std::vector<std::pair<u32, u64>>>(res.unwrap_error());
+  }
+
+  std::vector<std::pair<u32, u64>> snapshots;
+  auto entries = reinterpret_cast<SnapshotEntry *>(list.data());
+  for (u32 id = 0; id < list.size() / sizeof(SnapshotEntry); id++) {
+    if (entries[id].table_start != 0) {
+      snapshots.emplace_back(id, entries[id].time);
+    }
+  }
+  return ChfsResult<std::vector<std::pair<u32, u64>>>(std::move(snapshots));
+}
+
+auto FileOperation::delete_snapshot(u32 id) -> ChfsNullResult {
+  if (this->read_only_) {
+    return ChfsNullResult(ErrorType::ReadOnly);
+  }
+
+  std::vector<u8> list;
+  auto res = this->read_snapshot_list(list);
+  if (res.is_err()) {
+    return res;
+  }
+  auto entries = reinterpret_cast<SnapshotEntry *>(list.data());
+  if (id >= list.size() / sizeof(SnapshotEntry) ||
+      entries[id].table_start == 0) {
+    return ChfsNullResult(ErrorType::NotExist);
+  }
+  const auto table_start = entries[id].table_start;
+
+  // 1. unpublish the snapshot first. If we crash while releasing its blocks,
+  // they only leak (and fsck reclaims them).
+  {
+    JournalOp op(this->journal_.get());
+    entries[id] = SnapshotEntry{0, 0};
+    res = this->block_manager_->write_block(this->snapshot_block_, list.data());
+    if (res.is_ok()) {
+      res = this->commit_journal();
+    }
+    if (res.is_err()) {
+      return res;
+    }
+  }
+
+  // 2. release the inodes, each in its own operation to bound the transaction
+  const auto table_blocks = this->inode_manager_->n_table_blocks;
+  const auto bitmap_blocks = this->inode_manager_->n_bitmap_blocks;
+  res = for_each_inode_block(this->block_manager_, table_start, table_blocks,
+                             bitmap_blocks, [this](block_id_t inode_block) {
+                               JournalOp op(this->journal_.get());
+                               return this->release_inode_block(inode_block);
+                             });
+  if (res.is_err()) {
+    return res;
+  }
+
+  // 3. free the frozen inode table
+  JournalOp op(this->journal_.get());
+  std::vector<block_id_t> extent;
+  for (usize i = 0; i < table_blocks + bitmap_blocks; i++) {
+    extent.push_back(table_start + i);
+  }
+  res = this->block_allocator_->deallocate_batch(extent);
+  if (res.is_err()) {
+    return res;
+  }
+  return this->commit_journal();
+}
+
+auto FileOperation::clone_range(inode_id_t src, u64 src_off, inode_id_t dst,
+                                u64 dst_off, u64 len) -> ChfsNullResult {
+  if (this->read_only_) {
+    return ChfsNullResult(ErrorType::ReadOnly);
+  }
+  if (this->refcount_ == nullptr) {
+    return ChfsNullResult(ErrorType::INVALID);
+  }
+  const auto block_size = this->block_manager_->block_size();
+
+  // 1. the buffered content gets its blocks first
+  auto res = this->flush(src);
+  if (res.is_ok()) {
+    res = this->flush(dst);
+  }
+  if (res.is_err()) {
+    return res;
+  }
+  JournalOp op(this->journal_.get());
+
+  auto src_res = this->get_type_attr(src);
+  auto dst_res = this->get_type_attr(dst);
+  if (src_res.is_err() || dst_res.is_err()) {
+    return ChfsNullResult(src_res.is_err() ? src_res.unwrap_error()
+                                           : dst_res.unwrap_error());
+  }
+  if (src_res.unwrap().first != InodeType::FILE ||
+      dst_res.unwrap().first != InodeType::FILE) {
+    return ChfsNullResult(ErrorType::INVALID_ARG);
+  }
+  // the blocks of a compressed file don't map to its offsets
+  auto src_compressed = this->get_compression(src);
+  auto dst_compressed = this->get_compression(dst);
+  if (src_compressed.is_err() || dst_compressed.is_err() ||
+      src_compressed.unwrap() || dst_compressed.unwrap()) {
+    return ChfsNullResult(ErrorType::INVALID_ARG);
+  }
+  const auto src_size = src_res.unwrap().second.size;
+  auto dst_size = dst_res.unwrap().second.size;
+  if (len == 0) {
+    return KNullOk;
+  }
+  if (src_off % block_size != 0 || dst_off % block_size != 0 ||
+      src_off + len > src_size ||
+      (len % block_size != 0 &&
+       (src_off + len != src_size || dst_off + len < dst_size)) ||
+      (src == dst && src_off < dst_off + len && dst_off < src_off + len)) {
+    return ChfsNullResult(ErrorType::INVALID_ARG);
+  }
+
+  // the hole before the range is filled with zeros
+  if (dst_off > dst_size) {
+    auto resize_res = this->resize(dst, dst_off);
+    if (resize_res.is_err()) {
+      return ChfsNullResult(resize_res.unwrap_error());
+    }
+    res = this->flush(dst);
+    if (res.is_err()) {
+      return res;
+    }
+    dst_size = dst_off;
+  }
+
+  // 2. collect the blocks of the range
+  std::vector<block_id_t> blocks;
+  {
+    std::vector<u8> src_inode(block_size);
+    auto src_inode_res = this->inode_manager_->read_inode(src, src_inode);
+    if (src_inode_res.is_err()) {
+      return ChfsNullResult(src_inode_res.unwrap_error());
+    }
+    res = this->get_file_blocks(
+        reinterpret_cast<const Inode *>(src_inode.data()),
+        src_off / block_size, (src_off + len + block_size - 1) / block_size,
+        blocks);
+    if (res.is_err()) {
+      return res;
+    }
+  }
+
+  // 3. share them with the destination
+  std::vector<u8> inode(block_size);
+  std::vector<u8> indirect_block;
+  auto inode_p = reinterpret_cast<Inode *>(inode.data());
+  auto inode_res = this->inode_manager_->read_inode(dst, inode);
+  if (inode_res.is_err()) {
+    return ChfsNullResult(inode_res.unwrap_error());
+  }
+  auto inode_bid = inode_res.unwrap();
+
+  const u64 new_size = std::max(dst_size, dst_off + len);
+  if (new_size > inode_p->max_file_sz_supported()) {
+    return ChfsNullResult(ErrorType::OUT_OF_RESOURCE);
+  }
+  const usize direct_cnt = inode_p->get_direct_block_num();
+  const usize old_block_num = (dst_size + block_size - 1) / block_size;
+  const usize new_block_num = (new_size + block_size - 1) / block_size;
+  if (old_block_num > direct_cnt) {
+    indirect_block.resize(block_size);
+    res = this->block_manager_->read_block(inode_p->get_indirect_block_id(),
+                                           indirect_block.data());
+    if (res.is_err()) {
+      return res;
+    }
+  }
+
+  res = this->own_inode_blocks(dst, inode.data(), inode_bid, indirect_block,
+                               old_block_num);
+  if (res.is_err()) {
+    return res;
+  }
+  if (new_block_num > direct_cnt && old_block_num <= direct_cnt) {
+    auto alloc_res = this->block_allocator_->allocate();
+    if (alloc_res.is_err()) {
+      return ChfsNullResult(alloc_res.unwrap_error());
+    }
+    inode_p->blocks[inode_p->get_nblocks() - 1] = alloc_res.unwrap();
+    indirect_block.assign(block_size, 0);
+  }
+
+  std::vector<block_id_t> replaced;
+  auto indirect_p = reinterpret_cast<block_id_t *>(indirect_block.data());
+  const usize first = dst_off / block_size;
+  for (usize i = 0; i < blocks.size(); i++) {
+    res = this->refcount_->inc(blocks[i]);
+    if (res.is_err()) {
+      return res;
+    }
+
+    const auto idx = first + i;
+    if (inode_p->is_direct_block(idx)) {
+      if (idx < old_block_num) {
+        replaced.push_back(inode_p->blocks[idx]);
+      }
+      inode_p->set_block_direct(idx, blocks[i]);
+    } else {
+      if (idx < old_block_num) {
+        replaced.push_back(indirect_p[idx - direct_cnt]);
+      }
+      indirect_p[idx - direct_cnt] = blocks[i];
+    }
+  }
+
+  inode_p->inner_attr.size = new_size;
+  inode_p->inner_attr.set_all_time(time(0));
+  res = this->block_manager_->write_block(inode_bid, inode.data());
+  if (res.is_ok() && !indirect_block.empty()) {
+    res = inode_p->write_indirect_block(this->block_manager_, indirect_block);
+  }
+  if (res.is_err()) {
+    return res;
+  }
+
+  // 4. the replaced blocks may still be referenced elsewhere
+  return this->release_blocks(replaced);
+}
+
+auto FileOperation::release_blocks(const std::vector<block_id_t> &blocks)
+    -> ChfsNullResult {
+  if (this->refcount_ == nullptr) {
+    return this->free_after_commit(blocks);
+  }
+
+  std::vector<block_id_t> free_set;
+  for (auto block_id : blocks) {
+    auto res = this->refcount_->dec(block_id);
+    if (res.is_err()) {
+      return ChfsNullResult(res.unwrap_error());
+    }
+    if (!res.unwrap()) {
+      free_set.push_back(block_id);
+    }
+  }
+
+  // the freed blocks may be reused for another content
+  if (this->dedup_ != nullptr) {
+    std::vector<u8> buffer(this->block_manager_->block_size());
+    for (auto block_id : free_set) {
+      auto res = this->block_manager_->read_block(block_id, buffer.data());
+      if (res.is_ok()) {
+        res = this->dedup_->remove(
+            FingerprintIndex::fingerprint(buffer.data(), buffer.size()),
+            block_id);
+      }
+      if (res.is_err()) {
+        return res;
+      }
+    }
+  }
+  return this->free_after_commit(free_set);
+}
+
+auto FileOperation::free_after_commit(const std::vector<block_id_t> &blocks)
+    -> ChfsNullResult {
+  if (this->journal_ == nullptr) {
+    return this->block_allocator_->deallocate_batch(blocks);
+  }
+  this->pending_frees_->insert(this->pending_frees_->end(), blocks.begin(),
+                               blocks.end());
+  return KNullOk;
+}
+
+auto FileOperation::unshare_block(block_id_t block_id,
+                                  const std::vector<block_id_t> &children)
+    -> ChfsResult<block_id_t> {
+  for (auto child : children) {
+    auto res = this->refcount_->inc(child);
+    if (res.is_err()) {
+      return ChfsResult<block_id_t>(res.unwrap_error());
+    }
+  }
+
+  auto alloc_res = this->block_allocator_->allocate();
+  if (alloc_res.is_err()) {
+    return alloc_res;
+  }
+  // the block is shared, so it is never the last reference
+  auto dec_res = this->refcount_->dec(block_id);
+  if (dec_res.is_err()) {
+    return ChfsResult<block_id_t>(dec_res.unwrap_error());
+  }
+  return alloc_res;
+}
+
+auto FileOperation::own_inode_blocks(inode_id_t id, u8 *inode,
+                                     block_id_t &inode_bid,
+                                     const std::vector<u8> &indirect_block,
+                                     usize block_num) -> ChfsNullResult {
+  auto inode_p = reinterpret_cast<Inode *>(inode);
+  const auto direct_cnt = inode_p->get_direct_block_num();
+
+  auto shared_res = this->refcount_->is_shared(inode_bid);
+  if (shared_res.is_err()) {
+    return ChfsNullResult(shared_res.unwrap_error());
+  }
+  if (shared_res.unwrap()) {
+    std::vector<block_id_t> children;
+    for (usize idx = 0; idx < block_num && idx < direct_cnt; ++idx) {
+      children.push_back(inode_p->blocks[idx]);
+    }
+    if (block_num > direct_cnt) {
+      children.push_back(inode_p->get_indirect_block_id());
+    }
+
+    auto res = this->unshare_block(inode_bid, children);
+    if (res.is_err()) {
+      return ChfsNullResult(res.unwrap_error());
+    }
+    inode_bid = res.unwrap();
+    // the table is indexed by the physical inode id
+    auto table_res = this->inode_manager_->set_table(id - 1, inode_bid);
+    if (table_res.is_err()) {
+      return table_res;
+    }
+  }
+
+  if (block_num <= direct_cnt) {
+    return KNullOk;
+  }
+  shared_res = this->refcount_->is_shared(inode_p->get_indirect_block_id());
+  if (shared_res.is_err()) {
+    return ChfsNullResult(shared_res.unwrap_error());
+  }
+  if (shared_res.unwrap()) {
+    auto indirect_p =
+        reinterpret_cast<const block_id_t *>(indirect_block.data());
+    auto res = this->unshare_block(
+        inode_p->get_indirect_block_id(),
+        std::vector<block_id_t>(indirect_p,
+                                indirect_p + block_num - direct_cnt));
+    if (res.is_err()) {
+      return ChfsNullResult(res.unwrap_error());
+    }
+    inode_p->blocks[inode_p->get_nblocks() - 1] = res.unwrap();
+  }
+  return KNullOk;
+}
+
+auto FileOperation::write_shared_block(block_id_t block_id, const u8 *data,
+                                       bool journaled)
+    -> ChfsResult<block_id_t> {
+  const auto block_size = this->block_manager_->block_size();
+  auto write = [&](block_id_t target) {
+    return journaled ? this->block_manager_->write_block(target, data)
+                     : this->block_manager_->write_block_unlogged(target, data);
+  };
+
+  auto shared_res = this->refcount_->is_shared(block_id);
+  if (shared_res.is_err()) {
+    return ChfsResult<block_id_t>(shared_res.unwrap_error());
+  }
+  if (!shared_res.unwrap()) {
+    auto res = write(block_id);
+    if (res.is_err()) {
+      return ChfsResult<block_id_t>(res.unwrap_error());
+    }
+    return ChfsResult<block_id_t>(block_id);
+  }
+
+  // an unchanged block keeps being shared
+  std::vector<u8> old(block_size);
+  auto res = this->block_manager_->read_block(block_id, old.data());
+  if (res.is_err()) {
+    return ChfsResult<block_id_t>(res.unwrap_error());
+  }
+  if (memcmp(old.data(), data, block_size) == 0) {
+    return ChfsResult<block_id_t>(block_id);
+  }
+
+  auto alloc_res = this->block_allocator_->allocate();
+  if (alloc_res.is_err()) {
+    return alloc_res;
+  }
+  res = write(alloc_res.unwrap());
+  if (res.is_err()) {
+    return ChfsResult<block_id_t>(res.unwrap_error());
+  }
+  auto dec_res = this->refcount_->dec(block_id);
+  if (dec_res.is_err()) {
+    return ChfsResult<block_id_t>(dec_res.unwrap_error());
+  }
+  return alloc_res;
+}
+
+} // namespace chfs
@@ -0,0 +1,190 @@
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <iterator>
+#include <list>
+#include <unistd.h>
+
+#include "filesystem/directory_op.h"
+#include "filesystem/trace.h"
+
+namespace chfs {
+
+static const char *const KTraceOpNames[] = {
+    "unknown", "lookup", "getattr", "setattr", "open",    "release",
+    "read",    "write",  "flush",   "fsync",   "mknod",   "mkdir",
+    "unlink",  "opendir", "readdir", "releasedir", "ioctl",
+};
+
+auto trace_op_name(TraceOp op) -> const char * {
+  const auto idx = static_cast<usize>(op);
+  if (idx >= std::size(KTraceOpNames)) {
+    return KTraceOpNames[0];
+  }
+  return KTraceOpNames[idx];
+}
+
+auto TraceWriter::create(const std::string &path)
+    -> ChfsResult<std::shared_ptr<TraceWriter>> {
+  int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+                  S_IRUSR | S_IWUSR);
+  if (fd < 0) {
+    return ChfsResult<std::shared_ptr<TraceWriter>>(ErrorType::INVALID_ARG);
+  }
+
+  auto writer = std::shared_ptr<TraceWriter>(
+      new TraceWriter(fd, std::chrono::steady_clock::now()));
+  TraceHeader header;
+  header.magic = KTraceMagic;
+  header.version = KTraceVersion;
+  header.start_time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          std::chrono::system_clock::now().time_since_epoch())
+                          .count();
+  auto ptr = reinterpret_cast<const u8 *>(&header);
+  writer->buffer.insert(writer->buffer.end(), ptr, ptr + sizeof(header));
+  return ChfsResult<std::shared_ptr<TraceWriter>>(writer);
+}
+
+TraceWriter::~TraceWriter() {
+  static_cast<void>(this->flush());
+  ::close(this->fd);
+}
+
+auto TraceWriter::append(const TraceRecord &record, const char *name) -> void {
+  const usize name_len = name == nullptr ? 0 : strlen(name);
+  if (this->buffer.size() + sizeof(TraceRecord) + name_len > KTraceBufferSize) {
+    // a failed write only loses the records, the requests go on
+    static_cast<void>(this->flush());
+  }
+
+  auto ptr = reinterpret_cast<const u8 *>(&record);
+  const auto offset = this->buffer.size();
+  this->buffer.insert(this->buffer.end(), ptr, ptr + sizeof(record));
+  reinterpret_cast<TraceRecord *>(this->buffer.data() + offset)->name_len =
+      static_cast<uint16_t>(name_len);
+  this->buffer.insert(this->buffer.end(), name, name + name_len);
+}
+
+auto TraceWriter::flush() -> ChfsNullResult {
+  usize written = 0;
+  while (written < this->buffer.size()) {
+    auto res = ::write(this->fd, this->buffer.data() + written,
+                       this->buffer.size() - written);
+    if (res < 0) {
+      this->buffer.clear();
+      return ChfsNullResult(ErrorType::INVALID);
+    }
+    written += res;
+  }
+  this->buffer.clear();
+  return KNullOk;
+}
+
+auto TraceReader::open(const std::string &path)
+    -> ChfsResult<std::shared_ptr<TraceReader>> {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    return ChfsResult<std::shared_ptr<TraceReader>>(ErrorType::NotExist);
+  }
+  std::vector<u8> data((std::istreambuf_iterator<char>(file)),
+                       std::istreambuf_iterator<char>());
+
+  if (data.size() < sizeof(TraceHeader)) {
+    return ChfsResult<std::shared_ptr<TraceReader>>(ErrorType::INVALID);
+  }
+  auto header = reinterpret_cast<const TraceHeader *>(data.data());
+  if (header->magic != KTraceMagic || header->version != KTraceVersion) {
+    return ChfsResult<std::shared_ptr<TraceReader>>(ErrorType::INVALID);
+  }
+  return ChfsResult<std::shared_ptr<TraceReader>>(
+      std::shared_ptr<TraceReader>(new TraceReader(std::move(data))));
+}
+
+auto TraceReader::next(TraceRecord &record, std::string &name) -> bool {
+  if (this->pos + sizeof(TraceRecord) > this->data.size()) {
+    return false;
+  }
+  memcpy(&record, this->data.data() + this->pos, sizeof(TraceRecord));
+  // a record is cut if the daemon was killed while writing it
+  if (this->pos + sizeof(TraceRecord) + record.name_len > this->data.size()) {
+    return false;
+  }
+  this->pos += sizeof(TraceRecord);
+  name.assign(reinterpret_cast<const char *>(this->data.data() + this->pos),
+              record.name_len);
+  this->pos += record.name_len;
+  return true;
+}
+
+auto TraceReplayer::map_inode(u64 ino) const -> inode_id_t {
+  auto iter = this->inodes.find(ino);
+  return iter == this->inodes.end() ? static_cast<inode_id_t>(ino)
+                                    : iter->second;
+}
+
+auto TraceReplayer::replay(const TraceRecord &record, const std::string &name)
+    -> bool {
+  const auto ino = this->map_inode(record.ino);
+
+  // the operations resolving an inode, whose result is mapped
+  auto resolve = [&](const ChfsResult<inode_id_t> &res) {
+    if (res.is_ok() && record.result != 0) {
+      this->inodes[record.result] = res.unwrap();
+    }
+    return res.is_ok() == (record.result != 0);
+  };
+
+  switch (record.op) {
+  case TraceOp::Lookup:
+    return resolve(this->fs->lookup(ino, name.c_str()));
+  case TraceOp::Mknod:
+    return resolve(this->fs->mkfile(ino, name.c_str()));
+  case TraceOp::Mkdir:
+    return resolve(this->fs->mkdir(ino, name.c_str()));
+  case TraceOp::Unlink:
+    return this->fs->unlink(ino, name.c_str()).is_ok();
+  case TraceOp::Getattr:
+    return this->fs->getattr(ino).is_ok();
+  case TraceOp::Setattr:
+    return this->fs->resize(ino, record.size).is_ok();
+  case TraceOp::Read: {
+    // the read is cut at the end of the file, as the daemon does
+    auto attr_res = this->fs->getattr(ino);
+    if (attr_res.is_err()) {
+      return false;
+    }
+    const auto file_sz = attr_res.unwrap().size;
+    if (record.offset >= file_sz) {
+      return true;
+    }
+    const auto sz = std::min(record.size, file_sz - record.offset);
+    return this->fs->read_file_w_off(ino, sz, record.offset).is_ok();
+  }
+  case TraceOp::Write:
+    if (this->zeros.size() < record.size) {
+      this->zeros.resize(record.size);
+    }
+    return this->fs
+        ->write_file_w_off(ino, this->zeros.data(), record.size, record.offset)
+        .is_ok();
+  case TraceOp::Flush:
+  case TraceOp::Release:
+    return this->fs->flush(ino).is_ok();
+  case TraceOp::Fsync:
+    return this->fs->fsync(ino).is_ok();
+  case TraceOp::Opendir: {
+    // the entries are read upon opendir, and readdir only lists them
+    std::list<DirectoryEntry> list;
+    return read_directory(this->fs, ino, list).is_ok();
+  }
+  case TraceOp::Open:
+  case TraceOp::Readdir:
+  case TraceOp::Releasedir:
+  case TraceOp::Ioctl:
+    // nothing to do with the filesystem, or not replayable
+    return true;
+  }
+  return false;
+}
+
+} // namespace chfs
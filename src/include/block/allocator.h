@@ -12,14 +12,29 @@
 #pragma once
 
 #include <memory>
+#include <optional>
+#include <vector>
 
 #include "block/manager.h"
+#include "common/bitmap.h"
 
 namespace chfs {
 
 class SuperBlock;
 class InodeManager;
 
+/**
+ * The strategy used to manage the free blocks.
+ * It is selected when the filesystem is created and recorded in the super
+ * block, so the same strategy is used after re-mounting.
+ */
+enum class AllocatorType : u32 {
+  /** Scan the bitmap for free blocks */
+  Bitmap = 0,
+  /** Buddy free lists over the bitmap, see `BuddyAllocator` */
+  Buddy = 1,
+};
+
 /**
  * BlockManager implements a block allocator to manage blocks of the manager
  * It internally uses bitmap for the management.
@@ -45,6 +60,10 @@ protected:
   // number of bits needed in the last bitmap block
   usize last_block_num;
 
+  // number of free blocks, it is counted from the bitmap upon construction
+  // and kept in sync with every bitmap update afterwards
+  usize free_cnt = 0;
+
 public:
   /**
    * Creates a new block allocator with a block manager.
@@ -60,22 +79,48 @@ public:
    * @param bm the block manager
    * @param bitmap_block_id the block id of the bitmap
    * @param will_initialize whether to initialize the bitmap
+   * @param free_blocks the number of free blocks of an initialized bitmap if
+   * it is known, e.g., recorded upon unmount. Otherwise, it is counted from
+   * the bitmap.
    *
    * # Note!!!!
    * We assume that the blocks before the `bitmap_block_id` is reserved,
    * so they cannot be allocated.
    */
   BlockAllocator(std::shared_ptr<BlockManager> bm, usize bitmap_block_id,
-                 bool will_initialize = true);
+                 bool will_initialize = true,
+                 std::optional<usize> free_blocks = std::nullopt);
+
+  virtual ~BlockAllocator() = default;
+
+  /**
+   * Creates a block allocator of the given strategy.
+   * The parameters are the same as the constructor above.
+   *
+   * @return the error of reading the bitmap if the strategy builds an index
+   * from it, e.g., the buddy free lists
+   */
+  static auto create(AllocatorType type, std::shared_ptr<BlockManager> bm,
+                     usize bitmap_block_id, bool will_initialize = true,
+                     std::optional<usize> free_blocks = std::nullopt)
+      -> ChfsResult<std::shared_ptr<BlockAllocator>>;
 
   auto total_bitmap_block() -> usize { return this->bitmap_block_cnt; }
 
   /**
-   * Count the number of free blocks.
+   * Get the number of free blocks.
+   * It is maintained in memory, so it won't read the bitmap.
    *
    * @return the number of free blocks
    */
-  auto free_block_cnt() const -> usize;
+  auto free_block_cnt() const -> usize { return this->free_cnt; }
+
+  /**
+   * Count the number of free blocks by reading the whole bitmap.
+   *
+   * @return the number of free blocks, or the error of reading the bitmap
+   */
+  auto count_free_blocks() const -> ChfsResult<usize>;
 
   /**
    * Allocate a block.
@@ -84,7 +129,7 @@ public:
    *         OUT_OF_RESOURCE if there is no free block.
    *         other error code if there is other error.
    */
-  auto allocate() -> ChfsResult<block_id_t>;
+  virtual auto allocate() -> ChfsResult<block_id_t>;
 
   /**
    * Deallocate a block.
@@ -93,7 +138,98 @@ public:
    * @return INVALID_ARG if the block id is freed.
    *         other error code if there is other error.
    */
-  auto deallocate(block_id_t block_id) -> ChfsNullResult;
+  virtual auto deallocate(block_id_t block_id) -> ChfsNullResult;
+
+  /**
+   * Allocate `count` blocks in a batch.
+   * Each bitmap block is read and flushed at most once, so allocating many
+   * blocks costs one bitmap write per touched bitmap block instead of one per
+   * allocated block.
+   *
+   * @param count the number of blocks to allocate
+   * @param out the allocated block ids are appended to it, in ascending order
+   *
+   * @return OUT_OF_RESOURCE if there are not enough free blocks. In this case,
+   *         no block is allocated and `out` is left untouched.
+   *         other error code if there is other error.
+   */
+  virtual auto allocate_n(usize count, std::vector<block_id_t> &out)
+      -> ChfsNullResult;
+
+  /**
+   * Deallocate a batch of blocks.
+   * The block ids are grouped by the bitmap block that tracks them, and each
+   * bitmap block is read and flushed once.
+   *
+   * @param block_ids the block ids to be deallocated, in any order.
+   *
+   * @return INVALID_ARG if any block id is out of range or already freed
+   *         (including duplicated ids in the batch). The bitmap block
+   *         containing the invalid id is left untouched.
+   *         other error code if there is other error.
+   */
+  virtual auto deallocate_batch(const std::vector<block_id_t> &block_ids)
+      -> ChfsNullResult;
+
+  /**
+   * Allocate an extent of 2^order contiguous blocks.
+   * The start block id of the extent is aligned to 2^order.
+   *
+   * @return the first block id of the extent if succeed.
+   *         OUT_OF_RESOURCE if there is no such free extent.
+   *         other error code if there is other error.
+   */
+  virtual auto allocate_extent(u32 order) -> ChfsResult<block_id_t>;
+
+  /**
+   * Deallocate an extent allocated by `allocate_extent`.
+   *
+   * @return INVALID_ARG if the extent is not aligned or any block of it is
+   *         freed.
+   *         other error code if there is other error.
+   */
+  virtual auto deallocate_extent(block_id_t start, u32 order)
+      -> ChfsNullResult;
+
+  /**
+   * Allocate `count` contiguous blocks. It allocates the smallest extent
+   * holding them and frees the blocks beyond `count`.
+   *
+   * @return the first block id if succeed.
+   *         OUT_OF_RESOURCE if there is no such free extent.
+   *         other error code if there is other error.
+   */
+  auto allocate_contiguous(usize count) -> ChfsResult<block_id_t>;
+
+protected:
+  /**
+   * Reset the free block counter from the bitmap
+   */
+  auto recount_free_blocks() -> ChfsNullResult;
+
+  /**
+   * Set (or clear) the bits of the given blocks in the bitmap.
+   * The block ids are grouped by the bitmap block that tracks them, and each
+   * bitmap block is read and flushed once.
+   *
+   * @param block_ids the block ids to update, in any order
+   * @param allocated true to set the bits, false to clear them
+   *
+   * @return INVALID_ARG if any block id is out of range, duplicated, or its
+   *         bit is already in the target state. The bitmap block containing
+   *         the invalid id is left untouched.
+   */
+  auto update_bitmap(const std::vector<block_id_t> &block_ids, bool allocated)
+      -> ChfsNullResult;
+
+  /**
+   * The number of valid bits stored in the i-th bitmap block
+   */
+  auto bits_in_bitmap_block(block_id_t i) const -> usize {
+    return i == this->bitmap_block_cnt - 1
+               ? this->last_block_num
+               : this->bm->block_size() * KBitsPerByte;
+  }
 };
 
 } // namespace chfs
\ No newline at end of file
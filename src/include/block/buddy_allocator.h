@@ -0,0 +1,126 @@
+//===----------------------------------------------------------------------===//
+//
+//                         Chfs
+//
+// buddy_allocator.h
+//
+// Identification: src/include/block/buddy_allocator.h
+//
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <optional>
+#include <set>
+
+#include "block/allocator.h"
+
+namespace chfs {
+
+// The largest extent managed by the buddy allocator is 2^KBuddyMaxOrder blocks
+const u32 KBuddyMaxOrder = 20;
+
+/**
+ * BuddyAllocator manages the free blocks as buddy free lists layered over the
+ * bitmap of `BlockAllocator`.
+ *
+ * The bitmap is still the only persistent state: every allocation and
+ * deallocation is reflected in it, so an image formatted with the buddy
+ * allocator has the same on-disk layout. The free lists are kept in memory
+ * and are rebuilt from the bitmap when the allocator is constructed.
+ *
+ * A free extent of order k covers 2^k blocks and starts at a block id
+ * aligned to 2^k. The free lists are ordered sets, and a mask tells which of
+ * them are non-empty, so that the order to split is found at once.
+ * Allocating an extent of order k takes O(log n) and deallocating it
+ * coalesces the extent with its free buddies in O(log n) per order.
+ *
+ * Note that the block allocator is **not** thread-safe.
+ */
+class BuddyAllocator : public BlockAllocator {
+  // free_lists[k] stores the start block ids of the free extents of order k
+  std::vector<std::set<block_id_t>> free_lists;
+  // bit k is set if free_lists[k] is not empty
+  u32 nonempty_orders = 0;
+
+  BuddyAllocator(std::shared_ptr<BlockManager> bm, usize bitmap_block_id,
+                 bool will_initialize, std::optional<usize> free_blocks);
+
+public:
+  /**
+   * Creates a new buddy allocator with a block manager and a bitmap block id.
+   * See `BlockAllocator` for the parameters.
+   *
+   * @return the error of reading the bitmap, from which the free lists are
+   * built
+   */
+  static auto create(std::shared_ptr<BlockManager> bm, usize bitmap_block_id,
+                     bool will_initialize = true,
+                     std::optional<usize> free_blocks = std::nullopt)
+      -> ChfsResult<std::shared_ptr<BuddyAllocator>>;
+
+  auto allocate() -> ChfsResult<block_id_t> override {
+    return this->allocate_extent(0);
+  }
+
+  auto deallocate(block_id_t block_id) -> ChfsNullResult override {
+    return this->deallocate_extent(block_id, 0);
+  }
+
+  /**
+   * Allocate `count` blocks as a few large aligned extents.
+   * The bitmap is flushed once per touched bitmap block, and the blocks are
+   * appended in ascending order as the base class does.
+   */
+  auto allocate_n(usize count, std::vector<block_id_t> &out)
+      -> ChfsNullResult override;
+
+  auto deallocate_batch(const std::vector<block_id_t> &block_ids)
+      -> ChfsNullResult override;
+
+  auto allocate_extent(u32 order) -> ChfsResult<block_id_t> override;
+
+  auto deallocate_extent(block_id_t start, u32 order)
+      -> ChfsNullResult override;
+
+  /**
+   * Get the number of free extents of the given order.
+   * It is mainly used for testing.
+   */
+  auto free_extent_cnt(u32 order) const -> usize {
+    return order <= KBuddyMaxOrder ? free_lists[order].size() : 0;
+  }
+
+private:
+  /**
+   * Rebuild the free lists from the bitmap
+   */
+  auto build_free_lists() -> ChfsNullResult;
+
+  /**
+   * Take an extent of the given order from the free lists, splitting a larger
+   * one if necessary. Note that the bitmap is not updated.
+   */
+  auto take_extent(u32 order) -> std::optional<block_id_t>;
+
+  /**
+   * Return an extent to the free lists and coalesce it with its buddies.
+   * Note that the bitmap is not updated.
+   */
+  auto put_extent(block_id_t start, u32 order) -> void;
+
+  /**
+   * The largest order no larger than `order` that has a free extent, nullopt
+   * if there is none
+   */
+  auto fitting_order(u32 order) const -> std::optional<u32>;
+
+  /**
+   * Insert or erase a free extent, keeping `nonempty_orders` in sync
+   */
+  auto insert_free(block_id_t start, u32 order) -> void;
+  auto erase_free(std::set<block_id_t>::iterator iter, u32 order) -> void;
+};
+
+} // namespace chfs
@@ -0,0 +1,31 @@
+//===----------------------------------------------------------------------===//
+//
+//                         Chfs
+//
+// checksum.h
+//
+// Identification: src/include/block/checksum.h
+//
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include "common/config.h"
+
+namespace chfs {
+
+/**
+ * The CRC32C (Castagnoli) of the data. The SSE4.2 instruction is used if the
+ * CPU supports it, otherwise a slicing-by-8 table.
+ *
+ * @param crc the CRC of the preceding data, to checksum the data piecewise
+ */
+auto crc32c(const u8 *data, usize len, u32 crc = 0) -> u32;
+
+/**
+ * The portable version of `crc32c`, exposed for testing
+ */
+auto crc32c_sw(const u8 *data, usize len, u32 crc = 0) -> u32;
+
+} // namespace chfs
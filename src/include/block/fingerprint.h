@@ -0,0 +1,93 @@
+//===----------------------------------------------------------------------===//
+//
+//                         Chfs
+//
+// fingerprint.h
+//
+// Identification: src/include/block/fingerprint.h
+//
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include "block/manager.h"
+
+namespace chfs {
+
+/**
+ * An entry of the fingerprint index
+ */
+struct FingerprintEntry {
+  u64 fingerprint;
+  // 0 if the entry is empty
+  block_id_t block_id;
+};
+
+/**
+ * FingerprintIndex maps the fingerprints of the block contents to the blocks
+ * holding them, so that a block with the same content can be shared instead
+ * of written again.
+ *
+ * It is a hash table in a region of the block device, each block is a bucket
+ * of entries. A full bucket evicts an entry, so the index may miss a
+ * duplicate but never grows.
+ *
+ * The index is a cache: it is updated in place without the journal. A hit
+ * must be confirmed by comparing the contents, and the index should be
+ * cleared if the filesystem is not unmounted cleanly. Note that the index is
+ * **not** thread-safe.
+ */
+class FingerprintIndex {
+  std::shared_ptr<BlockManager> bm;
+  // the region of the index
+  block_id_t start;
+  usize block_cnt;
+
+public:
+  FingerprintIndex(std::shared_ptr<BlockManager> bm, block_id_t start,
+                   usize block_cnt)
+      : bm(std::move(bm)), start(start), block_cnt(block_cnt) {}
+
+  /**
+   * The 64-bit fingerprint of a block, in the manner of xxHash64
+   */
+  static auto fingerprint(const u8 *data, usize len) -> u64;
+
+  /**
+   * Empty the index
+   */
+  auto format() -> ChfsNullResult;
+
+  /**
+   * Get the blocks recorded with the fingerprint
+   */
+  auto lookup(u64 fingerprint, std::vector<block_id_t> &blocks)
+      -> ChfsNullResult;
+
+  /**
+   * Record a block with the fingerprint, it is a no-op if it is recorded
+   */
+  auto insert(u64 fingerprint, block_id_t block_id) -> ChfsNullResult;
+
+  /**
+   * Remove the record of a block with the fingerprint, if any
+   */
+  auto remove(u64 fingerprint, block_id_t block_id) -> ChfsNullResult;
+
+  /**
+   * Getters
+   */
+  auto region_start() const -> block_id_t { return this->start; }
+  auto region_blocks() const -> usize { return this->block_cnt; }
+
+private:
+  auto bucket(u64 fingerprint) const -> block_id_t {
+    return this->start + fingerprint % this->block_cnt;
+  }
+};
+
+} // namespace chfs
@@ -0,0 +1,306 @@
+//===----------------------------------------------------------------------===//
+//
+//                         Chfs
+//
+// journal.h
+//
+// Identification: src/include/block/journal.h
+//
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <optional>
+#include <set>
+#include <unordered_set>
+#include <vector>
+
+#include "block/manager.h"
+
+namespace chfs {
+
+// Identify the journal header, "chfsJRNL" in little endian
+const u64 KJournalMagic = 0x4c4e524a73666863;
+const u32 KJournalDescriptorMagic = 0x43534544; // "DESC"
+const u32 KJournalCommitMagic = 0x54494d43;     // "CMIT"
+// The free block counter is not recorded
+const u64 KJournalNoCounter = static_cast<u64>(-1);
+
+/**
+ * The header of the journal, stored in the first block of the journal region.
+ * It is only updated by checkpoints.
+ */
+struct JournalHeader {
+  u64 magic;
+  // The position of the oldest transaction that may be not checkpointed.
+  // A position is the number of blocks appended to the log since its
+  // creation, so it is taken modulo the log size to locate the block.
+  u64 tail;
+  // The sequence number of the transaction at the tail
+  u64 tail_seq;
+  // The number of free blocks at the tail
+  u64 free_blocks;
+};
+
+/**
+ * The first block of a transaction in the log. The ids of the logged blocks
+ * follow it, and may span more blocks. The images of the blocks follow the
+ * ids, and a commit block ends the transaction.
+ */
+struct JournalDescriptor {
+  u32 magic;
+  u32 block_cnt;
+  u64 seq;
+};
+
+struct JournalCommit {
+  u32 magic;
+  u32 block_cnt;
+  u64 seq;
+  // The checksum of the block ids and images
+  u64 checksum;
+  // The number of free blocks after the transaction, so that it can be
+  // recovered without scanning the block bitmap
+  u64 free_blocks;
+};
+
+/**
+ * Journal implements a write-ahead log of the block writes (physical
+ * logging) in a circular region of the block device.
+ *
+ * Once attached to the block manager, the writes to the blocks outside the
+ * region are staged in the running transaction instead of in place, and the
+ * reads see the staged content. A commit appends all the staged blocks to the
+ * log as one transaction (group commit), makes it durable with a single sync,
+ * and then installs the blocks in place. The log space is reclaimed by a
+ * checkpoint, which makes the installed blocks durable. The checkpoint is
+ * asynchronous: the writeback of the installed blocks is started by the
+ * commit, so the checkpoint mostly finds them written.
+ *
+ * Only the blocks touched since the last commit (or checkpoint) are synced,
+ * never the whole device.
+ *
+ * Note that the journal is **not** thread-safe.
+ */
+class Journal {
+  BlockManager *bm;
+  // the region of the journal, the first block stores the header
+  block_id_t start;
+  usize block_cnt;
+
+  // [tail, head) are the positions of the transactions not checkpointed
+  u64 head;
+  u64 tail;
+  // the sequence number of the next transaction
+  u64 seq;
+  u64 tail_seq;
+
+  // the blocks staged by the running transaction
+  std::map<block_id_t, std::vector<u8>> running;
+  // the blocks logged by the transactions not checkpointed
+  std::set<block_id_t> logged;
+  // the blocks written in place since the last commit, e.g., the file content
+  std::set<block_id_t> unsynced;
+  // the blocks always written in place
+  std::unordered_set<block_id_t> excluded;
+
+  // the number of free blocks recorded in the transactions
+  std::function<u64()> free_blocks_source;
+  // stage the updates deferred until the commit, e.g., the freed blocks
+  std::function<ChfsNullResult()> before_commit;
+  // whether an operation should start with a new transaction
+  std::function<bool()> commit_wanted;
+  u64 free_blocks = KJournalNoCounter;
+
+  // the running transaction is committed at the start of an operation once
+  // it stages so many blocks
+  usize group_limit;
+  usize op_depth = 0;
+  // whether the writes go to the device directly
+  bool in_place = false;
+  // the error of a commit issued by begin_op, reported by the next commit
+  ErrorType pending_error = ErrorType::DONE;
+
+public:
+  /**
+   * Create an empty journal in the region and attach it to the block manager
+   *
+   * @param bm the block manager
+   * @param start the first block of the region
+   * @param block_cnt the number of blocks in the region
+   */
+  static auto format(std::shared_ptr<BlockManager> bm, block_id_t start,
+                     usize block_cnt) -> ChfsResult<std::shared_ptr<Journal>>;
+
+  /**
+   * Open the journal in the region, replay the committed transactions and
+   * attach it to the block manager. It only reads the transactions since the
+   * last checkpoint, so it takes time proportional to the journal size.
+   *
+   * @return INVALID if the region doesn't contain a journal
+   */
+  static auto open(std::shared_ptr<BlockManager> bm, block_id_t start,
+                   usize block_cnt) -> ChfsResult<std::shared_ptr<Journal>>;
+
+  /**
+   * Never journal a block, i.e., its writes always go in place. It is used for
+   * the super block, which is updated in place upon mount and unmount, and
+   * whose lazy zeroing flags are updated in place by the block manager.
+   */
+  auto exclude(block_id_t block_id) -> void {
+    this->excluded.insert(block_id);
+  }
+
+  /**
+   * Set the source of the free block counter recorded by each commit.
+   * It is read at the commit, when the running transaction contains all the
+   * updates, so the counter matches the committed state.
+   */
+  auto set_free_blocks_source(std::function<u64()> source) -> void {
+    this->free_blocks_source = std::move(source);
+  }
+
+  /**
+   * Set the callback run at the start of each commit. The blocks it writes
+   * are staged in the committed transaction.
+   */
+  auto set_before_commit(std::function<ChfsNullResult()> callback) -> void {
+    this->before_commit = std::move(callback);
+  }
+
+  /**
+   * Set the condition to commit the running transaction at the start of an
+   * operation besides its size, e.g., the blocks freed by it are needed.
+   */
+  auto set_commit_wanted(std::function<bool()> condition) -> void {
+    this->commit_wanted = std::move(condition);
+  }
+
+  /**
+   * Get the number of free blocks recorded by the last committed transaction
+   * (or the checkpoint), which is recovered upon opening the journal.
+   *
+   * @return std::nullopt if it is not recorded
+   */
+  auto recorded_free_blocks() const -> std::optional<u64> {
+    if (this->free_blocks == KJournalNoCounter) {
+      return std::nullopt;
+    }
+    return this->free_blocks;
+  }
+
+  /**
+   * Mark the start of a filesystem operation. The running transaction is
+   * committed here if it is large enough (or wanted), so the writes of an operation are
+   * never split into two transactions. Operations can be nested.
+   */
+  auto begin_op() -> void;
+
+  /**
+   * Mark the end of a filesystem operation
+   */
+  auto end_op() -> void { this->op_depth -= 1; }
+
+  /**
+   * Commit the running transaction.
+   * A transaction too large to fit in the log is written through instead,
+   * i.e., its blocks are durable upon return but not updated atomically.
+   */
+  auto commit() -> ChfsNullResult;
+
+  /**
+   * Make the installed blocks and the excluded ones durable, and reclaim the
+   * log space.
+   */
+  auto checkpoint() -> ChfsNullResult;
+
+  /**
+   * Stage a write of the block manager.
+   *
+   * @param data the data to write, nullptr to zero the range
+   * @return false if the write should go in place, i.e., the block is in the
+   * journal region or excluded, or the journal is installing blocks
+   */
+  auto stage(block_id_t block_id, const u8 *data, usize offset, usize len)
+      -> bool;
+
+  /**
+   * Read the staged content of a block.
+   *
+   * @return false if the block is not staged
+   */
+  auto read_staged(block_id_t block_id, u8 *data) -> bool;
+
+  /**
+   * Get the staged content of a block in place, nullptr if it is not staged
+   */
+  auto peek_staged(block_id_t block_id) const -> const u8 * {
+    auto iter = this->running.find(block_id);
+    return iter == this->running.end() ? nullptr : iter->second.data();
+  }
+
+  /**
+   * Write a block in place, bypassing the running transaction
+   */
+  auto write_in_place(block_id_t block_id, const u8 *data) -> ChfsNullResult;
+
+  /**
+   * Whether the block is staged or logged by a transaction not checkpointed.
+   * Such a block must be journaled even if it becomes file content, otherwise
+   * a replay would overwrite it with the stale image.
+   */
+  auto is_logged(block_id_t block_id) const -> bool {
+    return this->running.count(block_id) != 0 ||
+           this->logged.count(block_id) != 0;
+  }
+
+  /**
+   * Getters
+   */
+  auto region_start() const -> block_id_t { return this->start; }
+  auto region_blocks() const -> usize { return this->block_cnt; }
+  auto running_blocks() const -> usize { return this->running.size(); }
+  auto committed_seq() const -> u64 { return this->seq; }
+
+private:
+  Journal(BlockManager *bm, block_id_t start, usize block_cnt);
+
+  auto log_blocks() const -> usize { return this->block_cnt - 1; }
+  auto log_block_id(u64 pos) const -> block_id_t {
+    return this->start + 1 + pos % this->log_blocks();
+  }
+  auto in_region(block_id_t block_id) const -> bool {
+    return block_id - this->start < this->block_cnt;
+  }
+
+  auto descriptor_blocks(usize logged_cnt) const -> usize;
+  /**
+   * Sync the blocks, or only start writing them back if not `wait`.
+   * The consecutive blocks are synced together.
+   */
+  auto sync_blocks(const std::set<block_id_t> &blocks, bool wait)
+      -> ChfsNullResult;
+  /**
+   * Sync the log blocks at the positions [from, to)
+   */
+  auto sync_log(u64 from, u64 to) -> ChfsNullResult;
+
+  /**
+   * Install the running transaction in place and make it durable, for the
+   * transaction too large to be logged
+   */
+  auto write_through() -> ChfsNullResult;
+  auto write_header() -> ChfsNullResult;
+
+  /**
+   * Replay the committed transaction at the head.
+   * @return DONE if there is no committed transaction at the head
+   */
+  auto replay_one() -> ChfsNullResult;
+};
+
+} // namespace chfs
@@ -11,8 +11,13 @@
 
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
 #include <vector>
 
+#include "common/bitmap.h"
 #include "common/config.h"
 #include "common/macros.h"
 #include "common/result.h"
@@ -21,16 +26,19 @@ namespace chfs {
 // TODO
 
 class BlockIterator;
+class Journal;
 
 /**
  * BlockManager implements a block device to read/write block devices
- * Note that the block manager is **not** thread-safe.
+ * Note that the block manager is **not** thread-safe, except that the
+ * lazily zeroed blocks can be zeroed by a background thread
+ * (see `zero_lazy_blocks`).
  */
 class BlockManager {
   friend class BlockIterator;
 
 protected:
-  const usize block_sz = 4096;
+  const usize block_sz = KDefaultBlockSize;
 
   std::string file_name_;
   int fd;
@@ -38,6 +46,32 @@ protected:
   usize block_cnt;
   bool in_memory; // whether we use in-memory to emulate the block manager
 
+  // Lazy zeroing: blocks in [lazy_start, lazy_start + lazy_cnt) are tracked by
+  // a bitmap stored in the device (at lazy_flag_block + lazy_flag_offset).
+  // A set bit means the block has never been written since it was zeroed
+  // lazily, so its content is treated as zeros. Only the blocks registered
+  // by `track_lazy` are tracked, the others never take the lazy_mutex.
+  bool lazy_enabled = false;
+  block_id_t lazy_start = 0;
+  usize lazy_cnt = 0;
+  block_id_t lazy_flag_block = 0;
+  usize lazy_flag_offset = 0;
+  usize lazy_uninit_cnt = 0;
+  std::mutex lazy_mutex;
+  std::atomic<bool> lazy_stop{false};
+
+  // If attached, the writes are staged in the journal
+  std::shared_ptr<Journal> journal;
+
+  // Checksums: the CRC32C of each block is stored in the region
+  // [checksum_start, checksum_start + checksum_cnt) as an array of u32.
+  // The region is updated in place whenever a block lands in the device, and
+  // the blocks are verified when they are read. 0 blocks if disabled.
+  // The checksum of a lazily zeroed block is the one of zeros.
+  block_id_t checksum_start = 0;
+  usize checksum_cnt = 0;
+  u32 zero_checksum = 0;
+
 public:
   /**
    * Creates a new block manager that writes to a file-backed block device.
@@ -54,6 +88,20 @@ public:
    */
   BlockManager(const std::string &file, usize block_cnt);
 
+  /**
+   * Creates a new block manager that writes to a file-backed block device.
+   * @param block_file the file name of the  file to write to
+   * @param block_cnt the number of expected blocks in the device, it is only
+   * used if the file is empty. Otherwise, the block cnt is determined by the
+   * file size.
+   * @param block_size the size of each block
+   * @param populate whether to pre-fault the whole file into memory upon
+   * construction (MAP_POPULATE). Otherwise, the kernel is only advised to read
+   * ahead the file asynchronously.
+   */
+  BlockManager(const std::string &file, usize block_cnt, usize block_size,
+               bool populate = false);
+
   /**
    * Creates a memory-backed block manager that writes to a memory block device.
    * Note that this is commonly used for testing.
@@ -75,6 +123,16 @@ public:
   virtual auto write_block(block_id_t block_id, const u8 *block_data)
       -> ChfsNullResult;
 
+  /**
+   * Write a block bypassing the journal (if any), e.g., for the file content,
+   * which is not journaled. The block is still journaled if the journal has
+   * logged it.
+   * @param block_id id of the block
+   * @param block_data raw block data
+   */
+  auto write_block_unlogged(block_id_t block_id, const u8 *block_data)
+      -> ChfsNullResult;
+
   /**
    * Write a partial block to the internal block device.
    */
@@ -89,16 +147,154 @@ public:
   virtual auto read_block(block_id_t block_id, u8 *block_data)
       -> ChfsNullResult;
 
+  /**
+   * Get the content of a block in place, without copying it. It is verified
+   * as `read_block` does, and it is valid until the block is written.
+   * @param block_id id of the block
+   * @return INVALID if the block is zeroed lazily, so it must be read by
+   * `read_block`
+   */
+  virtual auto peek_block(block_id_t block_id) -> ChfsResult<const u8 *>;
+
   /**
    * Clear the content of a block
    * @param block_id id of the block
    */
   virtual auto zero_block(block_id_t block_id) -> ChfsNullResult;
 
+  /**
+   * Hint the device that the blocks will be accessed soon.
+   * For the file-backed device, the pages are read ahead asynchronously.
+   * @param block_id the first block to prefetch
+   * @param cnt the number of blocks to prefetch
+   */
+  virtual auto prefetch(block_id_t block_id, usize cnt) -> ChfsNullResult;
+
+  /**
+   * Make the writes to the blocks durable.
+   * It is a no-op for the in-memory device.
+   * @param block_id the first block to sync
+   * @param cnt the number of blocks to sync
+   */
+  virtual auto sync(block_id_t block_id, usize cnt) -> ChfsNullResult;
+
+  /**
+   * Start writing the blocks back to the device without waiting for them,
+   * so a later `sync` of them returns sooner.
+   * It is a no-op for the in-memory device.
+   * @param block_id the first block to write back
+   * @param cnt the number of blocks to write back
+   */
+  virtual auto writeback(block_id_t block_id, usize cnt) -> ChfsNullResult;
+
+  /**
+   * Attach a journal to stage the writes, see `Journal`
+   */
+  auto set_journal(std::shared_ptr<Journal> journal) -> void {
+    this->journal = std::move(journal);
+  }
+
+  /**
+   * Enable lazy zeroing for the blocks following `flag_block`, so that
+   * zeroing them via `zero_block_lazily` costs nothing. The flags are
+   * persisted in `flag_block` from `flag_offset` to its end, which bounds the
+   * number of blocks tracked.
+   *
+   * @param flag_block the block to store the flags, it is not tracked itself
+   * @param flag_offset the offset of the flags in the block
+   * @param tracked the number of blocks tracked, i.e., 0 upon creating a
+   * filesystem, whose metadata blocks are registered by `track_lazy`, and the
+   * recorded number upon mounting one
+   * @param format whether to clear the flags (upon creating a filesystem) or
+   * load the persisted ones (upon mounting one)
+   *
+   * @return the number of blocks tracked
+   */
+  auto enable_lazy_zero(block_id_t flag_block, usize flag_offset,
+                        usize tracked, bool format) -> usize;
+
+  /**
+   * Track the blocks from the one following the flag block up to `end` for
+   * lazy zeroing, e.g., the inode table before it is zeroed. The blocks
+   * beyond the capacity of the flags are not tracked. It does nothing if lazy
+   * zeroing is not enabled.
+   *
+   * @return the number of blocks tracked
+   */
+  auto track_lazy(block_id_t end) -> usize;
+
+  /**
+   * Clear the content of a block lazily: the block is only flagged and
+   * reads return zeros until it is written. Fallback to `zero_block` if the
+   * block is not tracked.
+   * @param block_id id of the block
+   */
+  auto zero_block_lazily(block_id_t block_id) -> ChfsNullResult;
+
+  /**
+   * Zero all the lazily zeroed blocks eagerly. It is intended to run in a
+   * background thread, and it returns early after `stop_lazy_zero` is called,
+   * or at a block whose zeros cannot be made durable.
+   *
+   * @return the number of blocks zeroed
+   */
+  auto zero_lazy_blocks() -> usize;
+
+  /**
+   * Ask a running `zero_lazy_blocks` to return as soon as possible.
+   */
+  auto stop_lazy_zero() -> void { this->lazy_stop = true; }
+
+  /**
+   * Get the number of blocks tracked for lazy zeroing
+   */
+  auto lazy_tracked_cnt() const -> usize { return this->lazy_cnt; }
+
+  /**
+   * Get the number of blocks that are zeroed lazily but not yet written
+   */
+  auto lazy_block_cnt() -> usize {
+    std::lock_guard<std::mutex> lock(this->lazy_mutex);
+    return this->lazy_uninit_cnt;
+  }
+
   auto total_storage_sz() const -> usize {
     return this->block_cnt * this->block_sz;
   }
 
+  /**
+   * Get the number of blocks to store the checksums of all the blocks
+   */
+  auto checksum_blocks_needed() const -> usize;
+
+  /**
+   * Maintain the checksums of the blocks in a region of the device, so that
+   * a block corrupted behind our back is detected upon reading it, i.e.,
+   * `read_block` returns `Corrupted`. The blocks of the region itself are not
+   * checksummed. The region is not journaled, but the checksums are synced
+   * with their blocks, so after a crash only the blocks written without a
+   * sync may mismatch.
+   *
+   * @param start the first block of the region
+   * @param cnt the number of blocks in the region, at least
+   * `checksum_blocks_needed`
+   * @param rebuild whether to compute the checksums of all the blocks (upon
+   * creating the region or recovering from a crash) or use the stored ones
+   */
+  auto enable_checksum(block_id_t start, usize cnt, bool rebuild)
+      -> ChfsNullResult;
+
+  /**
+   * Accept the current content of a block, e.g., a corrupted one that has
+   * been inspected
+   */
+  auto update_checksum(block_id_t block_id) -> ChfsNullResult;
+
+  auto checksum_region_start() const -> block_id_t {
+    return this->checksum_start;
+  }
+  auto checksum_region_blocks() const -> usize { return this->checksum_cnt; }
+
   /**
    * Get the total number of blocks in the block manager
    */
@@ -113,6 +309,64 @@ public:
    * Get the block data pointer of the manager
    */
   auto unsafe_get_block_ptr() const -> u8 * { return this->block_data; }
+
+private:
+  auto is_checksummed(block_id_t block_id) const -> bool {
+    return this->checksum_cnt != 0 &&
+           block_id - this->checksum_start >= this->checksum_cnt;
+  }
+  auto checksum_slot(block_id_t block_id) const -> u32 * {
+    return reinterpret_cast<u32 *>(this->block_data +
+                                   this->checksum_start * this->block_sz) +
+           block_id;
+  }
+  /**
+   * Flush the blocks and their checksums, waiting for them if `wait`
+   */
+  auto flush_range(block_id_t block_id, usize cnt, bool wait)
+      -> ChfsNullResult;
+  /**
+   * Compute the checksum of a block from its content in the device
+   */
+  auto seal(block_id_t block_id) -> void;
+  /**
+   * Hold the lazy_mutex if the block is tracked for lazy zeroing or stores
+   * the flags. The latter is modified by the background zeroing, so it is
+   * read and written with the lock held, or its checksum may be stale.
+   * The caller should not hold the lazy_mutex.
+   */
+  auto lock_lazy(block_id_t block_id) -> std::unique_lock<std::mutex>;
+
+  auto lazy_flags() const -> Bitmap {
+    return Bitmap(this->block_data + this->lazy_flag_block * this->block_sz +
+                      this->lazy_flag_offset,
+                  this->block_sz - this->lazy_flag_offset);
+  }
+
+  auto is_lazy_tracked(block_id_t block_id) const -> bool {
+    return block_id - this->lazy_start < this->lazy_cnt;
+  }
+
+  /**
+   * The number of blocks the flags can track
+   */
+  auto lazy_capacity() const -> u64 {
+    return std::min(
+        static_cast<u64>((this->block_sz - this->lazy_flag_offset) *
+                         KBitsPerByte),
+        static_cast<u64>(this->block_cnt - this->lazy_start));
+  }
+
+  /**
+   * Clear the lazy flag of a tracked block, and zero it if it was flagged.
+   * The caller should hold the lazy_mutex.
+   *
+   * @param zero whether the block content should be zeroed
+   * @return whether the block was flagged. It fails if the zeros cannot be
+   * made durable, and the block is left flagged.
+   */
+  auto materialize_lazy_block(block_id_t block_id, bool zero)
+      -> ChfsResult<bool>;
 };
 
 /**
@@ -0,0 +1,106 @@
+//===----------------------------------------------------------------------===//
+//
+//                         Chfs
+//
+// refcount.h
+//
+// Identification: src/include/block/refcount.h
+//
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <memory>
+
+#include "block/manager.h"
+
+namespace chfs {
+
+/**
+ * RefcountTable records how many times each block is shared, in a region of
+ * the block device with an u32 counter per block.
+ *
+ * The counter is the number of **extra** references, i.e., 0 means that the
+ * block has a single owner (or is free), so a zeroed table is valid for a
+ * filesystem without any sharing. A block is freed only when its last
+ * reference is released, and a shared block is copied upon write.
+ *
+ * The updates go through the block manager, so they are journaled as the
+ * other metadata. Note that the table is **not** thread-safe.
+ */
+class RefcountTable {
+  std::shared_ptr<BlockManager> bm;
+  // the region of the table
+  block_id_t start;
+  usize block_cnt;
+
+public:
+  /**
+   * @param bm the block manager
+   * @param start the first block of the region
+   * @param block_cnt the number of blocks in the region, at least
+   * `blocks_needed(bm)`
+   */
+  RefcountTable(std::shared_ptr<BlockManager> bm, block_id_t start,
+                usize block_cnt)
+      : bm(std::move(bm)), start(start), block_cnt(block_cnt) {}
+
+  /**
+   * The number of blocks to store the counters of all the blocks
+   */
+  static auto blocks_needed(const BlockManager &bm) -> usize {
+    const auto per_block = bm.block_size() / sizeof(u32);
+    return (bm.total_blocks() + per_block - 1) / per_block;
+  }
+
+  /**
+   * Zero the counters, i.e., no block is shared
+   */
+  auto format() -> ChfsNullResult;
+
+  /**
+   * Get the number of extra references of a block
+   */
+  auto get(block_id_t block_id) -> ChfsResult<u32>;
+
+  /**
+   * Whether the block has more than one reference. It fails if the counter
+   * cannot be read, since an unknown block must not be written in place.
+   */
+  auto is_shared(block_id_t block_id) -> ChfsResult<bool> {
+    auto res = this->get(block_id);
+    if (res.is_err()) {
+      return ChfsResult<bool>(res.unwrap_error());
+    }
+    return ChfsResult<bool>(res.unwrap() != 0);
+  }
+
+  /**
+   * Add a reference to a block
+   */
+  auto inc(block_id_t block_id) -> ChfsNullResult;
+
+  /**
+   * Release a reference of a block.
+   *
+   * @return true if the block is still referenced, i.e., it should not be
+   * freed. false if the released reference was the last one.
+   */
+  auto dec(block_id_t block_id) -> ChfsResult<bool>;
+
+  /**
+   * Getters
+   */
+  auto region_start() const -> block_id_t { return this->start; }
+  auto region_blocks() const -> usize { return this->block_cnt; }
+
+private:
+  auto locate(block_id_t block_id) const -> std::pair<block_id_t, usize> {
+    const auto per_block = this->bm->block_size() / sizeof(u32);
+    return {this->start + block_id / per_block,
+            block_id % per_block * sizeof(u32)};
+  }
+};
+
+} // namespace chfs
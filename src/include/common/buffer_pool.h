@@ -0,0 +1,78 @@
+//===----------------------------------------------------------------------===//
+//
+//                         Chfs
+//
+// buffer_pool.h
+//
+// Identification: src/include/common/buffer_pool.h
+//
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <utility>
+
+#include "./config.h"
+
+namespace chfs {
+
+// The alignment of the pooled buffers, enough for O_DIRECT on any device
+const usize KBufferAlign = 4096;
+// The buffers of a size kept by a thread, the others are freed on release
+const usize KBufferPoolDepth = 16;
+
+/**
+ * A block-sized scratch buffer, taken from a pool of the current thread and
+ * returned to it when the handle is destroyed. So reading a block to inspect
+ * it, e.g., an inode or a bitmap block, rarely hits malloc.
+ *
+ * The buffers are aligned to `KBufferAlign` and are **not** zeroed, use
+ * `zeroed` for a buffer written partially. A handle may be released on
+ * another thread, whose pool takes the buffer.
+ */
+class BlockBuffer {
+  u8 *ptr;
+  usize sz;
+
+  BlockBuffer(u8 *ptr, usize sz) : ptr(ptr), sz(sz) {}
+
+public:
+  /**
+   * Take a buffer of `size` bytes, whose content is undefined
+   */
+  static auto acquire(usize size) -> BlockBuffer;
+
+  /**
+   * Take a buffer of `size` bytes filled with zeros
+   */
+  static auto zeroed(usize size) -> BlockBuffer;
+
+  BlockBuffer(BlockBuffer &&other) noexcept
+      : ptr(std::exchange(other.ptr, nullptr)), sz(other.sz) {}
+
+  auto operator=(BlockBuffer &&other) noexcept -> BlockBuffer & {
+    std::swap(this->ptr, other.ptr);
+    std::swap(this->sz, other.sz);
+    return *this;
+  }
+
+  BlockBuffer(const BlockBuffer &) = delete;
+  auto operator=(const BlockBuffer &) -> BlockBuffer & = delete;
+
+  ~BlockBuffer();
+
+  auto data() -> u8 * { return ptr; }
+  auto data() const -> const u8 * { return ptr; }
+  auto size() const -> usize { return sz; }
+
+  auto begin() -> u8 * { return ptr; }
+  auto end() -> u8 * { return ptr + sz; }
+  auto begin() const -> const u8 * { return ptr; }
+  auto end() const -> const u8 * { return ptr + sz; }
+
+  auto operator[](usize idx) -> u8 & { return ptr[idx]; }
+  auto operator[](usize idx) const -> const u8 & { return ptr[idx]; }
+};
+
+} // namespace chfs
@@ -16,5 +16,6 @@ using block_id_t = u64; // page id type
 using inode_id_t = u64;
 
 const usize KDefaultBlockCnt = 4096; // use a default 8MB file size
+const usize KDefaultBlockSize = 4096;
 
 } // namespace chfs
@@ -22,6 +22,12 @@ enum class ErrorType {
   AlreadyExist = 5,
 
   NotEmpty = 6,
+
+  /** The filesystem is read-only, e.g., a mounted snapshot */
+  ReadOnly = 7,
+
+  /** A block doesn't match its checksum */
+  Corrupted = 8,
 };
 
 } // namespace chfs
\ No newline at end of file
@@ -0,0 +1,85 @@
+//===----------------------------------------------------------------------===//
+//
+//                         Chfs
+//
+// range_set.h
+//
+// Identification: src/include/common/range_set.h
+//
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <algorithm>
+#include <iterator>
+#include <map>
+
+#include "./config.h"
+
+namespace chfs {
+
+/**
+ * A set of disjoint half-open ranges [begin, end). The overlapping or
+ * adjacent ranges are merged upon insertion, so a stream of small sequential
+ * ranges is kept as a single one.
+ */
+class RangeSet {
+  // begin -> end
+  std::map<u64, u64> ranges;
+
+public:
+  auto add(u64 begin, u64 end) -> void {
+    if (begin >= end) {
+      return;
+    }
+
+    // the first range that may be merged, i.e., it doesn't end before begin
+    auto iter = this->ranges.upper_bound(begin);
+    if (iter != this->ranges.begin() && std::prev(iter)->second >= begin) {
+      iter = std::prev(iter);
+    }
+    while (iter != this->ranges.end() && iter->first <= end) {
+      begin = std::min(begin, iter->first);
+      end = std::max(end, iter->second);
+      iter = this->ranges.erase(iter);
+    }
+    this->ranges.emplace(begin, end);
+  }
+
+  /**
+   * Whether any range overlaps [begin, end)
+   */
+  auto overlaps(u64 begin, u64 end) const -> bool {
+    auto iter = this->ranges.lower_bound(end);
+    if (iter == this->ranges.begin()) {
+      return false;
+    }
+    return std::prev(iter)->second > begin;
+  }
+
+  /**
+   * Whether a single range covers [begin, end)
+   */
+  auto covers(u64 begin, u64 end) const -> bool {
+    auto iter = this->ranges.upper_bound(begin);
+    if (iter == this->ranges.begin()) {
+      return false;
+    }
+    return std::prev(iter)->second >= end;
+  }
+
+  auto clear() -> void { this->ranges.clear(); }
+
+  auto empty() const -> bool { return this->ranges.empty(); }
+
+  /**
+   * Get the number of disjoint ranges
+   */
+  auto size() const -> usize { return this->ranges.size(); }
+
+  auto begin() const { return this->ranges.begin(); }
+  auto end() const { return this->ranges.end(); }
+};
+
+} // namespace chfs
@@ -2,6 +2,7 @@
 
 #include <iostream>
 #include <stdexcept>
+#include <utility>
 #include <variant>
 
 #include "./error_code.h"
@@ -10,34 +11,61 @@ namespace chfs {
 
 /*
  A result class to handle error inspired by rust
+
+ The value (or the error) lives in the variant, whose index tells which one it
+ is. A temporary result is unwrapped by moving its value out, e.g.,
+ `fs.read_file(id).unwrap()` or `std::move(res).unwrap()`, and `value()`
+ refers to the value in place. So a large value, e.g., the content of a file,
+ is never copied on its way out.
 */
-template <typename T, typename E> class Result {
+template <typename T, typename E> class [[nodiscard]] Result {
   std::variant<T, E> data;
-  bool hasValue;
 
 public:
-  Result(const T &value) : data(value), hasValue(true) {}
+  Result(const T &value) : data(std::in_place_index<0>, value) {}
+
+  Result(T &&value) : data(std::in_place_index<0>, std::move(value)) {}
+
+  Result(const E &error) : data(std::in_place_index<1>, error) {}
+
+  auto is_ok() const -> bool { return data.index() == 0; }
 
-  Result(const E &error) : data(error), hasValue(false) {}
+  auto is_err() const -> bool { return data.index() != 0; }
 
-  auto is_ok() const -> bool { return hasValue; }
+  /**
+   * Copy the value out, the result is kept
+   */
+  auto unwrap() const & -> T { return value(); }
 
-  auto is_err() const -> bool { return !hasValue; }
+  /**
+   * Move the value out of a temporary result
+   */
+  auto unwrap() && -> T { return std::move(value()); }
 
-  auto unwrap() const -> T {
-    if (hasValue) {
-      return std::get<T>(data);
-    } else {
-      throw std::runtime_error("Tried to unwrap error");
+  auto value() & -> T & {
+    if (auto ptr = std::get_if<0>(&data)) {
+      return *ptr;
     }
+    throw std::runtime_error("Tried to unwrap error");
   }
 
+  auto value() const & -> const T & {
+    if (auto ptr = std::get_if<0>(&data)) {
+      return *ptr;
+    }
+    throw std::runtime_error("Tried to unwrap error");
+  }
+
+  /**
+   * A reference into a temporary result would dangle, use `unwrap` instead
+   */
+  auto value() && -> T & = delete;
+
   auto unwrap_error() const -> E {
-    if (!hasValue) {
-      return std::get<E>(data);
-    } else {
-      throw std::runtime_error("Tried to unwrap value");
+    if (auto ptr = std::get_if<1>(&data)) {
+      return *ptr;
     }
+    throw std::runtime_error("Tried to unwrap value");
   }
 };
 
@@ -53,7 +81,7 @@ const ChfsNullResult KNullOk = ChfsNullResult(std::monostate());
     if (temp_res.is_err()) {                                                   \
       return ERROR_TYPE(temp_res.unwrap_error());                              \
     } else {                                                                   \
-      RESULT_VAR = temp_res.unwrap();                                          \
+      RESULT_VAR = std::move(temp_res).unwrap();                               \
     }                                                                          \
   }
 
@@ -0,0 +1,235 @@
+//===----------------------------------------------------------------------===//
+//
+//                         Chfs
+//
+// stats.h
+//
+// Identification: src/include/common/stats.h
+//
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+
+#include "./config.h"
+
+namespace chfs {
+
+/**
+ * The instrumented operations. The value recorded is the latency in
+ * nanoseconds, except for the `AllocatorScan`, which records the number of
+ * bitmap blocks scanned by an allocation.
+ */
+enum class Stat : u8 {
+  // the FUSE handlers of the daemon
+  FuseLookup,
+  FuseGetattr,
+  FuseSetattr,
+  FuseOpen,
+  FuseRelease,
+  FuseRead,
+  FuseWrite,
+  FuseFlush,
+  FuseFsync,
+  FuseMknod,
+  FuseMkdir,
+  FuseUnlink,
+  FuseOpendir,
+  FuseReaddir,
+  FuseIoctl,
+  // FileOperation
+  FsAllocInode,
+  FsGetattr,
+  FsReadFile,
+  FsReadFileWOff,
+  FsWriteFile,
+  FsWriteFileWOff,
+  FsResize,
+  FsFlush,
+  FsRemoveFile,
+  FsLookup,
+  FsMkfile,
+  FsMkdir,
+  FsUnlink,
+  // InodeManager
+  InodeAllocate,
+  InodeGet,
+  InodeRead,
+  InodeFree,
+  // BlockAllocator
+  AllocatorAllocate,
+  AllocatorAllocateN,
+  AllocatorDeallocate,
+  AllocatorScan,
+  // BlockManager
+  BlockRead,
+  BlockPeek,
+  BlockWrite,
+  BlockWritePartial,
+  BlockZero,
+  BlockSync,
+  Count,
+};
+
+const usize KStatCount = static_cast<usize>(Stat::Count);
+
+auto stat_name(Stat stat) -> const char *;
+
+/**
+ * A log-linear histogram in the manner of HdrHistogram: the values are
+ * bucketed by their highest bit, and each power of two is split into
+ * 2^KSubBucketBits linear sub-buckets, so a percentile is within 1/16 of the
+ * exact value.
+ *
+ * A histogram is written by a single thread, and it can be read by any
+ * thread meanwhile, so the counters are atomic but never contended.
+ */
+class Histogram {
+public:
+  static const u32 KSubBucketBits = 4;
+  static const u32 KSubBuckets = 1 << KSubBucketBits;
+  static const u32 KBuckets = (64 - KSubBucketBits + 1) * KSubBuckets;
+
+  static auto bucket_of(u64 value) -> u32;
+  /**
+   * The smallest value of a bucket
+   */
+  static auto bucket_floor(u32 bucket) -> u64;
+
+  auto record(u64 value) -> void {
+    increase(this->buckets[bucket_of(value)], 1);
+    increase(this->sum, value);
+    if (value > this->max_value.load(std::memory_order_relaxed)) {
+      this->max_value.store(value, std::memory_order_relaxed);
+    }
+  }
+
+  /**
+   * Add the counts of another histogram, which may be written meanwhile
+   */
+  auto merge(const Histogram &other) -> void;
+
+  auto count() const -> u64;
+  auto total() const -> u64 { return this->sum.load(std::memory_order_relaxed); }
+  /**
+   * The largest value recorded, exactly
+   */
+  auto max() const -> u64 {
+    return this->max_value.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * Get the value at a percentile in [0, 100], 0 if it is empty.
+   * The value is the middle of the bucket, see `max` for the exact maximum.
+   */
+  auto percentile(double p) const -> u64;
+
+  /**
+   * Clear the counters, by the owner thread
+   */
+  auto reset() -> void;
+
+private:
+  // only the owner thread writes, so the increment needs no atomic RMW
+  static auto increase(std::atomic<u64> &counter, u64 delta) -> void {
+    counter.store(counter.load(std::memory_order_relaxed) + delta,
+                  std::memory_order_relaxed);
+  }
+
+  std::atomic<u64> buckets[KBuckets] = {};
+  std::atomic<u64> sum{0};
+  std::atomic<u64> max_value{0};
+};
+
+/**
+ * Whether the operations are instrumented, it is off by default. The
+ * statistics are kept once it is on, even if it is turned off later.
+ */
+auto set_stats_enabled(bool enabled) -> void;
+
+extern std::atomic<bool> stats_enabled;
+
+/**
+ * Record a value of an operation in the histogram of the calling thread.
+ * It is a no-op if the statistics are disabled, as `count_stat` is.
+ */
+auto record_stat(Stat stat, u64 value) -> void;
+
+/**
+ * Count the bytes and the blocks processed by an operation
+ */
+auto count_stat(Stat stat, u64 bytes, u64 blocks) -> void;
+
+/**
+ * A snapshot of an operation merged from all the threads
+ */
+struct StatSummary {
+  Stat stat;
+  Histogram histogram;
+  u64 bytes;
+  u64 blocks;
+};
+
+/**
+ * Merge the statistics of every thread
+ *
+ * @return the summary of each operation, indexed by `Stat`
+ */
+auto collect_stats() -> std::unique_ptr<StatSummary[]>;
+
+/**
+ * Format the operations recorded as a table with the calls, p50, p99, p999,
+ * max, and the bytes and blocks processed
+ */
+auto dump_stats() -> std::string;
+
+/**
+ * Clear the statistics of every thread. Each thread clears its own counters
+ * upon its next record, and they are not collected meanwhile.
+ */
+auto reset_stats() -> void;
+
+/**
+ * Record the latency of the enclosing scope
+ */
+class StatTimer {
+  Stat stat;
+  bool enabled;
+  std::chrono::steady_clock::time_point start;
+
+public:
+  explicit StatTimer(Stat stat)
+      : stat(stat), enabled(stats_enabled.load(std::memory_order_relaxed)) {
+    if (this->enabled) {
+      this->start = std::chrono::steady_clock::now();
+    }
+  }
+
+  ~StatTimer() {
+    if (this->enabled) {
+      record_stat(this->stat,
+                  std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      std::chrono::steady_clock::now() - this->start)
+                      .count());
+    }
+  }
+
+  /**
+   * Count the bytes and the blocks processed by the operation
+   */
+  auto count(u64 bytes, u64 blocks = 0) -> void {
+    if (this->enabled) {
+      count_stat(this->stat, bytes, blocks);
+    }
+  }
+
+  StatTimer(const StatTimer &) = delete;
+  auto operator=(const StatTimer &) -> StatTimer & = delete;
+};
+
+} // namespace chfs
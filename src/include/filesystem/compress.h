@@ -0,0 +1,128 @@
+//===----------------------------------------------------------------------===//
+//
+//                         Chfs
+//
+// compress.h
+//
+// Identification: src/include/filesystem/compress.h
+//
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <list>
+#include <map>
+#include <vector>
+
+#include "common/config.h"
+
+namespace chfs {
+
+// The number of blocks compressed together
+const usize KClusterBlocks = 16;
+
+// The number of decompressed clusters cached
+const usize KClusterCacheSize = 64;
+
+/**
+ * Compress the data with an LZ77 codec in the manner of LZ4, which favors
+ * the speed over the ratio.
+ *
+ * @param dst the compressed data is appended to it
+ */
+auto lz_compress(const u8 *src, usize len, std::vector<u8> &dst) -> void;
+
+/**
+ * Decompress the data compressed by `lz_compress`
+ *
+ * @return false if the data is corrupted or not decompressed to exactly
+ * @dst_len bytes
+ */
+auto lz_decompress(const u8 *src, usize len, u8 *dst, usize dst_len) -> bool;
+
+/**
+ * The layout of a compressed file. The content is cut into clusters of
+ * `KClusterBlocks` blocks, each of them is compressed independently and
+ * stored in its own extent of blocks, so that a write only rewrites the
+ * clusters it modifies. The first block of the file indexes the clusters:
+ *
+ * | u32 cluster count | u32 stored length of each cluster |
+ *
+ * and the extents of the clusters follow it in order. A cluster that can't
+ * be compressed is stored as is, i.e., its stored length is its length. The
+ * index always fits in a block, and an empty file has no block.
+ */
+class ClusterIndex {
+public:
+  /**
+   * Compress a cluster, or copy it if it can't be compressed
+   *
+   * @param stored the stored cluster, whose length is the stored length
+   */
+  static auto encode_cluster(const u8 *raw, usize raw_len,
+                             std::vector<u8> &stored) -> void;
+
+  /**
+   * Decompress a cluster located by `locate`
+   *
+   * @param raw_len the length of the cluster before compression
+   * @return false if the cluster is corrupted
+   */
+  static auto decode_cluster(const u8 *stored, usize stored_len, usize raw_len,
+                             std::vector<u8> &cluster) -> bool;
+
+  /**
+   * Get the number of blocks of a file, including the index, from its index
+   */
+  static auto stored_blocks(const u8 *index, usize block_size) -> u64;
+
+  /**
+   * Locate a cluster from the index
+   *
+   * @return the index of the first block of its extent in the file, and its
+   * stored length
+   */
+  static auto locate(const u8 *index, usize idx, usize block_size)
+      -> std::pair<u64, usize>;
+};
+
+/**
+ * A LRU cache of the decompressed clusters, so that reading a compressed file
+ * piecewise doesn't decompress a cluster repeatedly.
+ *
+ * The clusters of a file must be invalidated once the file is written. Note
+ * that the cache is **not** thread-safe.
+ */
+class ClusterCache {
+  using Key = std::pair<inode_id_t, usize>;
+
+  usize capacity;
+  // the most recently used cluster is at the front
+  std::list<std::pair<Key, std::vector<u8>>> lru;
+  std::map<Key, decltype(lru)::iterator> index;
+
+public:
+  explicit ClusterCache(usize capacity) : capacity(capacity) {}
+
+  /**
+   * Get a cached cluster of a file
+   *
+   * @return nullptr if it is not cached
+   */
+  auto get(inode_id_t id, usize idx) -> const std::vector<u8> *;
+
+  /**
+   * Cache a cluster of a file, the least recently used one is evicted if the
+   * cache is full
+   */
+  auto put(inode_id_t id, usize idx, std::vector<u8> cluster)
+      -> const std::vector<u8> *;
+
+  /**
+   * Drop the cached clusters of a file
+   */
+  auto invalidate(inode_id_t id) -> void;
+};
+
+} // namespace chfs
@@ -0,0 +1,179 @@
+//===----------------------------------------------------------------------===//
+//
+//                         Chfs
+//
+// fsck.h
+//
+// Identification: src/include/filesystem/fsck.h
+//
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "block/refcount.h"
+#include "metadata/superblock.h"
+
+namespace chfs {
+
+// The index of a claimed block that is not file content
+const usize KFsckInodeBlock = static_cast<usize>(-1);
+const usize KFsckIndirectBlock = static_cast<usize>(-2);
+
+/**
+ * A directory entry referring to an inode that is not allocated (or bad)
+ */
+struct FsckDanglingEntry {
+  inode_id_t dir;
+  std::string name;
+  inode_id_t id;
+};
+
+/**
+ * A block claimed by an inode while it is already claimed by another one
+ * (or the same inode). Only the later claim is recorded.
+ */
+struct FsckSharedBlock {
+  inode_id_t inode;
+  // the index of the block in the file, or KFsckInodeBlock/KFsckIndirectBlock
+  usize idx;
+  block_id_t block_id;
+};
+
+/**
+ * The inconsistencies found by `Fsck::check`
+ */
+struct FsckReport {
+  // The number of allocated inodes
+  u64 inodes = 0;
+  // The number of blocks in use, including the metadata and the journal
+  u64 used_blocks = 0;
+  // Allocated inodes with an invalid inode block, type or block ids.
+  // They are freed upon repair.
+  std::vector<inode_id_t> bad_inodes;
+  // Allocated inodes unreachable from the root. The ones not referred by any
+  // directory are reconnected to /lost+found upon repair.
+  std::vector<inode_id_t> orphan_inodes;
+  // Reachable entries referring to free or bad inodes, removed upon repair
+  std::vector<FsckDanglingEntry> dangling_entries;
+  // Blocks claimed twice, the later claims get a copy upon repair
+  std::vector<FsckSharedBlock> shared_blocks;
+  // Blocks allocated in the bitmap but not in use
+  std::vector<block_id_t> leaked_blocks;
+  // Blocks in use but free in the bitmap
+  std::vector<block_id_t> unmarked_blocks;
+  // Whether the free block counter recorded upon a clean unmount is wrong
+  bool bad_free_counter = false;
+  // Blocks not matching their checksums. Their contents are accepted upon
+  // repair, since there is no other copy of them.
+  std::vector<block_id_t> corrupted_blocks;
+
+  auto is_clean() const -> bool {
+    return bad_inodes.empty() && orphan_inodes.empty() &&
+           dangling_entries.empty() && shared_blocks.empty() &&
+           leaked_blocks.empty() && unmarked_blocks.empty() &&
+           !bad_free_counter && corrupted_blocks.empty();
+  }
+};
+
+/**
+ * A bitmap whose bits can be set by threads concurrently
+ */
+class ConcurrentBitmap {
+  std::vector<std::atomic<u64>> words;
+
+public:
+  explicit ConcurrentBitmap(usize bits) : words((bits + 63) / 64) {}
+
+  /**
+   * Set the bit at the index
+   * @return whether the bit was set before
+   */
+  auto test_and_set(usize index) -> bool {
+    const u64 mask = static_cast<u64>(1) << (index % 64);
+    return (this->words[index / 64].fetch_or(mask) & mask) != 0;
+  }
+
+  auto check(usize index) const -> bool {
+    return (this->words[index / 64].load() >> (index % 64)) & 1;
+  }
+};
+
+/**
+ * Fsck checks the consistency of an unmounted filesystem, i.e., the inode
+ * table, the inode bitmap, the block bitmap and the directory tree.
+ *
+ * The inodes are checked in ranges of an inode table block across a pool of
+ * threads, which mark the blocks they claim in a shared bitmap. The
+ * directory tree is then walked in memory, and the bitmap blocks are compared
+ * with the claimed blocks in parallel again.
+ *
+ * The inodes of the snapshots claim the blocks only they refer to. A block
+ * with a reference counter may be claimed more than once, but the counters
+ * themselves are not verified.
+ *
+ * If the blocks are checksummed, they are verified in parallel as well
+ * unless the filesystem was not unmounted cleanly, and the repair recomputes
+ * all the checksums.
+ */
+class Fsck {
+  std::shared_ptr<BlockManager> bm;
+  std::shared_ptr<SuperBlock> super_block;
+  inode_id_t root;
+
+  u64 max_inode;
+  u64 n_table_blocks;
+  block_id_t inode_bitmap_start;
+  block_id_t block_bitmap_start;
+  u64 n_block_bitmap_blocks;
+  // the first block that can be claimed by an inode
+  block_id_t data_start;
+  // the reference counters, nullptr if the blocks cannot be shared
+  std::unique_ptr<RefcountTable> refcount;
+
+  // the blocks in use, valid after a check
+  std::unique_ptr<ConcurrentBitmap> used;
+
+public:
+  /**
+   * Open the filesystem on the block manager. The committed transactions in
+   * the journal are replayed first.
+   *
+   * @param root the inode of the root directory
+   * @return INVALID if the device is not formatted by chfs
+   */
+  static auto open(std::shared_ptr<BlockManager> bm, inode_id_t root = 1)
+      -> ChfsResult<std::shared_ptr<Fsck>>;
+
+  /**
+   * Check the filesystem. It doesn't modify any block.
+   *
+   * @param threads the number of threads to check the inodes and the bitmaps
+   * @return INVALID if the root is not a valid directory
+   */
+  auto check(usize threads) -> ChfsResult<FsckReport>;
+
+  /**
+   * Fix the inconsistencies found by the last check in place, and unmount
+   * the filesystem cleanly. Check again to see whether it is consistent.
+   */
+  auto repair(const FsckReport &report) -> ChfsNullResult;
+
+private:
+  Fsck(std::shared_ptr<BlockManager> bm,
+       std::shared_ptr<SuperBlock> super_block, inode_id_t root);
+
+  auto is_data_block(block_id_t block_id) const -> bool;
+  auto table_entry(inode_id_t id) const -> std::pair<block_id_t, usize>;
+  auto allocate_block() -> ChfsResult<block_id_t>;
+  auto copy_block(block_id_t block_id) -> ChfsResult<block_id_t>;
+  auto repair_shared_blocks(const FsckReport &report) -> ChfsNullResult;
+  auto repair_namespace(const FsckReport &report) -> ChfsNullResult;
+};
+
+} // namespace chfs
@@ -11,11 +11,40 @@
 
 #pragma once
 
+#include "block/fingerprint.h"
+#include "block/journal.h"
+#include "block/refcount.h"
+#include "common/range_set.h"
+#include "filesystem/compress.h"
 #include "metadata/manager.h"
+#include <functional>
+#include <map>
 #include <sys/stat.h>
+#include <unordered_map>
 
 namespace chfs {
 
+/**
+ * An entry of the snapshot list, which fills the block recorded in the super
+ * block. The index of the entry is the id of the snapshot.
+ */
+struct SnapshotEntry {
+  // the first block of the frozen inode table (followed by the inode bitmap),
+  // 0 if the entry is unused
+  block_id_t table_start;
+  // the creation time
+  u64 time;
+};
+
+/**
+ * A contiguous part of the file content in memory, see
+ * `FileOperation::read_file_in_place`
+ */
+struct FileSlice {
+  const u8 *data;
+  u64 len;
+};
+
 /**
  * Implement the basic inode filesystem
  */
@@ -26,6 +55,96 @@ protected:
   [[maybe_unused]] std::shared_ptr<BlockManager> block_manager_;
   [[maybe_unused]] std::shared_ptr<InodeManager> inode_manager_;
   [[maybe_unused]] std::shared_ptr<BlockAllocator> block_allocator_;
+  // The metadata journal, nullptr if the filesystem has no journal
+  std::shared_ptr<Journal> journal_;
+  // The blocks freed by the running transaction. They stay allocated until
+  // it commits, otherwise their new content written in place would corrupt
+  // the files still referring to them after a crash.
+  std::shared_ptr<std::vector<block_id_t>> pending_frees_ =
+      std::make_shared<std::vector<block_id_t>>();
+
+  /**
+   * Group the block writes of an operation into the same journal transaction
+   */
+  class JournalOp {
+    Journal *journal;
+
+  public:
+    explicit JournalOp(Journal *journal) : journal(journal) {
+      if (journal != nullptr) {
+        journal->begin_op();
+      }
+    }
+    ~JournalOp() {
+      if (journal != nullptr) {
+        journal->end_op();
+      }
+    }
+    JournalOp(const JournalOp &) = delete;
+    auto operator=(const JournalOp &) -> JournalOp & = delete;
+  };
+
+  /**
+   * A buffered block of a file under delayed allocation
+   */
+  struct DirtyBlock {
+    std::vector<u8> data;
+    // the bytes written, the others are read from the device when needed
+    RangeSet written;
+
+    auto is_full(usize block_size) const -> bool {
+      return written.covers(0, block_size);
+    }
+  };
+
+  /**
+   * The buffered content of a file under delayed allocation. Only the blocks
+   * written are buffered, the others are still read from the device.
+   */
+  struct DirtyFile {
+    // the buffered blocks by their indexes in the file
+    std::map<u64, DirtyBlock> blocks;
+    // the content stored on the device is valid below it, i.e., the file has
+    // not been truncated below it since it is buffered. The content beyond it
+    // is zeros if not written.
+    u64 stored_size;
+    // the size of the content on the device
+    u64 ondisk_size;
+    // the attribute to report before the content is flushed, including the
+    // size of the buffered content
+    FileAttr attr;
+    // the number of blocks (including the indirect one) on the device
+    usize ondisk_blocks;
+    // the number of blocks reserved for the content
+    usize reserved_blocks;
+    u64 max_file_sz;
+    // whether the content is compressed upon flush
+    bool compressed;
+    // the file, whose compressed content is read through the cluster cache
+    inode_id_t id;
+  };
+
+  // Delayed allocation: the files written but not yet flushed.
+  // It is disabled if the dirty_limit_ is 0.
+  std::unordered_map<inode_id_t, DirtyFile> dirty_files_;
+  u64 dirty_limit_ = 0;
+  u64 dirty_bytes_ = 0;
+  usize reserved_blocks_ = 0;
+
+  // The reference counters of the shared blocks, nullptr if the filesystem
+  // is formatted without block sharing (and thus snapshots)
+  std::shared_ptr<RefcountTable> refcount_;
+  block_id_t snapshot_block_ = 0;
+  // A mounted snapshot is read-only
+  bool read_only_ = false;
+  // The index of the file blocks by their contents, nullptr if the blocks
+  // are not deduplicated
+  std::shared_ptr<FingerprintIndex> dedup_;
+
+  // The decompressed clusters of the compressed files
+  ClusterCache cluster_cache_{KClusterCacheSize};
+  // Whether the files are compressed once they are created
+  bool compress_new_files_ = false;
 
 public:
   /**
@@ -33,8 +152,16 @@ public:
    * @param bm the block manager to manage the block device
    * @param max_inode_supported the maximum number of inodes supported by the
    * filesystem
+   * @param allocator_type the strategy of the block allocator, it is recorded
+   * in the super block
+   * @param journal_blocks the size of the metadata journal, which must be a
+   * power of two. 0 disables the journal.
+   * @param block_sharing whether the blocks can be shared, which is required
+   * by the snapshots
    */
-  FileOperation(std::shared_ptr<BlockManager> bm, u64 max_inode_supported);
+  FileOperation(std::shared_ptr<BlockManager> bm, u64 max_inode_supported,
+                AllocatorType allocator_type = AllocatorType::Bitmap,
+                usize journal_blocks = 0, bool block_sharing = false);
 
   /**
    * Create a filesystem handler from an initialized filesystem
@@ -44,6 +171,28 @@ public:
   static auto create_from_raw(std::shared_ptr<BlockManager> bm)
       -> ChfsResult<std::shared_ptr<FileOperation>>;
 
+  /**
+   * Mount a snapshot of an initialized filesystem. The snapshot is
+   * read-only, and nothing is written to the block manager.
+   *
+   * @param id the id of the snapshot
+   * @return NotExist if there is no such snapshot
+   */
+  static auto create_from_snapshot(std::shared_ptr<BlockManager> bm, u32 id)
+      -> ChfsResult<std::shared_ptr<FileOperation>>;
+
+  /**
+   * Whether the filesystem is a read-only snapshot
+   */
+  auto is_read_only() const -> bool { return read_only_; }
+
+  /**
+   * Get the block manager of the filesystem
+   */
+  auto get_block_manager() const -> std::shared_ptr<BlockManager> {
+    return block_manager_;
+  }
+
   /**
    * Get the free inodes of the filesystem.
    * Will read the inode bitmap of the underlying filesystem
@@ -87,11 +236,52 @@ public:
    * If the inode's block is insufficient, we will dynamically allocate more
    * blocks
    *
+   * If delayed allocation is enabled, the content is buffered in memory and
+   * only the blocks it needs are reserved. The blocks are allocated when the
+   * file is flushed.
+   *
    * @param id the id of the inode
    * @param content the content to write
    */
   auto write_file(inode_id_t, const std::vector<u8> &content) -> ChfsNullResult;
 
+  /**
+   * Enable (or disable) delayed allocation for file writes.
+   *
+   * @param dirty_limit the maximum bytes of the buffered content. If it is
+   * exceeded, all the buffered files are flushed. 0 disables delayed
+   * allocation and flushes the buffered files.
+   */
+  auto set_delayed_allocation(u64 dirty_limit) -> ChfsNullResult;
+
+  /**
+   * Flush the buffered content of a file to the blocks.
+   * It is a no-op if the file has no buffered content.
+   *
+   * @param id the id of the inode
+   */
+  auto flush(inode_id_t id) -> ChfsNullResult;
+
+  /**
+   * Flush the buffered content of a file and make the filesystem durable,
+   * i.e., commit the metadata journal.
+   *
+   * @param id the id of the inode
+   */
+  auto fsync(inode_id_t id) -> ChfsNullResult;
+
+  /**
+   * Flush all the buffered files and commit the metadata journal.
+   */
+  auto sync() -> ChfsNullResult;
+
+  /**
+   * Make the filesystem durable and mark it unmounted cleanly, so that the
+   * next mount needs no recovery. The filesystem should not be modified
+   * afterwards.
+   */
+  auto unmount() -> ChfsNullResult;
+
   /**
    * Write the content to the blocks pointed by the inode
    * If the inode's block is insufficient, we will dynamically allocate more
@@ -112,14 +302,36 @@ public:
   auto read_file(inode_id_t) -> ChfsResult<std::vector<u8>>;
 
   /**
-   * Read the content to the blocks pointed by the inode
+   * Read the content to the blocks pointed by the inode. Only the blocks
+   * covering the range are read.
    *
    * # Note
-   * We assume that the offset + size <= file size
+   * The range is truncated at the end of the file
    */
   auto read_file_w_off(inode_id_t id, u64 sz, u64 offset)
       -> ChfsResult<std::vector<u8>>;
 
+  /**
+   * Read a range of a file without copying it. The content is returned as
+   * the slices of the block device (or the buffered content), the adjacent
+   * blocks are merged into one slice. The slices are valid until the file or
+   * the device is written.
+   *
+   * # Note
+   * The range is truncated at the end of the file.
+   * It fails with INVALID if the content is not stored as is, i.e., the file
+   * is compressed, so that it must be read by `read_file_w_off`.
+   */
+  auto read_file_in_place(inode_id_t id, u64 sz, u64 offset)
+      -> ChfsResult<std::vector<FileSlice>>;
+
+  /**
+   * Hint that a range of a file will be read soon, its blocks are read ahead
+   * asynchronously by the device, see `BlockManager::prefetch`. The range is
+   * usually suggested by a `ReadaheadWindow`.
+   */
+  auto readahead(inode_id_t id, u64 offset, u64 len) -> ChfsNullResult;
+
   /**
    * Remove the file corresponding to an inode.
    * It is defined in contorl_op.cc
@@ -185,11 +397,359 @@ public:
    */
   auto unlink(inode_id_t parent, const char *name) -> ChfsNullResult;
 
+  // Block sharing operations, defined in snapshot_op.cc
+
+  /**
+   * Clone a range of a file into a file (or itself) by sharing the blocks,
+   * which are copied upon the next write. The destination grows if the range
+   * exceeds its end.
+   *
+   * The offsets must be aligned to the block size, so must be the length
+   * unless the range ends at the end of the source file and covers the end
+   * of the destination file.
+   *
+   * @return INVALID if the filesystem is formatted without block sharing.
+   * INVALID_ARG if the range is unaligned, beyond the source file, or
+   * overlapping with itself.
+   */
+  auto clone_range(inode_id_t src, u64 src_off, inode_id_t dst, u64 dst_off,
+                   u64 len) -> ChfsNullResult;
+
+  /**
+   * Take a point-in-time snapshot of the filesystem.
+   *
+   * The inode table and the inode bitmap are copied, and the inode blocks
+   * become shared with the snapshot. The following writes copy the shared
+   * blocks, so the snapshot costs no data copy.
+   *
+   * @return the id of the snapshot. INVALID if the filesystem is formatted
+   * without block sharing, OUT_OF_RESOURCE if the snapshot list is full.
+   */
+  auto snapshot() -> ChfsResult<u32>;
+
+  /**
+   * List the snapshots
+   *
+   * @return the ids and the creation time of the snapshots
+   */
+  auto list_snapshots() -> ChfsResult<std::vector<std::pair<u32, u64>>>;
+
+  /**
+   * Delete a snapshot and release the blocks only referenced by it
+   */
+  auto delete_snapshot(u32 id) -> ChfsNullResult;
+
+  // Deduplication, defined in dedup_op.cc
+
+  /**
+   * Deduplicate the file blocks written from now on: a block whose content
+   * is already stored shares the existing block instead. The blocks written
+   * before are deduplicated by `deduplicate`.
+   *
+   * Block sharing is enabled if the filesystem is formatted without it.
+   * The setting is recorded in the super block.
+   *
+   * @param index_blocks the size of the fingerprint index
+   * @return AlreadyExist if the deduplication is enabled
+   */
+  auto enable_dedup(usize index_blocks) -> ChfsNullResult;
+
+  /**
+   * Whether the file blocks are deduplicated
+   */
+  auto is_dedup_enabled() const -> bool { return dedup_ != nullptr; }
+
+  /**
+   * Deduplicate the blocks of all the files, e.g., those written before the
+   * deduplication is enabled. It scans the whole filesystem and is meant to
+   * be run offline.
+   *
+   * @return the number of the blocks freed. INVALID if the deduplication is
+   * not enabled.
+   */
+  auto deduplicate() -> ChfsResult<u64>;
+
+  // Compression, defined in compress_op.cc
+
+  /**
+   * Compress (or decompress) the content of a file. The following writes
+   * keep the content compressed, see `ClusterIndex` for the layout.
+   *
+   * @return INVALID_ARG if the inode is not a file
+   */
+  auto set_compression(inode_id_t id, bool compressed) -> ChfsNullResult;
+
+  /**
+   * Whether the content of a file is compressed
+   */
+  auto get_compression(inode_id_t id) -> ChfsResult<bool>;
+
+  /**
+   * Compress the files created from now on
+   */
+  auto set_compress_new_files(bool enable) -> void {
+    compress_new_files_ = enable;
+  }
+
+  // Checksums, defined in control_op.cc
+
+  /**
+   * Checksum all the blocks of the device, so that a corrupted block is
+   * reported as `Corrupted` instead of being used, see
+   * `BlockManager::enable_checksum`. The setting is recorded in the super
+   * block.
+   *
+   * @return AlreadyExist if the checksums are enabled
+   */
+  auto enable_checksum() -> ChfsNullResult;
+
+  /**
+   * Whether the blocks are checksummed
+   */
+  auto is_checksum_enabled() const -> bool {
+    return block_manager_->checksum_region_blocks() != 0;
+  }
+
 private:
+  /**
+   * Write the content to the blocks pointed by the inode, bypassing the
+   * delayed allocation buffer
+   *
+   * @param modified if given, the existing blocks not overlapping the ranges
+   * are known to be unchanged and thus not written
+   */
+  auto write_file_to_blocks(inode_id_t id, const std::vector<u8> &content,
+                            const RangeSet *modified = nullptr)
+      -> ChfsNullResult;
+
+  /**
+   * Produce a block of the content written by `write_file_to_blocks`
+   *
+   * @param block_idx the index of the block in the file
+   * @param stored the block storing it on the device before the write,
+   * KInvalidBlockID if there is none
+   * @param data the buffer of a block to fill
+   */
+  using BlockSource = std::function<ChfsNullResult(
+      u64 block_idx, block_id_t stored, u8 *data)>;
+
+  /**
+   * Write the content of the size produced by the source block by block.
+   * See above for the other parameters.
+   */
+  auto write_file_to_blocks(inode_id_t id, u64 size, const BlockSource &source,
+                            const RangeSet *modified) -> ChfsNullResult;
+
+  /**
+   * Write a data block of a file, which is deduplicated, or copied if it is
+   * shared
+   *
+   * @param fresh whether the block is newly allocated, i.e., it holds nothing
+   * @return the block holding the content
+   */
+  auto write_file_block(const Inode *inode_p, block_id_t block_id, bool fresh,
+                        const u8 *data) -> ChfsResult<block_id_t>;
+
+  /**
+   * Read the content from the blocks pointed by the inode, bypassing the
+   * delayed allocation buffer
+   */
+  auto read_file_from_blocks(inode_id_t id) -> ChfsResult<std::vector<u8>>;
+
+  /**
+   * Buffer the content of a file and reserve the blocks it needs
+   */
+  auto buffer_write(inode_id_t id, const std::vector<u8> &content)
+      -> ChfsNullResult;
+
+  /**
+   * Write a range of a file into its buffered blocks. Only the blocks
+   * overlapping the range are buffered, and a partially written one is
+   * completed from the device upon flush (or read).
+   */
+  auto buffer_write_at(inode_id_t id, const u8 *data, u64 sz, u64 offset)
+      -> ChfsNullResult;
+
+  /**
+   * Get the buffered content of a file, the buffer is created if it doesn't
+   * exist
+   *
+   * @return the buffer and whether it is newly created
+   */
+  auto get_dirty(inode_id_t id) -> ChfsResult<std::pair<DirtyFile *, bool>>;
+
+  /**
+   * Buffer the whole content of a file, replacing the buffered blocks
+   */
+  auto fill_dirty(DirtyFile &dirty, const std::vector<u8> &content) -> void;
+
+  /**
+   * Read a block of a buffered file, i.e., its stored content patched with
+   * the buffered bytes
+   *
+   * @param stored the block storing it on the device, KInvalidBlockID if
+   * there is none
+   */
+  auto read_dirty_block(const DirtyFile &dirty, u64 block_idx,
+                        block_id_t stored, u8 *data) -> ChfsNullResult;
+
+  /**
+   * `read_file_in_place` of a buffered file. A partially buffered block in
+   * the range is completed from the device, so that it can be sliced.
+   */
+  auto read_dirty_in_place(const Inode *inode_p, DirtyFile &dirty, u64 sz,
+                           u64 offset) -> ChfsResult<std::vector<FileSlice>>;
+
+  /**
+   * Reserve the blocks for the buffered content growing (or shrinking) to
+   * the size
+   *
+   * @return OUT_OF_RESOURCE if the file is too large or the blocks run out
+   */
+  auto reserve_dirty(DirtyFile &dirty, u64 size) -> ChfsNullResult;
+
+  /**
+   * Flush all the buffered files, without committing the journal
+   */
+  auto flush_all() -> ChfsNullResult;
+
+  /**
+   * Drop the buffered content of a file and release its reservation
+   */
+  auto drop_dirty(inode_id_t id) -> void;
+
+  /**
+   * Release the references of blocks, a block is freed upon its last
+   * reference
+   */
+  auto release_blocks(const std::vector<block_id_t> &blocks) -> ChfsNullResult;
+
+  /**
+   * Free blocks once the running transaction commits, or at once if the
+   * filesystem has no journal
+   */
+  auto free_after_commit(const std::vector<block_id_t> &blocks)
+      -> ChfsNullResult;
+
+  /**
+   * Release the reference of an inode block, and its content if it is the
+   * last reference
+   */
+  auto release_inode_block(block_id_t inode_block) -> ChfsNullResult;
+
+  /**
+   * Stop sharing a block pointing to other blocks, i.e., an inode block or an
+   * indirect block. The children gain a reference from the copy, and the
+   * reference to the shared block is released.
+   *
+   * The content is not copied, the caller writes it to the returned block.
+   *
+   * @param children the blocks the shared block points to
+   * @return the block replacing the shared one
+   */
+  auto unshare_block(block_id_t block_id,
+                     const std::vector<block_id_t> &children)
+      -> ChfsResult<block_id_t>;
+
+  /**
+   * Make the inode block and the indirect block of a file exclusively owned
+   * by the file before they are modified, see `unshare_block`
+   *
+   * @param inode the content of the inode block, whose id may be updated
+   * @param indirect_block the content of the indirect block, if any
+   * @param block_num the number of data blocks of the file
+   */
+  auto own_inode_blocks(inode_id_t id, u8 *inode, block_id_t &inode_bid,
+                        const std::vector<u8> &indirect_block, usize block_num)
+      -> ChfsNullResult;
+
+  /**
+   * Write a block of a file, which is copied if it is shared
+   *
+   * @return the block holding the content
+   */
+  auto write_shared_block(block_id_t block_id, const u8 *data, bool journaled)
+      -> ChfsResult<block_id_t>;
+
+  /**
+   * Write a block of a file with deduplication. The content shares a block
+   * holding the same content if there is one, otherwise it is written to the
+   * block (or a copy of it, if the block is shared).
+   *
+   * @param fresh whether the block is newly allocated, i.e., it holds nothing
+   * @return the block holding the content
+   */
+  auto dedup_write_block(block_id_t block_id, bool fresh, const u8 *data)
+      -> ChfsResult<block_id_t>;
+
+  /**
+   * Find a block other than @exclude with the same content
+   *
+   * @return the block, KInvalidBlockID if there is none
+   */
+  auto find_duplicate(u64 fingerprint, const u8 *data, block_id_t exclude)
+      -> ChfsResult<block_id_t>;
+
+  /**
+   * Deduplicate the data blocks of a file
+   */
+  auto dedup_file(inode_id_t id) -> ChfsNullResult;
+
+  /**
+   * Get the size of the content stored in the blocks of a file, which is
+   * smaller than the file size if the file is compressed
+   */
+  auto get_stored_size(const Inode *inode) -> ChfsResult<u64>;
+
+  /**
+   * Get the blocks of a file in the range [begin, end) of the block indexes
+   *
+   * @return INVALID_ARG if the range is not within the file
+   */
+  auto get_file_blocks(const Inode *inode_p, usize begin, usize end,
+                       std::vector<block_id_t> &blocks) -> ChfsNullResult;
+
+  /**
+   * `write_file_to_blocks` of a compressed file. Only the clusters
+   * overlapping @modified (or whose length changes) are compressed and
+   * rewritten, the others keep their blocks.
+   */
+  auto write_compressed_to_blocks(inode_id_t id, u64 size,
+                                  const BlockSource &source,
+                                  const RangeSet *modified) -> ChfsNullResult;
+
+  /**
+   * Read a range of a compressed file through the cluster cache, only the
+   * clusters covering the range are decompressed
+   */
+  auto read_compressed(inode_id_t id, u64 sz, u64 offset)
+      -> ChfsResult<std::vector<u8>>;
+
+  /**
+   * Read the snapshot list
+   */
+  auto read_snapshot_list(std::vector<u8> &buffer) -> ChfsNullResult;
+
+  /**
+   * Prepare the journal (if any) for the filesystem
+   */
+  auto setup_journal() -> void;
+
+  /**
+   * Commit the journal, if any
+   */
+  auto commit_journal() -> ChfsNullResult {
+    return this->journal_ != nullptr ? this->journal_->commit() : KNullOk;
+  }
+
   FileOperation(std::shared_ptr<BlockManager> bm,
                 std::shared_ptr<InodeManager> im,
-                std::shared_ptr<BlockAllocator> ba)
-      : block_manager_(bm), inode_manager_(im), block_allocator_(ba) {}
+                std::shared_ptr<BlockAllocator> ba,
+                std::shared_ptr<Journal> journal = nullptr)
+      : block_manager_(bm), inode_manager_(im), block_allocator_(ba),
+        journal_(journal) {
+    this->setup_journal();
+  }
 };
 
 } // namespace chfs
\ No newline at end of file
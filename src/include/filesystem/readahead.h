@@ -0,0 +1,65 @@
+//===----------------------------------------------------------------------===//
+//
+//                         Chfs
+//
+// readahead.h
+//
+// Identification: src/include/filesystem/readahead.h
+//
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <utility>
+
+#include "common/config.h"
+
+namespace chfs {
+
+// The readahead window of a newly detected sequential stream, and its limit
+const u64 KReadaheadMinBytes = 64 * 1024;
+const u64 KReadaheadMaxBytes = 2 * 1024 * 1024;
+
+/**
+ * ReadaheadWindow detects the sequential reads of an open file and suggests
+ * the range to read ahead, in the manner of the Linux page cache:
+ *
+ * - A read starting where the last one ended continues a stream. Any other
+ *   read resets the window.
+ * - The window ahead of a stream is read once less than half of it is left,
+ *   so the following reads find their blocks ready while the next part is
+ *   fetched asynchronously. The window doubles each time, up to its limit.
+ *
+ * Note that the window is **not** thread-safe.
+ */
+class ReadaheadWindow {
+  u64 min_window;
+  u64 max_window;
+  // where the next sequential read starts
+  u64 next_offset = 0;
+  // 0 if the reads are not sequential
+  u64 window = 0;
+  // the end of the range read ahead
+  u64 ahead_end = 0;
+
+public:
+  explicit ReadaheadWindow(u64 min_window = KReadaheadMinBytes,
+                           u64 max_window = KReadaheadMaxBytes)
+      : min_window(min_window), max_window(max_window) {}
+
+  /**
+   * Record a read of the file
+   *
+   * @return the offset and the length of the range to read ahead, the length
+   * is 0 if nothing should be read ahead
+   */
+  auto on_read(u64 offset, u64 len) -> std::pair<u64, u64>;
+
+  /**
+   * Get the current window, 0 if the reads are not sequential
+   */
+  auto get_window() const -> u64 { return this->window; }
+};
+
+} // namespace chfs
@@ -0,0 +1,236 @@
+//===----------------------------------------------------------------------===//
+//
+//                         Chfs
+//
+// trace.h
+//
+// Identification: src/include/filesystem/trace.h
+//
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "filesystem/operations.h"
+
+namespace chfs {
+
+// "CHTR", the first 4 bytes of a trace file
+const u32 KTraceMagic = 0x52544843;
+const u32 KTraceVersion = 1;
+
+// The bytes buffered by a trace writer before they are written to the file
+const usize KTraceBufferSize = 1024 * 1024;
+
+/**
+ * The FUSE operations traced
+ */
+enum class TraceOp : u8 {
+  Lookup = 1,
+  Getattr,
+  Setattr,
+  Open,
+  Release,
+  Read,
+  Write,
+  Flush,
+  Fsync,
+  Mknod,
+  Mkdir,
+  Unlink,
+  Opendir,
+  Readdir,
+  Releasedir,
+  Ioctl,
+};
+
+auto trace_op_name(TraceOp op) -> const char *;
+
+/**
+ * The header of a trace file
+ */
+struct TraceHeader {
+  u32 magic;
+  u32 version;
+  // nanoseconds since the epoch when the trace started
+  u64 start_time;
+} __attribute__((packed));
+
+/**
+ * A traced operation. The record is followed by `name_len` bytes of the name
+ * if the operation has one, e.g., a lookup. The content of the writes is not
+ * traced, a replay writes zeros.
+ */
+struct TraceRecord {
+  // nanoseconds since the trace started, when the operation arrived
+  u64 start;
+  // the inode, or the parent of a named operation
+  u64 ino;
+  // the offset and the size of a read or a write, the size of a setattr and
+  // the command of an ioctl
+  u64 offset;
+  u64 size;
+  // the inode created or looked up, 0 if the operation failed
+  u64 result;
+  // nanoseconds until the operation was replied, saturated
+  u32 duration;
+  uint16_t name_len;
+  TraceOp op;
+  u8 reserved;
+} __attribute__((packed));
+
+static_assert(sizeof(TraceRecord) == 48, "A trace record must be compact");
+
+/**
+ * Append the records to a trace file. The records are buffered and written
+ * in batches, so a request rarely waits for the file.
+ *
+ * Note that the writer is **not** thread-safe, as the daemon is
+ * single-threaded.
+ */
+class TraceWriter {
+  int fd;
+  std::chrono::steady_clock::time_point start_;
+  std::vector<u8> buffer;
+
+  TraceWriter(int fd, std::chrono::steady_clock::time_point start)
+      : fd(fd), start_(start) {
+    buffer.reserve(KTraceBufferSize);
+  }
+
+public:
+  /**
+   * Create (or truncate) a trace file
+   */
+  static auto create(const std::string &path)
+      -> ChfsResult<std::shared_ptr<TraceWriter>>;
+
+  ~TraceWriter();
+
+  TraceWriter(const TraceWriter &) = delete;
+  auto operator=(const TraceWriter &) -> TraceWriter & = delete;
+
+  /**
+   * Nanoseconds since the trace started
+   */
+  auto now() const -> u64 {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now() - start_)
+        .count();
+  }
+
+  auto append(const TraceRecord &record, const char *name) -> void;
+
+  /**
+   * Write the buffered records to the file
+   */
+  auto flush() -> ChfsNullResult;
+};
+
+/**
+ * Trace an operation from its arrival to the end of the enclosing scope, i.e.,
+ * after it is replied. It does nothing if the writer is null.
+ */
+class TraceScope {
+  TraceWriter *writer;
+  TraceRecord record;
+  const char *name;
+
+public:
+  TraceScope(TraceWriter *writer, TraceOp op, u64 ino,
+             const char *name = nullptr)
+      : writer(writer), record(), name(name) {
+    if (writer != nullptr) {
+      record.start = writer->now();
+      record.ino = ino;
+      record.op = op;
+    }
+  }
+
+  ~TraceScope() {
+    if (writer != nullptr) {
+      record.duration = static_cast<u32>(
+          std::min<u64>(writer->now() - record.start, ~u32(0)));
+      writer->append(record, name);
+    }
+  }
+
+  auto set_range(u64 offset, u64 size) -> void {
+    record.offset = offset;
+    record.size = size;
+  }
+
+  auto set_result(u64 result) -> void { record.result = result; }
+
+  TraceScope(const TraceScope &) = delete;
+  auto operator=(const TraceScope &) -> TraceScope & = delete;
+};
+
+/**
+ * Read the records of a trace file, which is loaded into memory at once
+ */
+class TraceReader {
+  std::vector<u8> data;
+  usize pos;
+
+  explicit TraceReader(std::vector<u8> data)
+      : data(std::move(data)), pos(sizeof(TraceHeader)) {}
+
+public:
+  /**
+   * @return NotExist if the file cannot be read, INVALID if it is not a trace
+   */
+  static auto open(const std::string &path)
+      -> ChfsResult<std::shared_ptr<TraceReader>>;
+
+  auto header() const -> const TraceHeader & {
+    return *reinterpret_cast<const TraceHeader *>(data.data());
+  }
+
+  /**
+   * Read the next record and its name
+   *
+   * @return false if there is no more complete record
+   */
+  auto next(TraceRecord &record, std::string &name) -> bool;
+};
+
+/**
+ * Re-execute the traced operations against a filesystem.
+ *
+ * The inodes created or looked up in the trace are mapped to the ones of the
+ * replay, and the other inodes are assumed to be the same, e.g., the root. So
+ * a trace is replayed faithfully on a copy of the image it is captured on, or
+ * on a new filesystem if the trace starts with an empty one.
+ */
+class TraceReplayer {
+  FileOperation *fs;
+  std::unordered_map<u64, inode_id_t> inodes;
+  std::vector<char> zeros;
+
+public:
+  explicit TraceReplayer(FileOperation *fs) : fs(fs) {}
+
+  /**
+   * Replay an operation
+   *
+   * @return whether the outcome is the same as the traced one, i.e., an
+   * operation creating or looking up an inode succeeds iff it did. The other
+   * operations are expected to succeed.
+   */
+  auto replay(const TraceRecord &record, const std::string &name) -> bool;
+
+  /**
+   * The inode of the replay for a traced inode
+   */
+  auto map_inode(u64 ino) const -> inode_id_t;
+};
+
+} // namespace chfs
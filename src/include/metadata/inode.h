@@ -27,6 +27,10 @@ namespace chfs {
 // So block IDs should be larger than 0
 const block_id_t KInvalidBlockID = 0;
 
+// The flags of an inode
+// The content is compressed, see `ClusterIndex`
+const u32 KInodeCompressed = 1;
+
 enum class InodeType : u32 {
   Unknown = 0,
   FILE = 1,
@@ -86,6 +90,8 @@ class Inode {
   // we stored the number of blocks in the inode to prevent
   // re-calculation during runtime
   u32 nblocks;
+  // KInode* flags
+  u32 flags;
   // The actual number of blocks should be larger,
   // which is dynamically calculated based on the block size
 public:
@@ -98,7 +104,7 @@ public:
    * @param block_size: the size of the block that stored the inode
    */
   Inode(InodeType type, usize block_size)
-      : type(type), inner_attr(), block_size(block_size) {
+      : type(type), inner_attr(), block_size(block_size), flags(0) {
     CHFS_VERIFY(block_size > sizeof(Inode), "Block size too small");
     nblocks = (block_size - sizeof(Inode)) / sizeof(block_id_t);
     inner_attr.set_all_time(time(0));
@@ -119,6 +125,16 @@ public:
    */
   auto get_size() const -> u64 { return inner_attr.size; }
 
+  /**
+   * Whether the content is compressed
+   */
+  auto is_compressed() const -> bool { return flags & KInodeCompressed; }
+
+  auto set_compressed(bool compressed) {
+    flags = compressed ? (flags | KInodeCompressed)
+                       : (flags & ~KInodeCompressed);
+  }
+
   /**
    * Get the number of blocks of the inode
    */
@@ -229,7 +245,7 @@ public:
 } __attribute__((packed));
 
 static_assert(sizeof(Inode) == sizeof(FileAttr) + sizeof(InodeType) +
-                                   sizeof(u32) + sizeof(u32),
+                                   sizeof(u32) + sizeof(u32) + sizeof(u32),
               "Unexpected Inode size");
 
 /**
@@ -38,6 +38,9 @@ class InodeManager {
   u64 max_inode_supported;
   u64 n_table_blocks;
   u64 n_bitmap_blocks;
+  // the inode table is followed by the inode bitmap. The live one follows the
+  // super block, and the ones of the snapshots are elsewhere.
+  block_id_t table_start = 1;
 
 public:
   /**
@@ -47,7 +50,7 @@ public:
   InodeManager(std::shared_ptr<BlockManager> bm, u64 max_inode_supported);
 
   static auto to_shared_ptr(InodeManager m) -> std::shared_ptr<InodeManager> {
-    return std::make_shared<InodeManager>(m);
+    return std::make_shared<InodeManager>(std::move(m));
   }
 
   /**
@@ -55,9 +58,12 @@ public:
    * Note that it won't modify any blocks on the block manager.
    *
    * The max_inode_supported can be found in the super block.
+   *
+   * @param table_start the first block of the inode table
    */
   static auto create_from_block_manager(std::shared_ptr<BlockManager> bm,
-                                        u64 max_inode_supported)
+                                        u64 max_inode_supported,
+                                        block_id_t table_start = 1)
       -> ChfsResult<InodeManager>;
 
   /**
@@ -125,16 +131,24 @@ private:
    * Simple constructors
    */
   InodeManager(std::shared_ptr<BlockManager> bm, u64 max_inode_supported,
-               u64 ntables, u64 nbit)
+               u64 ntables, u64 nbit, block_id_t table_start)
       : bm(bm), max_inode_supported(max_inode_supported),
-        n_table_blocks(ntables), n_bitmap_blocks(nbit) {}
+        n_table_blocks(ntables), n_bitmap_blocks(nbit),
+        table_start(table_start) {}
 
   /**
    * Read the inode to a buffer
    * @param block_id_t: the block id that stores the inode
    */
   auto read_inode(inode_id_t id, std::vector<u8> &buffer)
-      -> ChfsResult<block_id_t>;
+      -> ChfsResult<block_id_t> {
+    return this->read_inode(id, buffer.data());
+  }
+
+  /**
+   * Read the inode to a buffer as large as a block
+   */
+  auto read_inode(inode_id_t id, u8 *buffer) -> ChfsResult<block_id_t>;
 };
 
 } // namespace chfs
\ No newline at end of file
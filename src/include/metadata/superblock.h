@@ -11,11 +11,24 @@
 
 #pragma once
 
+#include <optional>
+#include <string>
+
 #include "block/allocator.h"
 #include "common/config.h"
 
 namespace chfs {
 
+// Identify a block device formatted by chfs
+const u64 KSuperBlockMagic = 0x3142530073666863; // "chfs\0SB1" in little endian
+// The on-disk format of the filesystem. It is bumped whenever the layout of
+// the super block or of the regions it describes changes, and an image of
+// another version is not mounted.
+const u32 KSuperBlockVersion = 1;
+// The lazy zeroing flags are stored in the super block from this fixed offset
+// to the end of the block, so they never move when the super block grows
+const usize KLazyFlagOffset = 256;
+
 typedef struct SuperBlockInternal {
   // Blocksize of the file system. It should be equal to the block size of the
   // block device.
@@ -28,8 +41,43 @@ typedef struct SuperBlockInternal {
   u64 ninodes;
   // The current filesystem size.
   u64 file_system_size;
+  // The strategy of the block allocator chosen when the filesystem is created.
+  AllocatorType allocator_type;
+  // It should be KSuperBlockMagic if the filesystem has been created.
+  u64 magic;
+  // It should be KSuperBlockVersion.
+  u32 version;
+  // The number of blocks following the super block that may be zeroed lazily,
+  // i.e., the inode table and the bitmaps. Their flags are stored at
+  // KLazyFlagOffset in the super block. 0 if the filesystem is formatted
+  // eagerly.
+  u64 lazy_zero_blocks;
+  // The region of the metadata journal. 0 blocks if there is no journal.
+  u64 journal_start;
+  u64 journal_blocks;
+  // Non-zero if the filesystem is mounted or not unmounted cleanly
+  u64 dirty;
+  // The number of free blocks upon the last clean unmount
+  u64 free_blocks;
+  // The region of the block reference counters. 0 blocks if the blocks
+  // cannot be shared, e.g., by snapshots.
+  u64 refcount_start;
+  u64 refcount_blocks;
+  // The block storing the list of the snapshots, see `SnapshotEntry`
+  u64 snapshot_block;
+  // The region of the fingerprint index, 0 blocks if the blocks are not
+  // deduplicated
+  u64 dedup_start;
+  u64 dedup_blocks;
+  // The region of the block checksums, 0 blocks if the blocks are not
+  // checksummed
+  u64 checksum_start;
+  u64 checksum_blocks;
 } SuperblockInternal;
 
+static_assert(sizeof(SuperBlockInternal) <= KLazyFlagOffset,
+              "The super block must not overlap the lazy zeroing flags");
+
 /**
  * Represent the super block of the filesystem
  * It records some critical information of the filesystem
@@ -51,9 +99,22 @@ public:
    *
    * @param bm the block manager
    * @param ninodes the number of inodes
+   * @param allocator_type the strategy of the block allocator
+   * @param lazy_zero_blocks the number of blocks tracked for lazy zeroing
    *
    */
-  SuperBlock(std::shared_ptr<BlockManager> bm, u64 ninodes);
+  SuperBlock(std::shared_ptr<BlockManager> bm, u64 ninodes,
+             AllocatorType allocator_type = AllocatorType::Bitmap,
+             u64 lazy_zero_blocks = 0);
+
+  /**
+   * Read the block size recorded in the super block of an image file, so
+   * that the image can be opened before its block size is known
+   *
+   * @return nullopt if the image is not formatted by chfs
+   */
+  static auto peek_block_size(const std::string &image)
+      -> std::optional<usize>;
 
   /**
    * Create a superblock from a block manager,
@@ -78,6 +139,80 @@ public:
   u32 get_block_size() const { return inner.block_size; }
   u64 get_nblocks() const { return inner.nblocks; }
   u64 get_ninodes() const { return inner.ninodes; }
+  AllocatorType get_allocator_type() const { return inner.allocator_type; }
+  u64 get_lazy_zero_blocks() const { return inner.lazy_zero_blocks; }
+  u64 get_journal_start() const { return inner.journal_start; }
+  u64 get_journal_blocks() const { return inner.journal_blocks; }
+  bool is_dirty() const { return inner.dirty != 0; }
+  u64 get_free_blocks() const { return inner.free_blocks; }
+  u64 get_refcount_start() const { return inner.refcount_start; }
+  u64 get_refcount_blocks() const { return inner.refcount_blocks; }
+  u64 get_snapshot_block() const { return inner.snapshot_block; }
+  u64 get_dedup_start() const { return inner.dedup_start; }
+  u64 get_dedup_blocks() const { return inner.dedup_blocks; }
+  u64 get_checksum_start() const { return inner.checksum_start; }
+  u64 get_checksum_blocks() const { return inner.checksum_blocks; }
+
+  /**
+   * Mark the filesystem in use. If it is still dirty upon the next mount,
+   * the filesystem was not unmounted cleanly.
+   */
+  auto mark_dirty() -> void { inner.dirty = 1; }
+
+  /**
+   * Mark the filesystem unmounted cleanly
+   * @param free_blocks the number of free blocks upon unmount
+   */
+  auto mark_clean(u64 free_blocks) -> void {
+    inner.dirty = 0;
+    inner.free_blocks = free_blocks;
+  }
+
+  /**
+   * Record the region of the metadata journal
+   */
+  auto set_journal(block_id_t start, u64 blocks) -> void {
+    inner.journal_start = start;
+    inner.journal_blocks = blocks;
+  }
+
+  /**
+   * Record the region of the block reference counters and the snapshot list
+   */
+  auto set_block_sharing(block_id_t refcount_start, u64 refcount_blocks,
+                         block_id_t snapshot_block) -> void {
+    inner.refcount_start = refcount_start;
+    inner.refcount_blocks = refcount_blocks;
+    inner.snapshot_block = snapshot_block;
+  }
+
+  /**
+   * Record the region of the fingerprint index
+   */
+  auto set_dedup_index(block_id_t start, u64 blocks) -> void {
+    inner.dedup_start = start;
+    inner.dedup_blocks = blocks;
+  }
+
+  /**
+   * Record the region of the block checksums
+   */
+  auto set_checksum(block_id_t start, u64 blocks) -> void {
+    inner.checksum_start = start;
+    inner.checksum_blocks = blocks;
+  }
+
+  /**
+   * Whether the super block belongs to a filesystem created on the block
+   * manager, i.e., the filesystem can be mounted via
+   * `FileOperation::create_from_raw`.
+   */
+  auto is_valid() const -> bool {
+    return inner.magic == KSuperBlockMagic &&
+           inner.version == KSuperBlockVersion &&
+           inner.block_size == bm->block_size() &&
+           inner.nblocks == bm->total_blocks();
+  }
 
 private:
   explicit SuperBlock(std::shared_ptr<BlockManager> bm) : bm(bm) {}
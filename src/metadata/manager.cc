@@ -1,6 +1,8 @@
 #include <vector>
 
 #include "common/bitmap.h"
+#include "common/buffer_pool.h"
+#include "common/stats.h"
 #include "metadata/inode.h"
 #include "metadata/manager.h"
 
@@ -38,17 +40,20 @@ InodeManager::InodeManager(std::shared_ptr<BlockManager> bm,
   this->n_table_blocks = table_blocks;
 
   // 3. clear the bitmap blocks and table blocks
+  // They are only flagged if the block manager zeros them lazily
+  bm->track_lazy(1 + this->n_table_blocks + this->n_bitmap_blocks);
   for (u64 i = 0; i < this->n_table_blocks; ++i) {
-    bm->zero_block(i + 1); // 1: the super block
+    bm->zero_block_lazily(i + 1).unwrap(); // 1: the super block
   }
 
   for (u64 i = 0; i < this->n_bitmap_blocks; ++i) {
-    bm->zero_block(i + 1 + this->n_table_blocks);
+    bm->zero_block_lazily(i + 1 + this->n_table_blocks).unwrap();
   }
 }
 
 auto InodeManager::create_from_block_manager(std::shared_ptr<BlockManager> bm,
-                                             u64 max_inode_supported)
+                                             u64 max_inode_supported,
+                                             block_id_t table_start)
     -> ChfsResult<InodeManager> {
   auto inode_bits_per_block = bm->block_size() * KBitsPerByte;
   auto n_bitmap_blocks = max_inode_supported / inode_bits_per_block;
@@ -62,15 +67,18 @@ auto InodeManager::create_from_block_manager(std::shared_ptr<BlockManager> bm,
     table_blocks += 1;
   }
 
-  InodeManager res = {bm, max_inode_supported, table_blocks, n_bitmap_blocks};
+  InodeManager res = {bm, max_inode_supported, table_blocks, n_bitmap_blocks,
+                      table_start};
   return ChfsResult<InodeManager>(res);
 }
 
 // { Your code here }
 auto InodeManager::allocate_inode(InodeType type, block_id_t bid)
     -> ChfsResult<inode_id_t> {
-  auto iter_res = BlockIterator::create(this->bm.get(), 1 + n_table_blocks,
-                                        1 + n_table_blocks + n_bitmap_blocks);
+  StatTimer timer(Stat::InodeAllocate);
+  auto iter_res =
+      BlockIterator::create(this->bm.get(), table_start + n_table_blocks,
+                            table_start + n_table_blocks + n_bitmap_blocks);
   if (iter_res.is_err()) {
     return ChfsResult<inode_id_t>(iter_res.unwrap_error());
   }
@@ -94,13 +102,24 @@ auto InodeManager::allocate_inode(InodeType type, block_id_t bid)
         return ChfsResult<inode_id_t>(res.unwrap_error());
       }
 
-      // TODO:
-      // 1. Initialize the inode with the given type.
-      // 2. Setup the inode table.
-      // 3. Return the id of the allocated inode.
-      //    You may have to use the `RAW_2_LOGIC` macro
-      //    to get the result inode id.
-      UNIMPLEMENTED();
+      // Initialize the inode block with the given type.
+      auto buffer = BlockBuffer::zeroed(bm->block_size());
+      Inode inode(type, bm->block_size());
+      inode.flush_to_buffer(buffer.data());
+      auto write_res = bm->write_block(bid, buffer.data());
+      if (write_res.is_err()) {
+        return ChfsResult<inode_id_t>(write_res.unwrap_error());
+      }
+
+      // Setup the inode table.
+      inode_id_t raw_id =
+          count * bm->block_size() * KBitsPerByte + free_idx.value();
+      auto table_res = this->set_table(raw_id, bid);
+      if (table_res.is_err()) {
+        return ChfsResult<inode_id_t>(table_res.unwrap_error());
+      }
+
+      return ChfsResult<inode_id_t>(RAW_2_LOGIC(raw_id));
     }
   }
 
@@ -109,32 +128,49 @@ auto InodeManager::allocate_inode(InodeType type, block_id_t bid)
 
 // { Your code here }
 auto InodeManager::set_table(inode_id_t idx, block_id_t bid) -> ChfsNullResult {
+  if (idx >= this->max_inode_supported) {
+    return ChfsNullResult(ErrorType::INVALID_ARG);
+  }
+
+  const auto inode_per_block = bm->block_size() / sizeof(block_id_t);
+  const block_id_t table_block = table_start + idx / inode_per_block;
 
-  // TODO: Implement this function.
-  // Fill `bid` into the inode table entry
-  // whose index is `idx`.
-  UNIMPLEMENTED();
+  auto buffer = BlockBuffer::acquire(bm->block_size());
+  auto read_res = bm->read_block(table_block, buffer.data());
+  if (read_res.is_err()) {
+    return read_res;
+  }
 
-  return KNullOk;
+  reinterpret_cast<block_id_t *>(buffer.data())[idx % inode_per_block] = bid;
+  return bm->write_block(table_block, buffer.data());
 }
 
 // { Your code here }
 auto InodeManager::get(inode_id_t id) -> ChfsResult<block_id_t> {
-  block_id_t res_block_id = 0;
+  StatTimer timer(Stat::InodeGet);
+  if (id == KInvalidInodeID || LOGIC_2_RAW(id) >= this->max_inode_supported) {
+    return ChfsResult<block_id_t>(ErrorType::INVALID_ARG);
+  }
 
-  // TODO: Implement this function.
-  // Get the block id of inode whose id is `id`
-  // from the inode table. You may have to use
-  // the macro `LOGIC_2_RAW` to get the inode
-  // table index.
-  UNIMPLEMENTED();
+  const auto idx = LOGIC_2_RAW(id);
+  const auto inode_per_block = bm->block_size() / sizeof(block_id_t);
+  const block_id_t table_block = table_start + idx / inode_per_block;
 
+  auto buffer = BlockBuffer::acquire(bm->block_size());
+  auto read_res = bm->read_block(table_block, buffer.data());
+  if (read_res.is_err()) {
+    return ChfsResult<block_id_t>(read_res.unwrap_error());
+  }
+
+  block_id_t res_block_id =
+      reinterpret_cast<block_id_t *>(buffer.data())[idx % inode_per_block];
   return ChfsResult<block_id_t>(res_block_id);
 }
 
 auto InodeManager::free_inode_cnt() const -> ChfsResult<u64> {
-  auto iter_res = BlockIterator::create(this->bm.get(), 1 + n_table_blocks,
-                                        1 + n_table_blocks + n_bitmap_blocks);
+  auto iter_res =
+      BlockIterator::create(this->bm.get(), table_start + n_table_blocks,
+                            table_start + n_table_blocks + n_bitmap_blocks);
 
   if (iter_res.is_err()) {
     return ChfsResult<u64>(iter_res.unwrap_error());
@@ -156,8 +192,8 @@ auto InodeManager::free_inode_cnt() const -> ChfsResult<u64> {
 }
 
 auto InodeManager::get_attr(inode_id_t id) -> ChfsResult<FileAttr> {
-  std::vector<u8> buffer(bm->block_size());
-  auto res = this->read_inode(id, buffer);
+  auto buffer = BlockBuffer::acquire(bm->block_size());
+  auto res = this->read_inode(id, buffer.data());
   if (res.is_err()) {
     return ChfsResult<FileAttr>(res.unwrap_error());
   }
@@ -166,8 +202,8 @@ auto InodeManager::get_attr(inode_id_t id) -> ChfsResult<FileAttr> {
 }
 
 auto InodeManager::get_type(inode_id_t id) -> ChfsResult<InodeType> {
-  std::vector<u8> buffer(bm->block_size());
-  auto res = this->read_inode(id, buffer);
+  auto buffer = BlockBuffer::acquire(bm->block_size());
+  auto res = this->read_inode(id, buffer.data());
   if (res.is_err()) {
     return ChfsResult<InodeType>(res.unwrap_error());
   }
@@ -177,8 +213,8 @@ auto InodeManager::get_type(inode_id_t id) -> ChfsResult<InodeType> {
 
 auto InodeManager::get_type_attr(inode_id_t id)
     -> ChfsResult<std::pair<InodeType, FileAttr>> {
-  std::vector<u8> buffer(bm->block_size());
-  auto res = this->read_inode(id, buffer);
+  auto buffer = BlockBuffer::acquire(bm->block_size());
+  auto res = this->read_inode(id, buffer.data());
   if (res.is_err()) {
     return ChfsResult<std::pair<InodeType, FileAttr>>(res.unwrap_error());
   }
@@ -188,8 +224,9 @@ auto InodeManager::get_type_attr(inode_id_t id)
 }
 
 // Note: the buffer must be as large as block size
-auto InodeManager::read_inode(inode_id_t id, std::vector<u8> &buffer)
+auto InodeManager::read_inode(inode_id_t id, u8 *buffer)
     -> ChfsResult<block_id_t> {
+  StatTimer timer(Stat::InodeRead);
   if (id >= max_inode_supported - 1) {
     return ChfsResult<block_id_t>(ErrorType::INVALID_ARG);
   }
@@ -203,7 +240,7 @@ auto InodeManager::read_inode(inode_id_t id, std::vector<u8> &buffer)
     return ChfsResult<block_id_t>(ErrorType::INVALID_ARG);
   }
 
-  auto res = bm->read_block(block_id.unwrap(), buffer.data());
+  auto res = bm->read_block(block_id.unwrap(), buffer);
   if (res.is_err()) {
     return ChfsResult<block_id_t>(res.unwrap_error());
   }
@@ -212,20 +249,41 @@ auto InodeManager::read_inode(inode_id_t id, std::vector<u8> &buffer)
 
 // {Your code}
 auto InodeManager::free_inode(inode_id_t id) -> ChfsNullResult {
+  StatTimer timer(Stat::InodeFree);
 
   // simple pre-checks
   if (id >= max_inode_supported - 1) {
     return ChfsNullResult(ErrorType::INVALID_ARG);
   }
 
-  // TODO:
+  if (id == KInvalidInodeID) {
+    return ChfsNullResult(ErrorType::INVALID_ARG);
+  }
+
   // 1. Clear the inode table entry.
-  //    You may have to use macro `LOGIC_2_RAW`
-  //    to get the index of inode table from `id`.
+  const auto idx = LOGIC_2_RAW(id);
+  auto table_res = this->set_table(idx, KInvalidBlockID);
+  if (table_res.is_err()) {
+    return table_res;
+  }
+
   // 2. Clear the inode bitmap.
-  UNIMPLEMENTED();
+  const auto inode_bits_per_block = bm->block_size() * KBitsPerByte;
+  const block_id_t bitmap_block =
+      this->table_start + this->n_table_blocks + idx / inode_bits_per_block;
+
+  auto buffer = BlockBuffer::acquire(bm->block_size());
+  auto read_res = bm->read_block(bitmap_block, buffer.data());
+  if (read_res.is_err()) {
+    return read_res;
+  }
 
-  return KNullOk;
+  auto bitmap = Bitmap(buffer.data(), bm->block_size());
+  if (!bitmap.check(idx % inode_bits_per_block)) {
+    return ChfsNullResult(ErrorType::INVALID_ARG);
+  }
+  bitmap.clear(idx % inode_bits_per_block);
+  return bm->write_block(bitmap_block, buffer.data());
 }
 
 } // namespace chfs
\ No newline at end of file
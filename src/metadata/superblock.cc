@@ -1,15 +1,36 @@
+#include <fstream>
 #include <string.h>
 
 #include "metadata/superblock.h"
 
 namespace chfs {
 
-SuperBlock::SuperBlock(std::shared_ptr<BlockManager> bm, u64 ninodes) : bm(bm) {
+SuperBlock::SuperBlock(std::shared_ptr<BlockManager> bm, u64 ninodes,
+                       AllocatorType allocator_type,
+                       u64 lazy_zero_blocks)
+    : bm(bm) {
   this->inner.block_size = bm->block_size();
   this->inner.nblocks = bm->total_blocks();
   this->inner.ninodes = ninodes;
+  this->inner.file_system_size = bm->total_storage_sz();
+  this->inner.allocator_type = allocator_type;
+  this->inner.magic = KSuperBlockMagic;
+  this->inner.version = KSuperBlockVersion;
+  this->inner.lazy_zero_blocks = lazy_zero_blocks;
+  this->inner.journal_start = 0;
+  this->inner.journal_blocks = 0;
+  // a newly created filesystem is in use
+  this->inner.dirty = 1;
+  this->inner.free_blocks = 0;
+  this->inner.refcount_start = 0;
+  this->inner.refcount_blocks = 0;
+  this->inner.snapshot_block = 0;
+  this->inner.dedup_start = 0;
+  this->inner.dedup_blocks = 0;
+  this->inner.checksum_start = 0;
+  this->inner.checksum_blocks = 0;
 
-  CHFS_VERIFY(this->inner.block_size >= sizeof(SuperBlockInternal),
+  CHFS_VERIFY(this->inner.block_size > KLazyFlagOffset,
               "Block size too small");
 }
 
@@ -26,4 +47,15 @@ auto SuperBlock::create_from_existing(std::shared_ptr<BlockManager> bm,
   return ChfsResult<std::shared_ptr<SuperBlock>>(res);
 }
 
-} // namespace chfs
\ No newline at end of file
+auto SuperBlock::peek_block_size(const std::string &image)
+    -> std::optional<usize> {
+  SuperBlockInternal inner;
+  std::ifstream file(image, std::ios::binary);
+  if (!file.read(reinterpret_cast<char *>(&inner), sizeof(inner)) ||
+      inner.magic != KSuperBlockMagic) {
+    return std::nullopt;
+  }
+  return inner.block_size;
+}
+
+} // namespace chfs
@@ -0,0 +1,69 @@
+#include <set>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "common/buffer_pool.h"
+
+namespace chfs {
+
+TEST(BasicTest, BufferPoolReuse) {
+  u8 *first = nullptr;
+  {
+    auto buffer = BlockBuffer::acquire(512);
+    EXPECT_EQ(buffer.size(), 512);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(buffer.data()) % KBufferAlign, 0);
+    first = buffer.data();
+    buffer[0] = 1;
+  }
+
+  // a released buffer is taken again by the thread, zeroed if asked
+  auto again = BlockBuffer::zeroed(512);
+  EXPECT_EQ(again.data(), first);
+  for (auto byte : again) {
+    ASSERT_EQ(byte, 0);
+  }
+
+  // the buffers of another size are kept apart
+  auto other = BlockBuffer::acquire(4096);
+  EXPECT_NE(other.data(), first);
+  EXPECT_EQ(other.size(), 4096);
+
+  // a moved-from handle releases nothing
+  auto moved = std::move(other);
+  EXPECT_EQ(other.data(), nullptr);
+  EXPECT_EQ(moved.size(), 4096);
+}
+
+TEST(BasicTest, BufferPoolAcrossThreads) {
+  // the buffers in use at once are distinct, on any thread
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([]() {
+      for (int round = 0; round < 100; round++) {
+        std::vector<BlockBuffer> buffers;
+        std::set<u8 *> seen;
+        for (usize i = 0; i < 2 * KBufferPoolDepth; i++) {
+          buffers.push_back(BlockBuffer::acquire(1024));
+          ASSERT_TRUE(seen.insert(buffers.back().data()).second);
+        }
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  // a buffer released on another thread goes to that thread's pool
+  auto buffer = BlockBuffer::acquire(2048);
+  u8 *released = buffer.data();
+  u8 *reacquired = nullptr;
+  std::thread([moved = std::move(buffer), &reacquired]() mutable {
+    { auto dropped = std::move(moved); }
+    reacquired = BlockBuffer::acquire(2048).data();
+  }).join();
+  EXPECT_EQ(reacquired, released);
+}
+
+} // namespace chfs
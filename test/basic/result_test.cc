@@ -0,0 +1,45 @@
+#include <type_traits>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "common/config.h"
+#include "common/result.h"
+
+namespace chfs {
+
+template <typename R, typename = void>
+struct HasTemporaryValue : std::false_type {};
+template <typename R>
+struct HasTemporaryValue<R, std::void_t<decltype(std::declval<R>().value())>>
+    : std::true_type {};
+
+TEST(BasicTest, ResultMoveOut) {
+  // the index of the variant tells a value from an error
+  static_assert(sizeof(ChfsResult<u64>) <= 2 * sizeof(u64));
+
+  ChfsResult<std::vector<u8>> res(std::vector<u8>(4096, 1));
+  ASSERT_TRUE(res.is_ok());
+  const auto data_ptr = res.value().data();
+
+  // an lvalue is copied out, and the value is kept
+  auto copy = res.unwrap();
+  EXPECT_EQ(copy.size(), 4096);
+  EXPECT_EQ(res.value().size(), 4096);
+
+  // a temporary is moved out, the buffer is not copied
+  auto moved = std::move(res).unwrap();
+  EXPECT_EQ(moved.data(), data_ptr);
+  EXPECT_EQ(moved.size(), 4096);
+
+  ChfsResult<std::vector<u8>> err(ErrorType::NotExist);
+  EXPECT_TRUE(err.is_err());
+  EXPECT_EQ(err.unwrap_error(), ErrorType::NotExist);
+  EXPECT_THROW(err.value(), std::runtime_error);
+
+  // a reference into a temporary would dangle
+  static_assert(HasTemporaryValue<ChfsResult<std::vector<u8>> &>::value);
+  static_assert(!HasTemporaryValue<ChfsResult<std::vector<u8>>>::value);
+}
+
+} // namespace chfs
@@ -0,0 +1,107 @@
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "block/manager.h"
+#include "common/stats.h"
+
+namespace chfs {
+
+TEST(BasicTest, HistogramPercentile) {
+  // the buckets are contiguous and ordered
+  for (u32 i = 0; i + 1 < Histogram::KBuckets; i++) {
+    EXPECT_LT(Histogram::bucket_floor(i), Histogram::bucket_floor(i + 1));
+    EXPECT_EQ(Histogram::bucket_of(Histogram::bucket_floor(i)), i);
+    EXPECT_EQ(Histogram::bucket_of(Histogram::bucket_floor(i + 1) - 1), i);
+  }
+  EXPECT_EQ(Histogram::bucket_of(~u64(0)), Histogram::KBuckets - 1);
+
+  Histogram hist;
+  EXPECT_EQ(hist.percentile(50), 0);
+  for (u64 v = 1; v <= 100000; v++) {
+    hist.record(v);
+  }
+  EXPECT_EQ(hist.count(), 100000);
+  EXPECT_EQ(hist.total(), u64(100000) * 100001 / 2);
+  EXPECT_EQ(hist.max(), 100000);
+  // within the width of a bucket
+  for (double p : {1.0, 50.0, 99.0, 99.9}) {
+    const double exact = p * 1000;
+    EXPECT_NEAR(hist.percentile(p), exact, exact / Histogram::KSubBuckets);
+  }
+}
+
+TEST(BasicTest, StatsAcrossThreads) {
+  {
+    // nothing is recorded while it is disabled
+    StatTimer timer(Stat::FsReadFile);
+  }
+  set_stats_enabled(true);
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([]() {
+      for (int i = 0; i < 1000; i++) {
+        StatTimer timer(Stat::FsWriteFile);
+        timer.count(10, 1);
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  auto bm = BlockManager(64, 512);
+  std::vector<u8> buffer(512);
+  bm.read_block(3, buffer.data()).unwrap();
+
+  // the threads exited, but their statistics are kept
+  auto summary = collect_stats();
+  const auto &write = summary[static_cast<usize>(Stat::FsWriteFile)];
+  EXPECT_EQ(write.histogram.count(), 4000);
+  EXPECT_EQ(write.bytes, 40000);
+  EXPECT_EQ(write.blocks, 4000);
+  EXPECT_EQ(summary[static_cast<usize>(Stat::FsReadFile)].histogram.count(), 0);
+  EXPECT_EQ(summary[static_cast<usize>(Stat::BlockRead)].histogram.count(), 1);
+  EXPECT_GT(write.histogram.max(), 0);
+
+  auto dump = dump_stats();
+  EXPECT_NE(dump.find("fs.write_file"), std::string::npos);
+  EXPECT_EQ(dump.find("fs.read_file "), std::string::npos);
+
+  reset_stats();
+  EXPECT_EQ(collect_stats()[static_cast<usize>(Stat::FsWriteFile)]
+                .histogram.count(),
+            0);
+  set_stats_enabled(false);
+}
+
+TEST(BasicTest, StatsResetLiveThread) {
+  set_stats_enabled(true);
+  count_stat(Stat::FsReadFile, 100, 1);
+  record_stat(Stat::FsReadFile, 1003);
+  record_stat(Stat::FsReadFile, 1000);
+  auto summary = collect_stats();
+  EXPECT_EQ(summary[static_cast<usize>(Stat::FsReadFile)].histogram.max(),
+            1003);
+
+  // the counters of this thread are stale until it records again
+  reset_stats();
+  summary = collect_stats();
+  EXPECT_EQ(summary[static_cast<usize>(Stat::FsReadFile)].histogram.count(),
+            0);
+  EXPECT_EQ(summary[static_cast<usize>(Stat::FsReadFile)].bytes, 0);
+
+  record_stat(Stat::FsReadFile, 7);
+  summary = collect_stats();
+  const auto &read = summary[static_cast<usize>(Stat::FsReadFile)];
+  EXPECT_EQ(read.histogram.count(), 1);
+  EXPECT_EQ(read.histogram.max(), 7);
+  EXPECT_EQ(read.bytes, 0);
+
+  reset_stats();
+  set_stats_enabled(false);
+}
+
+} // namespace chfs
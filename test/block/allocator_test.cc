@@ -1,3 +1,5 @@
+#include <algorithm>
+
 #include "block/allocator.h"
 #include "common/macros.h"
 #include "gtest/gtest.h"
@@ -66,4 +68,86 @@ TEST_F(BlockAllocatorTest, Allocation) {
   }
 }
 
+/**
+ * A memory-backed block manager that counts the writes to the bitmap blocks
+ */
+class WriteCountingBlockManager : public BlockManager {
+public:
+  usize bitmap_writes = 0;
+  block_id_t bitmap_end;
+
+  WriteCountingBlockManager(usize block_count, usize block_size,
+                            block_id_t bitmap_end)
+      : BlockManager(block_count, block_size), bitmap_end(bitmap_end) {}
+
+  auto write_block(block_id_t block_id, const u8 *block_data)
+      -> ChfsNullResult override {
+    if (block_id < bitmap_end) {
+      bitmap_writes += 1;
+    }
+    return BlockManager::write_block(block_id, block_data);
+  }
+};
+
+TEST_F(BlockAllocatorTest, BatchAllocation) {
+  const usize block_sz = 4096;
+  const usize block_cnt = 1024 * 64;
+
+  auto bm =
+      std::shared_ptr<BlockManager>(new BlockManager(block_cnt, block_sz));
+  auto allocator = BlockAllocator(bm);
+  auto bitmap_block_cnt = allocator.total_bitmap_block();
+  auto free_block_cnt = allocator.free_block_cnt();
+
+  std::vector<block_id_t> blocks;
+  ASSERT_TRUE(allocator.allocate_n(10000, blocks).is_ok());
+  ASSERT_EQ(blocks.size(), 10000);
+  for (usize i = 0; i < blocks.size(); i++) {
+    EXPECT_EQ(blocks[i], i + bitmap_block_cnt);
+  }
+  EXPECT_EQ(allocator.free_block_cnt(), free_block_cnt - 10000);
+
+  // the single-block allocation should continue after the batch
+  EXPECT_EQ(allocator.allocate().unwrap(), 10000 + bitmap_block_cnt);
+  blocks.push_back(10000 + bitmap_block_cnt);
+
+  // a failed batch must not leak any block
+  std::vector<block_id_t> too_many;
+  EXPECT_EQ(allocator.allocate_n(free_block_cnt, too_many).unwrap_error(),
+            ErrorType::OUT_OF_RESOURCE);
+  EXPECT_TRUE(too_many.empty());
+  EXPECT_EQ(allocator.free_block_cnt(), free_block_cnt - blocks.size());
+
+  // double free inside a batch is rejected
+  EXPECT_EQ(allocator.deallocate_batch({blocks[0], blocks[0]}).unwrap_error(),
+            ErrorType::INVALID_ARG);
+
+  std::reverse(blocks.begin(), blocks.end());
+  ASSERT_TRUE(allocator.deallocate_batch(blocks).is_ok());
+  EXPECT_EQ(allocator.free_block_cnt(), free_block_cnt);
+  EXPECT_EQ(allocator.deallocate_batch({blocks[0]}).unwrap_error(),
+            ErrorType::INVALID_ARG);
+}
+
+TEST_F(BlockAllocatorTest, BatchFlushOncePerBitmapBlock) {
+  const usize block_sz = 4096;
+  const usize block_cnt = 1024 * 64;
+  const usize bits_per_block = block_sz * KBitsPerByte;
+
+  // the bitmap is stored at block [0, block_cnt / bits_per_block)
+  auto counting_bm = std::shared_ptr<WriteCountingBlockManager>(
+      new WriteCountingBlockManager(block_cnt, block_sz,
+                                    block_cnt / bits_per_block));
+  auto allocator = BlockAllocator(counting_bm);
+
+  counting_bm->bitmap_writes = 0;
+  std::vector<block_id_t> blocks;
+  ASSERT_TRUE(allocator.allocate_n(10000, blocks).is_ok());
+  EXPECT_EQ(counting_bm->bitmap_writes, 1);
+
+  counting_bm->bitmap_writes = 0;
+  ASSERT_TRUE(allocator.deallocate_batch(blocks).is_ok());
+  EXPECT_EQ(counting_bm->bitmap_writes, 1);
+}
+
 } // namespace chfs
\ No newline at end of file
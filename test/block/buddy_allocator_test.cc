@@ -0,0 +1,194 @@
+#include <algorithm>
+#include <random>
+#include <unordered_set>
+
+#include "block/buddy_allocator.h"
+#include "common/macros.h"
+#include "filesystem/operations.h"
+#include "metadata/superblock.h"
+#include "gtest/gtest.h"
+
+namespace chfs {
+
+TEST(BuddyAllocatorTest, Init) {
+  const usize block_sz = 4096;
+  const usize block_cnt = 1024 * 64;
+
+  auto bm =
+      std::shared_ptr<BlockManager>(new BlockManager(block_cnt, block_sz));
+  auto allocator = BuddyAllocator::create(bm, 1).unwrap();
+
+  // the free count should agree with the plain bitmap allocator
+  auto bitmap_allocator = BlockAllocator(bm, 1, false);
+  EXPECT_EQ(allocator->free_block_cnt(), bitmap_allocator.free_block_cnt());
+  EXPECT_EQ(allocator->free_block_cnt(),
+            block_cnt - 1 - allocator->total_bitmap_block());
+}
+
+TEST(BuddyAllocatorTest, AlignedExtent) {
+  const usize block_sz = 4096;
+  const usize block_cnt = 1024 * 64;
+
+  auto bm =
+      std::shared_ptr<BlockManager>(new BlockManager(block_cnt, block_sz));
+  auto allocator = BuddyAllocator::create(bm, 1).unwrap();
+  auto free_block_cnt = allocator->free_block_cnt();
+
+  std::vector<std::pair<block_id_t, u32>> extents;
+  for (u32 order = 0; order <= 10; order++) {
+    auto res = allocator->allocate_extent(order);
+    ASSERT_TRUE(res.is_ok());
+    EXPECT_EQ(res.unwrap() % (1 << order), 0);
+    extents.emplace_back(res.unwrap(), order);
+  }
+
+  // the extents should not overlap
+  std::unordered_set<block_id_t> used;
+  for (auto &[start, order] : extents) {
+    for (block_id_t i = start; i < start + (1 << order); i++) {
+      ASSERT_TRUE(used.insert(i).second);
+    }
+  }
+  EXPECT_EQ(allocator->free_block_cnt(), free_block_cnt - used.size());
+  EXPECT_EQ(BlockAllocator(bm, 1, false).free_block_cnt(),
+            allocator->free_block_cnt());
+
+  // misaligned or double free is rejected
+  EXPECT_TRUE(allocator->deallocate_extent(extents[3].first + 1, 3).is_err());
+  EXPECT_TRUE(allocator->deallocate_extent(extents[3].first, 3).is_ok());
+  EXPECT_TRUE(allocator->deallocate_extent(extents[3].first, 3).is_err());
+  extents.erase(extents.begin() + 3);
+
+  // after freeing everything, the buddies are coalesced again
+  for (auto &[start, order] : extents) {
+    ASSERT_TRUE(allocator->deallocate_extent(start, order).is_ok());
+  }
+  EXPECT_EQ(allocator->free_block_cnt(), free_block_cnt);
+  auto rebuilt = BuddyAllocator::create(bm, 1, false).unwrap();
+  for (u32 order = 0; order <= KBuddyMaxOrder; order++) {
+    EXPECT_EQ(allocator->free_extent_cnt(order), rebuilt->free_extent_cnt(order));
+  }
+}
+
+TEST(BuddyAllocatorTest, MixedSizes) {
+  const usize block_sz = 512;
+  const usize block_cnt = 1024 * 16;
+
+  auto bm =
+      std::shared_ptr<BlockManager>(new BlockManager(block_cnt, block_sz));
+  auto allocator = BuddyAllocator::create(bm, 1).unwrap();
+  auto free_block_cnt = allocator->free_block_cnt();
+
+  std::mt19937 gen(0xdeadbeaf);
+  std::uniform_int_distribution<u32> order_dis(0, 5);
+  std::uniform_real_distribution<> dis(0, 1);
+
+  std::vector<std::pair<block_id_t, u32>> extents;
+  std::vector<block_id_t> singles;
+  for (usize i = 0; i < 5000; i++) {
+    auto p = dis(gen);
+    if (p < 0.4) {
+      auto order = order_dis(gen);
+      auto res = allocator->allocate_extent(order);
+      if (res.is_ok()) {
+        extents.emplace_back(res.unwrap(), order);
+      }
+    } else if (p < 0.6) {
+      std::vector<block_id_t> out;
+      if (allocator->allocate_n(7, out).is_ok()) {
+        EXPECT_TRUE(std::is_sorted(out.begin(), out.end()));
+        singles.insert(singles.end(), out.begin(), out.end());
+      }
+    } else if (p < 0.8 && !extents.empty()) {
+      auto [start, order] = extents.back();
+      extents.pop_back();
+      ASSERT_TRUE(allocator->deallocate_extent(start, order).is_ok());
+    } else if (!singles.empty()) {
+      std::vector<block_id_t> batch(
+          singles.end() - std::min<usize>(singles.size(), 5), singles.end());
+      singles.resize(singles.size() - batch.size());
+      ASSERT_TRUE(allocator->deallocate_batch(batch).is_ok());
+    }
+  }
+  for (auto &[start, order] : extents) {
+    ASSERT_TRUE(allocator->deallocate_extent(start, order).is_ok());
+  }
+  ASSERT_TRUE(allocator->deallocate_batch(singles).is_ok());
+  EXPECT_EQ(allocator->free_block_cnt(), free_block_cnt);
+}
+
+TEST(BuddyAllocatorTest, FragmentedBatch) {
+  const usize block_sz = 512;
+  const usize block_cnt = 1024 * 16;
+
+  auto bm =
+      std::shared_ptr<BlockManager>(new BlockManager(block_cnt, block_sz));
+  auto allocator = BuddyAllocator::create(bm, 1).unwrap();
+
+  // only single blocks are left free
+  std::vector<block_id_t> all;
+  allocator->allocate_n(allocator->free_block_cnt(), all).unwrap();
+  std::vector<block_id_t> holes;
+  for (usize i = 0; i < all.size(); i += 2) {
+    holes.push_back(all[i]);
+  }
+  allocator->deallocate_batch(holes).unwrap();
+  EXPECT_EQ(allocator->free_extent_cnt(0), holes.size());
+  EXPECT_EQ(allocator->free_extent_cnt(1), 0);
+
+  // a batch falls back to them, and a larger extent is out of resource
+  EXPECT_EQ(allocator->allocate_extent(1).unwrap_error(),
+            ErrorType::OUT_OF_RESOURCE);
+  std::vector<block_id_t> out;
+  allocator->allocate_n(holes.size(), out).unwrap();
+  EXPECT_EQ(out, holes);
+  EXPECT_EQ(allocator->free_block_cnt(), 0);
+  EXPECT_TRUE(allocator->allocate().is_err());
+}
+
+TEST(BuddyAllocatorTest, UnreadableBitmap) {
+  const usize block_sz = 512;
+  const usize block_cnt = 1024 * 16;
+
+  auto bm =
+      std::shared_ptr<BlockManager>(new BlockManager(block_cnt, block_sz));
+  ASSERT_TRUE(BuddyAllocator::create(bm, 1).is_ok());
+
+  // a corrupted bitmap fails the construction instead of aborting
+  const auto checksum_blocks = bm->checksum_blocks_needed();
+  ASSERT_TRUE(
+      bm->enable_checksum(block_cnt - checksum_blocks, checksum_blocks, true)
+          .is_ok());
+  bm->unsafe_get_block_ptr()[block_sz * 2] ^= 0xff;
+  auto res = BuddyAllocator::create(bm, 1, false);
+  ASSERT_TRUE(res.is_err());
+  EXPECT_EQ(res.unwrap_error(), ErrorType::Corrupted);
+  EXPECT_TRUE(
+      BlockAllocator::create(AllocatorType::Buddy, bm, 1, false).is_err());
+  EXPECT_TRUE(
+      BlockAllocator::create(AllocatorType::Bitmap, bm, 1, false).is_err());
+}
+
+TEST(BuddyAllocatorTest, RecordedInSuperBlock) {
+  const usize block_sz = 512;
+  const usize block_cnt = 1024 * 16;
+
+  auto bm =
+      std::shared_ptr<BlockManager>(new BlockManager(block_cnt, block_sz));
+  auto fs = FileOperation(bm, 1024, AllocatorType::Buddy);
+  ASSERT_EQ(SuperBlock::create_from_existing(bm, 0)
+                .unwrap()
+                ->get_allocator_type(),
+            AllocatorType::Buddy);
+
+  auto id = fs.alloc_inode(InodeType::FILE).unwrap();
+  std::vector<u8> content(block_sz * 32, 'a');
+  ASSERT_TRUE(fs.write_file(id, content).is_ok());
+
+  auto fs1 = FileOperation::create_from_raw(bm).unwrap();
+  EXPECT_EQ(fs1->get_free_blocks_num().unwrap(),
+            fs.get_free_blocks_num().unwrap());
+  EXPECT_EQ(fs1->read_file(id).unwrap(), content);
+}
+
+} // namespace chfs
@@ -0,0 +1,93 @@
+#include <cstring>
+#include <random>
+
+#include "block/checksum.h"
+#include "block/manager.h"
+#include "gtest/gtest.h"
+
+namespace chfs {
+
+TEST(ChecksumTest, Crc32c) {
+  const char *check = "123456789";
+  EXPECT_EQ(crc32c(reinterpret_cast<const u8 *>(check), 9), 0xE3069283);
+  EXPECT_EQ(crc32c_sw(reinterpret_cast<const u8 *>(check), 9), 0xE3069283);
+
+  // the hardware path agrees with the table at any length and alignment
+  std::mt19937 rng(0);
+  std::vector<u8> data(4096 + 7);
+  for (auto &byte : data) {
+    byte = rng();
+  }
+  for (usize offset : {0, 1, 3}) {
+    for (usize len : {0, 1, 7, 8, 63, 512, 4096}) {
+      EXPECT_EQ(crc32c(data.data() + offset, len),
+                crc32c_sw(data.data() + offset, len));
+    }
+  }
+
+  // piecewise
+  EXPECT_EQ(crc32c(data.data() + 100, 412, crc32c(data.data(), 100)),
+            crc32c(data.data(), 512));
+}
+
+TEST(ChecksumTest, DetectCorruption) {
+  const usize block_cnt = 1024;
+  const usize block_size = 512;
+  auto bm = BlockManager(block_cnt, block_size);
+  const block_id_t region = block_cnt - bm.checksum_blocks_needed();
+  EXPECT_EQ(bm.enable_checksum(region, 1, true).unwrap_error(),
+            ErrorType::INVALID_ARG);
+  bm.enable_checksum(region, bm.checksum_blocks_needed(), true).unwrap();
+
+  std::vector<u8> data(block_size, 'x');
+  std::vector<u8> buffer(block_size);
+  bm.write_block(10, data.data()).unwrap();
+  bm.write_partial_block(11, data.data(), 100, 10).unwrap();
+  bm.read_block(10, buffer.data()).unwrap();
+  EXPECT_EQ(buffer, data);
+  bm.read_block(11, buffer.data()).unwrap();
+
+  // a bit flipped behind our back
+  bm.unsafe_get_block_ptr()[10 * block_size + 7] ^= 1;
+  EXPECT_EQ(bm.read_block(10, buffer.data()).unwrap_error(),
+            ErrorType::Corrupted);
+  EXPECT_EQ(bm.peek_block(10).unwrap_error(), ErrorType::Corrupted);
+  bm.update_checksum(10).unwrap();
+  bm.read_block(10, buffer.data()).unwrap();
+
+  // an overwrite repairs the block
+  bm.unsafe_get_block_ptr()[11 * block_size] ^= 1;
+  EXPECT_EQ(bm.read_block(11, buffer.data()).unwrap_error(),
+            ErrorType::Corrupted);
+  bm.zero_block(11).unwrap();
+  bm.read_block(11, buffer.data()).unwrap();
+  EXPECT_EQ(buffer, std::vector<u8>(block_size, 0));
+}
+
+TEST(ChecksumTest, LazilyZeroedBlocks) {
+  const usize block_cnt = 1024;
+  const usize block_size = 512;
+  auto bm = BlockManager(block_cnt, block_size);
+  bm.enable_lazy_zero(0, 64, 0, true);
+  bm.track_lazy(20);
+  const auto region_blocks = bm.checksum_blocks_needed();
+  bm.enable_checksum(block_cnt - region_blocks, region_blocks, true).unwrap();
+
+  std::vector<u8> data(block_size, 'x');
+  std::vector<u8> buffer(block_size);
+  for (block_id_t i = 1; i < 20; i++) {
+    bm.write_block(i, data.data()).unwrap();
+    bm.zero_block_lazily(i).unwrap();
+  }
+  bm.write_partial_block(3, data.data(), 0, 10).unwrap();
+  EXPECT_EQ(bm.zero_lazy_blocks(), 18);
+
+  // the flags in the super block and the zeroed blocks are sealed
+  bm.read_block(0, buffer.data()).unwrap();
+  for (block_id_t i = 1; i < 20; i++) {
+    bm.read_block(i, buffer.data()).unwrap();
+  }
+  EXPECT_EQ(buffer, std::vector<u8>(block_size, 0));
+}
+
+} // namespace chfs
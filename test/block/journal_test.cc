@@ -0,0 +1,217 @@
+#include <cstring>
+
+#include "block/journal.h"
+#include "gtest/gtest.h"
+
+namespace chfs {
+
+const usize kJournalBlockSize = 512;
+const usize kJournalDeviceBlocks = 1024;
+const block_id_t kJournalStart = 512;
+const usize kJournalBlocks = 64;
+
+/**
+ * Record the ranges synced to the device
+ */
+class SyncRecordingBlockManager : public BlockManager {
+public:
+  std::vector<std::pair<block_id_t, usize>> synced;
+
+  using BlockManager::BlockManager;
+
+  auto sync(block_id_t block_id, usize cnt) -> ChfsNullResult override {
+    synced.emplace_back(block_id, cnt);
+    return BlockManager::sync(block_id, cnt);
+  }
+};
+
+TEST(JournalTest, StageAndCommit) {
+  auto bm = std::shared_ptr<BlockManager>(
+      new BlockManager(kJournalDeviceBlocks, kJournalBlockSize));
+  std::vector<u8> zeros(kJournalBlockSize, 0);
+  bm->write_block(10, zeros.data()).unwrap();
+
+  auto journal = Journal::format(bm, kJournalStart, kJournalBlocks).unwrap();
+
+  std::vector<u8> data(kJournalBlockSize, 'a');
+  std::vector<u8> buf(kJournalBlockSize);
+  bm->write_block(10, data.data()).unwrap();
+  bm->write_partial_block(11, data.data(), 0, 8).unwrap();
+  ASSERT_EQ(journal->running_blocks(), 2);
+
+  // the writes are only staged
+  auto raw = bm->unsafe_get_block_ptr();
+  EXPECT_EQ(memcmp(raw + 10 * kJournalBlockSize, zeros.data(),
+                   kJournalBlockSize),
+            0);
+  bm->read_block(10, buf.data()).unwrap();
+  EXPECT_EQ(buf, data);
+
+  journal->commit().unwrap();
+  ASSERT_EQ(journal->running_blocks(), 0);
+  EXPECT_EQ(
+      memcmp(raw + 10 * kJournalBlockSize, data.data(), kJournalBlockSize), 0);
+  EXPECT_EQ(raw[11 * kJournalBlockSize + 7], 'a');
+  EXPECT_TRUE(journal->is_logged(10));
+
+  // the file content bypasses the journal, unless the block is logged
+  bm->write_block_unlogged(12, data.data()).unwrap();
+  EXPECT_EQ(journal->running_blocks(), 0);
+  bm->write_block_unlogged(10, zeros.data()).unwrap();
+  EXPECT_EQ(journal->running_blocks(), 1);
+}
+
+TEST(JournalTest, SyncTouchedBlocksOnly) {
+  std::string file("test_journal_sync.db");
+  remove(file.c_str());
+
+  auto bm = std::shared_ptr<SyncRecordingBlockManager>(
+      new SyncRecordingBlockManager(file, kJournalDeviceBlocks,
+                                    kJournalBlockSize));
+  auto journal = Journal::format(bm, kJournalStart, kJournalBlocks).unwrap();
+
+  std::vector<u8> data(kJournalBlockSize, 'a');
+  bm->write_block(10, data.data()).unwrap();
+  bm->write_block_unlogged(12, data.data()).unwrap();
+  bm->write_block_unlogged(13, data.data()).unwrap();
+  bm->synced.clear();
+
+  // the file content, then the descriptor, the image and the commit block
+  journal->commit().unwrap();
+  using Range = std::pair<block_id_t, usize>;
+  EXPECT_EQ(bm->synced,
+            (std::vector<Range>{{12, 2}, {kJournalStart + 1, 3}}));
+
+  // the installed block and the header
+  bm->synced.clear();
+  journal->checkpoint().unwrap();
+  EXPECT_EQ(bm->synced, (std::vector<Range>{{10, 1}, {kJournalStart, 1}}));
+
+  // nothing to sync
+  bm->synced.clear();
+  journal->commit().unwrap();
+  EXPECT_TRUE(bm->synced.empty());
+
+  remove(file.c_str());
+}
+
+TEST(JournalTest, Replay) {
+  std::string file("test_journal.db");
+  remove(file.c_str());
+
+  std::vector<u8> data(kJournalBlockSize, 'a');
+  std::vector<u8> uncommitted(kJournalBlockSize, 'c');
+  {
+    auto bm = std::shared_ptr<BlockManager>(
+        new BlockManager(file, kJournalDeviceBlocks, kJournalBlockSize));
+    auto journal = Journal::format(bm, kJournalStart, kJournalBlocks).unwrap();
+    bm->write_block(10, data.data()).unwrap();
+    bm->write_partial_block(11, data.data(), 0, 8).unwrap();
+    journal->commit().unwrap();
+    bm->write_block(12, uncommitted.data()).unwrap();
+
+    // crash before the installed blocks reach the device
+    memset(bm->unsafe_get_block_ptr() + 10 * kJournalBlockSize, 0,
+           2 * kJournalBlockSize);
+  }
+
+  auto bm = std::shared_ptr<BlockManager>(
+      new BlockManager(file, 0, kJournalBlockSize));
+  auto journal = Journal::open(bm, kJournalStart, kJournalBlocks).unwrap();
+  ASSERT_EQ(journal->committed_seq(), 1);
+
+  std::vector<u8> buf(kJournalBlockSize);
+  bm->read_block(10, buf.data()).unwrap();
+  EXPECT_EQ(buf, data);
+  bm->read_block(11, buf.data()).unwrap();
+  EXPECT_EQ(buf[7], 'a');
+  EXPECT_EQ(buf[8], 0);
+  bm->read_block(12, buf.data()).unwrap();
+  EXPECT_NE(buf, uncommitted);
+
+  remove(file.c_str());
+}
+
+TEST(JournalTest, TornCommit) {
+  std::string file("test_journal_torn.db");
+  remove(file.c_str());
+
+  std::vector<u8> data(kJournalBlockSize, 'a');
+  {
+    auto bm = std::shared_ptr<BlockManager>(
+        new BlockManager(file, kJournalDeviceBlocks, kJournalBlockSize));
+    auto journal = Journal::format(bm, kJournalStart, kJournalBlocks).unwrap();
+    bm->write_block(10, data.data()).unwrap();
+    journal->commit().unwrap();
+
+    // the image is torn, and the installed block is lost
+    auto raw = bm->unsafe_get_block_ptr();
+    raw[(kJournalStart + 2) * kJournalBlockSize] = 'b';
+    memset(raw + 10 * kJournalBlockSize, 0, kJournalBlockSize);
+  }
+
+  auto bm = std::shared_ptr<BlockManager>(
+      new BlockManager(file, 0, kJournalBlockSize));
+  auto journal = Journal::open(bm, kJournalStart, kJournalBlocks).unwrap();
+  ASSERT_EQ(journal->committed_seq(), 0);
+
+  std::vector<u8> buf(kJournalBlockSize);
+  bm->read_block(10, buf.data()).unwrap();
+  EXPECT_EQ(buf, std::vector<u8>(kJournalBlockSize, 0));
+
+  remove(file.c_str());
+}
+
+TEST(JournalTest, WrapAround) {
+  std::string file("test_journal_wrap.db");
+  remove(file.c_str());
+
+  {
+    auto bm = std::shared_ptr<BlockManager>(
+        new BlockManager(file, kJournalDeviceBlocks, kJournalBlockSize));
+    auto journal = Journal::format(bm, kJournalStart, kJournalBlocks).unwrap();
+
+    // each transaction takes 5 blocks, the log is reused several times
+    for (u8 i = 0; i < 64; i++) {
+      std::vector<u8> data(kJournalBlockSize, i);
+      for (block_id_t id = 10; id < 13; id++) {
+        bm->write_block(id, data.data()).unwrap();
+      }
+      journal->commit().unwrap();
+    }
+    ASSERT_EQ(journal->committed_seq(), 64);
+
+    // too large to fit in the log, it is written through
+    std::vector<u8> data(kJournalBlockSize, 'z');
+    for (block_id_t id = 100; id < 100 + kJournalBlocks; id++) {
+      bm->write_block(id, data.data()).unwrap();
+    }
+    journal->commit().unwrap();
+    EXPECT_EQ(journal->running_blocks(), 0);
+    EXPECT_EQ(journal->committed_seq(), 64);
+
+    // the later transactions are still logged
+    bm->write_block(13, data.data()).unwrap();
+    journal->commit().unwrap();
+    EXPECT_EQ(journal->committed_seq(), 65);
+  }
+
+  auto bm = std::shared_ptr<BlockManager>(
+      new BlockManager(file, 0, kJournalBlockSize));
+  auto journal = Journal::open(bm, kJournalStart, kJournalBlocks).unwrap();
+  std::vector<u8> buf(kJournalBlockSize);
+  for (block_id_t id = 10; id < 13; id++) {
+    bm->read_block(id, buf.data()).unwrap();
+    EXPECT_EQ(buf, std::vector<u8>(kJournalBlockSize, 63));
+  }
+  for (block_id_t id = 100; id < 100 + kJournalBlocks; id++) {
+    bm->read_block(id, buf.data()).unwrap();
+    EXPECT_EQ(buf, std::vector<u8>(kJournalBlockSize, 'z'));
+  }
+  bm->read_block(13, buf.data()).unwrap();
+  EXPECT_EQ(buf, std::vector<u8>(kJournalBlockSize, 'z'));
+
+  remove(file.c_str());
+}
+
+} // namespace chfs
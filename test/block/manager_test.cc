@@ -29,8 +29,8 @@ TEST_F(BlockManagerTest, ReadWritePageTest) {
   // FIXME: what if sizeof(u8) != sizeof(char)?
   std::strncpy((char *)data, "A test string.", bm.block_size());
 
-  bm.write_block(0, data);
-  bm.read_block(0, buf);
+  bm.write_block(0, data).unwrap();
+  bm.read_block(0, buf).unwrap();
   EXPECT_EQ(std::memcmp(buf, data, bm.block_size()), 0);
 
   delete[] buf;
@@ -46,8 +46,8 @@ TEST_F(BlockManagerTest, ZeroTest) {
 
   std::strncpy((char *)data, "A test string.", bm.block_size());
 
-  bm.write_block(1, data);
-  bm.read_block(1, buf);
+  bm.write_block(1, data).unwrap();
+  bm.read_block(1, buf).unwrap();
   EXPECT_EQ(std::memcmp(buf, data, bm.block_size()), 0);
 
   bool pre_check = false;
@@ -59,8 +59,8 @@ TEST_F(BlockManagerTest, ZeroTest) {
   }
   ASSERT_EQ(pre_check, true);
 
-  bm.zero_block(1);
-  bm.read_block(1, buf);
+  bm.zero_block(1).unwrap();
+  bm.read_block(1, buf).unwrap();
   for (usize i = 0; i < bm.block_size(); i++) {
     EXPECT_EQ(buf[i], 0);
   }
@@ -78,14 +78,39 @@ TEST_F(BlockManagerTest, InMemoryTest) {
   // FIXME: what if sizeof(u8) != sizeof(char)?
   std::strncpy((char *)data, "A test string.", bm.block_size());
 
-  bm.write_block(0, data);
-  bm.read_block(0, buf);
+  bm.write_block(0, data).unwrap();
+  bm.read_block(0, buf).unwrap();
   EXPECT_EQ(std::memcmp(buf, data, bm.block_size()), 0);
 
   delete[] buf;
   delete[] data;
 }
 
+TEST_F(BlockManagerTest, FileBackedBlockSize) {
+  std::string file("test_block_size.db");
+  remove(file.c_str());
+
+  u8 data[512];
+  u8 buf[512];
+  std::strncpy((char *)data, "A test string.", sizeof(data));
+  {
+    auto bm = BlockManager(file, 128, 512);
+    ASSERT_EQ(bm.block_size(), 512);
+    ASSERT_EQ(bm.total_blocks(), 128);
+    bm.write_block(127, data).unwrap();
+  }
+
+  // re-open the file, the block count is determined by the file size
+  auto bm = BlockManager(file, 0, 512, true);
+  ASSERT_EQ(bm.total_blocks(), 128);
+  ASSERT_TRUE(bm.prefetch(0, bm.total_blocks()).is_ok());
+  bm.read_block(127, buf).unwrap();
+  EXPECT_EQ(std::memcmp(buf, data, sizeof(data)), 0);
+  EXPECT_TRUE(bm.read_block(128, buf).is_err());
+
+  remove(file.c_str());
+}
+
 TEST_F(BlockManagerTest, Iterator) {
   // 1024: block cnt
   // 4096: block size
@@ -103,10 +128,63 @@ TEST_F(BlockManagerTest, Iterator) {
   // re-test setted value
   for (uint i = 2; i < 128; ++i) {
     std::vector<u8> buffer(4096);
-    bm.read_block(i, buffer.data());
+    bm.read_block(i, buffer.data()).unwrap();
     u64 *ptr = reinterpret_cast<u64 *>(buffer.data());
     ASSERT_EQ(*ptr, i - 2 + 73);
   }
 }
 
+TEST_F(BlockManagerTest, LazyZero) {
+  auto bm = BlockManager(1024, 512);
+  std::vector<u8> data(bm.block_size(), 0xab);
+  std::vector<u8> buf(bm.block_size());
+  for (block_id_t i = 0; i < bm.total_blocks(); i++) {
+    bm.write_block(i, data.data()).unwrap();
+  }
+
+  // the flags occupy the last 64 bytes of block 0, and only the registered
+  // blocks are tracked
+  ASSERT_EQ(bm.enable_lazy_zero(0, 448, 0, true), 0);
+  ASSERT_EQ(bm.track_lazy(9), 8);
+  ASSERT_EQ(bm.track_lazy(5), 8);
+  for (block_id_t i = 1; i < 8; i++) {
+    bm.zero_block_lazily(i).unwrap();
+  }
+  // not tracked, zeroed eagerly
+  bm.zero_block_lazily(9).unwrap();
+  bm.zero_block_lazily(1000).unwrap();
+  ASSERT_EQ(bm.lazy_block_cnt(), 7);
+  bm.read_block(9, buf.data()).unwrap();
+  EXPECT_EQ(buf, std::vector<u8>(bm.block_size(), 0));
+
+  bm.read_block(1, buf.data()).unwrap();
+  EXPECT_EQ(buf, std::vector<u8>(bm.block_size(), 0));
+  bm.read_block(1000, buf.data()).unwrap();
+  EXPECT_EQ(buf, std::vector<u8>(bm.block_size(), 0));
+  bm.read_block(8, buf.data()).unwrap();
+  EXPECT_EQ(buf, data);
+
+  // the rest of a partially written block is zero
+  bm.write_partial_block(2, data.data(), 0, 16).unwrap();
+  bm.read_block(2, buf.data()).unwrap();
+  EXPECT_EQ(buf[15], 0xab);
+  EXPECT_EQ(buf[16], 0);
+
+  bm.write_block(3, data.data()).unwrap();
+  bm.read_block(3, buf.data()).unwrap();
+  EXPECT_EQ(buf, data);
+  ASSERT_EQ(bm.lazy_block_cnt(), 5);
+
+  // the flags survive re-enabling, as if the device was re-mounted
+  ASSERT_EQ(bm.enable_lazy_zero(0, 448, 8, false), 8);
+  ASSERT_EQ(bm.lazy_block_cnt(), 5);
+
+  ASSERT_EQ(bm.zero_lazy_blocks(), 5);
+  ASSERT_EQ(bm.lazy_block_cnt(), 0);
+  bm.read_block(4, buf.data()).unwrap();
+  EXPECT_EQ(buf, std::vector<u8>(bm.block_size(), 0));
+  bm.read_block(3, buf.data()).unwrap();
+  EXPECT_EQ(buf, data);
+}
+
 } // namespace chfs
@@ -0,0 +1,98 @@
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "../../daemons/single_node_fs/logger.h"
+
+namespace chfs {
+
+/**
+ * The log file of the running test, so that the tests can run in parallel
+ */
+auto log_file() -> std::string {
+  return std::string("test_logger_") +
+         testing::UnitTest::GetInstance()->current_test_info()->name() +
+         ".log";
+}
+
+/**
+ * The value of a key in a record line, -1 if it is absent
+ */
+auto field_of(const std::string &line, const std::string &key) -> i32 {
+  auto pos = line.find(" " + key + "=");
+  if (pos == std::string::npos) {
+    return -1;
+  }
+  return std::stoi(line.substr(pos + key.size() + 2));
+}
+
+TEST(LoggerTest, ConcurrentProducers) {
+  const i32 producer_num = 8;
+  const i32 record_num = 20000;
+  {
+    Logger logger(log_file());
+    std::vector<std::thread> producers;
+    for (i32 p = 0; p < producer_num; p++) {
+      producers.emplace_back([&logger, p]() {
+        for (i32 seq = 0; seq < record_num; seq++) {
+          logger.log(LogLevel::Info, "record", "producer", p, "seq", seq);
+        }
+      });
+    }
+    for (auto &producer : producers) {
+      producer.join();
+    }
+    logger.close();
+  }
+
+  // every record is either written or counted as dropped, and the records of
+  // a producer are written in order
+  std::ifstream file(log_file());
+  std::vector<i32> last(producer_num, -1);
+  u64 written = 0;
+  u64 dropped = 0;
+  std::string line;
+  while (std::getline(file, line)) {
+    if (line.find(" log_dropped ") != std::string::npos) {
+      dropped += field_of(line, "records");
+      continue;
+    }
+    auto p = field_of(line, "producer");
+    auto seq = field_of(line, "seq");
+    ASSERT_GE(p, 0);
+    ASSERT_LT(p, producer_num);
+    ASSERT_GT(seq, last[p]) << line;
+    last[p] = seq;
+    written++;
+  }
+  EXPECT_GT(written, 0u);
+  EXPECT_EQ(written + dropped, static_cast<u64>(producer_num * record_num));
+  remove(log_file().c_str());
+}
+
+TEST(LoggerTest, WakeUpWhenIdle) {
+  Logger logger(log_file());
+  // the writer is asleep by now
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  logger.log(LogLevel::Info, "record", "seq", 1);
+
+  // it is written without closing the logger
+  bool found = false;
+  for (usize i = 0; i < 500 && !found; i++) {
+    std::ifstream file(log_file());
+    std::string line;
+    found = std::getline(file, line) && field_of(line, "seq") == 1;
+    if (!found) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+  }
+  EXPECT_TRUE(found);
+  logger.close();
+  remove(log_file().c_str());
+}
+
+} // namespace chfs
@@ -1,5 +1,8 @@
+#include <thread>
+
 #include "./common.h"
 #include "filesystem/operations.h"
+#include "metadata/superblock.h"
 #include "gtest/gtest.h"
 
 namespace chfs {
@@ -29,4 +32,94 @@ TEST(BasicFileSystemTest, Init) {
   std::cout << "Basic FS test done" << std::endl;
 }
 
+TEST(BasicFileSystemTest, RemountImage) {
+  std::string image("test_remount.img");
+  remove(image.c_str());
+
+  std::vector<u8> content(kBlockSize * 3 + 7, 'c');
+  inode_id_t id;
+  u64 free_block_num;
+  {
+    auto bm = std::shared_ptr<BlockManager>(
+        new BlockManager(image, kBlockNum, kBlockSize));
+    // an empty device cannot be mounted
+    ASSERT_TRUE(FileOperation::create_from_raw(bm).is_err());
+
+    auto fs = FileOperation(bm, kTestInodeNum);
+    id = fs.alloc_inode(InodeType::FILE).unwrap();
+    fs.write_file(id, content).unwrap();
+    free_block_num = fs.get_free_blocks_num().unwrap();
+  }
+
+  auto bm = std::shared_ptr<BlockManager>(
+      new BlockManager(image, 0, kBlockSize));
+  ASSERT_EQ(bm->total_blocks(), kBlockNum);
+  auto fs = FileOperation::create_from_raw(bm).unwrap();
+  ASSERT_EQ(fs->get_free_blocks_num().unwrap(), free_block_num);
+  ASSERT_EQ(fs->read_file(id).unwrap(), content);
+
+  remove(image.c_str());
+}
+
+TEST(BasicFileSystemTest, FormatVersion) {
+  auto bm =
+      std::shared_ptr<BlockManager>(new BlockManager(kBlockNum, kBlockSize));
+  { auto fs = FileOperation(bm, kTestInodeNum); }
+  ASSERT_TRUE(FileOperation::create_from_raw(bm).is_ok());
+
+  // an image of another format is not mounted
+  auto inner =
+      reinterpret_cast<SuperBlockInternal *>(bm->unsafe_get_block_ptr());
+  inner->version += 1;
+  auto res = FileOperation::create_from_raw(bm);
+  ASSERT_TRUE(res.is_err());
+  EXPECT_EQ(res.unwrap_error(), ErrorType::INVALID);
+}
+
+TEST(BasicFileSystemTest, LazyFormat) {
+  std::string image("test_lazy_format.img");
+  remove(image.c_str());
+
+  std::vector<u8> content(kBlockSize * 3 + 7, 'c');
+  inode_id_t id;
+  u64 free_inode_num;
+  usize lazy_blocks;
+  {
+    auto bm = std::shared_ptr<BlockManager>(
+        new BlockManager(image, kBlockNum, kBlockSize));
+    auto fs = FileOperation(bm, kTestInodeNum);
+    // the inode table and bitmaps are not touched by the format, and they
+    // are the only blocks tracked
+    lazy_blocks = bm->lazy_block_cnt();
+    ASSERT_GT(lazy_blocks, 0);
+    ASSERT_EQ(bm->lazy_tracked_cnt(), 128 + 2 + 8);
+
+    id = fs.alloc_inode(InodeType::FILE).unwrap();
+    fs.write_file(id, content).unwrap();
+    free_inode_num = fs.get_free_inode_num().unwrap();
+    ASSERT_LT(bm->lazy_block_cnt(), lazy_blocks);
+    lazy_blocks = bm->lazy_block_cnt();
+  }
+
+  auto bm = std::shared_ptr<BlockManager>(
+      new BlockManager(image, 0, kBlockSize));
+  auto fs = FileOperation::create_from_raw(bm).unwrap();
+  ASSERT_EQ(bm->lazy_block_cnt(), lazy_blocks);
+  ASSERT_EQ(fs->get_free_inode_num().unwrap(), free_inode_num);
+  ASSERT_EQ(fs->read_file(id).unwrap(), content);
+
+  // zero the rest in the background while the filesystem is in use
+  std::thread zeroer([bm]() { bm->zero_lazy_blocks(); });
+  auto id2 = fs->alloc_inode(InodeType::FILE).unwrap();
+  fs->write_file(id2, content).unwrap();
+  zeroer.join();
+
+  ASSERT_EQ(bm->lazy_block_cnt(), 0);
+  ASSERT_EQ(fs->get_free_inode_num().unwrap(), free_inode_num - 1);
+  ASSERT_EQ(fs->read_file(id).unwrap(), content);
+  ASSERT_EQ(fs->read_file(id2).unwrap(), content);
+
+  remove(image.c_str());
+}
+
 } // namespace chfs
\ No newline at end of file
@@ -0,0 +1,125 @@
+#include "./common.h"
+#include "filesystem/directory_op.h"
+#include "gtest/gtest.h"
+
+namespace chfs {
+
+const usize kCloneTestJournalBlocks = 256;
+
+auto make_content(usize size, u8 seed) -> std::vector<u8> {
+  std::vector<u8> content(size);
+  for (usize i = 0; i < size; i++) {
+    content[i] = static_cast<u8>(seed + i * 7 + i / kBlockSize);
+  }
+  return content;
+}
+
+class CloneTest : public ::testing::Test {
+protected:
+  std::shared_ptr<BlockManager> bm;
+  std::unique_ptr<FileOperation> fs;
+  inode_id_t root;
+
+  void SetUp() override {
+    bm = std::shared_ptr<BlockManager>(
+        new BlockManager(kBlockNum, kBlockSize));
+    fs = std::make_unique<FileOperation>(bm, kTestInodeNum,
+                                         AllocatorType::Bitmap,
+                                         kCloneTestJournalBlocks, true);
+    root = fs->alloc_inode(InodeType::Directory).unwrap();
+  }
+};
+
+TEST_F(CloneTest, CloneWholeFile) {
+  const auto free_blocks = fs->get_free_blocks_num().unwrap();
+  // the file spans the indirect block
+  const auto content = make_content(kBlockSize * 100 + 17, 1);
+  auto src = fs->mkfile(root, "src").unwrap();
+  fs->write_file(src, content).unwrap();
+  auto dst = fs->mkfile(root, "dst").unwrap();
+  const auto before_clone = fs->get_free_blocks_num().unwrap();
+
+  fs->clone_range(src, 0, dst, 0, content.size()).unwrap();
+  EXPECT_EQ(fs->read_file(dst).unwrap(), content);
+  // only the indirect block of the destination is allocated
+  EXPECT_EQ(fs->get_free_blocks_num().unwrap(), before_clone - 1);
+
+  // the shared block is copied upon write
+  auto changed = content;
+  changed[kBlockSize * 50] = 'x';
+  fs->write_file(dst, changed).unwrap();
+  EXPECT_EQ(fs->read_file(src).unwrap(), content);
+  EXPECT_EQ(fs->read_file(dst).unwrap(), changed);
+
+  fs->unlink(root, "src").unwrap();
+  EXPECT_EQ(fs->read_file(dst).unwrap(), changed);
+  fs->unlink(root, "dst").unwrap();
+  EXPECT_EQ(fs->get_free_blocks_num().unwrap(), free_blocks);
+}
+
+TEST_F(CloneTest, CloneRange) {
+  const auto src_content = make_content(kBlockSize * 12 + 5, 1);
+  const auto dst_content = make_content(kBlockSize * 8, 2);
+  auto src = fs->mkfile(root, "src").unwrap();
+  auto dst = fs->mkfile(root, "dst").unwrap();
+  fs->write_file(src, src_content).unwrap();
+  fs->write_file(dst, dst_content).unwrap();
+
+  // replace the middle of the destination
+  fs->clone_range(src, kBlockSize * 2, dst, kBlockSize * 4, kBlockSize * 3)
+      .unwrap();
+  auto expected = dst_content;
+  std::copy(src_content.begin() + kBlockSize * 2,
+            src_content.begin() + kBlockSize * 5,
+            expected.begin() + kBlockSize * 4);
+  EXPECT_EQ(fs->read_file(dst).unwrap(), expected);
+
+  // the unaligned tail of the source extends the destination, past a hole
+  fs->clone_range(src, kBlockSize * 11, dst, kBlockSize * 9, kBlockSize + 5)
+      .unwrap();
+  expected.resize(kBlockSize * 9);
+  expected.insert(expected.end(), src_content.begin() + kBlockSize * 11,
+                  src_content.end());
+  EXPECT_EQ(fs->read_file(dst).unwrap(), expected);
+
+  // within the same file
+  fs->clone_range(dst, 0, dst, kBlockSize * 2, kBlockSize).unwrap();
+  std::copy(expected.begin(), expected.begin() + kBlockSize,
+            expected.begin() + kBlockSize * 2);
+  EXPECT_EQ(fs->read_file(dst).unwrap(), expected);
+  EXPECT_EQ(fs->read_file(src).unwrap(), src_content);
+}
+
+TEST_F(CloneTest, InvalidRange) {
+  auto src = fs->mkfile(root, "src").unwrap();
+  auto dst = fs->mkfile(root, "dst").unwrap();
+  fs->write_file(src, make_content(kBlockSize * 4 + 1, 1)).unwrap();
+  fs->write_file(dst, make_content(kBlockSize * 4, 2)).unwrap();
+
+  // unaligned offsets
+  EXPECT_EQ(fs->clone_range(src, 1, dst, 0, kBlockSize).unwrap_error(),
+            ErrorType::INVALID_ARG);
+  // beyond the source
+  EXPECT_EQ(
+      fs->clone_range(src, kBlockSize * 4, dst, 0, kBlockSize).unwrap_error(),
+      ErrorType::INVALID_ARG);
+  // the unaligned tail doesn't cover the end of the destination
+  EXPECT_EQ(fs->clone_range(src, kBlockSize * 4, dst, 0, 1).unwrap_error(),
+            ErrorType::INVALID_ARG);
+  // overlapping
+  EXPECT_EQ(fs->clone_range(src, 0, src, kBlockSize, kBlockSize * 2)
+                .unwrap_error(),
+            ErrorType::INVALID_ARG);
+  EXPECT_EQ(fs->clone_range(src, 0, root, 0, kBlockSize).unwrap_error(),
+            ErrorType::INVALID_ARG);
+
+  // block sharing is required
+  auto plain_bm =
+      std::shared_ptr<BlockManager>(new BlockManager(kBlockNum, kBlockSize));
+  auto plain = FileOperation(plain_bm, kTestInodeNum);
+  auto id = plain.alloc_inode(InodeType::FILE).unwrap();
+  EXPECT_EQ(plain.clone_range(id, 0, id, 0, 0).unwrap_error(),
+            ErrorType::INVALID);
+}
+
+} // namespace chfs
@@ -0,0 +1,225 @@
+#include <algorithm>
+#include <random>
+
+#include "./common.h"
+#include "filesystem/directory_op.h"
+#include "filesystem/fsck.h"
+#include "gtest/gtest.h"
+
+namespace chfs {
+
+/**
+ * Lines of a log, which compress well
+ */
+auto log_lines(usize size) -> std::vector<u8> {
+  std::string log;
+  for (usize i = 0; log.size() < size; i++) {
+    log += "[INFO] request " + std::to_string(i) + " served in " +
+           std::to_string(i % 7) + " ms\n";
+  }
+  return std::vector<u8>(log.begin(), log.begin() + size);
+}
+
+auto random_bytes(usize size) -> std::vector<u8> {
+  std::mt19937 rng(size);
+  std::vector<u8> content(size);
+  for (auto &byte : content) {
+    byte = rng();
+  }
+  return content;
+}
+
+/**
+ * Count the blocks written
+ */
+class WriteCountingBlockManager : public BlockManager {
+public:
+  usize writes = 0;
+
+  using BlockManager::BlockManager;
+
+  auto write_block(block_id_t block_id, const u8 *data)
+      -> ChfsNullResult override {
+    writes++;
+    return BlockManager::write_block(block_id, data);
+  }
+};
+
+TEST(CompressTest, Codec) {
+  for (auto &data : {std::vector<u8>(), std::vector<u8>(3, 'x'),
+                     std::vector<u8>(100000, 'x'), log_lines(70000),
+                     random_bytes(8192)}) {
+    std::vector<u8> compressed;
+    lz_compress(data.data(), data.size(), compressed);
+    std::vector<u8> decompressed(data.size());
+    ASSERT_TRUE(lz_decompress(compressed.data(), compressed.size(),
+                              decompressed.data(), decompressed.size()));
+    EXPECT_EQ(decompressed, data);
+
+    // a truncated input is detected
+    if (!compressed.empty() && !data.empty()) {
+      EXPECT_FALSE(lz_decompress(compressed.data(), compressed.size() - 1,
+                                 decompressed.data(), decompressed.size()));
+    }
+  }
+
+  std::vector<u8> compressed;
+  auto logs = log_lines(KClusterBlocks * kBlockSize);
+  lz_compress(logs.data(), logs.size(), compressed);
+  EXPECT_LT(compressed.size() * 3, logs.size());
+}
+
+TEST(CompressTest, CompressedFile) {
+  auto bm =
+      std::shared_ptr<BlockManager>(new BlockManager(kBlockNum, kBlockSize));
+  auto fs = FileOperation(bm, kTestInodeNum);
+  auto root = fs.alloc_inode(InodeType::Directory).unwrap();
+  const auto initial_free = fs.get_free_blocks_num().unwrap();
+  EXPECT_EQ(fs.set_compression(root, true).unwrap_error(),
+            ErrorType::INVALID_ARG);
+
+  const auto content = log_lines(kBlockSize * 100 + 17);
+  auto plain = fs.mkfile(root, "plain").unwrap();
+  auto free_blocks = fs.get_free_blocks_num().unwrap();
+  fs.write_file(plain, content).unwrap();
+  const auto plain_blocks = free_blocks - fs.get_free_blocks_num().unwrap();
+
+  fs.set_compress_new_files(true);
+  auto compressed = fs.mkfile(root, "compressed").unwrap();
+  EXPECT_TRUE(fs.get_compression(compressed).unwrap());
+  free_blocks = fs.get_free_blocks_num().unwrap();
+  fs.write_file(compressed, content).unwrap();
+  EXPECT_LT((free_blocks - fs.get_free_blocks_num().unwrap()) * 3,
+            plain_blocks);
+  EXPECT_EQ(fs.getattr(compressed).unwrap().size, content.size());
+  EXPECT_EQ(fs.read_file(compressed).unwrap(), content);
+
+  // the ranges across the clusters
+  const u64 cluster_size = KClusterBlocks * kBlockSize;
+  for (auto [offset, size] : std::vector<std::pair<u64, u64>>{
+           {0, 10}, {cluster_size - 5, 10}, {100, cluster_size * 3},
+           {content.size() - 3, 3}}) {
+    EXPECT_EQ(fs.read_file_w_off(compressed, size, offset).unwrap(),
+              std::vector<u8>(content.begin() + offset,
+                              content.begin() + offset + size));
+  }
+
+  // the cached clusters are dropped upon a write
+  const std::vector<u8> patch(20, '#');
+  fs.write_file_w_off(compressed, reinterpret_cast<const char *>(patch.data()),
+                      patch.size(), cluster_size)
+      .unwrap();
+  EXPECT_EQ(fs.read_file_w_off(compressed, patch.size(), cluster_size).unwrap(),
+            patch);
+
+  // the incompressible content is stored as is
+  auto random = fs.mkfile(root, "random").unwrap();
+  fs.write_file(random, random_bytes(kBlockSize * 40)).unwrap();
+  EXPECT_EQ(fs.read_file(random).unwrap(), random_bytes(kBlockSize * 40));
+
+  // the compression can be changed on an existing file
+  fs.set_compression(plain, true).unwrap();
+  EXPECT_EQ(fs.read_file(plain).unwrap(), content);
+  fs.set_compression(compressed, false).unwrap();
+  fs.write_file(compressed, content).unwrap();
+  EXPECT_EQ(fs.read_file_w_off(compressed, 10, cluster_size).unwrap(),
+            std::vector<u8>(content.begin() + cluster_size,
+                            content.begin() + cluster_size + 10));
+
+  for (auto name : {"plain", "compressed", "random"}) {
+    fs.unlink(root, name).unwrap();
+  }
+  EXPECT_EQ(fs.get_free_blocks_num().unwrap(), initial_free);
+}
+
+TEST(CompressTest, RewriteModifiedClusters) {
+  auto bm = std::make_shared<WriteCountingBlockManager>(kBlockNum, kBlockSize);
+  auto fs = FileOperation(bm, kTestInodeNum);
+  fs.set_delayed_allocation(KLargeFileMax * 4).unwrap();
+  auto root = fs.alloc_inode(InodeType::Directory).unwrap();
+  const auto initial_free = fs.get_free_blocks_num().unwrap();
+  fs.set_compress_new_files(true);
+  auto file = fs.mkfile(root, "log").unwrap();
+
+  const u64 cluster_size = KClusterBlocks * kBlockSize;
+  auto content = log_lines(cluster_size * 6 + kBlockSize * 3);
+  fs.write_file(file, content).unwrap();
+  bm->writes = 0;
+  fs.flush(file).unwrap();
+  const auto whole_writes = bm->writes;
+
+  // an append rewrites the index and the last cluster, besides the inode
+  auto check = [&]() {
+    EXPECT_EQ(fs.read_file(file).unwrap(), content);
+    auto remounted = FileOperation::create_from_raw(bm).unwrap();
+    EXPECT_EQ(remounted->read_file(file).unwrap(), content);
+  };
+  const auto tail = log_lines(100);
+  for (int i = 0; i < 3; i++) {
+    fs.write_file_w_off(file, reinterpret_cast<const char *>(tail.data()),
+                        tail.size(), content.size())
+        .unwrap();
+    content.insert(content.end(), tail.begin(), tail.end());
+    bm->writes = 0;
+    fs.flush(file).unwrap();
+    EXPECT_LE(bm->writes, 5);
+    EXPECT_LT(bm->writes * 2, whole_writes);
+    check();
+  }
+
+  // a cluster in the middle becomes incompressible, the following ones are
+  // moved in the file but not rewritten
+  const auto noise = random_bytes(kBlockSize * 4);
+  fs.write_file_w_off(file, reinterpret_cast<const char *>(noise.data()),
+                      noise.size(), cluster_size * 2 + 10)
+      .unwrap();
+  std::copy(noise.begin(), noise.end(),
+            content.begin() + cluster_size * 2 + 10);
+  bm->writes = 0;
+  fs.flush(file).unwrap();
+  EXPECT_LE(bm->writes, KClusterBlocks + 3);
+  check();
+
+  // a truncation rewrites the new last cluster, and frees the others
+  content.resize(cluster_size + 7);
+  fs.resize(file, content.size()).unwrap();
+  fs.flush(file).unwrap();
+  check();
+  EXPECT_EQ(fs.read_file_w_off(file, 20, cluster_size - 10).unwrap(),
+            std::vector<u8>(content.begin() + cluster_size - 10,
+                            content.end()));
+
+  fs.unlink(root, "log").unwrap();
+  EXPECT_EQ(fs.get_free_blocks_num().unwrap(), initial_free);
+}
+
+TEST(CompressTest, MountCompressedFile) {
+  std::string image("test_compress.img");
+  remove(image.c_str());
+
+  const auto content = log_lines(kBlockSize * 90);
+  inode_id_t file;
+  {
+    auto bm = std::shared_ptr<BlockManager>(
+        new BlockManager(image, kBlockNum, kBlockSize));
+    auto fs = FileOperation(bm, kTestInodeNum, AllocatorType::Bitmap, 256);
+    auto root = fs.alloc_inode(InodeType::Directory).unwrap();
+    file = fs.mkfile(root, "log").unwrap();
+    fs.set_compression(file, true).unwrap();
+    fs.write_file(file, content).unwrap();
+    fs.unmount().unwrap();
+  }
+
+  auto bm = std::shared_ptr<BlockManager>(
+      new BlockManager(image, 0, kBlockSize));
+  auto report = Fsck::open(bm).unwrap()->check(1).unwrap();
+  EXPECT_TRUE(report.is_clean());
+
+  auto fs = FileOperation::create_from_raw(bm).unwrap();
+  EXPECT_TRUE(fs->get_compression(file).unwrap());
+  EXPECT_EQ(fs->read_file(file).unwrap(), content);
+
+  remove(image.c_str());
+}
+
+} // namespace chfs
@@ -0,0 +1,148 @@
+#include "./common.h"
+#include "filesystem/directory_op.h"
+#include "filesystem/fsck.h"
+#include "gtest/gtest.h"
+
+namespace chfs {
+
+const usize kDedupTestJournalBlocks = 256;
+const usize kDedupTestIndexBlocks = 64;
+
+/**
+ * The content of @block_num blocks, each block differs from the others
+ */
+auto distinct_blocks(usize block_num, u8 seed) -> std::vector<u8> {
+  std::vector<u8> content(kBlockSize * block_num);
+  for (usize i = 0; i < block_num; i++) {
+    std::fill_n(content.begin() + i * kBlockSize, kBlockSize,
+                static_cast<u8>(seed + i));
+    content[i * kBlockSize] = static_cast<u8>(i >> 8);
+  }
+  return content;
+}
+
+TEST(DedupTest, IdenticalFilesShareBlocks) {
+  auto bm =
+      std::shared_ptr<BlockManager>(new BlockManager(kBlockNum, kBlockSize));
+  auto fs = FileOperation(bm, kTestInodeNum, AllocatorType::Bitmap,
+                          kDedupTestJournalBlocks);
+  auto root = fs.alloc_inode(InodeType::Directory).unwrap();
+  fs.enable_dedup(kDedupTestIndexBlocks).unwrap();
+  EXPECT_EQ(fs.enable_dedup(kDedupTestIndexBlocks).unwrap_error(),
+            ErrorType::AlreadyExist);
+  const auto initial_free = fs.get_free_blocks_num().unwrap();
+
+  // the files with the same content (beyond the direct blocks) only cost
+  // their inode and indirect blocks
+  const auto content = distinct_blocks(80, 'a');
+  auto first = fs.mkfile(root, "first").unwrap();
+  fs.write_file(first, content).unwrap();
+  auto second = fs.mkfile(root, "second").unwrap();
+  auto free_blocks = fs.get_free_blocks_num().unwrap();
+  fs.write_file(second, content).unwrap();
+  EXPECT_EQ(fs.get_free_blocks_num().unwrap(), free_blocks - 1);
+  EXPECT_EQ(fs.read_file(second).unwrap(), content);
+
+  // rewriting a shared block leaves the other file intact
+  const std::vector<u8> patch(kBlockSize * 2, 'z');
+  fs.write_file_w_off(second, reinterpret_cast<const char *>(patch.data()),
+                      patch.size(), kBlockSize * 10)
+      .unwrap();
+  EXPECT_EQ(fs.read_file(first).unwrap(), content);
+  auto patched = content;
+  std::copy(patch.begin(), patch.end(), patched.begin() + kBlockSize * 10);
+  EXPECT_EQ(fs.read_file(second).unwrap(), patched);
+
+  // so does rewriting a block back
+  fs.write_file(second, content).unwrap();
+  EXPECT_EQ(fs.get_free_blocks_num().unwrap(), free_blocks - 1);
+
+  // the blocks are freed with their last reference
+  fs.unlink(root, "first").unwrap();
+  EXPECT_EQ(fs.read_file(second).unwrap(), content);
+  fs.unlink(root, "second").unwrap();
+  EXPECT_EQ(fs.get_free_blocks_num().unwrap(), initial_free);
+}
+
+TEST(DedupTest, DeduplicateExistingFiles) {
+  const usize file_num = 4;
+  auto bm =
+      std::shared_ptr<BlockManager>(new BlockManager(kBlockNum, kBlockSize));
+  auto fs = FileOperation(bm, kTestInodeNum, AllocatorType::Bitmap,
+                          kDedupTestJournalBlocks);
+  auto root = fs.alloc_inode(InodeType::Directory).unwrap();
+  EXPECT_EQ(fs.deduplicate().unwrap_error(), ErrorType::INVALID);
+
+  // the files written before the deduplication is enabled
+  const auto content = distinct_blocks(30, 'k');
+  std::vector<inode_id_t> files;
+  for (usize i = 0; i < file_num; i++) {
+    auto id = fs.mkfile(root, ("file" + std::to_string(i)).c_str()).unwrap();
+    fs.write_file(id, content).unwrap();
+    files.push_back(id);
+  }
+  auto unique = fs.mkfile(root, "unique").unwrap();
+  fs.write_file(unique, distinct_blocks(5, 'U')).unwrap();
+
+  fs.enable_dedup(kDedupTestIndexBlocks).unwrap();
+  const auto free_blocks = fs.get_free_blocks_num().unwrap();
+  EXPECT_EQ(fs.deduplicate().unwrap(), 30 * (file_num - 1));
+  EXPECT_EQ(fs.get_free_blocks_num().unwrap(),
+            free_blocks + 30 * (file_num - 1));
+  for (auto id : files) {
+    EXPECT_EQ(fs.read_file(id).unwrap(), content);
+  }
+  EXPECT_EQ(fs.read_file(unique).unwrap(), distinct_blocks(5, 'U'));
+
+  // nothing is left to deduplicate
+  EXPECT_EQ(fs.deduplicate().unwrap(), 0);
+  fs.unmount().unwrap();
+  auto report = Fsck::open(bm).unwrap()->check(1).unwrap();
+  EXPECT_TRUE(report.is_clean());
+}
+
+TEST(DedupTest, IndexClearedAfterCrash) {
+  std::string image("test_dedup.img");
+  remove(image.c_str());
+
+  const auto content = distinct_blocks(20, 'c');
+  inode_id_t root, first;
+  {
+    auto bm = std::shared_ptr<BlockManager>(
+        new BlockManager(image, kBlockNum, kBlockSize));
+    auto fs = FileOperation(bm, kTestInodeNum, AllocatorType::Bitmap,
+                            kDedupTestJournalBlocks);
+    root = fs.alloc_inode(InodeType::Directory).unwrap();
+    fs.enable_dedup(kDedupTestIndexBlocks).unwrap();
+    fs.unmount().unwrap();
+  }
+  {
+    auto bm = std::shared_ptr<BlockManager>(
+        new BlockManager(image, 0, kBlockSize));
+    auto fs = FileOperation::create_from_raw(bm).unwrap();
+    EXPECT_TRUE(fs->is_dedup_enabled());
+    first = fs->mkfile(root, "first").unwrap();
+    fs->write_file(first, content).unwrap();
+    // crash without unmounting
+    fs->sync().unwrap();
+  }
+
+  // the index is rebuilt from nothing, so the content is stored again
+  auto bm = std::shared_ptr<BlockManager>(
+      new BlockManager(image, 0, kBlockSize));
+  auto fs = FileOperation::create_from_raw(bm).unwrap();
+  EXPECT_EQ(fs->read_file(first).unwrap(), content);
+  auto second = fs->mkfile(root, "second").unwrap();
+  auto free_blocks = fs->get_free_blocks_num().unwrap();
+  fs->write_file(second, content).unwrap();
+  EXPECT_EQ(fs->get_free_blocks_num().unwrap(), free_blocks - 20);
+
+  // the offline pass catches up
+  EXPECT_EQ(fs->deduplicate().unwrap(), 20);
+  EXPECT_EQ(fs->read_file(first).unwrap(), content);
+  EXPECT_EQ(fs->read_file(second).unwrap(), content);
+
+  remove(image.c_str());
+}
+
+} // namespace chfs
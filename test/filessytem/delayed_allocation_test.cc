@@ -0,0 +1,223 @@
+#include <random>
+
+#include "./common.h"
+#include "filesystem/operations.h"
+#include "gtest/gtest.h"
+
+namespace chfs {
+
+/**
+ * Count the reads of the blocks
+ */
+class ReadCountingBlockManager : public BlockManager {
+public:
+  usize reads = 0;
+
+  using BlockManager::BlockManager;
+
+  auto read_block(block_id_t block_id, u8 *data) -> ChfsNullResult override {
+    reads++;
+    return BlockManager::read_block(block_id, data);
+  }
+};
+
+TEST(FileSystemTest, DelayedAllocation) {
+  auto bm =
+      std::shared_ptr<BlockManager>(new BlockManager(kBlockNum, kBlockSize));
+  auto fs = FileOperation(bm, kTestInodeNum);
+  fs.set_delayed_allocation(KLargeFileMax * 4).unwrap();
+
+  auto inode = fs.alloc_inode(InodeType::FILE).unwrap();
+  auto free_block_num = fs.get_free_blocks_num().unwrap();
+  auto free_block_num_on_disk =
+      FileOperation::create_from_raw(bm).unwrap()->get_free_blocks_num().unwrap();
+
+  // the writes are buffered, only the blocks are reserved
+  std::vector<u8> content(KLargeFileMin, 'a');
+  for (uint i = 0; i < 8; ++i) {
+    auto res = fs.write_file_w_off(inode, reinterpret_cast<const char *>(
+                                              content.data()),
+                                   content.size(), i * content.size());
+    ASSERT_TRUE(res.is_ok());
+  }
+  auto reserved = (KLargeFileMin * 8) / kBlockSize + 1; // 1: indirect block
+  ASSERT_EQ(fs.get_free_blocks_num().unwrap(), free_block_num - reserved);
+  ASSERT_EQ(fs.getattr(inode).unwrap().size, KLargeFileMin * 8);
+  ASSERT_EQ(FileOperation::create_from_raw(bm)
+                .unwrap()
+                ->get_free_blocks_num()
+                .unwrap(),
+            free_block_num_on_disk);
+
+  auto read_res = fs.read_file_w_off(inode, 5, KLargeFileMin * 3);
+  ASSERT_EQ(read_res.unwrap(), std::vector<u8>(5, 'a'));
+
+  // the blocks are allocated at flush
+  ASSERT_TRUE(fs.flush(inode).is_ok());
+  ASSERT_EQ(fs.get_free_blocks_num().unwrap(), free_block_num - reserved);
+  auto fs1 = FileOperation::create_from_raw(bm).unwrap();
+  ASSERT_EQ(fs1->get_free_blocks_num().unwrap(),
+            free_block_num_on_disk - reserved);
+  ASSERT_EQ(fs1->read_file(inode).unwrap(),
+            std::vector<u8>(KLargeFileMin * 8, 'a'));
+
+  // a temporary file never touches the allocator
+  auto tmp = fs.alloc_inode(InodeType::FILE).unwrap();
+  free_block_num = fs.get_free_blocks_num().unwrap();
+  ASSERT_TRUE(fs.write_file(tmp, content).is_ok());
+  ASSERT_LT(fs.get_free_blocks_num().unwrap(), free_block_num);
+  ASSERT_TRUE(fs.remove_file(tmp).is_ok());
+  ASSERT_EQ(fs.get_free_blocks_num().unwrap(), free_block_num + 1);
+}
+
+TEST(FileSystemTest, DelayedAllocationTruncated) {
+  auto bm =
+      std::shared_ptr<BlockManager>(new BlockManager(kBlockNum, kBlockSize));
+  auto fs = FileOperation(bm, kTestInodeNum);
+  auto inode = fs.alloc_inode(InodeType::FILE).unwrap();
+  fs.write_file(inode, std::vector<u8>(KLargeFileMin, 'a')).unwrap();
+
+  // the file truncated while buffered has no dirty bytes
+  fs.set_delayed_allocation(KLargeFileMax).unwrap();
+  fs.resize(inode, 0).unwrap();
+  fs.set_delayed_allocation(0).unwrap();
+  EXPECT_EQ(FileOperation::create_from_raw(bm)
+                .unwrap()
+                ->getattr(inode)
+                .unwrap()
+                .size,
+            0u);
+
+  // the later writes are not shadowed by the buffer
+  const std::vector<u8> content(2000, 'b');
+  fs.write_file_w_off(inode, reinterpret_cast<const char *>(content.data()),
+                      content.size(), 0)
+      .unwrap();
+  EXPECT_EQ(fs.getattr(inode).unwrap().size, content.size());
+  EXPECT_EQ(fs.read_file(inode).unwrap(), content);
+}
+
+TEST(FileSystemTest, DelayedAllocationPressure) {
+  std::mt19937 rng(get_test_seed());
+  std::uniform_int_distribution<usize> uni_sz(1, KLargeFileMax);
+
+  auto bm =
+      std::shared_ptr<BlockManager>(new BlockManager(kBlockNum, kBlockSize));
+  auto fs = FileOperation(bm, kTestInodeNum);
+  fs.set_delayed_allocation(KLargeFileMax * 2).unwrap();
+
+  std::unordered_map<inode_id_t, std::vector<u8>> contents;
+  for (usize i = 0; i < kFileNum; i++) {
+    auto id = fs.alloc_inode(InodeType::FILE).unwrap();
+    contents[id] = std::vector<u8>(uni_sz(rng), static_cast<u8>(i));
+    ASSERT_TRUE(fs.write_file(id, contents[id]).is_ok());
+  }
+  for (auto &[id, content] : contents) {
+    ASSERT_EQ(fs.read_file(id).unwrap(), content);
+  }
+
+  // disabling the delayed allocation writes everything back
+  ASSERT_TRUE(fs.set_delayed_allocation(0).is_ok());
+  auto fs1 = FileOperation::create_from_raw(bm).unwrap();
+  ASSERT_EQ(fs1->get_free_blocks_num().unwrap(),
+            fs.get_free_blocks_num().unwrap());
+  for (auto &[id, content] : contents) {
+    ASSERT_EQ(fs1->read_file(id).unwrap(), content);
+  }
+}
+
+TEST(FileSystemTest, CoalescedWrites) {
+  auto bm =
+      std::shared_ptr<BlockManager>(new BlockManager(kBlockNum, kBlockSize));
+  auto fs = FileOperation(bm, kTestInodeNum);
+  fs.set_delayed_allocation(KLargeFileMax * 4).unwrap();
+  auto inode = fs.alloc_inode(InodeType::FILE).unwrap();
+
+  // small sequential writes, each smaller than a block
+  std::vector<u8> content(kBlockSize * 70);
+  for (usize i = 0; i < content.size(); i++) {
+    content[i] = i % 251;
+  }
+  const u64 chunk = 100;
+  for (u64 offset = 0; offset < content.size(); offset += chunk) {
+    const auto sz = std::min<u64>(chunk, content.size() - offset);
+    fs.write_file_w_off(inode,
+                        reinterpret_cast<const char *>(content.data()) + offset,
+                        sz, offset)
+        .unwrap();
+  }
+  fs.flush(inode).unwrap();
+  EXPECT_EQ(fs.read_file(inode).unwrap(), content);
+
+  // only the blocks written since the last flush are written again, so a
+  // block changed behind our back is left as is
+  std::vector<u8> raw(kBlockSize);
+  bm->read_block(1, raw.data()).unwrap(); // the inode table
+  bm->read_block(reinterpret_cast<block_id_t *>(raw.data())[inode - 1],
+                 raw.data())
+      .unwrap();
+  const block_id_t untouched =
+      reinterpret_cast<Inode *>(raw.data())->blocks[3];
+  bm->unsafe_get_block_ptr()[untouched * kBlockSize] = 0xFF;
+
+  const std::vector<u8> patch(10, 'p');
+  fs.write_file_w_off(inode, reinterpret_cast<const char *>(patch.data()),
+                      patch.size(), kBlockSize * 10 - 5)
+      .unwrap();
+  // extending the file zeroes the hole
+  fs.write_file_w_off(inode, reinterpret_cast<const char *>(patch.data()),
+                      patch.size(), content.size() + kBlockSize)
+      .unwrap();
+  fs.flush(inode).unwrap();
+
+  std::copy(patch.begin(), patch.end(), content.begin() + kBlockSize * 10 - 5);
+  content[3 * kBlockSize] = 0xFF;
+  content.resize(content.size() + kBlockSize);
+  content.insert(content.end(), patch.begin(), patch.end());
+  EXPECT_EQ(fs.read_file(inode).unwrap(), content);
+}
+
+TEST(FileSystemTest, SparseWrites) {
+  auto bm = std::make_shared<ReadCountingBlockManager>(kBlockNum, kBlockSize);
+  auto fs = FileOperation(bm, kTestInodeNum);
+  auto inode = fs.alloc_inode(InodeType::FILE).unwrap();
+
+  const usize file_blocks = 70;
+  std::vector<u8> content(kBlockSize * file_blocks);
+  for (usize i = 0; i < content.size(); i++) {
+    content[i] = i % 251;
+  }
+  fs.write_file(inode, content).unwrap();
+
+  // the file is larger than the buffer, yet a small write buffers only its
+  // block, instead of loading the whole file
+  fs.set_delayed_allocation(kBlockSize * 4).unwrap();
+  bm->reads = 0;
+  for (usize i = 0; i < 8; i++) {
+    const u64 offset = (i * 9 + 1) * kBlockSize + 7;
+    const char byte = 'x';
+    fs.write_file_w_off(inode, &byte, 1, offset).unwrap();
+    content[offset] = byte;
+
+    auto read_res = fs.read_file_w_off(inode, 3, offset - 1).unwrap();
+    EXPECT_EQ(read_res, std::vector<u8>(content.begin() + offset - 1,
+                                        content.begin() + offset + 2));
+  }
+  fs.flush(inode).unwrap();
+  EXPECT_LT(bm->reads, file_blocks);
+  EXPECT_EQ(fs.read_file(inode).unwrap(), content);
+
+  // the slices of a partially written block are completed from the device
+  const char byte = 'y';
+  fs.write_file_w_off(inode, &byte, 1, kBlockSize * 2 + 3).unwrap();
+  content[kBlockSize * 2 + 3] = byte;
+  auto slices = fs.read_file_in_place(inode, kBlockSize * 3, 0).unwrap();
+  std::vector<u8> sliced;
+  for (auto &slice : slices) {
+    sliced.insert(sliced.end(), slice.data, slice.data + slice.len);
+  }
+  EXPECT_EQ(sliced, std::vector<u8>(content.begin(),
+                                    content.begin() + kBlockSize * 3));
+}
+
+} // namespace chfs
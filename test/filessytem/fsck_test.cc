@@ -0,0 +1,276 @@
+#include <algorithm>
+
+#include "./common.h"
+#include "filesystem/directory_op.h"
+#include "filesystem/fsck.h"
+#include "gtest/gtest.h"
+
+namespace chfs {
+
+const usize kFsckTestJournalBlocks = 256;
+const usize kFsckTestThreads = 4;
+// superblock + inode table + inode bitmap
+const block_id_t kFsckTestBlockBitmap = 1 + 128 + 2;
+
+/**
+ * Read the inode of a file from the raw image
+ */
+auto read_raw_inode(std::shared_ptr<BlockManager> bm, inode_id_t id,
+                    std::vector<u8> &inode) -> block_id_t {
+  const auto inode_per_block = kBlockSize / sizeof(block_id_t);
+  std::vector<u8> table(kBlockSize);
+  bm->read_block(1 + (id - 1) / inode_per_block, table.data()).unwrap();
+  auto bid =
+      reinterpret_cast<block_id_t *>(table.data())[(id - 1) % inode_per_block];
+  bm->read_block(bid, inode.data()).unwrap();
+  return bid;
+}
+
+auto flip_block_bit(std::shared_ptr<BlockManager> bm, block_id_t block_id)
+    -> void {
+  const auto bits_per_block = kBlockSize * KBitsPerByte;
+  const auto bitmap_block = kFsckTestBlockBitmap + block_id / bits_per_block;
+  std::vector<u8> buffer(kBlockSize);
+  bm->read_block(bitmap_block, buffer.data()).unwrap();
+  auto bitmap = Bitmap(buffer.data(), kBlockSize);
+  if (bitmap.check(block_id % bits_per_block)) {
+    bitmap.clear(block_id % bits_per_block);
+  } else {
+    bitmap.set(block_id % bits_per_block);
+  }
+  bm->write_block(bitmap_block, buffer.data()).unwrap();
+}
+
+TEST(FsckTest, CleanFilesystem) {
+  std::string image("test_fsck_clean.img");
+  remove(image.c_str());
+
+  u64 free_block_num;
+  {
+    auto bm = std::shared_ptr<BlockManager>(
+        new BlockManager(image, kBlockNum, kBlockSize));
+    auto fs = FileOperation(bm, kTestInodeNum, AllocatorType::Bitmap,
+                            kFsckTestJournalBlocks);
+    auto root = fs.alloc_inode(InodeType::Directory).unwrap();
+    for (int i = 0; i < 8; i++) {
+      auto dir = fs.mkdir(root, ("dir" + std::to_string(i)).c_str()).unwrap();
+      for (int j = 0; j < 16; j++) {
+        auto id = fs.mkfile(dir, ("file" + std::to_string(j)).c_str()).unwrap();
+        // some files use the indirect block
+        std::vector<u8> content(kBlockSize * 6 * j + 7, 'a' + j);
+        fs.write_file(id, content).unwrap();
+      }
+    }
+    fs.unlink(root, "dir3").is_ok();
+    free_block_num = fs.get_free_blocks_num().unwrap();
+    fs.unmount().unwrap();
+  }
+
+  auto bm = std::shared_ptr<BlockManager>(
+      new BlockManager(image, 0, kBlockSize));
+  auto fsck = Fsck::open(bm).unwrap();
+  auto report = fsck->check(kFsckTestThreads).unwrap();
+  EXPECT_TRUE(report.is_clean());
+  EXPECT_EQ(report.inodes, 1 + 8 + 8 * 16);
+  EXPECT_EQ(report.used_blocks, kBlockNum - free_block_num);
+
+  remove(image.c_str());
+}
+
+TEST(FsckTest, CleanWithSnapshots) {
+  std::string image("test_fsck_snapshot.img");
+  remove(image.c_str());
+
+  u64 free_block_num;
+  {
+    auto bm = std::shared_ptr<BlockManager>(
+        new BlockManager(image, kBlockNum, kBlockSize));
+    auto fs = FileOperation(bm, kTestInodeNum, AllocatorType::Bitmap,
+                            kFsckTestJournalBlocks, true);
+    auto root = fs.alloc_inode(InodeType::Directory).unwrap();
+    std::vector<inode_id_t> files;
+    for (int i = 0; i < 16; i++) {
+      auto id = fs.mkfile(root, ("file" + std::to_string(i)).c_str()).unwrap();
+      fs.write_file(id, std::vector<u8>(kBlockSize * 6 * i + 7, 'a' + i))
+          .unwrap();
+      files.push_back(id);
+    }
+
+    // the blocks are shared by the snapshots, partially copied and dropped
+    fs.snapshot().unwrap();
+    fs.write_file(files[15], std::vector<u8>(kBlockSize * 40, 'z')).unwrap();
+    fs.unlink(root, "file3").unwrap();
+    fs.snapshot().unwrap();
+    fs.write_file(files[12], std::vector<u8>(kBlockSize * 2, 'y')).unwrap();
+    fs.unlink(root, "file15").unwrap();
+    free_block_num = fs.get_free_blocks_num().unwrap();
+    fs.unmount().unwrap();
+  }
+
+  auto bm = std::shared_ptr<BlockManager>(
+      new BlockManager(image, 0, kBlockSize));
+  auto report = Fsck::open(bm).unwrap()->check(kFsckTestThreads).unwrap();
+  EXPECT_TRUE(report.is_clean());
+  EXPECT_EQ(report.inodes, 1 + 14);
+  EXPECT_EQ(report.used_blocks, kBlockNum - free_block_num);
+
+  remove(image.c_str());
+}
+
+TEST(FsckTest, FindAndRepair) {
+  std::string image("test_fsck_repair.img");
+  remove(image.c_str());
+
+  const std::vector<u8> content_a(kBlockSize * 2, 'a');
+  const std::vector<u8> content_b(kBlockSize * 2, 'b');
+  inode_id_t root, file_a, file_b, file_c, removed, orphan;
+  {
+    auto bm = std::shared_ptr<BlockManager>(
+        new BlockManager(image, kBlockNum, kBlockSize));
+    auto fs = FileOperation(bm, kTestInodeNum, AllocatorType::Bitmap,
+                            kFsckTestJournalBlocks);
+    root = fs.alloc_inode(InodeType::Directory).unwrap();
+    file_a = fs.mkfile(root, "a").unwrap();
+    file_b = fs.mkfile(root, "b").unwrap();
+    file_c = fs.mkfile(root, "c").unwrap();
+    removed = fs.mkfile(root, "removed").unwrap();
+    fs.write_file(file_a, content_a).unwrap();
+    fs.write_file(file_b, content_b).unwrap();
+    fs.write_file(file_c, content_b).unwrap();
+
+    // an orphan and a dangling entry
+    orphan = fs.alloc_inode(InodeType::FILE).unwrap();
+    fs.write_file(orphan, content_a).unwrap();
+    fs.remove_file(removed).unwrap();
+    fs.unmount().unwrap();
+  }
+
+  auto bm = std::shared_ptr<BlockManager>(
+      new BlockManager(image, 0, kBlockSize));
+  // the untouched bitmap blocks are zeroed lazily
+  bm->enable_lazy_zero(
+      0, KLazyFlagOffset,
+      SuperBlock::create_from_existing(bm, 0).unwrap()->get_lazy_zero_blocks(),
+      false);
+  std::vector<u8> inode(kBlockSize);
+  auto inode_p = reinterpret_cast<Inode *>(inode.data());
+
+  // b shares the first block of a, so its own first block leaks
+  read_raw_inode(bm, file_a, inode);
+  const auto shared_block = inode_p->blocks[0];
+  const auto a_second_block = inode_p->blocks[1];
+  auto b_inode_block = read_raw_inode(bm, file_b, inode);
+  const auto b_first_block = inode_p->blocks[0];
+  inode_p->blocks[0] = shared_block;
+  bm->write_block(b_inode_block, inode.data()).unwrap();
+
+  // c has a bad type
+  auto c_inode_block = read_raw_inode(bm, file_c, inode);
+  const auto c_first_block = inode_p->blocks[0];
+  memset(inode.data(), 0, sizeof(InodeType));
+  bm->write_block(c_inode_block, inode.data()).unwrap();
+
+  // a block leaks and a block in use is free in the bitmap
+  const block_id_t leaked_block = kBlockNum - 1;
+  flip_block_bit(bm, leaked_block);
+  flip_block_bit(bm, a_second_block);
+
+  auto fsck = Fsck::open(bm).unwrap();
+  auto report = fsck->check(kFsckTestThreads).unwrap();
+  ASSERT_FALSE(report.is_clean());
+  EXPECT_EQ(report.bad_inodes, std::vector<inode_id_t>{file_c});
+  EXPECT_EQ(report.orphan_inodes, std::vector<inode_id_t>{orphan});
+  ASSERT_EQ(report.dangling_entries.size(), 2);
+  for (auto &entry : report.dangling_entries) {
+    EXPECT_EQ(entry.dir, root);
+    EXPECT_TRUE(entry.name == "c" || entry.name == "removed");
+  }
+  ASSERT_EQ(report.shared_blocks.size(), 1);
+  EXPECT_EQ(report.shared_blocks[0].block_id, shared_block);
+  EXPECT_EQ(report.unmarked_blocks, std::vector<block_id_t>{a_second_block});
+  for (auto block_id : {leaked_block, b_first_block, c_first_block}) {
+    EXPECT_NE(std::find(report.leaked_blocks.begin(),
+                        report.leaked_blocks.end(), block_id),
+              report.leaked_blocks.end());
+  }
+
+  fsck->repair(report).unwrap();
+  report = Fsck::open(bm).unwrap()->check(kFsckTestThreads).unwrap();
+  EXPECT_TRUE(report.is_clean());
+
+  auto fs = FileOperation::create_from_raw(bm).unwrap();
+  EXPECT_EQ(fs->read_file(file_a).unwrap(), content_a);
+  auto content = fs->read_file(file_b).unwrap();
+  EXPECT_TRUE(std::equal(content.begin(), content.begin() + kBlockSize,
+                         content_a.begin()));
+  EXPECT_TRUE(fs->lookup(root, "c").is_err());
+  EXPECT_TRUE(fs->lookup(root, "removed").is_err());
+
+  auto lost_found = fs->lookup(root, "lost+found").unwrap();
+  auto name = "#" + std::to_string(orphan);
+  EXPECT_EQ(fs->lookup(lost_found, name.c_str()).unwrap(), orphan);
+  EXPECT_EQ(fs->read_file(orphan).unwrap(), content_a);
+
+  // the shared block is copied, so writing b leaves a intact
+  fs->write_file(file_b, content_b).unwrap();
+  EXPECT_EQ(fs->read_file(file_a).unwrap(), content_a);
+
+  remove(image.c_str());
+}
+
+TEST(FsckTest, CorruptedBlocks) {
+  std::string image("test_fsck_checksum.img");
+  remove(image.c_str());
+
+  const std::vector<u8> content(kBlockSize * 3, 'a');
+  inode_id_t file;
+  {
+    auto bm = std::shared_ptr<BlockManager>(
+        new BlockManager(image, kBlockNum, kBlockSize));
+    auto fs = FileOperation(bm, kTestInodeNum, AllocatorType::Bitmap,
+                            kFsckTestJournalBlocks);
+    auto root = fs.alloc_inode(InodeType::Directory).unwrap();
+    fs.enable_checksum().unwrap();
+    EXPECT_EQ(fs.enable_checksum().unwrap_error(), ErrorType::AlreadyExist);
+    file = fs.mkfile(root, "a").unwrap();
+    fs.write_file(file, content).unwrap();
+    fs.unmount().unwrap();
+  }
+
+  auto bm = std::shared_ptr<BlockManager>(
+      new BlockManager(image, 0, kBlockSize));
+  {
+    auto report = Fsck::open(bm).unwrap()->check(kFsckTestThreads).unwrap();
+    EXPECT_TRUE(report.is_clean());
+  }
+
+  // a bit rots in the second block of the file
+  std::vector<u8> inode(kBlockSize);
+  read_raw_inode(bm, file, inode);
+  const block_id_t rotten = reinterpret_cast<Inode *>(inode.data())->blocks[1];
+  bm->unsafe_get_block_ptr()[rotten * kBlockSize + 5] ^= 0x10;
+
+  {
+    auto fs = FileOperation::create_from_raw(bm).unwrap();
+    EXPECT_TRUE(fs->is_checksum_enabled());
+    EXPECT_EQ(fs->read_file(file).unwrap_error(), ErrorType::Corrupted);
+    EXPECT_EQ(fs->getattr(file).unwrap().size, content.size());
+    fs->unmount().unwrap();
+  }
+
+  auto fsck = Fsck::open(bm).unwrap();
+  auto report = fsck->check(kFsckTestThreads).unwrap();
+  EXPECT_EQ(report.corrupted_blocks, std::vector<block_id_t>{rotten});
+  fsck->repair(report).unwrap();
+  report = Fsck::open(bm).unwrap()->check(kFsckTestThreads).unwrap();
+  EXPECT_TRUE(report.is_clean());
+
+  // the rotten content is accepted
+  auto fs = FileOperation::create_from_raw(bm).unwrap();
+  auto read = fs->read_file(file).unwrap();
+  EXPECT_EQ(read[kBlockSize + 5], 'a' ^ 0x10);
+
+  remove(image.c_str());
+}
+
+} // namespace chfs
@@ -0,0 +1,111 @@
+#include "./common.h"
+#include "filesystem/operations.h"
+#include "filesystem/readahead.h"
+#include "gtest/gtest.h"
+
+namespace chfs {
+
+using Range = std::pair<u64, u64>;
+
+TEST(ReadaheadTest, Window) {
+  auto window = ReadaheadWindow(8, 32);
+
+  // a stream is detected from its first read
+  EXPECT_EQ(window.on_read(0, 4), Range(4, 8));
+  // half of the window is still ahead
+  EXPECT_EQ(window.on_read(4, 2).second, 0);
+  // the window doubles as the stream goes on
+  EXPECT_EQ(window.on_read(6, 4), Range(12, 14));
+  EXPECT_EQ(window.get_window(), 16);
+  EXPECT_EQ(window.on_read(10, 20), Range(30, 32));
+  EXPECT_EQ(window.get_window(), 32);
+  EXPECT_EQ(window.on_read(30, 40), Range(70, 32));
+  EXPECT_EQ(window.get_window(), 32);
+
+  // a random read resets it
+  EXPECT_EQ(window.on_read(1000, 4).second, 0);
+  EXPECT_EQ(window.get_window(), 0);
+  EXPECT_EQ(window.on_read(1004, 4), Range(1008, 8));
+}
+
+TEST(ReadaheadTest, RangedRead) {
+  std::string image("test_readahead.img");
+  remove(image.c_str());
+
+  auto bm = std::shared_ptr<BlockManager>(
+      new BlockManager(image, kBlockNum, kBlockSize));
+  auto fs = FileOperation(bm, kTestInodeNum);
+  auto root = fs.alloc_inode(InodeType::Directory).unwrap();
+  auto file = fs.mkfile(root, "stream").unwrap();
+
+  // across the direct and the indirect blocks
+  std::vector<u8> content(kBlockSize * 100 + 3);
+  for (usize i = 0; i < content.size(); i++) {
+    content[i] = i * 7 + i / kBlockSize;
+  }
+  fs.write_file(file, content).unwrap();
+
+  auto window = ReadaheadWindow(kBlockSize * 4, kBlockSize * 32);
+  std::vector<u8> streamed;
+  const u64 chunk = kBlockSize / 2 + 5;
+  for (u64 offset = 0; offset < content.size(); offset += chunk) {
+    auto part = fs.read_file_w_off(file, chunk, offset).unwrap();
+    streamed.insert(streamed.end(), part.begin(), part.end());
+    auto [ahead_off, ahead_len] = window.on_read(offset, part.size());
+    fs.readahead(file, ahead_off, ahead_len).unwrap();
+  }
+  EXPECT_EQ(streamed, content);
+
+  // the range is truncated at the end of the file
+  EXPECT_EQ(fs.read_file_w_off(file, 100, content.size() - 3).unwrap().size(),
+            3);
+  EXPECT_TRUE(fs.read_file_w_off(file, 100, content.size()).unwrap().empty());
+  fs.readahead(file, content.size() + 10, 100).unwrap();
+
+  remove(image.c_str());
+}
+
+TEST(FileSystemTest, ReadInPlace) {
+  auto bm =
+      std::shared_ptr<BlockManager>(new BlockManager(kBlockNum, kBlockSize));
+  auto fs = FileOperation(bm, kTestInodeNum);
+  auto file = fs.alloc_inode(InodeType::FILE).unwrap();
+
+  std::vector<u8> content(kBlockSize * 40 + 9);
+  for (usize i = 0; i < content.size(); i++) {
+    content[i] = i * 13 + i / kBlockSize;
+  }
+  fs.write_file(file, content).unwrap();
+
+  auto gather = [&](u64 sz, u64 offset) {
+    std::vector<u8> gathered;
+    for (auto slice : fs.read_file_in_place(file, sz, offset).unwrap()) {
+      gathered.insert(gathered.end(), slice.data, slice.data + slice.len);
+    }
+    return gathered;
+  };
+  EXPECT_EQ(gather(content.size(), 0), content);
+  EXPECT_EQ(gather(kBlockSize * 3, kBlockSize / 2),
+            fs.read_file_w_off(file, kBlockSize * 3, kBlockSize / 2).unwrap());
+  EXPECT_EQ(gather(100, content.size() - 4).size(), 4);
+  EXPECT_TRUE(gather(100, content.size()).empty());
+
+  // the blocks allocated in a row are merged
+  EXPECT_LT(fs.read_file_in_place(file, kBlockSize * 8, 0).unwrap().size(), 8);
+
+  // the buffered content is sliced as well
+  fs.set_delayed_allocation(KLargeFileMax * 4).unwrap();
+  fs.write_file_w_off(file, "xyz", 3, 10).unwrap();
+  std::copy_n("xyz", 3, content.begin() + 10);
+  EXPECT_EQ(gather(content.size(), 0), content);
+  fs.flush(file).unwrap();
+  EXPECT_EQ(gather(content.size(), 0), content);
+
+  // a compressed file must be decompressed
+  fs.set_compression(file, true).unwrap();
+  fs.flush(file).unwrap();
+  EXPECT_EQ(fs.read_file_in_place(file, 10, 0).unwrap_error(),
+            ErrorType::INVALID);
+}
+
+} // namespace chfs
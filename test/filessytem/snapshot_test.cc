@@ -0,0 +1,172 @@
+#include "./common.h"
+#include "filesystem/directory_op.h"
+#include "metadata/superblock.h"
+#include "gtest/gtest.h"
+
+namespace chfs {
+
+const usize kSnapshotTestJournalBlocks = 256;
+
+/**
+ * Create files of different sizes, some of them use the indirect block
+ */
+auto populate(FileOperation &fs, inode_id_t root, usize file_num)
+    -> std::vector<inode_id_t> {
+  std::vector<inode_id_t> files;
+  for (usize i = 0; i < file_num; i++) {
+    auto id = fs.mkfile(root, ("file" + std::to_string(i)).c_str()).unwrap();
+    fs.write_file(id, std::vector<u8>(kBlockSize * 5 * i + 3, 'a' + i))
+        .unwrap();
+    files.push_back(id);
+  }
+  return files;
+}
+
+/**
+ * Fail the reads of the blocks in [begin, end)
+ */
+class FailingBlockManager : public BlockManager {
+public:
+  block_id_t begin = 0;
+  block_id_t end = 0;
+
+  using BlockManager::BlockManager;
+
+  auto read_block(block_id_t block_id, u8 *data) -> ChfsNullResult override {
+    if (block_id >= begin && block_id < end) {
+      return ChfsNullResult(ErrorType::Corrupted);
+    }
+    return BlockManager::read_block(block_id, data);
+  }
+};
+
+TEST(SnapshotTest, CopyOnWrite) {
+  const usize file_num = 8;
+  auto bm =
+      std::shared_ptr<BlockManager>(new BlockManager(kBlockNum, kBlockSize));
+  auto fs = FileOperation(bm, kTestInodeNum, AllocatorType::Bitmap,
+                          kSnapshotTestJournalBlocks, true);
+  auto root = fs.alloc_inode(InodeType::Directory).unwrap();
+  auto files = populate(fs, root, file_num);
+
+  // the same operations on a filesystem without snapshot
+  auto control_bm =
+      std::shared_ptr<BlockManager>(new BlockManager(kBlockNum, kBlockSize));
+  auto control = FileOperation(control_bm, kTestInodeNum,
+                               AllocatorType::Bitmap,
+                               kSnapshotTestJournalBlocks, true);
+  control.alloc_inode(InodeType::Directory).unwrap();
+  populate(control, root, file_num);
+
+  auto id = fs.snapshot().unwrap();
+  ASSERT_EQ(fs.list_snapshots().unwrap().size(), 1);
+
+  // rewriting the same content copies only the inode block
+  auto free_blocks = fs.get_free_blocks_num().unwrap();
+  fs.write_file(files[1], fs.read_file(files[1]).unwrap()).unwrap();
+  EXPECT_EQ(fs.get_free_blocks_num().unwrap(), free_blocks - 1);
+
+  // modify the live filesystem
+  std::vector<u8> changed(kBlockSize * 30 + 1, 'z');
+  for (auto fs_p : {&fs, &control}) {
+    fs_p->write_file(files[7], changed).unwrap();
+    fs_p->write_file(files[3], std::vector<u8>(7, 'y')).unwrap();
+    fs_p->unlink(root, "file5").unwrap();
+    fs_p->mkfile(root, "new").unwrap();
+  }
+  EXPECT_EQ(fs.read_file(files[7]).unwrap(), changed);
+  EXPECT_TRUE(fs.lookup(root, "file5").is_err());
+
+  // the snapshot is intact
+  auto snapshot = FileOperation::create_from_snapshot(bm, id).unwrap();
+  for (usize i = 0; i < file_num; i++) {
+    auto name = "file" + std::to_string(i);
+    EXPECT_EQ(snapshot->lookup(root, name.c_str()).unwrap(), files[i]);
+    EXPECT_EQ(snapshot->read_file(files[i]).unwrap(),
+              std::vector<u8>(kBlockSize * 5 * i + 3, 'a' + i));
+  }
+  EXPECT_TRUE(snapshot->lookup(root, "new").is_err());
+
+  // and read-only
+  EXPECT_EQ(snapshot->write_file(files[0], changed).unwrap_error(),
+            ErrorType::ReadOnly);
+  EXPECT_EQ(snapshot->mkfile(root, "new").unwrap_error(),
+            ErrorType::ReadOnly);
+  EXPECT_EQ(snapshot->unlink(root, "file0").unwrap_error(),
+            ErrorType::ReadOnly);
+
+  // the blocks only referenced by the snapshot are freed
+  fs.delete_snapshot(id).unwrap();
+  EXPECT_TRUE(fs.list_snapshots().unwrap().empty());
+  EXPECT_EQ(fs.get_free_blocks_num().unwrap(),
+            control.get_free_blocks_num().unwrap());
+  EXPECT_EQ(fs.read_file(files[7]).unwrap(), changed);
+  EXPECT_EQ(fs.read_file(files[3]).unwrap(), std::vector<u8>(7, 'y'));
+  EXPECT_TRUE(FileOperation::create_from_snapshot(bm, id).is_err());
+}
+
+TEST(SnapshotTest, MountPersistedSnapshot) {
+  std::string image("test_snapshot.img");
+  remove(image.c_str());
+
+  const std::vector<u8> content(kBlockSize * 20 + 9, 's');
+  inode_id_t root, file;
+  u32 first, second;
+  {
+    auto bm = std::shared_ptr<BlockManager>(
+        new BlockManager(image, kBlockNum, kBlockSize));
+    auto fs = FileOperation(bm, kTestInodeNum, AllocatorType::Bitmap,
+                            kSnapshotTestJournalBlocks, true);
+    root = fs.alloc_inode(InodeType::Directory).unwrap();
+    file = fs.mkfile(root, "file").unwrap();
+    fs.write_file(file, content).unwrap();
+    first = fs.snapshot().unwrap();
+    fs.remove_file(file).unwrap();
+    second = fs.snapshot().unwrap();
+    fs.unmount().unwrap();
+  }
+
+  auto bm = std::shared_ptr<BlockManager>(
+      new BlockManager(image, 0, kBlockSize));
+  auto fs = FileOperation::create_from_raw(bm).unwrap();
+  EXPECT_EQ(fs->list_snapshots().unwrap().size(), 2);
+  EXPECT_TRUE(fs->read_file(file).is_err());
+
+  auto snapshot = FileOperation::create_from_snapshot(bm, first).unwrap();
+  EXPECT_EQ(snapshot->read_file(file).unwrap(), content);
+  snapshot = FileOperation::create_from_snapshot(bm, second).unwrap();
+  EXPECT_TRUE(snapshot->read_file(file).is_err());
+
+  // the filesystem without block sharing has no snapshot
+  auto plain_bm =
+      std::shared_ptr<BlockManager>(new BlockManager(kBlockNum, kBlockSize));
+  auto plain = FileOperation(plain_bm, kTestInodeNum);
+  EXPECT_EQ(plain.snapshot().unwrap_error(), ErrorType::INVALID);
+
+  remove(image.c_str());
+}
+
+TEST(SnapshotTest, UnreadableRefcount) {
+  auto bm = std::make_shared<FailingBlockManager>(kBlockNum, kBlockSize);
+  auto fs = FileOperation(bm, kTestInodeNum, AllocatorType::Bitmap,
+                          kSnapshotTestJournalBlocks, true);
+  auto root = fs.alloc_inode(InodeType::Directory).unwrap();
+  auto files = populate(fs, root, 4);
+  const auto content = fs.read_file(files[3]).unwrap();
+  auto id = fs.snapshot().unwrap();
+
+  // a block whose counter cannot be read may be shared, so the write fails
+  // instead of overwriting it in place
+  auto super_block = SuperBlock::create_from_existing(bm, 0).unwrap();
+  bm->begin = super_block->get_refcount_start();
+  bm->end = bm->begin + super_block->get_refcount_blocks();
+  EXPECT_EQ(fs.write_file(files[3], std::vector<u8>(content.size(), 'x'))
+                .unwrap_error(),
+            ErrorType::Corrupted);
+
+  bm->end = bm->begin;
+  auto snapshot = FileOperation::create_from_snapshot(bm, id).unwrap();
+  EXPECT_EQ(snapshot->read_file(files[3]).unwrap(), content);
+}
+
+} // namespace chfs
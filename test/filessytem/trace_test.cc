@@ -0,0 +1,83 @@
+#include <cstdio>
+
+#include "gtest/gtest.h"
+
+#include "./common.h"
+#include "filesystem/trace.h"
+
+namespace chfs {
+
+TEST(FileSystemTest, TraceReplay) {
+  const char *path = "chfs_trace_test.trace";
+  const inode_id_t root = 1;
+
+  // the operations of a mount, with the inodes replied by it
+  auto bm = std::shared_ptr<BlockManager>(new BlockManager(kBlockNum, kBlockSize));
+  auto fs = FileOperation(bm, kTestInodeNum);
+  ASSERT_EQ(fs.alloc_inode(InodeType::Directory).unwrap(), root);
+  auto dir = fs.mkdir(root, "dir").unwrap();
+  auto file = fs.mkfile(dir, "file").unwrap();
+  {
+    auto writer = TraceWriter::create(path).unwrap();
+    {
+      TraceScope trace(writer.get(), TraceOp::Lookup, root, "dir");
+      trace.set_result(dir);
+    }
+    {
+      TraceScope trace(writer.get(), TraceOp::Mknod, dir, "file");
+      trace.set_result(file);
+    }
+    {
+      TraceScope trace(writer.get(), TraceOp::Write, file);
+      trace.set_range(1000, 3000);
+    }
+    {
+      TraceScope trace(writer.get(), TraceOp::Read, file);
+      trace.set_range(0, 8192);
+    }
+    // a missing entry
+    { TraceScope trace(writer.get(), TraceOp::Lookup, dir, "missing"); }
+    { TraceScope trace(writer.get(), TraceOp::Release, file); }
+    // nothing is traced without a writer
+    { TraceScope trace(nullptr, TraceOp::Getattr, file); }
+  }
+
+  auto reader = TraceReader::open(path).unwrap();
+  EXPECT_EQ(reader->header().magic, KTraceMagic);
+
+  // the trace is replayed on a filesystem with only "dir", whose inode
+  // differs from the traced one
+  auto replay_bm =
+      std::shared_ptr<BlockManager>(new BlockManager(kBlockNum, kBlockSize));
+  auto replay_fs = FileOperation(replay_bm, kTestInodeNum);
+  replay_fs.alloc_inode(InodeType::Directory).unwrap();
+  replay_fs.mkfile(root, "other").unwrap();
+  auto replay_dir = replay_fs.mkdir(root, "dir").unwrap();
+  ASSERT_NE(replay_dir, dir);
+
+  TraceReplayer replayer(&replay_fs);
+  TraceRecord record;
+  std::string name;
+  std::vector<TraceOp> ops;
+  u64 last_start = 0;
+  while (reader->next(record, name)) {
+    EXPECT_GE(record.start, last_start);
+    last_start = record.start;
+    EXPECT_TRUE(replayer.replay(record, name)) << trace_op_name(record.op);
+    ops.push_back(record.op);
+  }
+  EXPECT_EQ(ops, std::vector<TraceOp>({TraceOp::Lookup, TraceOp::Mknod,
+                                       TraceOp::Write, TraceOp::Read,
+                                       TraceOp::Lookup, TraceOp::Release}));
+  EXPECT_EQ(name, "");
+
+  // the write landed on the file created by the replay
+  EXPECT_EQ(replayer.map_inode(dir), replay_dir);
+  auto replay_file = replay_fs.lookup(replay_dir, "file").unwrap();
+  EXPECT_EQ(replayer.map_inode(file), replay_file);
+  EXPECT_EQ(replay_fs.getattr(replay_file).unwrap().size, 4000);
+
+  std::remove(path);
+}
+
+} // namespace chfs